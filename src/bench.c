@@ -0,0 +1,509 @@
+// Benchmark harness for the filesystem API.
+//
+// Runs a workload (a list of steps such as "mkdir:3000" or "create:100:1048576")
+// in-process against a freshly formatted drive, times every operation with the
+// monotonic clock and reports throughput and latency percentiles per step.
+// With --host=<dir> the same workload is also run against the host filesystem
+// through the equivalent system calls, and both are reported side by side.
+//
+//     gcc -O2 -pthread src/bench.c -o obj/bench.o && obj/bench.o --reps=5 --json
+# define NO_CLI_MAIN
+# include "main.c"
+# include <fcntl.h>
+# include <dirent.h>
+# include <limits.h>
+# include <sys/stat.h>
+
+# define BENCH_DRIVE_NAME "bench.bin"
+# define BENCH_MAX_STEPS 32
+
+// Operations a workload step can run
+# define BENCH_MKDIR  0 // create_directory "dir_<i>"
+# define BENCH_RMDIR  1 // delete_directory "dir_<i>"
+# define BENCH_CREATE 2 // create_file "file_<i>.dat" with <size> bytes
+# define BENCH_READ   3 // read_file "file_<i>.dat"
+# define BENCH_APPEND 4 // append <size> bytes to "file_<i>.dat"
+# define BENCH_DELETE 5 // delete_file "file_<i>.dat"
+# define BENCH_LOOKUP 6 // resolve the path "dir_<i>"
+
+static const char *bench_op_names[] = { "mkdir", "rmdir", "create", "read", "append", "delete", "lookup" };
+# define BENCH_OPS_COUNT (sizeof(bench_op_names) / sizeof(bench_op_names[0]))
+
+// Filesystems a workload runs against
+# define BENCH_TARGET_FS   0 // This filesystem, through its API
+# define BENCH_TARGET_HOST 1 // The host filesystem, through system calls
+# define BENCH_TARGETS     2
+
+static const char *bench_target_names[] = { "fs", "host" };
+
+// Samples collected for one step on one target
+typedef struct bench_result {
+    uint64_t *latencies;    // Nanoseconds per operation, all measured repetitions
+    uint32_t samples;
+    uint64_t elapsed_ns;    // Wall time of the step, all measured repetitions
+    uint64_t bytes;         // Bytes moved, all measured repetitions
+    uint32_t errors;        // Operations that failed or whose target could not be found
+} bench_result;
+
+// One step of the workload
+typedef struct bench_step {
+    int op;
+    uint32_t count;         // Operations per repetition
+    uint32_t size;          // Bytes written per operation (create, append)
+    bench_result results[BENCH_TARGETS];
+} bench_step;
+
+typedef struct bench_config {
+    bench_step steps[BENCH_MAX_STEPS];
+    uint32_t steps_count;
+    uint32_t warmup;        // Repetitions run first and discarded
+    uint32_t reps;          // Measured repetitions
+    bool json;
+    const char *drive_name;
+    const char *host_dir;   // Directory on the host filesystem, or NULL
+} bench_config;
+
+// Summary of one result
+typedef struct bench_summary {
+    double seconds;
+    double ops_per_s;
+    double mb_per_s;
+    double mean_us;
+    double p50_us;
+    double p99_us;
+    double max_us;
+} bench_summary;
+
+// Workload used when none is given (the former 'test' command)
+static const char *bench_default_workload[] = {
+    "mkdir:3000", "rmdir:3000", "create:100:1048576", "read:100", "delete:100"
+};
+
+static uint64_t bench_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Parse a step "<op>:<count>[:<size>]".
+ *
+ * @return 0 on success, or -1 if the step is malformed.
+ */
+static int bench_parse_step(const char *spec, bench_step *step) {
+    char name[16];
+    unsigned long count = 0, size = 0;
+    memset(step, 0, sizeof(bench_step));
+
+    int fields = sscanf(spec, "%15[a-z]:%lu:%lu", name, &count, &size);
+    if (fields < 2 || count == 0) return -1;
+
+    step->op = -1;
+    for (uint32_t i = 0; i < BENCH_OPS_COUNT; i++) {
+        if (strcmp(name, bench_op_names[i]) == 0) step->op = (int)i;
+    }
+    if (step->op < 0) return -1;
+    if ((step->op == BENCH_CREATE || step->op == BENCH_APPEND) && fields < 3) return -1;
+
+    step->count = (uint32_t)count;
+    step->size = (uint32_t)size;
+    return 0;
+}
+
+/**
+ * @brief Format a fresh drive and mount it with the background threads running.
+ *
+ * @return The opened drive, or NULL if it cannot be created.
+ */
+static FILE *bench_mount(const char *drive_name) {
+    create_drive_file(drive_name, (uint64_t)BLOCK_SIZE * BLOCKS_COUNT);
+    FILE *disk = fopen(drive_name, "rb+");
+    if (!disk) {
+        fprintf(stderr, "Error: Unable to open file %s\n", drive_name);
+        return NULL;
+    }
+    initialize_drive(disk);
+    dcache_clear(&dentry_cache);
+    if (mount_drive(disk) != 0) {
+        fclose(disk);
+        return NULL;
+    }
+    start_flusher(disk);
+    start_reclaimer(disk);
+    return disk;
+}
+
+static void bench_unmount(FILE *disk) {
+    stop_reclaimer(disk);
+    stop_flusher(disk);
+    unmount_drive(disk);
+    fclose(disk);
+}
+
+/**
+ * @brief Run operation 'i' of a step.
+ *
+ * @return The number of bytes moved, or -1 if the target was not found.
+ */
+static long bench_run_op(FILE *disk, const bench_step *step, uint32_t i, const char *data) {
+    char name[64];
+    uint32_t inode_number;
+    uint8_t file_type;
+    long bytes = 0;
+
+    switch (step->op) {
+        case BENCH_MKDIR:
+            snprintf(name, sizeof(name), "dir_%u", i);
+            create_directory(disk, name, 0755, ROOT_INODE_NUMBER);
+            break;
+        case BENCH_RMDIR:
+            snprintf(name, sizeof(name), "dir_%u", i);
+            if (lookup_name(disk, ROOT_INODE_NUMBER, name, &inode_number, &file_type) != 0) return -1;
+            delete_directory(disk, inode_number, ROOT_INODE_NUMBER);
+            break;
+        case BENCH_CREATE:
+            snprintf(name, sizeof(name), "file_%u", i);
+            create_file(disk, name, "dat", 0644, data, ROOT_INODE_NUMBER);
+            bytes = step->size;
+            break;
+        case BENCH_READ: {
+            snprintf(name, sizeof(name), "file_%u.dat", i);
+            if (lookup_name(disk, ROOT_INODE_NUMBER, name, &inode_number, &file_type) != 0) return -1;
+            file_t *file_data = read_file(disk, inode_number);
+            if (!file_data) return -1;
+            bytes = (long)(file_data->size - sizeof(file_t));
+            free(file_data);
+            break;
+        }
+        case BENCH_APPEND:
+            snprintf(name, sizeof(name), "file_%u.dat", i);
+            if (lookup_name(disk, ROOT_INODE_NUMBER, name, &inode_number, &file_type) != 0) return -1;
+            write_file(disk, inode_number, data, "-a");
+            bytes = step->size;
+            break;
+        case BENCH_DELETE:
+            snprintf(name, sizeof(name), "file_%u.dat", i);
+            if (lookup_name(disk, ROOT_INODE_NUMBER, name, &inode_number, &file_type) != 0) return -1;
+            delete_file(disk, inode_number, ROOT_INODE_NUMBER);
+            break;
+        case BENCH_LOOKUP:
+            snprintf(name, sizeof(name), "dir_%u", i);
+            if (resolve_path(disk, ROOT_INODE_NUMBER, name, &inode_number, &file_type) != 0) return -1;
+            break;
+    }
+    return bytes;
+}
+
+/**
+ * @brief Run operation 'i' of a step on the host filesystem, inside 'dir'.
+ *
+ * Each operation makes the system calls a program would use for it; with
+ * --durability=sync, written data is fsync'ed like this filesystem does.
+ *
+ * @return The number of bytes moved, or -1 if a call failed.
+ */
+static long bench_run_host_op(const char *dir, const bench_step *step, uint32_t i, const char *data, char *read_buffer) {
+    char path[PATH_MAX];
+    struct stat st;
+    long bytes = 0;
+    int fd;
+
+    switch (step->op) {
+        case BENCH_MKDIR:
+            snprintf(path, sizeof(path), "%s/dir_%u", dir, i);
+            if (mkdir(path, 0755) != 0) return -1;
+            break;
+        case BENCH_RMDIR:
+            snprintf(path, sizeof(path), "%s/dir_%u", dir, i);
+            if (rmdir(path) != 0) return -1;
+            break;
+        case BENCH_CREATE:
+        case BENCH_APPEND:
+            snprintf(path, sizeof(path), "%s/file_%u.dat", dir, i);
+            fd = (step->op == BENCH_CREATE) ? open(path, O_WRONLY | O_CREAT | O_EXCL, 0644)
+                                             : open(path, O_WRONLY | O_APPEND);
+            if (fd < 0) return -1;
+            bytes = write(fd, data, step->size);
+            if (DURABILITY == DURABILITY_SYNC) fsync(fd);
+            close(fd);
+            if (bytes != (long)step->size) return -1;
+            break;
+        case BENCH_READ:
+            snprintf(path, sizeof(path), "%s/file_%u.dat", dir, i);
+            fd = open(path, O_RDONLY);
+            if (fd < 0) return -1;
+            for (ssize_t n; (n = read(fd, read_buffer, BLOCK_SIZE * 16)) > 0; ) bytes += n;
+            close(fd);
+            break;
+        case BENCH_DELETE:
+            snprintf(path, sizeof(path), "%s/file_%u.dat", dir, i);
+            if (unlink(path) != 0) return -1;
+            break;
+        case BENCH_LOOKUP:
+            snprintf(path, sizeof(path), "%s/dir_%u", dir, i);
+            if (stat(path, &st) != 0) return -1;
+            break;
+    }
+    return bytes;
+}
+
+// Remove everything a repetition left in the (flat) host work directory
+static void bench_clear_host_dir(const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) return;
+    char path[PATH_MAX];
+    for (struct dirent *e; (e = readdir(d)) != NULL; ) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        if (unlink(path) != 0) rmdir(path);
+    }
+    closedir(d);
+}
+
+// Time operation 'i' of a step on a target and add the sample to its result
+static void bench_sample(bench_result *result, bool measure, int target, void *handle,
+                         const bench_step *step, uint32_t i, const char *data, char *read_buffer) {
+    uint64_t t0 = bench_now_ns();
+    long bytes = (target == BENCH_TARGET_FS) ? bench_run_op((FILE *)handle, step, i, data)
+                                             : bench_run_host_op((const char *)handle, step, i, data, read_buffer);
+    uint64_t t1 = bench_now_ns();
+    if (!measure) return;
+
+    result->latencies[result->samples++] = t1 - t0;
+    if (bytes < 0) result->errors++;
+    else result->bytes += (uint64_t)bytes;
+}
+
+/**
+ * @brief Run every step once on a target: a freshly formatted drive, or an
+ * emptied work directory on the host.
+ *
+ * @param measure Whether the samples are kept (false for warm-up repetitions).
+ * @return 0 on success, or -1 if the target cannot be set up.
+ */
+static int bench_run_repetition(bench_config *cfg, int target, char **payloads, char *read_buffer, bool measure) {
+    void *handle;
+    if (target == BENCH_TARGET_FS) {
+        handle = bench_mount(cfg->drive_name);
+        if (!handle) return -1;
+    } else {
+        if (mkdir(cfg->host_dir, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Error: Unable to create directory %s\n", cfg->host_dir);
+            return -1;
+        }
+        bench_clear_host_dir(cfg->host_dir);
+        handle = (void *)cfg->host_dir;
+    }
+
+    for (uint32_t s = 0; s < cfg->steps_count; s++) {
+        bench_step *step = &cfg->steps[s];
+        bench_result *result = &step->results[target];
+        uint64_t step_start = bench_now_ns();
+        for (uint32_t i = 0; i < step->count; i++) {
+            bench_sample(result, measure, target, handle, step, i, payloads[s], read_buffer);
+        }
+        if (measure) result->elapsed_ns += bench_now_ns() - step_start;
+    }
+
+    if (target == BENCH_TARGET_FS) {
+        bench_unmount((FILE *)handle);
+    } else {
+        bench_clear_host_dir(cfg->host_dir);
+    }
+    return 0;
+}
+
+// Latency at percentile 'p' of sorted samples, in microseconds
+static double bench_percentile_us(const uint64_t *sorted, uint32_t count, uint32_t p) {
+    if (count == 0) return 0.0;
+    return sorted[(uint64_t)(count - 1) * p / 100] / 1000.0;
+}
+
+static bench_summary bench_summarize(bench_result *result) {
+    bench_summary sum;
+    qsort(result->latencies, result->samples, sizeof(uint64_t), compare_u64);
+
+    sum.seconds = result->elapsed_ns / 1e9;
+    sum.ops_per_s = sum.seconds > 0 ? result->samples / sum.seconds : 0.0;
+    sum.mb_per_s = sum.seconds > 0 ? result->bytes / (1024.0 * 1024.0) / sum.seconds : 0.0;
+    sum.mean_us = result->samples ? result->elapsed_ns / 1000.0 / result->samples : 0.0;
+    sum.p50_us = bench_percentile_us(result->latencies, result->samples, 50);
+    sum.p99_us = bench_percentile_us(result->latencies, result->samples, 99);
+    sum.max_us = result->samples ? result->latencies[result->samples - 1] / 1000.0 : 0.0;
+    return sum;
+}
+
+static void bench_print_json_result(const char *target, bench_result *result, bench_summary *sum, bool last) {
+    printf("\"%s\": {\"ops\": %u, \"errors\": %u, \"seconds\": %.6f, \"ops_per_s\": %.1f, \"mb_per_s\": %.2f, "
+           "\"mean_us\": %.2f, \"p50_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f}%s",
+           target, result->samples, result->errors, sum->seconds, sum->ops_per_s, sum->mb_per_s,
+           sum->mean_us, sum->p50_us, sum->p99_us, sum->max_us, last ? "" : ", ");
+}
+
+static void bench_report(bench_config *cfg) {
+    const char *durability_names[] = { "group", "none", "sync", "periodic" };
+    int targets = cfg->host_dir ? BENCH_TARGETS : 1;
+
+    if (cfg->json) {
+        printf("{\n  \"config\": {\"reps\": %u, \"warmup\": %u, \"delalloc\": %s, \"compress\": %s, \"dedup\": %s, \"durability\": \"%s\"},\n",
+               cfg->reps, cfg->warmup, DELALLOC ? "true" : "false", COMPRESS ? "true" : "false", DEDUP ? "true" : "false", durability_names[DURABILITY]);
+        printf("  \"steps\": [\n");
+    } else if (targets == 1) {
+        printf("%-20s %8s %12s %10s %10s %10s %10s %10s %6s\n",
+               "step", "ops", "ops/s", "MB/s", "mean(us)", "p50(us)", "p99(us)", "max(us)", "errors");
+    } else {
+        printf("%-20s %12s %12s %8s %10s %10s %10s %10s %6s %6s\n",
+               "step", "fs ops/s", "host ops/s", "fs/host", "fs p50", "host p50", "fs p99", "host p99", "fs err", "h err");
+    }
+
+    for (uint32_t s = 0; s < cfg->steps_count; s++) {
+        bench_step *step = &cfg->steps[s];
+        bench_summary sums[BENCH_TARGETS];
+        for (int t = 0; t < targets; t++) {
+            sums[t] = bench_summarize(&step->results[t]);
+        }
+
+        char label[48];
+        if (step->size) snprintf(label, sizeof(label), "%s:%u:%u", bench_op_names[step->op], step->count, step->size);
+        else snprintf(label, sizeof(label), "%s:%u", bench_op_names[step->op], step->count);
+
+        if (cfg->json) {
+            printf("    {\"step\": \"%s\", \"op\": \"%s\", \"count\": %u, \"size\": %u, ",
+                   label, bench_op_names[step->op], step->count, step->size);
+            for (int t = 0; t < targets; t++) {
+                bench_print_json_result(bench_target_names[t], &step->results[t], &sums[t], t + 1 == targets);
+            }
+            printf("}%s\n", (s + 1 < cfg->steps_count) ? "," : "");
+        } else if (targets == 1) {
+            printf("%-20s %8u %12.1f %10.2f %10.2f %10.2f %10.2f %10.2f %6u\n",
+                   label, step->results[0].samples, sums[0].ops_per_s, sums[0].mb_per_s, sums[0].mean_us,
+                   sums[0].p50_us, sums[0].p99_us, sums[0].max_us, step->results[0].errors);
+        } else {
+            // Throughput relative to the host: 1.00 is native speed, 0.10 ten times slower
+            double ratio = sums[1].ops_per_s > 0 ? sums[0].ops_per_s / sums[1].ops_per_s : 0.0;
+            printf("%-20s %12.1f %12.1f %8.2f %10.2f %10.2f %10.2f %10.2f %6u %6u\n",
+                   label, sums[0].ops_per_s, sums[1].ops_per_s, ratio, sums[0].p50_us, sums[1].p50_us,
+                   sums[0].p99_us, sums[1].p99_us, step->results[0].errors, step->results[1].errors);
+        }
+    }
+
+    if (cfg->json) printf("  ]\n}\n");
+}
+
+static void bench_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [--reps=<n>] [--warmup=<n>] [--json] [--drive=<file>] [--host=<dir>] [--delalloc] [--compress] [--dedup]\n"
+            "          [--durability=group|none|sync|periodic] [<op>:<count>[:<size>] ...]\n"
+            "Operations: mkdir, rmdir, lookup (dir_<i>); create, append (need <size>), read, delete (file_<i>.dat)\n",
+            program);
+}
+
+int main(int argc, char *argv[]) {
+    bench_config cfg;
+    memset(&cfg, 0, sizeof(bench_config));
+    cfg.reps = 1;
+    cfg.warmup = 0;
+    cfg.drive_name = BENCH_DRIVE_NAME;
+
+    // 1. Parse options and workload steps
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--reps=", 7) == 0 && atoi(argv[i] + 7) > 0) {
+            cfg.reps = (uint32_t)atoi(argv[i] + 7);
+        } else if (strncmp(argv[i], "--warmup=", 9) == 0 && atoi(argv[i] + 9) >= 0) {
+            cfg.warmup = (uint32_t)atoi(argv[i] + 9);
+        } else if (strcmp(argv[i], "--json") == 0) {
+            cfg.json = true;
+        } else if (strncmp(argv[i], "--drive=", 8) == 0 && argv[i][8] != '\0') {
+            cfg.drive_name = argv[i] + 8;
+        } else if (strncmp(argv[i], "--host=", 7) == 0 && argv[i][7] != '\0') {
+            cfg.host_dir = argv[i] + 7;
+        } else if (strcmp(argv[i], "--delalloc") == 0) {
+            DELALLOC = true;
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            COMPRESS = true;
+        } else if (strcmp(argv[i], "--dedup") == 0) {
+            DEDUP = true;
+        } else if (strcmp(argv[i], "--durability=group") == 0) {
+            DURABILITY = DURABILITY_GROUP;
+        } else if (strcmp(argv[i], "--durability=none") == 0) {
+            DURABILITY = DURABILITY_NOSYNC;
+        } else if (strcmp(argv[i], "--durability=sync") == 0) {
+            DURABILITY = DURABILITY_SYNC;
+        } else if (strcmp(argv[i], "--durability=periodic") == 0) {
+            DURABILITY = DURABILITY_PERIODIC;
+        } else if (argv[i][0] != '-' && cfg.steps_count < BENCH_MAX_STEPS &&
+                   bench_parse_step(argv[i], &cfg.steps[cfg.steps_count]) == 0) {
+            cfg.steps_count++;
+        } else {
+            bench_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (cfg.steps_count == 0) {
+        for (uint32_t i = 0; i < sizeof(bench_default_workload) / sizeof(bench_default_workload[0]); i++) {
+            bench_parse_step(bench_default_workload[i], &cfg.steps[cfg.steps_count++]);
+        }
+    }
+
+    // 2. Allocate the samples and the payloads (same pseudo-random content every run)
+    int status = 1;
+    int targets = cfg.host_dir ? BENCH_TARGETS : 1;
+    char *payloads[BENCH_MAX_STEPS] = { NULL };
+    char *read_buffer = (char *)malloc(BLOCK_SIZE * 16);
+    if (!read_buffer) {
+        fprintf(stderr, "Error: could not allocate memory for the benchmark.\n");
+        return 1;
+    }
+    srand(1);
+    for (uint32_t s = 0; s < cfg.steps_count; s++) {
+        bench_step *step = &cfg.steps[s];
+        bool allocated = true;
+        for (int t = 0; t < targets; t++) {
+            step->results[t].latencies = (uint64_t *)malloc((size_t)step->count * cfg.reps * sizeof(uint64_t));
+            allocated = allocated && step->results[t].latencies;
+        }
+        payloads[s] = (char *)malloc((size_t)step->size + 1);
+        if (!allocated || !payloads[s]) {
+            fprintf(stderr, "Error: could not allocate memory for the benchmark.\n");
+            goto cleanup;
+        }
+        for (uint32_t i = 0; i < step->size; i++) {
+            payloads[s][i] = (char)((rand() % 26) + 'a');
+        }
+        payloads[s][step->size] = '\0';
+    }
+
+    // 3. Warm up, then measure; every repetition starts from a freshly formatted
+    //    drive (or an empty host directory), and the targets take turns
+    VERBOSE = false;
+    initialize_delalloc_table(&pending_writes);
+    initialize_dcache(&dentry_cache);
+    initialize_locks();
+    for (uint32_t r = 0; r < cfg.warmup + cfg.reps; r++) {
+        for (int t = 0; t < targets; t++) {
+            if (bench_run_repetition(&cfg, t, payloads, read_buffer, r >= cfg.warmup) != 0) goto cleanup;
+        }
+    }
+
+    // 4. Report
+    bench_report(&cfg);
+    remove(cfg.drive_name);
+    if (cfg.host_dir) rmdir(cfg.host_dir);
+    status = 0;
+
+cleanup:
+    for (uint32_t s = 0; s < cfg.steps_count; s++) {
+        for (int t = 0; t < targets; t++) {
+            free(cfg.steps[s].results[t].latencies);
+        }
+        free(payloads[s]);
+    }
+    free(read_buffer);
+    return status;
+}
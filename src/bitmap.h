@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include "metrics.h"
 
 // Initialize the bitmap (set all bits to 0)
 void initialize_bitmap(uint8_t *bitmap, int block_count) {
@@ -32,9 +33,30 @@ void free_bitmap_bit(uint8_t *bitmap, int block_index) {
 int find_free_block(uint8_t *bitmap, int block_count, int start_from) {
     for (int i = start_from; i < block_count; i++) {
         if (is_bit_free(bitmap, i)) {
+            metrics_add(&metrics.bits_scanned, (uint64_t)(i - start_from + 1));
             return i;
         }
     }
+    if (block_count > start_from) metrics_add(&metrics.bits_scanned, (uint64_t)(block_count - start_from));
+    return -1;
+}
+
+// Find the first run of 'run_length' consecutive free blocks
+int find_free_run(uint8_t *bitmap, int block_count, int start_from, int run_length) {
+    int run_start = -1;
+    int run_found = 0;
+    for (int i = start_from; i < block_count; i++) {
+        if (is_bit_free(bitmap, i)) {
+            if (run_found == 0) run_start = i;
+            if (++run_found == run_length) {
+                metrics_add(&metrics.bits_scanned, (uint64_t)(i - start_from + 1));
+                return run_start;
+            }
+        } else {
+            run_found = 0;
+        }
+    }
+    if (block_count > start_from) metrics_add(&metrics.bits_scanned, (uint64_t)(block_count - start_from));
     return -1;
 }
 
@@ -1,69 +1,849 @@
-# include <stdio.h>
-# include <stdlib.h>
-# include <stdint.h>
-# include "superblock.h"
-# include "group_descriptor.h"
-# include "bitmap.h"
-# include "inode.h"
-
-# define DRIVE_NAME "drive.bin"
-# define BLOCK_SIZE 4096
-# define BLOCKS_COUNT 32768
-# define BLOCKS_PER_GROUP 16384
-
-void check_superblock(FILE *file) {
-    fseek(file, 0, SEEK_SET);
+// Drive checker (fsck).
+//
+// Verifies a drive image: every allocated inode and its block map, the block
+// bitmap against the blocks the inodes actually use, the directory tree against
+// the inode bitmap, and the free counters of the group descriptor against the
+// real counts. With --repair the problems that can be fixed are fixed and
+// written back through the journal in one transaction.
+//
+// Committed transactions left in the log by a crash are loaded first, so the
+// drive is checked as it will be after recovery (--repair also writes them
+// home). Orphans (inodes already unlinked but not reclaimed yet, see orphan.h)
+// count as referenced. Allocation reservations need no special case: a drive
+// image never holds reserved but unused blocks or inodes as used. A block may be
+// used by as many inodes as its reference count allows (deduplicated blocks).
+//
+// The inode table is read and checked by several threads, each on its own
+// range of inode-table blocks; indirect blocks are then read in block order,
+// also split between the threads. --dump prints the structures instead.
+//
+//     gcc -O2 -pthread src/check_drive.c -o obj/check_drive.o && obj/check_drive.o --repair
+# define NO_CLI_MAIN
+# include "main.c"
+# include <stdarg.h>
 
-    superblock sb;
-    fread(&sb, sizeof(superblock), 1, file);
+# define FSCK_THREADS_MAX 8
+# define FSCK_REPORT_LIMIT 20 // Problems printed per kind, the rest are only counted
 
-    print_superblock(&sb);
-}
+// Data blocks in free_blocks_count of a freshly formatted drive without a journal, a
+// refcount or a checksum table (as counted by initialize_drive); the journal and the
+// tables take their own blocks
+# define FSCK_DATA_BLOCKS (BLOCKS_COUNT - FIRST_DATA_BLOCK + 1)
+
+// Kinds of problems
+# define FSCK_BAD_INODE         0 // Allocated inode with an invalid number, type or size (repair: freed)
+# define FSCK_BAD_POINTER       1 // Block pointer outside the data area (repair: cleared)
+# define FSCK_STALE_INODE       2 // Free inode that was not zeroed (repair: zeroed)
+# define FSCK_DUPLICATE_BLOCK   3 // Block used by more inodes than its reference count (repair: count raised)
+# define FSCK_BAD_DIRECTORY     4 // Directory whose entry count does not fit its size (repair: truncated)
+# define FSCK_BAD_DOTS          5 // Wrong "." or ".." entry (repair: fixed)
+# define FSCK_BAD_ENTRY         6 // Entry naming a free inode or with the wrong type (repair: removed)
+# define FSCK_EXTRA_LINK        7 // Second entry for the same inode (repair: removed)
+# define FSCK_BAD_ORPHAN        8 // Orphan list entry naming a free inode (repair: removed)
+# define FSCK_UNREFERENCED      9 // Allocated inode no entry or orphan refers to (repair: freed)
+# define FSCK_BLOCK_NOT_MARKED 10 // Block in use but free in the bitmap (repair: marked)
+# define FSCK_BLOCK_LEAKED     11 // Block marked used but used by nothing (repair: freed)
+# define FSCK_BAD_COUNTER      12 // Group descriptor or inode table counter (repair: set)
+# define FSCK_BAD_REFCOUNT     13 // Reference count above the inodes using the block (repair: set)
+# define FSCK_BAD_CHECKSUM     14 // Metadata block that does not match its checksum (repair: checksum set)
+# define FSCK_BAD_SIZE         15 // Size beyond the blocks the inode maps (repair: cut to them, or freed)
+# define FSCK_DUPLICATE_NAME   16 // Second entry with the same name in a directory (repair: renamed)
+# define FSCK_KINDS            17
+
+static const char *fsck_kind_names[FSCK_KINDS] = {
+    "invalid inodes", "invalid block pointers", "stale free inodes", "blocks used twice",
+    "invalid directories", "wrong . or .. entries", "invalid entries", "extra links", "invalid orphans",
+    "unreferenced inodes", "used blocks marked free", "leaked blocks", "wrong counters", "wrong reference counts",
+    "checksum mismatches", "sizes beyond block map", "duplicate names"
+};
+
+// Largest directory read: every inode once, plus "." and ".."
+# define FSCK_DIRECTORY_MAX (sizeof(directory_block_t) + (INODES_COUNT + 2) * sizeof(dir_entry_t))
 
-void check_group_descriptor(FILE *file) {
-    fseek(file, BLOCK_SIZE, SEEK_SET);
+// Per-inode state
+# define FSCK_INODE_FREED   0x1 // Freed by the check (invalid or unreferenced)
+# define FSCK_INODE_REACHED 0x2 // Referenced by a directory entry or the orphan list
 
+// An indirect block to read, with the inode it belongs to
+typedef struct fsck_ref {
+    uint32_t block;
+    uint32_t inode;
+} fsck_ref;
+
+typedef struct fsck_refs {
+    fsck_ref *items;
+    uint32_t count;
+    uint32_t capacity;
+} fsck_refs;
+
+typedef struct fsck_state {
+    FILE *disk;
+    bool repair;
+    uint32_t threads;
+
+    // Metadata as it will be after journal recovery
     group_descriptor gd;
-    fread(&gd, sizeof(group_descriptor), 1, file);
+    uint8_t block_bitmap[BLOCKS_COUNT / 8];
+    uint8_t inode_bitmap[INODES_COUNT / 8];
+    inode_table *itable;
+    orphan_table orphans;
+    uint16_t refcounts[BLOCKS_COUNT];   // Extra references per block (all 0 without a table)
+    uint32_t refcount_start;            // 0 if the drive has no refcount table
+    uint32_t checksum_start;            // 0 if the drive has no checksum table
+    uint32_t data_end;                  // First block after the data area (a table or the journal)
+    uint32_t data_blocks;               // Data blocks of the drive, as in free_blocks_count when empty
+
+    uint32_t *block_owner;  // Per block number: inode + 1 using it first, 0 if none
+    uint32_t *block_refs;   // Per block number: inodes using it
+    uint8_t *inode_state;   // Per inode: FSCK_INODE_* flags
+    fsck_refs double_refs;  // Double-indirect blocks, read first
+    fsck_refs single_refs;  // Single-indirect blocks (including those found in double-indirect ones)
+
+    pthread_mutex_t lock;   // Protects the counters and the ref lists
+    uint32_t problems[FSCK_KINDS];
+    uint32_t repaired[FSCK_KINDS];
+} fsck_state;
+
+fsck_state fsck = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Record (and print, up to FSCK_REPORT_LIMIT per kind) one problem
+static void fsck_problem(int kind, bool repaired, const char *format, ...) {
+    pthread_mutex_lock(&fsck.lock);
+    if (fsck.problems[kind]++ < FSCK_REPORT_LIMIT) {
+        va_list args;
+        va_start(args, format);
+        printf("  ");
+        vprintf(format, args);
+        printf(repaired ? " (repaired)\n" : "\n");
+        va_end(args);
+    }
+    if (repaired) fsck.repaired[kind]++;
+    pthread_mutex_unlock(&fsck.lock);
+}
+
+static int fsck_push_ref(fsck_refs *refs, uint32_t block, uint32_t inode_number) {
+    if (refs->count == refs->capacity) {
+        uint32_t capacity = refs->capacity ? refs->capacity * 2 : 256;
+        fsck_ref *grown = (fsck_ref *)realloc(refs->items, capacity * sizeof(fsck_ref));
+        if (!grown) return -1;
+        refs->items = grown;
+        refs->capacity = capacity;
+    }
+    refs->items[refs->count].block = block;
+    refs->items[refs->count].inode = inode_number;
+    refs->count++;
+    return 0;
+}
+
+static int compare_fsck_refs(const void *a, const void *b) {
+    uint32_t x = ((const fsck_ref *)a)->block, y = ((const fsck_ref *)b)->block;
+    return (x > y) - (x < y);
+}
+
+static bool fsck_is_data_block(uint32_t block) {
+    return block >= FIRST_DATA_BLOCK && block < fsck.data_end;
+}
+
+// Claim 'block' for 'inode_number'; reports a block used by more inodes than its
+// reference count allows (the count is raised by pass 4 with --repair)
+static void fsck_claim(uint32_t block, uint32_t inode_number) {
+    uint32_t expected = 0;
+    __atomic_compare_exchange_n(&fsck.block_owner[block], &expected, inode_number + 1, false,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    uint32_t users = __atomic_add_fetch(&fsck.block_refs[block], 1, __ATOMIC_RELAXED);
+    if (users > 1u + fsck.refcounts[block]) {
+        fsck_problem(FSCK_DUPLICATE_BLOCK, fsck.repair && fsck.refcount_start != 0,
+                     "Block %u is used by inode %u and inode %u (%u extra references allowed)",
+                     block, __atomic_load_n(&fsck.block_owner[block], __ATOMIC_RELAXED) - 1, inode_number,
+                     fsck.refcounts[block]);
+    }
+}
+
+// Mark an inode free in the check's metadata (its blocks become unused)
+static void fsck_free_inode(uint32_t inode_number) {
+    // Pass 1 threads share the bitmap bytes at the edges of their ranges
+    __atomic_and_fetch(&fsck.inode_bitmap[inode_number / 8], (uint8_t)~(1 << (inode_number % 8)), __ATOMIC_RELAXED);
+    memset(&fsck.itable->inodes[inode_number], 0, sizeof(inode));
+    __atomic_or_fetch(&fsck.inode_state[inode_number], FSCK_INODE_FREED, __ATOMIC_RELAXED);
+}
+
+// [PASS 1: INODES]
+typedef struct fsck_worker {
+    pthread_t thread;
+    uint32_t first;         // Pass 1: inode range; pass 2: range of the sorted refs
+    uint32_t end;
+    fsck_refs *input;       // Pass 2: refs to read
+    fsck_refs output;       // Indirect blocks found by this worker
+    bool failed;
+} fsck_worker;
+
+// Blocks mapped from the start of an inode's map, up to 'needed'. The entries of indirect
+// blocks are only read in pass 2, so an indirect block counts as fully mapped here.
+static uint64_t fsck_mapped_blocks(const inode *node, uint64_t needed) {
+    const uint64_t per_block = BLOCK_SIZE / sizeof(uint32_t);
+    uint64_t mapped = 0;
+    while (mapped < 12 && mapped < needed && node->blocks[mapped] != 0) mapped++;
+    if (mapped < 12 || mapped >= needed) return mapped;
+    if (node->single_indirect != 0) mapped += per_block;
+    if (mapped == 12 + per_block && node->double_indirect != 0) mapped += per_block * per_block;
+    return (mapped < needed) ? mapped : needed;
+}
+
+// Check one allocated inode and claim its direct and indirect blocks
+static void fsck_check_inode(fsck_worker *w, uint32_t i) {
+    inode *node = &fsck.itable->inodes[i];
+
+    if (node->file_type > 1 || node->file_size == 0) {
+        fsck_problem(FSCK_BAD_INODE, fsck.repair, "Inode %u has type %u and size %u",
+                     i, node->file_type, node->file_size);
+        if (fsck.repair) fsck_free_inode(i);
+        return;
+    }
+    if (node->inode_number != i) {
+        fsck_problem(FSCK_BAD_INODE, fsck.repair, "Inode %u holds inode number %u", i, node->inode_number);
+        if (fsck.repair) node->inode_number = i;
+    }
 
-    print_descriptor_block(&gd);
+    for (int b = 0; b < 12; b++) {
+        if (node->blocks[b] == 0) continue;
+        if (!fsck_is_data_block(node->blocks[b])) {
+            fsck_problem(FSCK_BAD_POINTER, fsck.repair, "Inode %u: direct block %d is %u", i, b, node->blocks[b]);
+            if (fsck.repair) node->blocks[b] = 0;
+            continue;
+        }
+        fsck_claim(node->blocks[b], i);
+    }
+
+    uint32_t *indirect[2] = { &node->single_indirect, &node->double_indirect };
+    for (int level = 0; level < 2; level++) {
+        if (*indirect[level] == 0) continue;
+        if (!fsck_is_data_block(*indirect[level])) {
+            fsck_problem(FSCK_BAD_POINTER, fsck.repair, "Inode %u: %s-indirect block is %u",
+                         i, level ? "double" : "single", *indirect[level]);
+            if (fsck.repair) *indirect[level] = 0;
+            continue;
+        }
+        fsck_claim(*indirect[level], i);
+        if (level == 1) {
+            // Double-indirect blocks go to the shared list directly (there are few)
+            pthread_mutex_lock(&fsck.lock);
+            w->failed |= fsck_push_ref(&fsck.double_refs, *indirect[level], i) != 0;
+            pthread_mutex_unlock(&fsck.lock);
+        } else {
+            w->failed |= fsck_push_ref(&w->output, *indirect[level], i) != 0;
+        }
+    }
+
+    // The size must lie within the block map (files and directories have no holes, and
+    // blocks past the size are preallocated; a compressed file maps fewer blocks than its size)
+    if (inode_is_compressed(node)) return;
+    uint64_t needed = ((uint64_t)node->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint64_t mapped = fsck_mapped_blocks(node, needed);
+    if (mapped < needed) {
+        fsck_problem(FSCK_BAD_SIZE, fsck.repair, "Inode %u has size %u but maps only %llu of its %llu blocks",
+                     i, node->file_size, (unsigned long long)mapped, (unsigned long long)needed);
+        if (fsck.repair && mapped == 0) {
+            fsck_free_inode(i);
+        } else if (fsck.repair) {
+            node->file_size = (uint32_t)(mapped * BLOCK_SIZE);
+        }
+    }
+}
+
+// Read a range of the inode table and check every inode in it
+static void *fsck_inodes_worker(void *arg) {
+    fsck_worker *w = (fsck_worker *)arg;
+    static const inode zero_inode;
+
+    if (journal_read_metadata(&fs_journal, fsck.disk, fsck.gd.inode_table, w->first * sizeof(inode),
+                              &fsck.itable->inodes[w->first], (w->end - w->first) * sizeof(inode)) != 0) {
+        // The whole table is logged again by fsck_write_back
+        fsck_problem(FSCK_BAD_CHECKSUM, fsck.repair, "Inode table: a block holding inodes %u..%u fails its checksum",
+                     w->first, w->end - 1);
+    }
+
+    for (uint32_t i = w->first; i < w->end; i++) {
+        if (is_bit_free(fsck.inode_bitmap, i)) {
+            if (memcmp(&fsck.itable->inodes[i], &zero_inode, sizeof(inode)) != 0) {
+                fsck_problem(FSCK_STALE_INODE, fsck.repair, "Free inode %u is not cleared", i);
+                if (fsck.repair) memset(&fsck.itable->inodes[i], 0, sizeof(inode));
+            }
+            continue;
+        }
+        fsck_check_inode(w, i);
+    }
+    return NULL;
+}
+
+// [PASS 2: INDIRECT BLOCKS]
+// Whether an earlier ref of the sorted list is the same block of a live inode. An
+// indirect block shared by clones is read once: the blocks below it count it as
+// one user, whatever the number of inodes pointing to it.
+static bool fsck_ref_seen(const fsck_refs *refs, uint32_t r) {
+    for (uint32_t k = r; k > 0 && refs->items[k - 1].block == refs->items[r].block; k--) {
+        if (!(__atomic_load_n(&fsck.inode_state[refs->items[k - 1].inode], __ATOMIC_RELAXED) & FSCK_INODE_FREED)) return true;
+    }
+    return false;
+}
+
+// Read a range of sorted indirect blocks; entries of single-indirect blocks are
+// claimed, entries of double-indirect ones are collected as single-indirect blocks
+static void *fsck_indirect_worker(void *arg) {
+    fsck_worker *w = (fsck_worker *)arg;
+    bool is_double = (w->input == &fsck.double_refs);
+    uint32_t refs[BLOCK_SIZE / sizeof(uint32_t)];
+
+    for (uint32_t r = w->first; r < w->end; r++) {
+        fsck_ref *ref = &w->input->items[r];
+        if (__atomic_load_n(&fsck.inode_state[ref->inode], __ATOMIC_RELAXED) & FSCK_INODE_FREED) continue;
+        if (fsck_ref_seen(w->input, r)) continue;
+        if (journal_read_metadata(&fs_journal, fsck.disk, ref->block, 0, refs, BLOCK_SIZE) != 0) {
+            fsck_problem(FSCK_BAD_CHECKSUM, fsck.repair, "Inode %u: indirect block %u fails its checksum",
+                         ref->inode, ref->block);
+            if (fsck.repair) journal_write(&fs_journal, fsck.disk, ref->block, 0, refs, BLOCK_SIZE);
+        }
+
+        for (uint32_t e = 0; e < BLOCK_SIZE / sizeof(uint32_t); e++) {
+            if (refs[e] == 0) continue;
+            if (!fsck_is_data_block(refs[e])) {
+                fsck_problem(FSCK_BAD_POINTER, fsck.repair, "Inode %u: entry %u of indirect block %u is %u",
+                             ref->inode, e, ref->block, refs[e]);
+                if (fsck.repair) {
+                    uint32_t zero = 0;
+                    journal_write(&fs_journal, fsck.disk, ref->block, e * sizeof(uint32_t), &zero, sizeof(uint32_t));
+                }
+                continue;
+            }
+            fsck_claim(refs[e], ref->inode);
+            if (is_double) w->failed |= fsck_push_ref(&w->output, refs[e], ref->inode) != 0;
+        }
+    }
+    return NULL;
 }
 
-void check_bitmap(FILE *file, uint64_t block_offset, const char *label, uint32_t size) {
-    fseek(file, block_offset * BLOCK_SIZE, SEEK_SET);
+/**
+ * @brief Run one pass over 'count' items split between the threads.
+ *
+ * Indirect blocks found by the workers are appended to 'collected'.
+ *
+ * @return 0 on success, -1 if a worker ran out of memory.
+ */
+static int fsck_run_workers(void *(*body)(void *), fsck_refs *input, uint32_t count, fsck_refs *collected) {
+    fsck_worker workers[FSCK_THREADS_MAX];
+    memset(workers, 0, sizeof(workers));
+    uint32_t threads = (count < fsck.threads) ? (count ? count : 1) : fsck.threads;
 
-    uint8_t *bitmap = (uint8_t *)malloc(size / 8);
-    fread(bitmap, size / 8, 1, file);
+    for (uint32_t t = 0; t < threads; t++) {
+        workers[t].first = (uint32_t)((uint64_t)count * t / threads);
+        workers[t].end = (uint32_t)((uint64_t)count * (t + 1) / threads);
+        workers[t].input = input;
+        if (t > 0 && pthread_create(&workers[t].thread, NULL, body, &workers[t]) != 0) {
+            body(&workers[t]);
+            workers[t].thread = 0;
+        }
+    }
+    body(&workers[0]);
 
-    printf("Bitmap for %s:\n", label);
-    print_bitmap(bitmap, size);
+    int status = 0;
+    for (uint32_t t = 0; t < threads; t++) {
+        if (t > 0 && workers[t].thread) pthread_join(workers[t].thread, NULL);
+        for (uint32_t r = 0; r < workers[t].output.count; r++) {
+            if (fsck_push_ref(collected, workers[t].output.items[r].block, workers[t].output.items[r].inode) != 0) status = -1;
+        }
+        if (workers[t].failed) status = -1;
+        free(workers[t].output.items);
+    }
+    return status;
 }
 
-void check_inode_table(FILE *file, uint32_t size) {
-    fseek(file, 4 * BLOCK_SIZE, SEEK_SET);
-    inode_table inode_table;
-    fread(&inode_table, sizeof(inode_table), 1, file);
+// [PASS 3: DIRECTORY TREE]
+// Rewrite the entries of a repaired directory over its own blocks
+static void fsck_write_directory(uint32_t dir_inode_number, directory_block_t *dir) {
+    inode *node = &fsck.itable->inodes[dir_inode_number];
+    uint32_t size = sizeof(directory_block_t) + dir->entries_count * sizeof(dir_entry_t);
+    for (uint32_t offset = 0; offset < size; offset += BLOCK_SIZE) {
+        uint32_t block;
+        if (lookup_data_block_of_inode(fsck.disk, node, offset / BLOCK_SIZE, &block) != 0 || block == 0) break;
+        uint32_t len = (size - offset > BLOCK_SIZE) ? BLOCK_SIZE : size - offset;
+        journal_write(&fs_journal, fsck.disk, block, 0, (uint8_t *)dir + offset, len);
+    }
+    node->file_size = size;
+}
 
-    fseek(file, 3 * BLOCK_SIZE, SEEK_SET);
-    uint8_t *bitmap = (uint8_t *)malloc(size / 8);
-    fread(bitmap, size / 8, 1, file);
+// Read the blocks of a directory; one that fails its checksum is reported and read all
+// the same. Returns false if any did (the directory is then rewritten on repair).
+static bool fsck_read_directory(uint32_t dir_inode_number, directory_block_t *dir, uint32_t size) {
+    inode *node = &fsck.itable->inodes[dir_inode_number];
+    bool intact = true;
+    for (uint32_t offset = 0; offset < size; offset += BLOCK_SIZE) {
+        uint32_t block;
+        if (lookup_data_block_of_inode(fsck.disk, node, offset / BLOCK_SIZE, &block) != 0 || block == 0) break;
+        uint32_t len = (size - offset > BLOCK_SIZE) ? BLOCK_SIZE : size - offset;
+        if (journal_read_metadata(&fs_journal, fsck.disk, block, 0, (uint8_t *)dir + offset, len) != 0) {
+            fsck_problem(FSCK_BAD_CHECKSUM, fsck.repair, "Directory %u: block %u fails its checksum", dir_inode_number, block);
+            intact = false;
+        }
+    }
+    return intact;
+}
 
-    print_inode_table(&inode_table, bitmap);
+// Slot of 'name' in a hash table of entry indexes + 1 (0 is empty). A free slot is taken
+// for the entry 'index'; otherwise the slot of the kept entry with that name is returned.
+static uint32_t *fsck_name_slot(const directory_block_t *dir, uint32_t *names, uint32_t slots,
+                                const char *name, uint32_t index) {
+    uint32_t hash = 2166136261u;
+    for (const char *c = name; *c; c++) hash = (hash ^ (uint8_t)*c) * 16777619u;
+    uint32_t k = hash & (slots - 1);
+    while (names[k] != 0 && strcmp(dir->entries[names[k] - 1].name, name) != 0) k = (k + 1) & (slots - 1);
+    if (names[k] == 0) names[k] = index + 1;
+    return &names[k];
 }
 
-int main() {
-    FILE *file = fopen(DRIVE_NAME, "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Error: Unable to open file %s\n", DRIVE_NAME);
-        exit(EXIT_FAILURE);
+// Check the entries of one directory; subdirectories are appended to 'queue'
+static int fsck_check_directory(uint32_t dir_inode_number, uint32_t parent, uint32_t *queue, uint32_t *queue_end) {
+    inode *node = &fsck.itable->inodes[dir_inode_number];
+    uint32_t size = (node->file_size < FSCK_DIRECTORY_MAX) ? node->file_size : FSCK_DIRECTORY_MAX;
+    // Room for at least "." and "..", which are rebuilt if the directory lost them
+    directory_block_t *dir = (directory_block_t *)calloc(1, size + sizeof(directory_block_t) + 2 * sizeof(dir_entry_t));
+    if (!dir) return -1;
+    bool changed = !fsck_read_directory(dir_inode_number, dir, size);
+
+    // 1. The entries must fit in the directory size
+    uint32_t fit = (size > sizeof(directory_block_t)) ? (size - sizeof(directory_block_t)) / sizeof(dir_entry_t) : 0;
+    if (dir->entries_count > fit || dir->entries_count < 2) {
+        fsck_problem(FSCK_BAD_DIRECTORY, fsck.repair, "Directory %u holds %u entries, room for %u",
+                     dir_inode_number, dir->entries_count, fit);
+        if (dir->entries_count > fit) dir->entries_count = fit;
+        changed = true;
     }
 
-    check_superblock(file);                                     printf("\n");
-    check_group_descriptor(file);                               printf("\n");
-    check_bitmap(file, 2, "Data Block Bitmap", BLOCKS_COUNT);   printf("\n");
-    check_bitmap(file, 3, "Inode Bitmap", INODES_COUNT);        printf("\n");
-    check_inode_table(file, INODES_COUNT);                      printf("\n");
+    // 2. "." and ".." (a directory left with fewer entries, e.g. a zeroed block, gets them back)
+    bool dots_wrong = dir->entries_count < 2;
+    if (dots_wrong) {
+        fsck_problem(FSCK_BAD_DOTS, fsck.repair, "Directory %u has no . and .. entries", dir_inode_number);
+    } else if (dir->entries[0].inode != dir_inode_number || dir->entries[1].inode != parent ||
+               strcmp(dir->entries[0].name, ".") != 0 || strcmp(dir->entries[1].name, "..") != 0) {
+        fsck_problem(FSCK_BAD_DOTS, fsck.repair, "Directory %u: . is %u and .. is %u, expected %u and %u",
+                     dir_inode_number, dir->entries[0].inode, dir->entries[1].inode, dir_inode_number, parent);
+        dots_wrong = true;
+    }
+    if (dots_wrong) {
+        directory_block_t *dots = create_minimal_directory_block(dir_inode_number, parent);
+        if (dots) {
+            memcpy(dir->entries, dots->entries, 2 * sizeof(dir_entry_t));
+            free(dots);
+        }
+        changed = true;
+    }
+
+    // 3. Every other entry must name an allocated inode of its type, referenced only here,
+    //    under a name no kept entry has (the kept entries go into a hash table of indexes)
+    uint32_t slots = 64;
+    while (slots < 2 * dir->entries_count) slots *= 2;
+    uint32_t *names = (uint32_t *)calloc(slots, sizeof(uint32_t));
+    if (!names) {
+        free(dir);
+        return -1;
+    }
+    fsck_name_slot(dir, names, slots, ".", 0);
+    fsck_name_slot(dir, names, slots, "..", 1);
+    uint32_t kept = 2;
+    for (uint32_t e = 2; e < dir->entries_count; e++) {
+        dir_entry_t *entry = &dir->entries[e];
+        entry->name[MAX_FILENAME_LEN] = '\0';
+        uint32_t child = entry->inode;
 
-    fclose(file);
+        if (child >= INODES_COUNT || is_bit_free(fsck.inode_bitmap, child) ||
+            fsck.itable->inodes[child].file_type != entry->file_type) {
+            fsck_problem(FSCK_BAD_ENTRY, fsck.repair, "Directory %u: entry '%s' names %s inode %u",
+                         dir_inode_number, entry->name,
+                         (child < INODES_COUNT && !is_bit_free(fsck.inode_bitmap, child)) ? "a wrong type of" : "free", child);
+            changed = true;
+            continue;
+        }
+        if (fsck.inode_state[child] & FSCK_INODE_REACHED) {
+            fsck_problem(FSCK_EXTRA_LINK, fsck.repair, "Directory %u: entry '%s' links inode %u a second time",
+                         dir_inode_number, entry->name, child);
+            changed = true;
+            continue;
+        }
+        uint32_t *slot = fsck_name_slot(dir, names, slots, entry->name, kept);
+        if (*slot != kept + 1) {
+            // Keep the inode under "name~inode" (the entry is dropped if that is taken as well)
+            char renamed[MAX_FILENAME_LEN + 1];
+            char suffix[16];
+            int suffix_len = snprintf(suffix, sizeof(suffix), "~%u", child);
+            snprintf(renamed, sizeof(renamed), "%.*s%s", MAX_FILENAME_LEN - suffix_len, entry->name, suffix);
+            slot = fsck_name_slot(dir, names, slots, renamed, kept);
+            fsck_problem(FSCK_DUPLICATE_NAME, fsck.repair, "Directory %u: a second entry '%s' names inode %u%s",
+                         dir_inode_number, entry->name, child, (*slot == kept + 1) ? "" : ", its new name is taken");
+            changed = true;
+            if (*slot != kept + 1) continue;
+            strcpy(entry->name, renamed);
+        }
+        fsck.inode_state[child] |= FSCK_INODE_REACHED;
+        if (entry->file_type == 1) {
+            queue[(*queue_end)++] = child;
+            queue[(*queue_end)++] = dir_inode_number;
+        }
+        if (kept != e) dir->entries[kept] = *entry;
+        kept++;
+    }
+
+    if (changed && fsck.repair) {
+        dir->entries_count = kept;
+        fsck_write_directory(dir_inode_number, dir);
+    }
+    free(names);
+    free(dir);
     return 0;
-}
\ No newline at end of file
+}
+
+// Walk the tree from the root and from every orphan
+static int fsck_check_tree() {
+    // Pairs (directory, parent); every directory is queued at most once
+    uint32_t *queue = (uint32_t *)malloc(2 * (INODES_COUNT + 1) * sizeof(uint32_t));
+    if (!queue) return -1;
+    uint32_t head = 0, end = 0;
+
+    if (is_bit_free(fsck.inode_bitmap, ROOT_INODE_NUMBER) || fsck.itable->inodes[ROOT_INODE_NUMBER].file_type != 1) {
+        fsck_problem(FSCK_BAD_INODE, false, "Root inode %u is not an allocated directory", ROOT_INODE_NUMBER);
+    } else {
+        fsck.inode_state[ROOT_INODE_NUMBER] |= FSCK_INODE_REACHED;
+        queue[end++] = ROOT_INODE_NUMBER;
+        queue[end++] = ROOT_INODE_NUMBER;
+    }
+
+    // Orphans are unlinked but still own their blocks until they are reclaimed
+    uint32_t kept = 0;
+    for (uint32_t o = 0; o < fsck.orphans.count; o++) {
+        orphan_entry *orphan = &fsck.orphans.entries[o];
+        if (orphan->inode >= INODES_COUNT || is_bit_free(fsck.inode_bitmap, orphan->inode) ||
+            (fsck.inode_state[orphan->inode] & FSCK_INODE_REACHED)) {
+            fsck_problem(FSCK_BAD_ORPHAN, fsck.repair, "Orphan %u names free or linked inode %u", o, orphan->inode);
+            continue;
+        }
+        fsck.inode_state[orphan->inode] |= FSCK_INODE_REACHED;
+        if (fsck.itable->inodes[orphan->inode].file_type == 1) {
+            queue[end++] = orphan->inode;
+            queue[end++] = orphan->parent;
+        }
+        fsck.orphans.entries[kept++] = *orphan;
+    }
+    if (fsck.repair) fsck.orphans.count = kept;
+
+    while (head < end) {
+        uint32_t dir = queue[head++];
+        uint32_t parent = queue[head++];
+        if (fsck_check_directory(dir, parent, queue, &end) != 0) {
+            free(queue);
+            return -1;
+        }
+    }
+    free(queue);
+    return 0;
+}
+
+// [PASS 4: BITMAPS AND COUNTERS]
+static void fsck_check_counter(const char *name, uint32_t *counter, uint32_t expected) {
+    if (*counter == expected) return;
+    fsck_problem(FSCK_BAD_COUNTER, fsck.repair, "%s is %u, counted %u", name, *counter, expected);
+    if (fsck.repair) *counter = expected;
+}
+
+static void fsck_check_bitmaps() {
+    // 1. Inodes nothing refers to
+    for (uint32_t i = 0; i < INODES_COUNT; i++) {
+        if (is_bit_free(fsck.inode_bitmap, i) || (fsck.inode_state[i] & FSCK_INODE_REACHED)) continue;
+        fsck_problem(FSCK_UNREFERENCED, fsck.repair, "Inode %u (%s, %u bytes) is not referenced", i,
+                     fsck.itable->inodes[i].file_type == 1 ? "directory" : "file", fsck.itable->inodes[i].file_size);
+        if (fsck.repair) fsck_free_inode(i);
+    }
+
+    // 2. Blocks of inodes freed by the check are unused now (unless other inodes share them)
+    for (uint32_t b = 0; b < BLOCKS_COUNT; b++) {
+        uint32_t owner = fsck.block_owner[b];
+        if (owner && (fsck.inode_state[owner - 1] & FSCK_INODE_FREED) && fsck.block_refs[b] == 1) {
+            fsck.block_owner[b] = 0;
+            fsck.block_refs[b] = 0;
+        }
+    }
+
+    // 3. Reference counts against the inodes using each block
+    for (uint32_t b = FIRST_DATA_BLOCK; b < fsck.data_end; b++) {
+        uint32_t extra = fsck.block_refs[b] ? fsck.block_refs[b] - 1 : 0;
+        if (extra > UINT16_MAX) extra = UINT16_MAX;
+        if (extra == fsck.refcounts[b]) continue;
+        if (extra < fsck.refcounts[b]) {
+            fsck_problem(FSCK_BAD_REFCOUNT, fsck.repair, "Block %u has %u extra references, counted %u",
+                         b, fsck.refcounts[b], extra);
+        }
+        if (fsck.repair && fsck.refcount_start != 0) fsck.refcounts[b] = (uint16_t)extra;
+    }
+
+    // 4. Block bitmap against the blocks in use (the tables and the journal are always used)
+    uint32_t used_blocks = 0;
+    for (uint32_t index = 0; index < BLOCKS_COUNT; index++) {
+        uint32_t block = FIRST_DATA_BLOCK + index;
+        bool journal_area = block >= fsck.data_end && block < BLOCKS_COUNT;
+        bool in_use = journal_area || (block < BLOCKS_COUNT && fsck.block_owner[block] != 0);
+        bool marked = !is_bit_free(fsck.block_bitmap, index);
+
+        if (in_use && !marked) {
+            fsck_problem(FSCK_BLOCK_NOT_MARKED, fsck.repair, "Block %u is used by inode %u but marked free",
+                         block, fsck.block_owner[block] - 1);
+            if (fsck.repair) set_bitmap_bit(fsck.block_bitmap, index);
+        } else if (!in_use && marked) {
+            fsck_problem(FSCK_BLOCK_LEAKED, fsck.repair, "Block %u is marked used but used by nothing", block);
+            if (fsck.repair) free_bitmap_bit(fsck.block_bitmap, index);
+        }
+        if (!is_bit_free(fsck.block_bitmap, index) && !journal_area) used_blocks++;
+    }
+
+    // 5. Counters
+    uint32_t used_inodes = 0, directories = 0;
+    for (uint32_t i = 0; i < INODES_COUNT; i++) {
+        if (is_bit_free(fsck.inode_bitmap, i)) continue;
+        used_inodes++;
+        if (fsck.itable->inodes[i].file_type == 1) directories++;
+    }
+    fsck_check_counter("Free blocks count", &fsck.gd.free_blocks_count, fsck.data_blocks - used_blocks);
+    fsck_check_counter("Free inodes count", &fsck.gd.free_inodes_count, INODES_COUNT - used_inodes);
+    fsck_check_counter("Used directories count", &fsck.gd.used_dirs_count, directories);
+    fsck_check_counter("Inode table used count", &fsck.itable->used_inodes, used_inodes);
+}
+
+// Log the repaired metadata and write everything home; returns 0, or -1 on an I/O error
+static int fsck_write_back() {
+    journal_write(&fs_journal, fsck.disk, 1, 0, &fsck.gd, sizeof(group_descriptor));
+    journal_write(&fs_journal, fsck.disk, 1, ORPHAN_TABLE_OFFSET, &fsck.orphans, sizeof(orphan_table));
+    journal_write(&fs_journal, fsck.disk, fsck.gd.block_bitmap, 0, fsck.block_bitmap, BLOCKS_COUNT / 8);
+    journal_write(&fs_journal, fsck.disk, fsck.gd.inode_bitmap, 0, fsck.inode_bitmap, INODES_COUNT / 8);
+    journal_write(&fs_journal, fsck.disk, fsck.gd.inode_table, 0, fsck.itable, sizeof(inode_table));
+    if (fsck.refcount_start != 0) {
+        journal_write(&fs_journal, fsck.disk, fsck.refcount_start, 0, fsck.refcounts, sizeof(fsck.refcounts));
+    }
+    if (journal_commit(&fs_journal, fsck.disk) != 0) return -1;
+    return journal_checkpoint(&fs_journal, fsck.disk);
+}
+
+/**
+ * @brief Check (and with 'repair', fix) the drive.
+ *
+ * @return 0 if the drive is clean, 1 if every problem was repaired, 4 if
+ *         problems are left, 8 if the check could not run.
+ */
+int check_drive(const char *drive_name, bool repair, uint32_t threads) {
+    uint64_t start = metrics_now();
+    int status = 8;
+    fsck.repair = repair;
+    fsck.threads = threads;
+    fsck.disk = fopen(drive_name, repair ? "rb+" : "rb");
+    if (!fsck.disk) {
+        fprintf(stderr, "Error: Unable to open file %s\n", drive_name);
+        return status;
+    }
+    fsck.itable = (inode_table *)calloc(1, sizeof(inode_table));
+    fsck.block_owner = (uint32_t *)calloc(BLOCKS_COUNT, sizeof(uint32_t));
+    fsck.block_refs = (uint32_t *)calloc(BLOCKS_COUNT, sizeof(uint32_t));
+    fsck.inode_state = (uint8_t *)calloc(INODES_COUNT, sizeof(uint8_t));
+    if (!fsck.itable || !fsck.block_owner || !fsck.block_refs || !fsck.inode_state) {
+        fprintf(stderr, "Error: could not allocate memory for the check.\n");
+        goto cleanup;
+    }
+
+    // 1. Superblock, and the committed transactions of the log
+    superblock sb;
+    disk_read(fsck.disk, 0, &sb, sizeof(superblock));
+    if (sb.magic_number != 0xEF53 || sb.block_size != BLOCK_SIZE || sb.total_blocks != BLOCKS_COUNT ||
+        sb.total_inodes != INODES_COUNT) {
+        fprintf(stderr, "Error: %s is not a drive of this filesystem (bad superblock).\n", drive_name);
+        goto cleanup;
+    }
+    journal_free_checksums(&fs_journal);
+    initialize_journal(&fs_journal, BLOCK_SIZE, sb.journal_start, sb.journal_blocks);
+    int transactions = journal_load(&fs_journal, fsck.disk);
+    if (transactions < 0) {
+        printf("Journal has no valid superblock%s.\n", repair ? ", formatting an empty log" : "");
+        if (repair && journal_format(&fs_journal, fsck.disk) != 0) {
+            fprintf(stderr, "Error: could not write an empty log to %s.\n", drive_name);
+            goto cleanup;
+        }
+    } else if (transactions > 0) {
+        printf("Journal holds %d committed transactions%s.\n", transactions, repair ? ", replaying them" : ", checking as if replayed");
+    }
+
+    // Checksum table, as it will be after recovery (a damaged block is cleared and logged again)
+    fsck.checksum_start = (fs_journal.enabled && sb.checksum_blocks == CHECKSUM_BLOCKS) ? sb.checksum_start : 0;
+    if (fsck.checksum_start) {
+        int damaged = journal_load_checksums(&fs_journal, fsck.disk, fsck.checksum_start, CHECKSUM_BLOCKS);
+        if (damaged < 0) {
+            fprintf(stderr, "Error: could not allocate memory for the check.\n");
+            goto cleanup;
+        }
+        if (damaged > 0) fsck_problem(FSCK_BAD_CHECKSUM, repair, "Checksum table: %d blocks fail their own checksum", damaged);
+        if (journal_read_metadata(&fs_journal, fsck.disk, 0, 0, &sb, sizeof(superblock)) != 0) {
+            fsck_problem(FSCK_BAD_CHECKSUM, repair, "Superblock fails its checksum");
+            if (repair) journal_write(&fs_journal, fsck.disk, 0, 0, &sb, sizeof(superblock));
+        }
+    }
+
+    // Block 1 and the bitmaps are logged again by fsck_write_back
+    if (journal_read_metadata(&fs_journal, fsck.disk, 1, 0, &fsck.gd, sizeof(group_descriptor)) != 0 ||
+        journal_read_metadata(&fs_journal, fsck.disk, 1, ORPHAN_TABLE_OFFSET, &fsck.orphans, sizeof(orphan_table)) != 0) {
+        fsck_problem(FSCK_BAD_CHECKSUM, repair, "Group descriptor block fails its checksum");
+    }
+    if (journal_read_metadata(&fs_journal, fsck.disk, fsck.gd.block_bitmap, 0, fsck.block_bitmap, BLOCKS_COUNT / 8) != 0) {
+        fsck_problem(FSCK_BAD_CHECKSUM, repair, "Block bitmap fails its checksum");
+    }
+    if (journal_read_metadata(&fs_journal, fsck.disk, fsck.gd.inode_bitmap, 0, fsck.inode_bitmap, INODES_COUNT / 8) != 0) {
+        fsck_problem(FSCK_BAD_CHECKSUM, repair, "Inode bitmap fails its checksum");
+    }
+    journal_read(&fs_journal, fsck.disk, fsck.gd.inode_table, offsetof(inode_table, used_inodes),
+                 &fsck.itable->used_inodes, sizeof(uint32_t));
+    if (fsck.orphans.count > ORPHAN_TABLE_MAX) {
+        fsck_problem(FSCK_BAD_ORPHAN, repair, "Orphan list holds %u entries", fsck.orphans.count);
+        fsck.orphans.count = 0;
+    }
+    fsck.refcount_start = (sb.refcount_blocks == REFCOUNT_BLOCKS) ? sb.refcount_start : 0;
+    // The journal, as the superblock describes it (drives formatted without one have none)
+    uint32_t journal_start = fs_journal.enabled ? sb.journal_start : BLOCKS_COUNT;
+    uint32_t journal_blocks = fs_journal.enabled ? sb.journal_blocks : 0;
+    fsck.data_end = fsck.checksum_start ? fsck.checksum_start : (fsck.refcount_start ? fsck.refcount_start : journal_start);
+    fsck.data_blocks = FSCK_DATA_BLOCKS - journal_blocks - (fsck.refcount_start ? REFCOUNT_BLOCKS : 0) -
+                       (fsck.checksum_start ? CHECKSUM_BLOCKS : 0);
+    if (fsck.refcount_start &&
+        journal_read_metadata(&fs_journal, fsck.disk, fsck.refcount_start, 0, fsck.refcounts, sizeof(fsck.refcounts)) != 0) {
+        fsck_problem(FSCK_BAD_CHECKSUM, repair, "Reference count table fails its checksum");
+    }
+
+    // 2. Inodes and their block maps, then indirect blocks in block order
+    printf("Pass 1: inodes and block maps (%u thread%s)\n", threads, threads > 1 ? "s" : "");
+    fsck_refs found = { NULL, 0, 0 };
+    if (fsck_run_workers(fsck_inodes_worker, NULL, INODES_COUNT, &fsck.single_refs) != 0) goto out_of_memory;
+
+    printf("Pass 2: indirect blocks\n");
+    qsort(fsck.double_refs.items, fsck.double_refs.count, sizeof(fsck_ref), compare_fsck_refs);
+    if (fsck_run_workers(fsck_indirect_worker, &fsck.double_refs, fsck.double_refs.count, &found) != 0) goto out_of_memory;
+    for (uint32_t r = 0; r < found.count; r++) {
+        if (fsck_push_ref(&fsck.single_refs, found.items[r].block, found.items[r].inode) != 0) goto out_of_memory;
+    }
+    free(found.items);
+    found.items = NULL;
+    qsort(fsck.single_refs.items, fsck.single_refs.count, sizeof(fsck_ref), compare_fsck_refs);
+    if (fsck_run_workers(fsck_indirect_worker, &fsck.single_refs, fsck.single_refs.count, &found) != 0) goto out_of_memory;
+
+    // 3. Directory tree, then bitmaps and counters
+    printf("Pass 3: directory tree\n");
+    if (fsck_check_tree() != 0) goto out_of_memory;
+    printf("Pass 4: bitmaps and counters\n");
+    fsck_check_bitmaps();
+
+    // 4. Write the repairs (and the replayed log) home
+    uint32_t problems = 0, repaired = 0;
+    for (int k = 0; k < FSCK_KINDS; k++) {
+        problems += fsck.problems[k];
+        repaired += fsck.repaired[k];
+    }
+    bool write_failed = repair && (repaired > 0 || transactions > 0) && fsck_write_back() != 0;
+    if (write_failed) {
+        fprintf(stderr, "Error: could not write the repairs to %s.\n", drive_name);
+        memset(fsck.repaired, 0, sizeof(fsck.repaired));
+        repaired = 0;
+    }
+
+    // 5. Summary
+    for (int k = 0; k < FSCK_KINDS; k++) {
+        if (fsck.problems[k] == 0) continue;
+        printf("%-24s: %u%s\n", fsck_kind_names[k], fsck.problems[k],
+               fsck.repaired[k] == fsck.problems[k] ? " (repaired)" : (fsck.repaired[k] ? " (partly repaired)" : ""));
+    }
+    printf("%s: %s, %u/%u inodes, %u/%u blocks, checked in %.1f ms\n", drive_name,
+           (problems == 0 && !write_failed) ? "clean" : (repaired == problems && !write_failed ? "repaired" : "PROBLEMS LEFT"),
+           INODES_COUNT - fsck.gd.free_inodes_count, INODES_COUNT,
+           fsck.data_blocks - fsck.gd.free_blocks_count, fsck.data_blocks, (metrics_now() - start) / 1e6);
+    status = write_failed ? 4 : ((problems == 0) ? 0 : (repaired == problems ? 1 : 4));
+    goto cleanup;
+
+out_of_memory:
+    fprintf(stderr, "Error: could not allocate memory for the check.\n");
+    free(found.items);
+
+cleanup:
+    free(fsck.single_refs.items);
+    free(fsck.double_refs.items);
+    free(fsck.inode_state);
+    free(fsck.block_refs);
+    free(fsck.block_owner);
+    free(fsck.itable);
+    journal_free_checksums(&fs_journal);
+    fclose(fsck.disk);
+    return status;
+}
+
+// [DUMP]
+void dump_drive(FILE *file) {
+    superblock sb;
+    group_descriptor gd;
+    uint8_t *block_bitmap = (uint8_t *)malloc(BLOCKS_COUNT / 8);
+    uint8_t *inode_bitmap = (uint8_t *)malloc(INODES_COUNT / 8);
+    inode_table *itable = (inode_table *)malloc(sizeof(inode_table));
+    if (!block_bitmap || !inode_bitmap || !itable) {
+        fprintf(stderr, "Error: could not allocate memory for the dump.\n");
+        goto cleanup;
+    }
+
+    disk_read(file, 0, &sb, sizeof(superblock));
+    disk_read(file, BLOCK_SIZE, &gd, sizeof(group_descriptor));
+    disk_read(file, (uint64_t)gd.block_bitmap * BLOCK_SIZE, block_bitmap, BLOCKS_COUNT / 8);
+    disk_read(file, (uint64_t)gd.inode_bitmap * BLOCK_SIZE, inode_bitmap, INODES_COUNT / 8);
+    disk_read(file, (uint64_t)gd.inode_table * BLOCK_SIZE, itable, sizeof(inode_table));
+
+    print_superblock(&sb);                                      printf("\n");
+    print_descriptor_block(&gd);                                printf("\n");
+    printf("Bitmap for Data Block Bitmap:\n");
+    print_bitmap(block_bitmap, BLOCKS_COUNT);                   printf("\n");
+    printf("Bitmap for Inode Bitmap:\n");
+    print_bitmap(inode_bitmap, INODES_COUNT);                   printf("\n");
+    print_inode_table(itable, inode_bitmap);                    printf("\n");
+
+cleanup:
+    free(block_bitmap);
+    free(inode_bitmap);
+    free(itable);
+}
+
+int main(int argc, char *argv[]) {
+    const char *drive_name = DRIVE_NAME;
+    bool dump = false, repair = false;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t threads = (cpus < 1) ? 1 : (cpus > FSCK_THREADS_MAX ? FSCK_THREADS_MAX : (uint32_t)cpus);
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--dump") == 0) {
+            dump = true;
+        } else if (strcmp(argv[i], "--repair") == 0) {
+            repair = true;
+        } else if (strncmp(argv[i], "--threads=", 10) == 0 && atoi(argv[i] + 10) > 0) {
+            threads = (uint32_t)atoi(argv[i] + 10);
+            if (threads > FSCK_THREADS_MAX) threads = FSCK_THREADS_MAX;
+        } else if (argv[i][0] != '-') {
+            drive_name = argv[i];
+        } else {
+            fprintf(stderr, "Usage: %s [--dump] [--repair] [--threads=<n>] [drive]\n", argv[0]);
+            return 8;
+        }
+    }
+
+    if (dump) {
+        FILE *file = fopen(drive_name, "rb");
+        if (file == NULL) {
+            fprintf(stderr, "Error: Unable to open file %s\n", drive_name);
+            exit(EXIT_FAILURE);
+        }
+        dump_drive(file);
+        fclose(file);
+        return 0;
+    }
+    return check_drive(drive_name, repair, threads);
+}
@@ -0,0 +1,174 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Fast LZ77 codec for file data, in the spirit of LZ4.
+//
+// The compressed form is a sequence of (literals, match) pairs. Each one starts
+// with a token byte: the high nibble is the literal count and the low nibble the
+// match length minus LZ_MIN_MATCH, where 15 means "15 plus the following length
+// bytes" (bytes of 255 continue, the first smaller one ends the length). The
+// literals follow, then the match offset (2 bytes, little endian, 1..65535 back
+// from the current position) and the length bytes of the match. The last pair
+// has no match: decoding stops as soon as the expected output size is reached,
+// so the input may carry padding after the last pair.
+
+# define LZ_MIN_MATCH 4
+# define LZ_MAX_OFFSET 65535
+# define LZ_HASH_BITS 12
+
+static inline uint32_t lz_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Write the extension bytes of a length (its part above 15); NULL if 'end' is reached
+static uint8_t *lz_put_length(uint8_t *op, const uint8_t *end, size_t length) {
+    while (length >= 255) {
+        if (op >= end) return NULL;
+        *op++ = 255;
+        length -= 255;
+    }
+    if (op >= end) return NULL;
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+// Read the extension bytes of a length and add them to *length; -1 if the input ends
+static int lz_get_length(const uint8_t *src, size_t src_len, size_t *ip, size_t *length) {
+    uint8_t byte;
+    do {
+        if (*ip >= src_len) return -1;
+        byte = src[(*ip)++];
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+// Write one pair (match_len 0: literals only); NULL if 'end' is reached
+static uint8_t *lz_put_sequence(uint8_t *op, const uint8_t *end, const uint8_t *literals, size_t literal_len,
+                                size_t offset, size_t match_len) {
+    size_t extra = match_len ? match_len - LZ_MIN_MATCH : 0;
+    if (op >= end) return NULL;
+    uint8_t *token = op++;
+    *token = (uint8_t)(((literal_len < 15) ? literal_len : 15) << 4 | ((extra < 15) ? extra : 15));
+
+    if (literal_len >= 15 && !(op = lz_put_length(op, end, literal_len - 15))) return NULL;
+    if ((size_t)(end - op) < literal_len) return NULL;
+    memcpy(op, literals, literal_len);
+    op += literal_len;
+    if (match_len == 0) return op;
+
+    if (end - op < 2) return NULL;
+    *op++ = (uint8_t)(offset & 0xff);
+    *op++ = (uint8_t)(offset >> 8);
+    if (extra >= 15 && !(op = lz_put_length(op, end, extra - 15))) return NULL;
+    return op;
+}
+
+// Length of the common prefix of 'a' and 'b', at most 'limit' bytes
+static inline size_t lz_match_length(const uint8_t *a, const uint8_t *b, size_t limit) {
+    size_t n = 0;
+    while (n + 8 <= limit) {
+        uint64_t x, y;
+        memcpy(&x, a + n, 8);
+        memcpy(&y, b + n, 8);
+        if (x != y) return n + (size_t)(__builtin_ctzll(x ^ y) >> 3);
+        n += 8;
+    }
+    while (n < limit && a[n] == b[n]) n++;
+    return n;
+}
+
+/**
+ * @brief Compress 'len' bytes of 'src' into at most 'capacity' bytes of 'dst'.
+ *
+ * Matches are found through a hash table of the last position of every 4-byte
+ * prefix. Incompressible input is skipped faster the longer no match is found.
+ *
+ * @return The compressed size, or 0 if it does not fit in 'capacity'.
+ */
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t capacity) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    uint8_t *op = dst;
+    const uint8_t *end = dst + capacity;
+    size_t anchor = 0;  // Start of the pending literals
+    size_t misses = 0;
+
+    size_t i = 0;
+    while (i + LZ_MIN_MATCH <= len) {
+        uint32_t sequence = lz_read32(src + i);
+        uint32_t h = lz_hash(sequence);
+        size_t candidate = table[h];
+        table[h] = (uint32_t)i;
+
+        if (candidate < i && i - candidate <= LZ_MAX_OFFSET && lz_read32(src + candidate) == sequence) {
+            size_t match_len = LZ_MIN_MATCH + lz_match_length(src + candidate + LZ_MIN_MATCH, src + i + LZ_MIN_MATCH,
+                                                              len - i - LZ_MIN_MATCH);
+            op = lz_put_sequence(op, end, src + anchor, i - anchor, i - candidate, match_len);
+            if (!op) return 0;
+            i += match_len;
+            anchor = i;
+            misses = 0;
+        } else {
+            i += 1 + (misses++ >> 5);
+        }
+    }
+
+    if (anchor < len || len == 0) {
+        op = lz_put_sequence(op, end, src + anchor, len - anchor, 0, 0);
+        if (!op) return 0;
+    }
+    return (size_t)(op - dst);
+}
+
+/**
+ * @brief Decompress 'src' into exactly 'dst_len' bytes of 'dst'.
+ *
+ * Bytes of 'src' after the pair that completes the output are ignored.
+ *
+ * @return 0 on success, or -1 if the input is corrupt or too short.
+ */
+int lz_decompress(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_len) {
+    size_t ip = 0, op = 0;
+    while (op < dst_len) {
+        // 1. Literals
+        if (ip >= src_len) return -1;
+        uint8_t token = src[ip++];
+        size_t literal_len = token >> 4;
+        if (literal_len == 15 && lz_get_length(src, src_len, &ip, &literal_len) != 0) return -1;
+        if (literal_len > src_len - ip || literal_len > dst_len - op) return -1;
+        memcpy(dst + op, src + ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+        if (op == dst_len) break;
+
+        // 2. Match (may overlap the bytes it produces)
+        if (src_len - ip < 2) return -1;
+        size_t offset = (size_t)src[ip] | (size_t)src[ip + 1] << 8;
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && lz_get_length(src, src_len, &ip, &match_len) != 0) return -1;
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || match_len > dst_len - op) return -1;
+
+        if (offset >= match_len) {
+            memcpy(dst + op, dst + op - offset, match_len);
+        } else {
+            for (size_t k = 0; k < match_len; k++) dst[op + k] = dst[op - offset + k];
+        }
+        op += match_len;
+    }
+    return 0;
+}
+
+#endif // COMPRESS_H
@@ -0,0 +1,215 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+# define DCACHE_BUCKETS 4096
+# define DCACHE_MAX_ENTRIES 65536
+
+// Result of a dentry cache lookup
+# define DCACHE_MISS     0 // Nothing known about this name, the directory must be read
+# define DCACHE_HIT      1 // The name exists, inode and file type are returned
+# define DCACHE_NEGATIVE 2 // The name is known not to exist
+
+// One cached (parent inode, name) -> inode mapping
+typedef struct dentry {
+    uint32_t parent_inode;  // Inode of the directory containing the name
+    uint32_t inode;         // Inode the name refers to (unused for negative entries)
+    uint8_t  file_type;     // 0 = regular file, 1 = directory
+    uint8_t  negative;      // 1 if the name is known not to exist in the parent
+    char    *name;          // Entry name (owned by the cache)
+    struct dentry *next;    // Next entry in the same hash bucket
+} dentry;
+
+typedef struct dcache {
+    dentry *buckets[DCACHE_BUCKETS];
+    uint32_t entries_count;
+    pthread_mutex_t lock;   // Protects the buckets; taken by every public function
+} dcache;
+
+// Hash a (parent inode, name) key (FNV-1a)
+uint32_t dcache_hash(uint32_t parent_inode, const char *name) {
+    uint32_t hash = 2166136261u ^ parent_inode;
+    for (const char *c = name; *c; c++) {
+        hash ^= (uint8_t)*c;
+        hash *= 16777619u;
+    }
+    return hash % DCACHE_BUCKETS;
+}
+
+// Initialize an empty cache
+void initialize_dcache(dcache *dc) {
+    memset(dc->buckets, 0, sizeof(dc->buckets));
+    dc->entries_count = 0;
+    pthread_mutex_init(&dc->lock, NULL);
+}
+
+// Drop every entry (lock held)
+static void dcache_clear_locked(dcache *dc) {
+    for (int i = 0; i < DCACHE_BUCKETS; i++) {
+        dentry *d = dc->buckets[i];
+        while (d) {
+            dentry *next = d->next;
+            free(d->name);
+            free(d);
+            d = next;
+        }
+        dc->buckets[i] = NULL;
+    }
+    dc->entries_count = 0;
+}
+
+// Drop every entry
+void dcache_clear(dcache *dc) {
+    pthread_mutex_lock(&dc->lock);
+    dcache_clear_locked(dc);
+    pthread_mutex_unlock(&dc->lock);
+}
+
+// Find the cached entry for a key, or NULL (lock held)
+dentry *dcache_find(dcache *dc, uint32_t parent_inode, const char *name) {
+    for (dentry *d = dc->buckets[dcache_hash(parent_inode, name)]; d; d = d->next) {
+        if (d->parent_inode == parent_inode && strcmp(d->name, name) == 0) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+// Look up a name; returns DCACHE_MISS, DCACHE_HIT or DCACHE_NEGATIVE
+int dcache_lookup(dcache *dc, uint32_t parent_inode, const char *name, uint32_t *out_inode, uint8_t *out_file_type) {
+    int result = DCACHE_MISS;
+
+    pthread_mutex_lock(&dc->lock);
+    dentry *d = dcache_find(dc, parent_inode, name);
+    if (d && d->negative) {
+        result = DCACHE_NEGATIVE;
+    } else if (d) {
+        *out_inode = d->inode;
+        *out_file_type = d->file_type;
+        result = DCACHE_HIT;
+    }
+    pthread_mutex_unlock(&dc->lock);
+    return result;
+}
+
+// Insert or update an entry (negative != 0 records that the name does not exist)
+static void dcache_store(dcache *dc, uint32_t parent_inode, const char *name, uint32_t inode, uint8_t file_type, uint8_t negative) {
+    pthread_mutex_lock(&dc->lock);
+    dentry *d = dcache_find(dc, parent_inode, name);
+    if (!d) {
+        // Keep memory bounded: start over once the cache is full
+        if (dc->entries_count >= DCACHE_MAX_ENTRIES) {
+            dcache_clear_locked(dc);
+        }
+
+        d = (dentry *)malloc(sizeof(dentry));
+        if (!d) goto out;
+        d->name = strdup(name);
+        if (!d->name) {
+            free(d);
+            goto out;
+        }
+        d->parent_inode = parent_inode;
+
+        uint32_t bucket = dcache_hash(parent_inode, name);
+        d->next = dc->buckets[bucket];
+        dc->buckets[bucket] = d;
+        dc->entries_count++;
+    }
+
+    d->inode = inode;
+    d->file_type = file_type;
+    d->negative = negative;
+out:
+    pthread_mutex_unlock(&dc->lock);
+}
+
+// Cache an existing name
+void dcache_insert(dcache *dc, uint32_t parent_inode, const char *name, uint32_t inode, uint8_t file_type) {
+    dcache_store(dc, parent_inode, name, inode, file_type, 0);
+}
+
+// Cache that a name does not exist
+void dcache_insert_negative(dcache *dc, uint32_t parent_inode, const char *name) {
+    dcache_store(dc, parent_inode, name, 0, 0, 1);
+}
+
+// Forget a single name
+void dcache_remove(dcache *dc, uint32_t parent_inode, const char *name) {
+    pthread_mutex_lock(&dc->lock);
+    dentry **link = &dc->buckets[dcache_hash(parent_inode, name)];
+    while (*link) {
+        dentry *d = *link;
+        if (d->parent_inode == parent_inode && strcmp(d->name, name) == 0) {
+            *link = d->next;
+            free(d->name);
+            free(d);
+            dc->entries_count--;
+            break;
+        }
+        link = &d->next;
+    }
+    pthread_mutex_unlock(&dc->lock);
+}
+
+// Forget every entry inside a directory and every name pointing to it
+// (used when the directory is deleted and its inode may be reused)
+void dcache_invalidate_dir(dcache *dc, uint32_t dir_inode) {
+    pthread_mutex_lock(&dc->lock);
+    for (int i = 0; i < DCACHE_BUCKETS; i++) {
+        dentry **link = &dc->buckets[i];
+        while (*link) {
+            dentry *d = *link;
+            if (d->parent_inode == dir_inode || (!d->negative && d->inode == dir_inode)) {
+                *link = d->next;
+                free(d->name);
+                free(d);
+                dc->entries_count--;
+            } else {
+                link = &d->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&dc->lock);
+}
+
+static bool dcache_dir_listed(const uint32_t *dirs, uint32_t count, uint32_t inode) {
+    uint32_t lo = 0, hi = count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (dirs[mid] == inode) return true;
+        if (dirs[mid] < inode) lo = mid + 1; else hi = mid;
+    }
+    return false;
+}
+
+// Same as dcache_invalidate_dir for a whole set of directories ('dirs' sorted
+// ascending) in a single pass over the cache
+void dcache_invalidate_dirs(dcache *dc, const uint32_t *dirs, uint32_t count) {
+    if (count == 0) return;
+    pthread_mutex_lock(&dc->lock);
+    for (int i = 0; i < DCACHE_BUCKETS; i++) {
+        dentry **link = &dc->buckets[i];
+        while (*link) {
+            dentry *d = *link;
+            if (dcache_dir_listed(dirs, count, d->parent_inode) ||
+                (!d->negative && dcache_dir_listed(dirs, count, d->inode))) {
+                *link = d->next;
+                free(d->name);
+                free(d);
+                dc->entries_count--;
+            } else {
+                link = &d->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&dc->lock);
+}
+
+#endif // DCACHE_H
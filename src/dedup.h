@@ -0,0 +1,250 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// Fingerprint index of data block contents, for inline deduplication.
+//
+// Every block written while deduplication is on is hashed with a 64-bit
+// XXH64-style hash and recorded here as hash -> block number. A later write of
+// the same content finds the block and maps it instead of writing a copy (the
+// caller compares the bytes, so a hash collision only costs a read).
+//
+// The table uses open addressing with linear probing. Every block is indexed
+// at most once, and a per-block slot number lets a block be dropped in O(1)
+// when it is freed or about to be written in place. Dropped entries become
+// tombstones; the table is rebuilt when live entries and tombstones fill 3/4
+// of it. It lives in memory only and is built from the writes since mount.
+
+# define DEDUP_SLOT_EMPTY   0
+# define DEDUP_SLOT_LIVE    1
+# define DEDUP_SLOT_DELETED 2
+
+typedef struct dedup_slot {
+    uint64_t hash;
+    uint32_t block;
+    uint32_t state; // DEDUP_SLOT_*
+} dedup_slot;
+
+typedef struct dedup_index {
+    dedup_slot *slots;
+    uint32_t mask;          // Slot count - 1 (a power of two)
+    uint32_t used;          // Live entries and tombstones
+    uint32_t *slot_of;      // Per block number: its slot + 1, 0 if not indexed
+    uint32_t blocks;        // Size of slot_of
+    pthread_mutex_t lock;
+} dedup_index;
+
+// [HASH]
+# define XXH_PRIME64_1 0x9E3779B185EBCA87ull
+# define XXH_PRIME64_2 0xC2B2AE3D27D4EB4Full
+# define XXH_PRIME64_3 0x165667B19E3779F9ull
+# define XXH_PRIME64_4 0x85EBCA77C2B2AE63ull
+# define XXH_PRIME64_5 0x27D4EB2F165667C5ull
+
+static inline uint64_t xxh_rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = xxh_rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh_merge_round(uint64_t acc, uint64_t lane) {
+    acc ^= xxh_round(0, lane);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/**
+ * @brief 64-bit hash of 'len' bytes (XXH64 with seed 0).
+ *
+ * Four independent lanes consume 32 bytes per step, so a 4 KB block takes a
+ * few hundred multiply-rotate rounds that the CPU runs in parallel.
+ */
+uint64_t dedup_hash(const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    const uint8_t *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = XXH_PRIME64_1 + XXH_PRIME64_2, v2 = XXH_PRIME64_2, v3 = 0, v4 = 0 - XXH_PRIME64_1;
+        const uint8_t *limit = end - 32;
+        do {
+            v1 = xxh_round(v1, xxh_read64(p));
+            v2 = xxh_round(v2, xxh_read64(p + 8));
+            v3 = xxh_round(v3, xxh_read64(p + 16));
+            v4 = xxh_round(v4, xxh_read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = xxh_rotl64(v1, 1) + xxh_rotl64(v2, 7) + xxh_rotl64(v3, 12) + xxh_rotl64(v4, 18);
+        h = xxh_merge_round(h, v1);
+        h = xxh_merge_round(h, v2);
+        h = xxh_merge_round(h, v3);
+        h = xxh_merge_round(h, v4);
+    } else {
+        h = XXH_PRIME64_5;
+    }
+    h += (uint64_t)len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh_round(0, xxh_read64(p));
+        h = xxh_rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        h ^= (uint64_t)v * XXH_PRIME64_1;
+        h = xxh_rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (*p) * XXH_PRIME64_5;
+        h = xxh_rotl64(h, 11) * XXH_PRIME64_1;
+    }
+
+    // Avalanche
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+// [INDEX]
+/**
+ * @brief Set up an empty index for a drive of 'blocks' blocks.
+ *
+ * @return 0 on success, or -1 if the tables cannot be allocated.
+ */
+int initialize_dedup_index(dedup_index *idx, uint32_t blocks) {
+    uint32_t capacity = 1024;
+    while (capacity < 2 * blocks) capacity <<= 1;
+
+    idx->slots = (dedup_slot *)calloc(capacity, sizeof(dedup_slot));
+    idx->slot_of = (uint32_t *)calloc(blocks, sizeof(uint32_t));
+    if (!idx->slots || !idx->slot_of) {
+        free(idx->slots);
+        free(idx->slot_of);
+        idx->slots = NULL;
+        idx->slot_of = NULL;
+        return -1;
+    }
+    idx->mask = capacity - 1;
+    idx->used = 0;
+    idx->blocks = blocks;
+    pthread_mutex_init(&idx->lock, NULL);
+    return 0;
+}
+
+// Release the tables (the index is empty and disabled afterwards)
+void destroy_dedup_index(dedup_index *idx) {
+    if (!idx->slots) return;
+    free(idx->slots);
+    free(idx->slot_of);
+    idx->slots = NULL;
+    idx->slot_of = NULL;
+    pthread_mutex_destroy(&idx->lock);
+}
+
+// Slot holding 'hash', or the slot where it would go (the first tombstone on its probe path)
+static uint32_t dedup_probe_locked(const dedup_index *idx, uint64_t hash) {
+    uint32_t i = (uint32_t)(hash ^ (hash >> 32)) & idx->mask;
+    uint32_t tombstone = UINT32_MAX;
+    for (;;) {
+        const dedup_slot *s = &idx->slots[i];
+        if (s->state == DEDUP_SLOT_EMPTY) return (tombstone != UINT32_MAX) ? tombstone : i;
+        if (s->state == DEDUP_SLOT_LIVE && s->hash == hash) return i;
+        if (s->state == DEDUP_SLOT_DELETED && tombstone == UINT32_MAX) tombstone = i;
+        i = (i + 1) & idx->mask;
+    }
+}
+
+// Re-insert the live entries into a table without tombstones
+static void dedup_rebuild_locked(dedup_index *idx) {
+    uint32_t capacity = idx->mask + 1;
+    dedup_slot *old = idx->slots;
+    dedup_slot *fresh = (dedup_slot *)calloc(capacity, sizeof(dedup_slot));
+    if (!fresh) return; // Keep probing through the tombstones
+
+    idx->slots = fresh;
+    idx->used = 0;
+    for (uint32_t i = 0; i < capacity; i++) {
+        if (old[i].state != DEDUP_SLOT_LIVE) continue;
+        uint32_t slot = dedup_probe_locked(idx, old[i].hash);
+        idx->slots[slot] = old[i];
+        idx->slot_of[old[i].block] = slot + 1;
+        idx->used++;
+    }
+    free(old);
+}
+
+// Block holding content with 'hash', or 0 if none is indexed
+uint32_t dedup_lookup(dedup_index *idx, uint64_t hash) {
+    if (!idx->slots) return 0;
+    pthread_mutex_lock(&idx->lock);
+    uint32_t slot = dedup_probe_locked(idx, hash);
+    uint32_t block = (idx->slots[slot].state == DEDUP_SLOT_LIVE) ? idx->slots[slot].block : 0;
+    pthread_mutex_unlock(&idx->lock);
+    return block;
+}
+
+// Whether 'block' is still indexed under 'hash'
+bool dedup_holds(dedup_index *idx, uint64_t hash, uint32_t block) {
+    if (!idx->slots || block >= idx->blocks) return false;
+    pthread_mutex_lock(&idx->lock);
+    uint32_t slot = idx->slot_of[block];
+    bool held = slot != 0 && idx->slots[slot - 1].hash == hash;
+    pthread_mutex_unlock(&idx->lock);
+    return held;
+}
+
+// Drop 'block' from the index, if it is there (idx->lock held)
+static void dedup_forget_locked(dedup_index *idx, uint32_t block) {
+    uint32_t slot = idx->slot_of[block];
+    if (slot == 0) return;
+    idx->slots[slot - 1].state = DEDUP_SLOT_DELETED;
+    idx->slot_of[block] = 0;
+}
+
+// Drop 'block' from the index, if it is there
+void dedup_forget(dedup_index *idx, uint32_t block) {
+    if (!idx->slots || block >= idx->blocks) return;
+    pthread_mutex_lock(&idx->lock);
+    dedup_forget_locked(idx, block);
+    pthread_mutex_unlock(&idx->lock);
+}
+
+// Record that 'block' holds content with 'hash' (replacing an older block with the same hash)
+void dedup_insert(dedup_index *idx, uint64_t hash, uint32_t block) {
+    if (!idx->slots || block >= idx->blocks) return;
+    pthread_mutex_lock(&idx->lock);
+    dedup_forget_locked(idx, block);
+    uint32_t slot = dedup_probe_locked(idx, hash);
+    dedup_slot *s = &idx->slots[slot];
+    if (s->state == DEDUP_SLOT_LIVE) {
+        idx->slot_of[s->block] = 0;
+    } else if (s->state == DEDUP_SLOT_EMPTY) {
+        idx->used++;
+    }
+    s->hash = hash;
+    s->block = block;
+    s->state = DEDUP_SLOT_LIVE;
+    idx->slot_of[block] = slot + 1;
+    if (idx->used > (idx->mask + 1) / 4 * 3) dedup_rebuild_locked(idx);
+    pthread_mutex_unlock(&idx->lock);
+}
+
+#endif // DEDUP_H
@@ -0,0 +1,114 @@
+#ifndef DELALLOC_H
+#define DELALLOC_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "inode.h"
+
+// Dirty content of one file whose data blocks have not been chosen yet
+typedef struct delalloc_buffer {
+    uint32_t inode_number;  // Inode the content belongs to
+    size_t size;            // Number of valid bytes in 'data'
+    uint8_t *data;          // Whole file image (file_t header followed by the content)
+} delalloc_buffer;
+
+// Table of pending (delayed) writes, indexed by inode number.
+// The buffer of one inode is only replaced or dropped under that inode's write lock;
+// 'lock' protects the slots and the counters.
+typedef struct delalloc_table {
+    delalloc_buffer *buffers[INODES_COUNT];
+    uint32_t pending_count; // Number of inodes with pending data
+    size_t dirty_bytes;     // Total number of bytes held in memory
+    pthread_mutex_t lock;
+} delalloc_table;
+
+// Initialize the table (no pending writes)
+void initialize_delalloc_table(delalloc_table *table) {
+    memset(table->buffers, 0, sizeof(table->buffers));
+    table->pending_count = 0;
+    table->dirty_bytes = 0;
+    pthread_mutex_init(&table->lock, NULL);
+}
+
+// Return the pending buffer of an inode, or NULL if its data is on disk
+delalloc_buffer *delalloc_lookup(delalloc_table *table, uint32_t inode_number) {
+    if (inode_number >= INODES_COUNT) return NULL;
+    pthread_mutex_lock(&table->lock);
+    delalloc_buffer *buf = table->buffers[inode_number];
+    pthread_mutex_unlock(&table->lock);
+    return buf;
+}
+
+// Number of inodes with pending data
+uint32_t delalloc_pending_count(delalloc_table *table) {
+    pthread_mutex_lock(&table->lock);
+    uint32_t count = table->pending_count;
+    pthread_mutex_unlock(&table->lock);
+    return count;
+}
+
+// Number of bytes held in memory
+size_t delalloc_dirty_bytes(delalloc_table *table) {
+    pthread_mutex_lock(&table->lock);
+    size_t bytes = table->dirty_bytes;
+    pthread_mutex_unlock(&table->lock);
+    return bytes;
+}
+
+// Drop the pending buffer of an inode (if any)
+void delalloc_drop(delalloc_table *table, uint32_t inode_number) {
+    if (inode_number >= INODES_COUNT) return;
+
+    pthread_mutex_lock(&table->lock);
+    delalloc_buffer *buf = table->buffers[inode_number];
+    if (buf) {
+        table->dirty_bytes -= buf->size;
+        table->pending_count--;
+        table->buffers[inode_number] = NULL;
+    }
+    pthread_mutex_unlock(&table->lock);
+
+    if (!buf) return;
+    free(buf->data);
+    free(buf);
+}
+
+// Replace the pending content of an inode with a copy of 'data'
+int delalloc_store(delalloc_table *table, uint32_t inode_number, const void *data, size_t size) {
+    if (inode_number >= INODES_COUNT) return -1;
+
+    uint8_t *copy = (uint8_t *)malloc(size);
+    if (!copy) return -1;
+    memcpy(copy, data, size);
+
+    pthread_mutex_lock(&table->lock);
+    delalloc_buffer *buf = table->buffers[inode_number];
+    uint8_t *old_data = NULL;
+    if (buf) {
+        table->dirty_bytes -= buf->size;
+        old_data = buf->data;
+    } else {
+        buf = (delalloc_buffer *)malloc(sizeof(delalloc_buffer));
+        if (!buf) {
+            pthread_mutex_unlock(&table->lock);
+            free(copy);
+            return -1;
+        }
+        buf->inode_number = inode_number;
+        table->buffers[inode_number] = buf;
+        table->pending_count++;
+    }
+
+    buf->data = copy;
+    buf->size = size;
+    table->dirty_bytes += size;
+    pthread_mutex_unlock(&table->lock);
+
+    free(old_data);
+    return 0;
+}
+
+#endif // DELALLOC_H
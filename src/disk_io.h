@@ -0,0 +1,58 @@
+#ifndef DISK_IO_H
+#define DISK_IO_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "metrics.h"
+
+// Position-independent I/O on the drive image.
+//
+// Every access goes through pread/pwrite on the descriptor behind the FILE,
+// so threads never share (or move) a file position and stdio never buffers
+// drive contents.
+
+// Read 'len' bytes at byte 'offset'; bytes past the end of the drive read as zero.
+// Returns 0 on success, or -1 on an I/O error.
+int disk_read(FILE *disk, uint64_t offset, void *buf, size_t len) {
+    uint8_t *dst = (uint8_t *)buf;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t got = pread(fileno(disk), dst + done, len - done, (off_t)(offset + done));
+        metrics_add(&metrics.read_calls, 1);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            memset(dst + done, 0, len - done);
+            return -1;
+        }
+        if (got == 0) {
+            memset(dst + done, 0, len - done);
+            break;
+        }
+        done += (size_t)got;
+    }
+    metrics_add(&metrics.bytes_read, done);
+    return 0;
+}
+
+// Write 'len' bytes at byte 'offset'. Returns 0 on success, or -1 on an I/O error.
+int disk_write(FILE *disk, uint64_t offset, const void *buf, size_t len) {
+    const uint8_t *src = (const uint8_t *)buf;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t put = pwrite(fileno(disk), src + done, len - done, (off_t)(offset + done));
+        metrics_add(&metrics.write_calls, 1);
+        if (put < 0) {
+            if (errno == EINTR) continue;
+            perror("Error: disk write failed");
+            return -1;
+        }
+        done += (size_t)put;
+    }
+    metrics_add(&metrics.bytes_written, done);
+    return 0;
+}
+
+#endif // DISK_IO_H
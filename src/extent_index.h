@@ -0,0 +1,246 @@
+#ifndef EXTENT_INDEX_H
+#define EXTENT_INDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitmap.h"
+
+// In-memory index of the free extents (runs of free bits) of a block bitmap.
+//
+// Every extent is a node of two treaps at once: one ordered by start, used to find
+// neighbours when a range is freed or claimed, and one ordered by (length, start),
+// used for best-fit searches. All operations take O(log n) expected time.
+// The index mirrors the bitmap; the owner changes both together.
+
+# define EXTENT_BY_START 0
+# define EXTENT_BY_SIZE  1
+
+typedef struct extent_node {
+    uint32_t start;     // First free bit of the extent
+    uint32_t length;    // Number of free bits
+    uint32_t priority;  // Treap heap priority
+    struct extent_node *link[2][2]; // [tree][0 = left, 1 = right]
+    struct extent_node *next_free;  // Free list of unused nodes
+} extent_node;
+
+typedef struct extent_index {
+    extent_node *nodes;     // Preallocated node pool
+    extent_node *free_nodes;
+    extent_node *root[2];   // Roots of the start and size treaps
+    uint32_t extents_count; // Free extents
+    uint32_t free_count;    // Free bits in all extents
+    uint32_t seed;          // State of the priority generator
+} extent_index;
+
+// Strict order of the nodes in one treap (keys are unique in both)
+static int extent_less(const extent_node *a, const extent_node *b, int tree) {
+    if (tree == EXTENT_BY_SIZE && a->length != b->length) return a->length < b->length;
+    return a->start < b->start;
+}
+
+static extent_node *extent_treap_insert(extent_node *root, extent_node *n, int tree) {
+    if (!root) {
+        n->link[tree][0] = n->link[tree][1] = NULL;
+        return n;
+    }
+    int dir = extent_less(root, n, tree);
+    root->link[tree][dir] = extent_treap_insert(root->link[tree][dir], n, tree);
+
+    // Rotate the child up if it has the higher priority
+    extent_node *child = root->link[tree][dir];
+    if (child->priority > root->priority) {
+        root->link[tree][dir] = child->link[tree][!dir];
+        child->link[tree][!dir] = root;
+        return child;
+    }
+    return root;
+}
+
+// Join two treaps where every key of 'a' is smaller than every key of 'b'
+static extent_node *extent_treap_merge(extent_node *a, extent_node *b, int tree) {
+    if (!a) return b;
+    if (!b) return a;
+    if (a->priority > b->priority) {
+        a->link[tree][1] = extent_treap_merge(a->link[tree][1], b, tree);
+        return a;
+    }
+    b->link[tree][0] = extent_treap_merge(a, b->link[tree][0], tree);
+    return b;
+}
+
+static extent_node *extent_treap_remove(extent_node *root, extent_node *n, int tree) {
+    if (!root) return NULL;
+    if (root == n) return extent_treap_merge(n->link[tree][0], n->link[tree][1], tree);
+    int dir = extent_less(root, n, tree);
+    root->link[tree][dir] = extent_treap_remove(root->link[tree][dir], n, tree);
+    return root;
+}
+
+static void extent_add(extent_index *idx, uint32_t start, uint32_t length) {
+    extent_node *n = idx->free_nodes;
+    idx->free_nodes = n->next_free;
+
+    // xorshift32
+    idx->seed ^= idx->seed << 13;
+    idx->seed ^= idx->seed >> 17;
+    idx->seed ^= idx->seed << 5;
+
+    n->start = start;
+    n->length = length;
+    n->priority = idx->seed;
+    idx->root[EXTENT_BY_START] = extent_treap_insert(idx->root[EXTENT_BY_START], n, EXTENT_BY_START);
+    idx->root[EXTENT_BY_SIZE] = extent_treap_insert(idx->root[EXTENT_BY_SIZE], n, EXTENT_BY_SIZE);
+    idx->extents_count++;
+}
+
+static void extent_delete(extent_index *idx, extent_node *n) {
+    idx->root[EXTENT_BY_START] = extent_treap_remove(idx->root[EXTENT_BY_START], n, EXTENT_BY_START);
+    idx->root[EXTENT_BY_SIZE] = extent_treap_remove(idx->root[EXTENT_BY_SIZE], n, EXTENT_BY_SIZE);
+    n->next_free = idx->free_nodes;
+    idx->free_nodes = n;
+    idx->extents_count--;
+}
+
+// The extent with the greatest start <= 'bit', or NULL
+static extent_node *extent_at_or_before(const extent_index *idx, uint32_t bit) {
+    extent_node *best = NULL;
+    for (extent_node *n = idx->root[EXTENT_BY_START]; n; ) {
+        if (n->start <= bit) {
+            best = n;
+            n = n->link[EXTENT_BY_START][1];
+        } else {
+            n = n->link[EXTENT_BY_START][0];
+        }
+    }
+    return best;
+}
+
+// The extent starting exactly at 'bit', or NULL
+static extent_node *extent_starting_at(const extent_index *idx, uint32_t bit) {
+    extent_node *n = idx->root[EXTENT_BY_START];
+    while (n && n->start != bit) {
+        n = n->link[EXTENT_BY_START][n->start < bit];
+    }
+    return n;
+}
+
+/**
+ * @brief Build the index from the free bits [first, limit) of 'bitmap'.
+ *
+ * @return 0 on success, or -1 if the node pool cannot be allocated.
+ */
+int initialize_extent_index(extent_index *idx, uint8_t *bitmap, uint32_t first, uint32_t limit) {
+    memset(idx, 0, sizeof(extent_index));
+    idx->seed = 2463534242u;
+
+    // Runs alternate with used bits, so there are never more than half as many
+    // extents as bits; one spare node covers a split before the matching merge.
+    uint32_t capacity = (limit - first) / 2 + 2;
+    idx->nodes = (extent_node *)calloc(capacity, sizeof(extent_node));
+    if (!idx->nodes) return -1;
+    for (uint32_t i = 0; i < capacity; i++) {
+        idx->nodes[i].next_free = (i + 1 < capacity) ? &idx->nodes[i + 1] : NULL;
+    }
+    idx->free_nodes = &idx->nodes[0];
+
+    uint32_t i = first;
+    while (i < limit) {
+        if (!is_bit_free(bitmap, i)) {
+            i++;
+            continue;
+        }
+        uint32_t start = i;
+        while (i < limit && is_bit_free(bitmap, i)) i++;
+        extent_add(idx, start, i - start);
+        idx->free_count += i - start;
+    }
+    return 0;
+}
+
+// Release the node pool
+void destroy_extent_index(extent_index *idx) {
+    free(idx->nodes);
+    memset(idx, 0, sizeof(extent_index));
+}
+
+/**
+ * @brief Mark [start, start + length) as used.
+ *
+ * @return 0, or -1 if the range is not entirely free (the index is unchanged).
+ */
+int extent_index_claim(extent_index *idx, uint32_t start, uint32_t length) {
+    extent_node *e = extent_at_or_before(idx, start);
+    if (!e || length == 0 || (uint64_t)e->start + e->length < (uint64_t)start + length) return -1;
+
+    uint32_t e_start = e->start, e_end = e->start + e->length;
+    extent_delete(idx, e);
+    if (start > e_start) extent_add(idx, e_start, start - e_start);
+    if (start + length < e_end) extent_add(idx, start + length, e_end - (start + length));
+    idx->free_count -= length;
+    return 0;
+}
+
+// Mark [start, start + length) (currently used) as free, merging with free neighbours
+void extent_index_release(extent_index *idx, uint32_t start, uint32_t length) {
+    if (length == 0) return;
+    uint32_t merged_start = start, merged_length = length;
+
+    extent_node *prev = extent_at_or_before(idx, start);
+    if (prev && prev->start + prev->length == start) {
+        merged_start = prev->start;
+        merged_length += prev->length;
+        extent_delete(idx, prev);
+    }
+    extent_node *next = extent_starting_at(idx, start + length);
+    if (next) {
+        merged_length += next->length;
+        extent_delete(idx, next);
+    }
+    extent_add(idx, merged_start, merged_length);
+    idx->free_count += length;
+}
+
+/**
+ * @brief Best fit: the start of the smallest free extent holding 'length' bits
+ * (the lowest such start among equals), or -1 if there is none.
+ */
+int extent_index_best_fit(const extent_index *idx, uint32_t length) {
+    const extent_node *best = NULL;
+    for (const extent_node *n = idx->root[EXTENT_BY_SIZE]; n; ) {
+        if (n->length >= length) {
+            best = n;
+            n = n->link[EXTENT_BY_SIZE][0];
+        } else {
+            n = n->link[EXTENT_BY_SIZE][1];
+        }
+    }
+    return best ? (int)best->start : -1;
+}
+
+/**
+ * @brief First fit: the lowest free extent. Returns its start and stores its
+ * length in 'out_length', or returns -1 if nothing is free.
+ */
+int extent_index_first(const extent_index *idx, uint32_t *out_length) {
+    const extent_node *n = idx->root[EXTENT_BY_START];
+    if (!n) return -1;
+    while (n->link[EXTENT_BY_START][0]) n = n->link[EXTENT_BY_START][0];
+    *out_length = n->length;
+    return (int)n->start;
+}
+
+static void extent_visit(const extent_node *n, void (*fn)(uint32_t, uint32_t, void *), void *arg) {
+    if (!n) return;
+    extent_visit(n->link[EXTENT_BY_START][0], fn, arg);
+    fn(n->start, n->length, arg);
+    extent_visit(n->link[EXTENT_BY_START][1], fn, arg);
+}
+
+// Call 'fn' with the start and length of every free extent, in start order
+void extent_index_for_each(const extent_index *idx, void (*fn)(uint32_t start, uint32_t length, void *arg), void *arg) {
+    extent_visit(idx->root[EXTENT_BY_START], fn, arg);
+}
+
+#endif // EXTENT_INDEX_H
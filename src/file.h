@@ -99,6 +99,31 @@ directory_block_t *add_entry_to_directory_block(directory_block_t *dirblk, uint3
     return new_dirblk;
 }
 
+// Append 'count' entries of the same type at once (one copy of the existing entries)
+directory_block_t *add_entries_to_directory_block(directory_block_t *dirblk, uint32_t count, const uint32_t *inodes, char **names, uint8_t file_type) {
+    size_t new_size = sizeof(directory_block_t) + (dirblk->entries_count + count) * sizeof(dir_entry_t);
+
+    directory_block_t *new_dirblk = (directory_block_t *)malloc(new_size);
+    if (!new_dirblk) {
+        return NULL;
+    }
+
+    memcpy(new_dirblk, dirblk, sizeof(directory_block_t) + dirblk->entries_count * sizeof(dir_entry_t));
+    memset(&new_dirblk->entries[dirblk->entries_count], 0, count * sizeof(dir_entry_t));
+
+    for (uint32_t i = 0; i < count; i++) {
+        dir_entry_t *new_entry = &new_dirblk->entries[dirblk->entries_count + i];
+        new_entry->inode = inodes[i];
+        new_entry->rec_len = sizeof(dir_entry_t);
+        new_entry->name_len = (uint8_t)strlen(names[i]);
+        new_entry->file_type = file_type;
+        strncpy(new_entry->name, names[i], MAX_FILENAME_LEN);
+    }
+    new_dirblk->entries_count += count;
+
+    return new_dirblk;
+}
+
 directory_block_t *remove_entry_from_directory_block(directory_block_t *dirblk, uint32_t inode) {
     // Find the entry to remove
     size_t i;
@@ -22,6 +22,22 @@ typedef struct inode {
 
 # define INODE_SIZE sizeof(inode)
 
+// Flag kept in the high bit of 'permissions' (the rwx bits only use the low 9 bits):
+// the data of the file is stored as compressed clusters (see compress.h)
+# define INODE_COMPRESSED 0x80000000u
+
+static inline bool inode_is_compressed(const inode *node) {
+    return (node->permissions & INODE_COMPRESSED) != 0;
+}
+
+// Flag kept in the next bit: the inode belongs to a snapshot, its content (or for a
+// directory its entries) cannot change
+# define INODE_READONLY 0x40000000u
+
+static inline bool inode_is_readonly(const inode *node) {
+    return (node->permissions & INODE_READONLY) != 0;
+}
+
 // Define the inode table
 typedef struct inode_table {
     inode inodes[INODES_COUNT]; // Array of inodes
@@ -56,7 +72,9 @@ void print_inode_table(const inode_table *inode_table, uint8_t *inode_bitmap) {
             printf("Inode Number: %u\n", node->inode_number);
             printf("  File Size: %u bytes\n", node->file_size);
             printf("  File Type: %s\n", (node->file_type == 0) ? "Regular File" : "Directory");
-            printf("  Permissions: %o\n", node->permissions);
+            printf("  Permissions: %o%s%s\n", node->permissions & ~(INODE_COMPRESSED | INODE_READONLY),
+                   (node->permissions & INODE_COMPRESSED) ? " (compressed)" : "",
+                   (node->permissions & INODE_READONLY) ? " (read-only)" : "");
             printf("  Direct Blocks: ");
             for (int j = 0; j < 12; j++) {
                 printf("%u ", node->blocks[j]);
@@ -0,0 +1,1149 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "disk_io.h"
+#include "crc32c.h"
+
+// Simplified JBD-style write-ahead journal for metadata blocks.
+//
+// On-disk layout of the journal area (journal_start .. journal_start + journal_blocks - 1):
+//   block 0      : journal superblock (sequence number of the first transaction in the log)
+//   block 1 ...  : transactions, one after another:
+//                  descriptor block(s) listing home block numbers, each followed by the block images,
+//                  optional revoke block(s), then a commit block carrying a checksum of the transaction.
+//
+// A transaction is committed with a single fsync. Committed images stay in memory and are
+// written to their home locations lazily (checkpoint) when the log is full or at unmount.
+// Until then every read of a metadata block is served from the newest in-memory image.
+//
+// Metadata checksums: when the drive has a checksum table, the journal keeps the CRC32C of
+// every metadata block in it. A commit records the checksums of the images it logs and logs
+// the changed table blocks in the same transaction, so the table always matches what
+// replay or checkpoint writes home. journal_read_metadata checks blocks read from disk.
+//
+// Concurrency: every filesystem operation runs inside a handle (journal_start/journal_stop).
+// A commit waits until no handle is open, so a transaction never contains half of an
+// operation. The block maps are protected by a reader/writer lock.
+
+# define JOURNAL_IOV_MAX 64 // Maximum blocks per vectored writeback
+
+# define JOURNAL_MAGIC       0x4A424431 // "JBD1"
+# define JOURNAL_SUPERBLOCK  1
+# define JOURNAL_DESCRIPTOR  2
+# define JOURNAL_REVOKE      3
+# define JOURNAL_COMMIT      4
+
+# define JOURNAL_HASH_BUCKETS 1024
+
+// Header shared by every journal block
+typedef struct journal_header {
+    uint32_t magic;        // JOURNAL_MAGIC
+    uint32_t block_type;   // JOURNAL_SUPERBLOCK / DESCRIPTOR / REVOKE / COMMIT
+    uint32_t sequence;     // Transaction sequence number
+} journal_header;
+
+// Journal superblock: where replay starts
+typedef struct journal_superblock {
+    journal_header header;
+    uint32_t first_sequence; // Sequence number of the first transaction in the log
+} journal_superblock;
+
+// Descriptor and revoke blocks: a list of home block numbers
+typedef struct journal_block_list {
+    journal_header header;
+    uint32_t count;          // Number of valid entries in 'blocks'
+    uint32_t blocks[];       // Home block numbers
+} journal_block_list;
+
+// Commit block: marks the transaction as complete
+typedef struct journal_commit_block {
+    journal_header header;
+    uint32_t checksum;       // Checksum of all descriptor, image and revoke blocks of the transaction
+} journal_commit_block;
+
+// In-memory image of one metadata block
+typedef struct journal_buffer {
+    uint32_t block;               // Home block number
+    uint8_t *data;                // Block image
+    struct journal_buffer *next;  // Next buffer in the same hash bucket
+} journal_buffer;
+
+// Set of block images keyed by home block number
+typedef struct journal_map {
+    journal_buffer *buckets[JOURNAL_HASH_BUCKETS];
+    uint32_t count;
+} journal_map;
+
+typedef struct journal {
+    bool enabled;            // false for drives formatted without a journal
+    uint32_t block_size;
+    uint32_t start;          // First block of the journal area (journal superblock)
+    uint32_t blocks;         // Size of the journal area in blocks
+
+    uint32_t sequence;       // Sequence number of the running transaction
+    uint32_t first_sequence; // Sequence number of the first transaction in the log
+    uint32_t head;           // Next free log block, relative to 'start'
+    bool superblock_stale;   // The last reset of the log may not be on disk: reset it again before logging
+
+    journal_map running;     // Images modified by the running transaction
+    journal_map committed;   // Committed images not yet checkpointed
+    uint32_t *revoked;       // Blocks revoked by the running transaction
+    uint32_t revoked_count;
+    uint32_t revoked_capacity;
+
+    uint32_t running_ops;    // Operations accumulated in the running transaction
+    uint32_t group_ops;      // Commit after this many operations (group commit)
+    uint32_t max_txn_blocks; // ... or once the running transaction holds this many blocks
+    bool use_fsync;          // false: commits and checkpoints are not forced to stable storage
+
+    uint32_t *checksums;           // Checksum table as on disk (NULL: metadata is not checksummed)
+    uint32_t checksum_start;       // First block of the table
+    uint32_t checksum_blocks;      // Size of the table in blocks
+    uint8_t *checksum_dirty;       // Per table block: changed since the last commit
+    uint32_t checksum_dirty_count;
+    uint8_t *checksum_verified;    // Per block bit: read from disk and matched since mount
+
+    pthread_rwlock_t lock;       // Protects the maps, the revoke list and the log position
+    pthread_mutex_t handle_lock; // Protects 'updates', 'committing' and 'running_ops'
+    pthread_cond_t handle_done;  // Signalled when a handle stops or a commit ends
+    uint32_t updates;            // Handles (operations) currently open
+    bool committing;             // A commit is waiting for open handles or running (or updates are locked)
+} journal;
+
+// Handles opened by the current thread (nested operations share the outermost handle)
+static __thread uint32_t journal_handle_depth;
+
+// [MAP HELPERS]
+static journal_buffer *journal_map_find(journal_map *map, uint32_t block) {
+    for (journal_buffer *b = map->buckets[block % JOURNAL_HASH_BUCKETS]; b; b = b->next) {
+        if (b->block == block) return b;
+    }
+    return NULL;
+}
+
+// Insert a buffer, replacing (and freeing) an existing one for the same block
+static void journal_map_put(journal_map *map, journal_buffer *buf) {
+    journal_buffer **link = &map->buckets[buf->block % JOURNAL_HASH_BUCKETS];
+    while (*link) {
+        if ((*link)->block == buf->block) {
+            journal_buffer *old = *link;
+            buf->next = old->next;
+            *link = buf;
+            free(old->data);
+            free(old);
+            return;
+        }
+        link = &(*link)->next;
+    }
+    buf->next = NULL;
+    *link = buf;
+    map->count++;
+}
+
+// Remove and free the buffer of a block; returns true if there was one
+static bool journal_map_remove(journal_map *map, uint32_t block) {
+    journal_buffer **link = &map->buckets[block % JOURNAL_HASH_BUCKETS];
+    while (*link) {
+        if ((*link)->block == block) {
+            journal_buffer *old = *link;
+            *link = old->next;
+            free(old->data);
+            free(old);
+            map->count--;
+            return true;
+        }
+        link = &(*link)->next;
+    }
+    return false;
+}
+
+// Detach all buffers into an array sorted by block number (caller frees the array)
+static int compare_journal_buffers(const void *a, const void *b) {
+    uint32_t x = (*(journal_buffer **)a)->block;
+    uint32_t y = (*(journal_buffer **)b)->block;
+    return (x > y) - (x < y);
+}
+
+static journal_buffer **journal_map_take_sorted(journal_map *map, uint32_t *out_count) {
+    journal_buffer **list = (journal_buffer **)malloc((map->count + 1) * sizeof(journal_buffer *));
+    uint32_t n = 0;
+    for (int i = 0; i < JOURNAL_HASH_BUCKETS; i++) {
+        for (journal_buffer *b = map->buckets[i]; b; b = b->next) {
+            list[n++] = b;
+        }
+        map->buckets[i] = NULL;
+    }
+    map->count = 0;
+    qsort(list, n, sizeof(journal_buffer *), compare_journal_buffers);
+    *out_count = n;
+    return list;
+}
+// [END MAP HELPERS]
+
+// Checksum used by commit blocks (CRC32C, continuing 'seed')
+uint32_t journal_checksum(uint32_t seed, const void *data, size_t len) {
+    return crc32c(seed, data, len);
+}
+
+// [CHECKSUMS]
+// Every block of the checksum table holds the checksums of the next CHECKSUMS_PER_BLOCK
+// blocks of the drive, and in its last word the checksum of the rest of itself. An entry
+// of 0 means that the block has no checksum (yet).
+static inline uint32_t journal_checksums_per_block(journal *j) {
+    return j->block_size / sizeof(uint32_t) - 1;
+}
+
+// Entry of 'block' in the checksum table, or NULL if the table does not cover it
+static inline uint32_t *journal_checksum_slot(journal *j, uint32_t block) {
+    if (!j->checksums) return NULL;
+    uint32_t per_block = journal_checksums_per_block(j);
+    uint32_t k = block / per_block;
+    if (k >= j->checksum_blocks) return NULL;
+    return &j->checksums[(size_t)k * (per_block + 1) + block % per_block];
+}
+
+// Note that the table block holding the entry of 'block' has to be logged (lock held for writing)
+static void journal_checksum_changed(journal *j, uint32_t block) {
+    uint32_t k = block / journal_checksums_per_block(j);
+    if (j->checksum_dirty[k]) return;
+    j->checksum_dirty[k] = 1;
+    j->checksum_dirty_count++;
+}
+
+static inline bool journal_block_verified(journal *j, uint32_t block) {
+    return (__atomic_load_n(&j->checksum_verified[block / 8], __ATOMIC_RELAXED) >> (block % 8)) & 1;
+}
+
+static inline void journal_set_verified(journal *j, uint32_t block) {
+    __atomic_or_fetch(&j->checksum_verified[block / 8], (uint8_t)(1 << (block % 8)), __ATOMIC_RELAXED);
+}
+
+// Whether the on-disk content 'data' of a block differs from its recorded checksum
+static bool journal_checksum_stale(journal *j, uint32_t block, const uint8_t *data) {
+    uint32_t *slot = journal_checksum_slot(j, block);
+    return slot && *slot != crc32c(0, data, j->block_size);
+}
+
+/**
+ * Check a block read from disk against its checksum; 'data' is the whole block,
+ * or NULL to read it here. A block that matches is not checked again.
+ * Returns 0, or -1 if it does not match.
+ */
+static int journal_verify_block(journal *j, FILE *disk, uint32_t block, const uint8_t *data) {
+    uint32_t *slot = journal_checksum_slot(j, block);
+    if (!slot || *slot == 0 || journal_block_verified(j, block)) return 0;
+
+    uint8_t *content = NULL;
+    if (!data) {
+        content = (uint8_t *)malloc(j->block_size);
+        if (!content || disk_read(disk, (uint64_t)block * j->block_size, content, j->block_size) != 0) {
+            free(content);
+            return -1;
+        }
+        data = content;
+    }
+    int status = 0;
+    if (crc32c(0, data, j->block_size) == *slot) {
+        journal_set_verified(j, block);
+        metrics_add(&metrics.checksums_verified, 1);
+    } else {
+        fprintf(stderr, "Error: metadata block %u does not match its checksum.\n", block);
+        metrics_add(&metrics.checksum_errors, 1);
+        status = -1;
+    }
+    free(content);
+    return status;
+}
+
+/**
+ * Record the checksum of a metadata block written in place, outside the
+ * journal ('data' is its whole content). The table block is logged with the
+ * running transaction, which must also be the one that links the block.
+ */
+void journal_set_checksum(journal *j, uint32_t block, const void *data) {
+    if (!j->checksums) return;
+    uint32_t checksum = crc32c(0, data, j->block_size);
+    pthread_rwlock_wrlock(&j->lock);
+    uint32_t *slot = journal_checksum_slot(j, block);
+    if (slot && *slot != checksum) {
+        *slot = checksum;
+        journal_checksum_changed(j, block);
+    }
+    if (slot) journal_set_verified(j, block);
+    pthread_rwlock_unlock(&j->lock);
+}
+
+// Drop the checksum table (metadata is no longer checksummed)
+void journal_free_checksums(journal *j) {
+    free(j->checksums);
+    free(j->checksum_dirty);
+    free(j->checksum_verified);
+    j->checksums = NULL;
+    j->checksum_dirty = NULL;
+    j->checksum_verified = NULL;
+    j->checksum_dirty_count = 0;
+}
+
+/**
+ * Start an empty checksum table of 'blocks' blocks at 'start' (when the drive
+ * is formatted); all of it is logged with the next commit.
+ * Returns 0, or -1 if it cannot be allocated.
+ */
+int journal_create_checksums(journal *j, uint32_t start, uint32_t blocks) {
+    journal_free_checksums(j);
+    uint32_t covered = blocks * journal_checksums_per_block(j);
+    j->checksums = (uint32_t *)calloc(blocks, j->block_size);
+    j->checksum_dirty = (uint8_t *)malloc(blocks);
+    j->checksum_verified = (uint8_t *)calloc((covered + 7) / 8, 1);
+    if (!j->checksums || !j->checksum_dirty || !j->checksum_verified) {
+        journal_free_checksums(j);
+        return -1;
+    }
+    memset(j->checksum_dirty, 1, blocks);
+    j->checksum_dirty_count = blocks;
+    j->checksum_start = start;
+    j->checksum_blocks = blocks;
+    return 0;
+}
+
+/**
+ * Record the checksums of the images of a committing transaction and append
+ * the changed table blocks to it (lock held for writing).
+ * Returns the list, grown by the table blocks and sorted again.
+ */
+static journal_buffer **journal_add_checksum_blocks(journal *j, journal_buffer **list, uint32_t *count) {
+    if (!j->checksums) return list;
+
+    // 1. Checksums of the logged images (which is what replay or checkpoint writes home)
+    for (uint32_t i = 0; i < *count; i++) {
+        uint32_t *slot = journal_checksum_slot(j, list[i]->block);
+        if (!slot) continue;
+        journal_set_verified(j, list[i]->block);
+        uint32_t checksum = crc32c(0, list[i]->data, j->block_size);
+        if (*slot == checksum) continue;
+        *slot = checksum;
+        journal_checksum_changed(j, list[i]->block);
+    }
+    if (j->checksum_dirty_count == 0) return list;
+
+    // 2. Images of the table blocks that changed, each sealed with its own checksum
+    uint32_t per_block = journal_checksums_per_block(j);
+    list = (journal_buffer **)realloc(list, (*count + j->checksum_dirty_count + 1) * sizeof(journal_buffer *));
+    for (uint32_t k = 0; k < j->checksum_blocks; k++) {
+        if (!j->checksum_dirty[k]) continue;
+        uint32_t *words = j->checksums + (size_t)k * (per_block + 1);
+        words[per_block] = crc32c(0, words, per_block * sizeof(uint32_t));
+
+        journal_buffer *buf = (journal_buffer *)malloc(sizeof(journal_buffer));
+        buf->block = j->checksum_start + k;
+        buf->data = (uint8_t *)malloc(j->block_size);
+        memcpy(buf->data, words, j->block_size);
+        list[(*count)++] = buf;
+        j->checksum_dirty[k] = 0;
+    }
+    j->checksum_dirty_count = 0;
+    qsort(list, *count, sizeof(journal_buffer *), compare_journal_buffers);
+    return list;
+}
+
+// Returns 0, or -1 if the drive could not be synced (what was written may not be durable)
+static int journal_sync(journal *j, FILE *disk) {
+    if (!j->use_fsync) return 0;
+    metrics_add(&metrics.fsyncs, 1);
+    if (fsync(fileno(disk)) != 0) {
+        perror("Error: journal fsync failed");
+        return -1;
+    }
+    return 0;
+}
+
+static int journal_write_raw(journal *j, FILE *disk, uint32_t log_block, const void *data) {
+    return disk_write(disk, (uint64_t)(j->start + log_block) * j->block_size, data, j->block_size);
+}
+
+static int journal_read_raw(journal *j, FILE *disk, uint32_t log_block, void *data) {
+    return disk_read(disk, (uint64_t)(j->start + log_block) * j->block_size, data, j->block_size);
+}
+
+// Number of block list entries that fit into one descriptor/revoke block
+static uint32_t journal_tags_per_block(journal *j) {
+    return (j->block_size - sizeof(journal_block_list)) / sizeof(uint32_t);
+}
+
+static int journal_write_superblock(journal *j, FILE *disk) {
+    uint8_t *block = (uint8_t *)calloc(1, j->block_size);
+    journal_superblock *jsb = (journal_superblock *)block;
+    jsb->header.magic = JOURNAL_MAGIC;
+    jsb->header.block_type = JOURNAL_SUPERBLOCK;
+    jsb->header.sequence = j->first_sequence;
+    jsb->first_sequence = j->first_sequence;
+    int status = journal_write_raw(j, disk, 0, block);
+    free(block);
+    return status;
+}
+
+// Set up an in-memory journal (disabled when 'blocks' is 0)
+void initialize_journal(journal *j, uint32_t block_size, uint32_t start, uint32_t blocks) {
+    memset(j, 0, sizeof(journal));
+    j->enabled = (blocks > 2);
+    j->block_size = block_size;
+    j->start = start;
+    j->blocks = blocks;
+    j->sequence = 1;
+    j->first_sequence = 1;
+    j->head = 1;
+    j->group_ops = 32;
+    j->max_txn_blocks = blocks / 4;
+    j->use_fsync = true;
+
+    pthread_rwlock_init(&j->lock, NULL);
+    pthread_mutex_init(&j->handle_lock, NULL);
+    pthread_cond_init(&j->handle_done, NULL);
+}
+
+// Write an empty journal (called when the drive is formatted). Returns 0, or -1 on an I/O error.
+int journal_format(journal *j, FILE *disk) {
+    if (!j->enabled) return 0;
+    uint8_t *zero = (uint8_t *)calloc(1, j->block_size);
+    int status = 0;
+    for (uint32_t i = 1; i < j->blocks && status == 0; i++) {
+        status = journal_write_raw(j, disk, i, zero);
+    }
+    free(zero);
+    if (status != 0 || journal_write_superblock(j, disk) != 0) return -1;
+    return journal_sync(j, disk);
+}
+
+// Newest image of a block (running transaction first, then committed), or NULL
+uint8_t *journal_lookup(journal *j, uint32_t block) {
+    journal_buffer *b = journal_map_find(&j->running, block);
+    if (!b) b = journal_map_find(&j->committed, block);
+    return b ? b->data : NULL;
+}
+
+// journal_read, checking the blocks that come from disk against their checksums if 'verify'
+static int journal_read_blocks(journal *j, FILE *disk, uint32_t block, uint32_t offset, void *buf, size_t len,
+                               bool verify) {
+    if (!j->enabled) {
+        disk_read(disk, (uint64_t)block * j->block_size + offset, buf, len);
+        return 0;
+    }
+
+    // Held across the disk read so that a checkpoint cannot move an image home in between
+    pthread_rwlock_rdlock(&j->lock);
+    disk_read(disk, (uint64_t)block * j->block_size + offset, buf, len);
+    verify = verify && j->checksums;
+    bool images = j->running.count != 0 || j->committed.count != 0;
+    if (!verify && !images) {
+        pthread_rwlock_unlock(&j->lock);
+        return 0;
+    }
+
+    int status = 0;
+    size_t done = 0;
+    while (done < len) {
+        uint32_t cur = block + (uint32_t)((offset + done) / j->block_size);
+        uint32_t in_block = (uint32_t)((offset + done) % j->block_size);
+        size_t chunk = j->block_size - in_block;
+        if (chunk > len - done) chunk = len - done;
+
+        uint8_t *image = images ? journal_lookup(j, cur) : NULL;
+        if (image) {
+            memcpy((uint8_t *)buf + done, image + in_block, chunk);
+        } else if (verify && journal_verify_block(j, disk, cur, (chunk == j->block_size) ? (uint8_t *)buf + done : NULL) != 0) {
+            status = -1;
+        }
+        done += chunk;
+    }
+    pthread_rwlock_unlock(&j->lock);
+    return status;
+}
+
+/**
+ * Read 'len' bytes starting at byte 'offset' of block 'block'.
+ * The range may span several blocks; blocks with an image in the journal
+ * are served from memory, the rest with a single read from disk.
+ */
+void journal_read(journal *j, FILE *disk, uint32_t block, uint32_t offset, void *buf, size_t len) {
+    journal_read_blocks(j, disk, block, offset, buf, len, false);
+}
+
+/**
+ * journal_read for metadata: a block that comes from disk is checked against
+ * its checksum the first time it is read after mount (a partly read block is
+ * read whole for that). In-memory images are trusted.
+ * Returns 0, or -1 if a block does not match (the data is read all the same).
+ */
+int journal_read_metadata(journal *j, FILE *disk, uint32_t block, uint32_t offset, void *buf, size_t len) {
+    return journal_read_blocks(j, disk, block, offset, buf, len, true);
+}
+
+/**
+ * Load the checksum table of 'blocks' blocks at 'start' (after recovery).
+ * A table block that does not match its own checksum is reported and
+ * cleared, so the blocks it covers go unchecked until they are logged again.
+ * Returns the number of such blocks, or -1 if the table cannot be allocated.
+ */
+int journal_load_checksums(journal *j, FILE *disk, uint32_t start, uint32_t blocks) {
+    if (journal_create_checksums(j, start, blocks) != 0) return -1;
+    memset(j->checksum_dirty, 0, blocks);
+    j->checksum_dirty_count = 0;
+    journal_read(j, disk, start, 0, j->checksums, (size_t)blocks * j->block_size);
+
+    uint32_t per_block = journal_checksums_per_block(j);
+    int damaged = 0;
+    for (uint32_t k = 0; k < blocks; k++) {
+        uint32_t *words = j->checksums + (size_t)k * (per_block + 1);
+        if (crc32c(0, words, per_block * sizeof(uint32_t)) == words[per_block]) continue;
+        fprintf(stderr, "Error: block %u of the checksum table does not match its checksum.\n", start + k);
+        memset(words, 0, j->block_size);
+        j->checksum_dirty[k] = 1;
+        j->checksum_dirty_count++;
+        damaged++;
+    }
+    return damaged;
+}
+
+// Sequence number of the running transaction; every transaction before it is committed
+uint32_t journal_running_sequence(journal *j) {
+    return __atomic_load_n(&j->sequence, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Drop the journaled images of a block that is being freed or reused for file data,
+ * so that neither checkpoint nor replay can later overwrite its new content.
+ */
+void journal_revoke(journal *j, uint32_t block) {
+    if (!j->enabled) return;
+
+    pthread_rwlock_wrlock(&j->lock);
+    journal_map_remove(&j->running, block);
+    if (journal_map_remove(&j->committed, block)) {
+        // The block is still in the log: tell replay to skip the older copies
+        if (j->revoked_count == j->revoked_capacity) {
+            j->revoked_capacity = j->revoked_capacity ? j->revoked_capacity * 2 : 64;
+            j->revoked = (uint32_t *)realloc(j->revoked, j->revoked_capacity * sizeof(uint32_t));
+        }
+        j->revoked[j->revoked_count++] = block;
+    }
+    pthread_rwlock_unlock(&j->lock);
+}
+
+// Forget a pending revoke of a block that is logged again
+static void journal_cancel_revoke(journal *j, uint32_t block) {
+    for (uint32_t i = 0; i < j->revoked_count; i++) {
+        if (j->revoked[i] == block) {
+            j->revoked[i] = j->revoked[--j->revoked_count];
+            return;
+        }
+    }
+}
+
+/**
+ * Write 'len' bytes at byte 'offset' of block 'block' through the journal.
+ * The range may span several blocks. Blocks whose content does not change are
+ * not logged. Without a journal the data is written in place.
+ */
+void journal_write(journal *j, FILE *disk, uint32_t block, uint32_t offset, const void *data, size_t len) {
+    if (!j->enabled) {
+        disk_write(disk, (uint64_t)block * j->block_size + offset, data, len);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&j->lock);
+    size_t done = 0;
+    while (done < len) {
+        uint32_t cur = block + (uint32_t)((offset + done) / j->block_size);
+        uint32_t in_block = (uint32_t)((offset + done) % j->block_size);
+        size_t chunk = j->block_size - in_block;
+        if (chunk > len - done) chunk = len - done;
+        const uint8_t *src = (const uint8_t *)data + done;
+        done += chunk;
+
+        journal_buffer *running = journal_map_find(&j->running, cur);
+        if (running) {
+            memcpy(running->data + in_block, src, chunk);
+            continue;
+        }
+
+        // Start from the newest known content of the block
+        uint8_t *image = (uint8_t *)malloc(j->block_size);
+        uint8_t *committed = journal_lookup(j, cur);
+        if (committed) {
+            memcpy(image, committed, j->block_size);
+        } else {
+            disk_read(disk, (uint64_t)cur * j->block_size, image, j->block_size);
+        }
+
+        // Unchanged ranges are not logged, unless the block on disk does not match its
+        // checksum: logging it lets the commit record the checksum of its content
+        if (memcmp(image + in_block, src, chunk) == 0 && (committed || !journal_checksum_stale(j, cur, image))) {
+            free(image);
+            continue;
+        }
+
+        memcpy(image + in_block, src, chunk);
+        journal_buffer *buf = (journal_buffer *)malloc(sizeof(journal_buffer));
+        buf->block = cur;
+        buf->data = image;
+        journal_map_put(&j->running, buf);
+        journal_cancel_revoke(j, cur);
+    }
+    pthread_rwlock_unlock(&j->lock);
+}
+
+/**
+ * Write block images (sorted by block number) to their home locations.
+ * Runs of adjacent blocks are coalesced into a single vectored write.
+ * Returns 0, or -1 if a block could not be written.
+ */
+int journal_write_home(journal *j, FILE *disk, journal_buffer **list, uint32_t count) {
+    struct iovec iov[JOURNAL_IOV_MAX];
+    int max_iov = JOURNAL_IOV_MAX;
+
+    uint32_t i = 0;
+    while (i < count) {
+        uint32_t first_block = list[i]->block;
+        int n = 0;
+        while (i < count && n < max_iov && list[i]->block == first_block + (uint32_t)n) {
+            iov[n].iov_base = list[i]->data;
+            iov[n].iov_len = j->block_size;
+            n++;
+            i++;
+        }
+        size_t len = (size_t)n * j->block_size;
+        ssize_t put = pwritev(fileno(disk), iov, n, (off_t)first_block * j->block_size);
+        metrics_add(&metrics.write_calls, 1);
+        if (put < 0 && errno != EINTR) {
+            perror("Error: journal writeback failed");
+            return -1;
+        }
+        if (put < 0) put = 0;
+        metrics_add(&metrics.bytes_written, (uint64_t)put);
+
+        // Interrupted or short: finish the run block by block
+        for (size_t done = (size_t)put; done < len; ) {
+            uint32_t k = (uint32_t)(done / j->block_size);
+            uint32_t in_block = (uint32_t)(done % j->block_size);
+            if (disk_write(disk, (uint64_t)(first_block + k) * j->block_size + in_block,
+                           (uint8_t *)iov[k].iov_base + in_block, j->block_size - in_block) != 0) {
+                return -1;
+            }
+            done += j->block_size - in_block;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Checkpoint with the journal lock already held for writing. Returns 0, or -1
+ * on an I/O error: the images that could not be written home stay committed
+ * and the log is kept, so reads, replay and the next checkpoint still have them.
+ */
+static int journal_checkpoint_locked(journal *j, FILE *disk) {
+    if (j->committed.count == 0 && j->head == 1 && !j->superblock_stale) return 0;
+
+    // Home locations must be durable before the log is discarded
+    uint32_t count;
+    journal_buffer **list = journal_map_take_sorted(&j->committed, &count);
+    if (journal_write_home(j, disk, list, count) != 0 || journal_sync(j, disk) != 0) {
+        for (uint32_t i = 0; i < count; i++) {
+            journal_map_put(&j->committed, list[i]);
+        }
+        free(list);
+        fprintf(stderr, "Error: could not write the journaled metadata home, the log is kept.\n");
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        free(list[i]->data);
+        free(list[i]);
+    }
+    free(list);
+
+    // Until a new journal superblock is known to be on disk, replay may start from the old
+    // one or the new one, so nothing may be appended to the log
+    uint32_t first_sequence = j->first_sequence;
+    j->first_sequence = j->sequence;
+    if (journal_write_superblock(j, disk) != 0 || journal_sync(j, disk) != 0) {
+        j->first_sequence = first_sequence;
+        j->superblock_stale = true;
+        fprintf(stderr, "Error: could not reset the journal, nothing more is logged until it is.\n");
+        return -1;
+    }
+    j->superblock_stale = false;
+    j->head = 1;
+    return 0;
+}
+
+/**
+ * Write every committed image to its home location in block order, then
+ * empty the log. Called lazily when the log is full, at unmount, and by
+ * the periodic writeback. Returns 0, or -1 on an I/O error (the log is kept).
+ */
+int journal_checkpoint(journal *j, FILE *disk) {
+    if (!j->enabled) return 0;
+    pthread_rwlock_wrlock(&j->lock);
+    int status = journal_checkpoint_locked(j, disk);
+    pthread_rwlock_unlock(&j->lock);
+    return status;
+}
+
+// Log blocks taken by a transaction of 'images' block images and 'revokes' revoke records
+static uint32_t journal_transaction_blocks(journal *j, uint32_t images, uint32_t revokes) {
+    uint32_t tags = journal_tags_per_block(j);
+    return (images + tags - 1) / tags + images + (revokes + tags - 1) / tags + 1;
+}
+
+/**
+ * Append one transaction to the log and make it durable with a single fsync,
+ * making room first if needed (lock held for writing). On success the images
+ * move to the committed map. Returns 0, or -1 on an I/O error: the head is
+ * left where it was and the images stay with the caller.
+ */
+static int journal_log_transaction(journal *j, FILE *disk, journal_buffer **list, uint32_t count,
+                                   const uint32_t *revoked, uint32_t revoked_count) {
+    uint32_t tags = journal_tags_per_block(j);
+
+    // Make room in the log
+    if (j->superblock_stale || j->head + journal_transaction_blocks(j, count, revoked_count) > j->blocks) {
+        if (journal_checkpoint_locked(j, disk) != 0) return -1;
+    }
+
+    uint8_t *block = (uint8_t *)malloc(j->block_size);
+    journal_block_list *desc = (journal_block_list *)block;
+    uint32_t checksum = j->sequence;
+    uint32_t head = j->head;
+    int status = 0;
+
+    // 1. Descriptor blocks, each followed by its images
+    for (uint32_t first = 0; first < count && status == 0; first += tags) {
+        uint32_t n = (count - first < tags) ? count - first : tags;
+        memset(block, 0, j->block_size);
+        desc->header.magic = JOURNAL_MAGIC;
+        desc->header.block_type = JOURNAL_DESCRIPTOR;
+        desc->header.sequence = j->sequence;
+        desc->count = n;
+        for (uint32_t i = 0; i < n; i++) {
+            desc->blocks[i] = list[first + i]->block;
+        }
+        checksum = journal_checksum(checksum, block, j->block_size);
+        status |= journal_write_raw(j, disk, head++, block);
+
+        for (uint32_t i = 0; i < n && status == 0; i++) {
+            checksum = journal_checksum(checksum, list[first + i]->data, j->block_size);
+            status |= journal_write_raw(j, disk, head++, list[first + i]->data);
+        }
+    }
+
+    // 2. Revoke blocks
+    for (uint32_t first = 0; first < revoked_count && status == 0; first += tags) {
+        uint32_t n = (revoked_count - first < tags) ? revoked_count - first : tags;
+        memset(block, 0, j->block_size);
+        desc->header.magic = JOURNAL_MAGIC;
+        desc->header.block_type = JOURNAL_REVOKE;
+        desc->header.sequence = j->sequence;
+        desc->count = n;
+        memcpy(desc->blocks, revoked + first, n * sizeof(uint32_t));
+        checksum = journal_checksum(checksum, block, j->block_size);
+        status |= journal_write_raw(j, disk, head++, block);
+    }
+
+    // 3. Commit block, then a single fsync for the whole transaction
+    if (status == 0) {
+        memset(block, 0, j->block_size);
+        journal_commit_block *commit = (journal_commit_block *)block;
+        commit->header.magic = JOURNAL_MAGIC;
+        commit->header.block_type = JOURNAL_COMMIT;
+        commit->header.sequence = j->sequence;
+        commit->checksum = checksum;
+        status = journal_write_raw(j, disk, head++, block);
+    }
+    if (status == 0) status = journal_sync(j, disk);
+    free(block);
+    if (status != 0) return -1;
+
+    // 4. The images are now committed and wait for the checkpoint
+    j->head = head;
+    for (uint32_t i = 0; i < count; i++) {
+        journal_map_put(&j->committed, list[i]);
+    }
+    __atomic_add_fetch(&j->sequence, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Whether 'block' belongs to the checksum table
+static inline bool journal_is_checksum_block(journal *j, uint32_t block) {
+    return j->checksums && block >= j->checksum_start && block - j->checksum_start < j->checksum_blocks;
+}
+
+/**
+ * Commit with every handle stopped and the journal lock held for writing.
+ *
+ * A transaction larger than the whole log is committed in parts, each atomic
+ * on its own. The changed checksum table blocks go into the last part, so a
+ * crash between two parts leaves metadata that fails its checksums (and is
+ * refused at mount) rather than metadata that looks consistent.
+ *
+ * Returns 0, or -1 on an I/O error: the images that were not committed go
+ * back to the running transaction and are logged again by the next commit.
+ */
+static int journal_commit_locked(journal *j, FILE *disk) {
+    if (j->running.count == 0 && j->revoked_count == 0 && j->checksum_dirty_count == 0) return 0;
+
+    uint32_t count;
+    journal_buffer **list = journal_map_take_sorted(&j->running, &count);
+    list = journal_add_checksum_blocks(j, list, &count);
+
+    // Checksum table blocks last (the list stays sorted otherwise)
+    uint32_t plain = 0;
+    journal_buffer **table = (journal_buffer **)malloc((count + 1) * sizeof(journal_buffer *));
+    uint32_t table_count = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (journal_is_checksum_block(j, list[i]->block)) {
+            table[table_count++] = list[i];
+        } else {
+            list[plain++] = list[i];
+        }
+    }
+    memcpy(list + plain, table, table_count * sizeof(journal_buffer *));
+    free(table);
+
+    uint32_t parts = 0;
+    uint32_t first = 0;
+    int status = 0;
+    while (first < count || parts == 0) {
+        // Revoke records go with the first part
+        uint32_t revokes = (parts == 0) ? j->revoked_count : 0;
+        uint32_t n = count - first;
+        if (1 + journal_transaction_blocks(j, n, revokes) > j->blocks) {
+            while (n > 0 && 1 + journal_transaction_blocks(j, n, revokes) > j->blocks) n--;
+            if (first < plain && n > plain - first) n = plain - first;
+            if (parts == 0) {
+                fprintf(stderr, "Warning: transaction of %u blocks exceeds the journal, committing it in parts.\n", count);
+            }
+        }
+        if (n == 0 && first < count) {
+            status = -1;
+            break;
+        }
+
+        status = journal_log_transaction(j, disk, list + first, n, j->revoked, revokes);
+        if (status != 0) break;
+        if (revokes) j->revoked_count = 0;
+        first += n;
+        parts++;
+    }
+
+    if (status != 0) {
+        fprintf(stderr, "Error: journal commit failed, the changes stay in memory until the next commit.\n");
+        for (uint32_t i = first; i < count; i++) {
+            // Table blocks are rebuilt from the table by the next commit
+            if (journal_is_checksum_block(j, list[i]->block)) {
+                uint32_t k = list[i]->block - j->checksum_start;
+                if (!j->checksum_dirty[k]) {
+                    j->checksum_dirty[k] = 1;
+                    j->checksum_dirty_count++;
+                }
+                free(list[i]->data);
+                free(list[i]);
+            } else {
+                journal_map_put(&j->running, list[i]);
+            }
+        }
+    }
+    free(list);
+    return status;
+}
+
+/**
+ * Commit the running transaction: log its block images, revoke records and a
+ * commit block, then make them durable with a single fsync.
+ *
+ * Waits until every other open handle has stopped; new handles wait for the
+ * commit to finish. Returns 0, or -1 if the transaction could not be made durable.
+ */
+int journal_commit(journal *j, FILE *disk) {
+    if (!j->enabled) return 0;
+    uint64_t metrics_start = metrics_now();
+
+    pthread_mutex_lock(&j->handle_lock);
+    while (j->committing) {
+        pthread_cond_wait(&j->handle_done, &j->handle_lock);
+    }
+    j->committing = true;
+    uint32_t own = (journal_handle_depth > 0) ? 1 : 0;
+    while (j->updates > own) {
+        pthread_cond_wait(&j->handle_done, &j->handle_lock);
+    }
+    j->running_ops = 0;
+    pthread_mutex_unlock(&j->handle_lock);
+
+    pthread_rwlock_wrlock(&j->lock);
+    int status = journal_commit_locked(j, disk);
+    pthread_rwlock_unlock(&j->lock);
+
+    pthread_mutex_lock(&j->handle_lock);
+    j->committing = false;
+    pthread_cond_broadcast(&j->handle_done);
+    pthread_mutex_unlock(&j->handle_lock);
+    metrics_record(METRIC_JOURNAL_COMMIT, metrics_start);
+    return status;
+}
+
+// Open a handle for one filesystem operation (nested calls join the outer handle)
+void journal_start(journal *j) {
+    if (journal_handle_depth++ > 0) return;
+
+    pthread_mutex_lock(&j->handle_lock);
+    while (j->committing) {
+        pthread_cond_wait(&j->handle_done, &j->handle_lock);
+    }
+    j->updates++;
+    pthread_mutex_unlock(&j->handle_lock);
+}
+
+// Close the handle of one finished operation; commits when the group is full.
+// Must be called with no filesystem lock held, since the commit waits for other handles.
+void journal_stop(journal *j, FILE *disk) {
+    if (--journal_handle_depth > 0) return;
+
+    pthread_mutex_lock(&j->handle_lock);
+    j->updates--;
+    j->running_ops++;
+    bool full = j->running_ops >= j->group_ops;
+    pthread_cond_broadcast(&j->handle_done);
+    pthread_mutex_unlock(&j->handle_lock);
+
+    pthread_rwlock_rdlock(&j->lock);
+    full = full || j->running.count >= j->max_txn_blocks;
+    pthread_rwlock_unlock(&j->lock);
+
+    if (j->enabled && full) {
+        journal_commit(j, disk);
+    }
+}
+
+/**
+ * Wait until every open handle has stopped and keep new handles waiting until
+ * journal_unlock_updates, so that the caller sees the whole file system with no
+ * operation half done. The caller must not hold a handle: it gets one here,
+ * which its own nested handles join, and must not commit before unlocking.
+ */
+void journal_lock_updates(journal *j) {
+    pthread_mutex_lock(&j->handle_lock);
+    while (j->committing) {
+        pthread_cond_wait(&j->handle_done, &j->handle_lock);
+    }
+    j->committing = true;
+    while (j->updates > 0) {
+        pthread_cond_wait(&j->handle_done, &j->handle_lock);
+    }
+    j->updates++;
+    journal_handle_depth++;
+    pthread_mutex_unlock(&j->handle_lock);
+}
+
+// Let the handles held back by journal_lock_updates start, and stop the caller's
+void journal_unlock_updates(journal *j, FILE *disk) {
+    pthread_mutex_lock(&j->handle_lock);
+    j->committing = false;
+    pthread_cond_broadcast(&j->handle_done);
+    pthread_mutex_unlock(&j->handle_lock);
+    journal_stop(j, disk);
+}
+
+// One transaction found in the log during recovery
+typedef struct journal_txn_record {
+    uint32_t sequence;
+    uint32_t first_block;   // Log block of its first descriptor
+} journal_txn_record;
+
+// Read back the transaction starting at 'pos'; returns its length in log blocks or 0 if incomplete
+static uint32_t journal_scan_transaction(journal *j, FILE *disk, uint32_t pos, uint32_t sequence,
+                                         uint8_t *block, uint8_t *image) {
+    uint32_t start = pos;
+    uint32_t checksum = sequence;
+    journal_header *hdr = (journal_header *)block;
+
+    while (pos < j->blocks) {
+        if (journal_read_raw(j, disk, pos, block) != 0) return 0;
+        if (hdr->magic != JOURNAL_MAGIC || hdr->sequence != sequence) return 0;
+
+        if (hdr->block_type == JOURNAL_COMMIT) {
+            journal_commit_block *commit = (journal_commit_block *)block;
+            return (commit->checksum == checksum) ? pos + 1 - start : 0;
+        }
+
+        checksum = journal_checksum(checksum, block, j->block_size);
+        journal_block_list *list = (journal_block_list *)block;
+        uint32_t n = list->count;
+        if (n > journal_tags_per_block(j)) return 0;
+        pos++;
+
+        if (hdr->block_type == JOURNAL_DESCRIPTOR) {
+            for (uint32_t i = 0; i < n; i++) {
+                if (pos >= j->blocks || journal_read_raw(j, disk, pos++, image) != 0) return 0;
+                checksum = journal_checksum(checksum, image, j->block_size);
+            }
+        } else if (hdr->block_type != JOURNAL_REVOKE) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// A revoke record found in the log during recovery
+typedef struct journal_revoke_record {
+    uint32_t block;
+    uint32_t sequence;      // Transaction that revoked the block
+} journal_revoke_record;
+
+static int compare_revoke_records(const void *a, const void *b) {
+    const journal_revoke_record *x = (const journal_revoke_record *)a;
+    const journal_revoke_record *y = (const journal_revoke_record *)b;
+    if (x->block != y->block) return (x->block > y->block) - (x->block < y->block);
+    return (x->sequence > y->sequence) - (x->sequence < y->sequence);
+}
+
+// True if 'block' was revoked by a transaction newer than 'sequence' (records sorted by block)
+static bool journal_is_revoked(journal_revoke_record *revokes, uint32_t count, uint32_t block, uint32_t sequence) {
+    uint32_t lo = 0, hi = count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (revokes[mid].block < block) lo = mid + 1; else hi = mid;
+    }
+    for (uint32_t i = lo; i < count && revokes[i].block == block; i++) {
+        if (revokes[i].sequence > sequence) return true;
+    }
+    return false;
+}
+
+/**
+ * Load the committed transactions left in the log into the committed images,
+ * without writing anything: journal_read then sees the drive as it will be
+ * once they are replayed, and the next checkpoint writes them home.
+ * Returns the number of loaded transactions, or -1 if the log has no valid
+ * journal superblock.
+ */
+int journal_load(journal *j, FILE *disk) {
+    if (!j->enabled) return 0;
+
+    uint8_t *block = (uint8_t *)malloc(j->block_size);
+    uint8_t *image = (uint8_t *)malloc(j->block_size);
+
+    if (journal_read_raw(j, disk, 0, block) != 0 ||
+        ((journal_superblock *)block)->header.magic != JOURNAL_MAGIC) {
+        free(block);
+        free(image);
+        return -1;
+    }
+    j->first_sequence = ((journal_superblock *)block)->first_sequence;
+
+    // Pass 1: find the complete transactions
+    journal_txn_record *txns = NULL;
+    uint32_t txn_count = 0;
+    uint32_t pos = 1;
+    uint32_t sequence = j->first_sequence;
+    while (pos < j->blocks) {
+        uint32_t len = journal_scan_transaction(j, disk, pos, sequence, block, image);
+        if (len == 0) break;
+        txns = (journal_txn_record *)realloc(txns, (txn_count + 1) * sizeof(journal_txn_record));
+        txns[txn_count].sequence = sequence;
+        txns[txn_count].first_block = pos;
+        txn_count++;
+        pos += len;
+        sequence++;
+    }
+    uint32_t pos_end = pos;
+
+    // Pass 2: collect revoke records
+    journal_revoke_record *revokes = NULL;
+    uint32_t revoke_count = 0;
+    for (uint32_t t = 0; t < txn_count; t++) {
+        pos = txns[t].first_block;
+        while (journal_read_raw(j, disk, pos, block) == 0 &&
+               ((journal_header *)block)->block_type != JOURNAL_COMMIT) {
+            journal_block_list *list = (journal_block_list *)block;
+            pos++;
+            if (list->header.block_type == JOURNAL_DESCRIPTOR) {
+                pos += list->count;
+                continue;
+            }
+            revokes = (journal_revoke_record *)realloc(revokes, (revoke_count + list->count) * sizeof(journal_revoke_record));
+            for (uint32_t i = 0; i < list->count; i++) {
+                revokes[revoke_count].block = list->blocks[i];
+                revokes[revoke_count].sequence = txns[t].sequence;
+                revoke_count++;
+            }
+        }
+    }
+    qsort(revokes, revoke_count, sizeof(journal_revoke_record), compare_revoke_records);
+
+    // Pass 3: keep the newest image of every block, skipping copies revoked by a later transaction
+    for (uint32_t t = 0; t < txn_count; t++) {
+        pos = txns[t].first_block;
+        while (journal_read_raw(j, disk, pos, block) == 0 &&
+               ((journal_header *)block)->block_type != JOURNAL_COMMIT) {
+            journal_block_list *list = (journal_block_list *)block;
+            pos++;
+            if (list->header.block_type != JOURNAL_DESCRIPTOR) continue;
+
+            uint32_t n = list->count;
+            uint32_t *homes = (uint32_t *)malloc(n * sizeof(uint32_t));
+            memcpy(homes, list->blocks, n * sizeof(uint32_t));
+            for (uint32_t i = 0; i < n; i++) {
+                uint8_t *data = (uint8_t *)malloc(j->block_size);
+                journal_read_raw(j, disk, pos++, data);
+                if (journal_is_revoked(revokes, revoke_count, homes[i], txns[t].sequence)) {
+                    free(data);
+                    continue;
+                }
+                journal_buffer *buf = (journal_buffer *)malloc(sizeof(journal_buffer));
+                buf->block = homes[i];
+                buf->data = data;
+                journal_map_put(&j->committed, buf);
+            }
+            free(homes);
+        }
+    }
+    free(revokes);
+
+    // New transactions are appended after the loaded ones
+    j->sequence = sequence;
+    j->head = pos_end;
+
+    free(txns);
+    free(block);
+    free(image);
+    return (int)txn_count;
+}
+
+/**
+ * Replay committed transactions left in the log by an unclean shutdown: load
+ * them, then write them home in block order and start a fresh log.
+ * Returns the number of replayed transactions, or -1 on an I/O error.
+ */
+int journal_recover(journal *j, FILE *disk) {
+    if (!j->enabled) return 0;
+
+    int loaded = journal_load(j, disk);
+    if (loaded < 0) {
+        // No valid journal superblock: start an empty log
+        return journal_format(j, disk);
+    }
+
+    pthread_rwlock_wrlock(&j->lock);
+    int status = journal_checkpoint_locked(j, disk);
+    pthread_rwlock_unlock(&j->lock);
+    return (status == 0) ? loaded : -1;
+}
+
+#endif // JOURNAL_H
@@ -2,20 +2,463 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 #include "superblock.h"
 #include "group_descriptor.h"
 #include "bitmap.h"
 #include "inode.h"
 #include "file.h"
+#include "delalloc.h"
+#include "dcache.h"
+#include "journal.h"
+#include "orphan.h"
+#include "extent_index.h"
+#include "disk_io.h"
+#include "work_pool.h"
+#include "metrics.h"
+#include "trace.h"
+#include "workload.h"
+#include "compress.h"
+#include "dedup.h"
 
 # define DRIVE_NAME "drive.bin"
 # define BLOCK_SIZE 4096
 # define BLOCKS_COUNT 32768
 # define MAX_INODE_COUNT 1024
 # define FIRST_DATA_BLOCK (4 + INODES_COUNT * INODE_SIZE / BLOCK_SIZE + 1)
+# define JOURNAL_BLOCKS 1024
+# define JOURNAL_START (BLOCKS_COUNT - JOURNAL_BLOCKS)
+# define REFCOUNT_BLOCKS (BLOCKS_COUNT * sizeof(uint16_t) / BLOCK_SIZE)
+# define REFCOUNT_START (JOURNAL_START - REFCOUNT_BLOCKS)
+# define CHECKSUMS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t) - 1)
+# define CHECKSUM_BLOCKS ((BLOCKS_COUNT + CHECKSUMS_PER_BLOCK - 1) / CHECKSUMS_PER_BLOCK)
+# define CHECKSUM_START (REFCOUNT_START - CHECKSUM_BLOCKS)
+
+// Largest file the block map addresses (12 direct, single- and double-indirect blocks), in
+// whole blocks that fit file_size, so rounding a size up to blocks cannot overflow
+# define MAX_FILE_BLOCKS (12 + BLOCK_SIZE / 4 + (uint64_t)(BLOCK_SIZE / 4) * (BLOCK_SIZE / 4))
+# define MAX_FILE_SIZE ((MAX_FILE_BLOCKS < UINT32_MAX / BLOCK_SIZE ? MAX_FILE_BLOCKS : UINT32_MAX / BLOCK_SIZE) * BLOCK_SIZE)
+# define MAX_FILE_DATA_SIZE (MAX_FILE_SIZE - sizeof(file_t)) // Content after the file header
+
+# define MAX_INPUT_SIZE 1024
 
 bool VERBOSE = true;
 
+// Delayed allocation: file data is kept in memory and blocks are chosen at flush time
+bool DELALLOC = false;
+# define DELALLOC_MAX_DIRTY (16 * 1024 * 1024)
+delalloc_table pending_writes;
+
+// Dentry cache: (parent inode, name) -> inode, shared by all path lookups
+dcache dentry_cache;
+
+// Transparent compression: files created while it is on store their data as
+// LZ-compressed clusters of COMPRESS_CLUSTER_BLOCKS blocks (the inode keeps the mode)
+bool COMPRESS = false;
+# define COMPRESS_CLUSTER_BLOCKS 16
+
+// Inline deduplication: a file block whose content is already stored is mapped to
+// the existing copy instead of being written again (see dedup.h and [SHARED BLOCKS])
+bool DEDUP = false;
+dedup_index fingerprints;
+
+// Metadata journal of the mounted drive
+journal fs_journal;
+
+// Durability policy: when changes are forced to stable storage
+# define DURABILITY_GROUP    0 // Commit and fsync every 32 operations (default)
+# define DURABILITY_NOSYNC   1 // Commit like DURABILITY_GROUP but never fsync
+# define DURABILITY_SYNC     2 // Commit and fsync after every operation
+# define DURABILITY_PERIODIC 3 // A background flusher commits and writes back every interval
+int DURABILITY = DURABILITY_GROUP;
+uint32_t FLUSH_INTERVAL_MS = 1000;
+
+// Asynchronous unlink: large files and directory trees are put on the orphan list
+// when removed and their blocks are reclaimed by a background thread
+bool ASYNC_UNLINK = false;
+# define ORPHAN_BATCH 16 // Orphans reclaimed per transaction
+
+// Print the instrumentation counters (see metrics.h) when the CLI exits
+bool DUMP_STATS = false;
+
+// Chrome trace written when the CLI exits (builds with -DFS_TRACE, see trace.h)
+const char *TRACE_FILE = NULL;
+
+// Batch mode: commands come from a script or a pipe, no prompt is shown and the
+// journal is only committed every BATCH_CHECKPOINT commands (0: when the log
+// fills up and at exit), so long command streams run at in-memory speed
+bool BATCH = false;
+uint32_t BATCH_CHECKPOINT = 0;
+
+// Workload trace the CLI appends its filesystem commands to (see workload.h)
+const char *RECORD_FILE = NULL;
+workload_writer recorder;
+
+// In-memory metadata of the mounted drive, shared by all threads. Loaded once at
+// mount; operations change it in place and log the changed blocks through the journal.
+typedef struct fs_metadata {
+    group_descriptor gd;
+    uint8_t block_bitmap[BLOCKS_COUNT / 8];
+    uint8_t inode_bitmap[INODES_COUNT / 8];
+    inode_table itable;
+    orphan_table orphans;
+    uint16_t refcounts[BLOCKS_COUNT]; // Extra references per block: 0 for one owner (or free)
+    uint32_t refcount_start;          // First block of the refcount table, 0 if the drive has none
+} fs_metadata;
+fs_metadata fs_meta;
+
+// Free extents of the block bitmap of the mounted drive, built at mount and kept in
+// step with the bitmap (alloc_lock). Covers the indices the allocator hands out:
+// 1 up to the last block of the drive.
+# define DATA_INDEX_LIMIT (BLOCKS_COUNT - FIRST_DATA_BLOCK)
+extent_index free_extents;
+
+// [LOCKING]
+// Lock order: journal handle -> directory locks (parent before child) -> inode locks
+//             -> alloc_lock -> dentry cache / delalloc table / journal internals.
+pthread_mutex_t dir_locks[INODES_COUNT];    // Serializes entry changes inside one directory
+pthread_rwlock_t inode_locks[INODES_COUNT]; // Inode fields and the data blocks they map
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER; // Bitmaps, group descriptor counters, orphan table
+
+void initialize_locks() {
+    for (uint32_t i = 0; i < INODES_COUNT; i++) {
+        pthread_mutex_init(&dir_locks[i], NULL);
+        pthread_rwlock_init(&inode_locks[i], NULL);
+    }
+}
+
+void lock_inode_read(uint32_t inode_number) {
+    if (inode_number < INODES_COUNT) pthread_rwlock_rdlock(&inode_locks[inode_number]);
+}
+
+void lock_inode_write(uint32_t inode_number) {
+    if (inode_number < INODES_COUNT) pthread_rwlock_wrlock(&inode_locks[inode_number]);
+}
+
+void unlock_inode(uint32_t inode_number) {
+    if (inode_number < INODES_COUNT) pthread_rwlock_unlock(&inode_locks[inode_number]);
+}
+
+void lock_directory(uint32_t inode_number) {
+    if (inode_number < INODES_COUNT) pthread_mutex_lock(&dir_locks[inode_number]);
+}
+
+void unlock_directory(uint32_t inode_number) {
+    if (inode_number < INODES_COUNT) pthread_mutex_unlock(&dir_locks[inode_number]);
+}
+
+// Inodes changed by the running operation of this thread; write_metadata logs them.
+// When more inodes change than fit here the whole inode table is logged instead.
+# define DIRTY_INODES_MAX 256
+static __thread uint32_t dirty_inodes[DIRTY_INODES_MAX];
+static __thread uint32_t dirty_inodes_count;
+static __thread bool dirty_inodes_overflow;
+
+void mark_inode_dirty(inode *node) {
+    if (node < fs_meta.itable.inodes || node >= fs_meta.itable.inodes + INODES_COUNT) return;
+    uint32_t inode_number = (uint32_t)(node - fs_meta.itable.inodes);
+    for (uint32_t i = 0; i < dirty_inodes_count; i++) {
+        if (dirty_inodes[i] == inode_number) return;
+    }
+    if (dirty_inodes_count < DIRTY_INODES_MAX) {
+        dirty_inodes[dirty_inodes_count++] = inode_number;
+    } else {
+        dirty_inodes_overflow = true;
+    }
+}
+
+// Blocks of the refcount table changed by the running operation of this thread
+// (one bit per table block); write_metadata logs them.
+static __thread uint32_t dirty_refcount_blocks;
+
+// Set the extra reference count of a block of the mounted drive (alloc_lock held)
+static void set_block_refs_locked(uint32_t block, uint16_t extra) {
+    fs_meta.refcounts[block] = extra;
+    dirty_refcount_blocks |= 1u << (block * sizeof(uint16_t) / BLOCK_SIZE);
+}
+
+// Mark block bitmap indices [start, start + count) of the mounted drive as used (alloc_lock held)
+static void claim_blocks_locked(uint32_t start, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        set_bitmap_bit(fs_meta.block_bitmap, start + i);
+    }
+    fs_meta.gd.free_blocks_count -= count;
+    if (start >= 1 && start + count <= DATA_INDEX_LIMIT) extent_index_claim(&free_extents, start, count);
+}
+
+// Mark block bitmap indices [start, start + count) of the mounted drive as free (alloc_lock held)
+static void release_blocks_locked(uint32_t start, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        free_bitmap_bit(fs_meta.block_bitmap, start + i);
+        dedup_forget(&fingerprints, FIRST_DATA_BLOCK + start + i);
+    }
+    fs_meta.gd.free_blocks_count += count;
+    if (start >= 1 && start + count <= DATA_INDEX_LIMIT) extent_index_release(&free_extents, start, count);
+}
+
+// [DEFERRED FREES]
+// As in JBD, a block freed by the running transaction is not handed out again until
+// that transaction commits: until then the committed metadata may still point to it,
+// and a new owner could write it in place. Its bit stays set in fs_meta.block_bitmap,
+// but write_metadata logs it as free, so it is free on disk from the same transaction.
+typedef struct deferred_free {
+    uint32_t index;    // Block bitmap index
+    uint32_t sequence; // Journal transaction that frees it
+} deferred_free;
+
+static deferred_free *deferred_frees; // In freeing order, so in sequence order (alloc_lock)
+static uint32_t deferred_frees_count;
+static uint32_t deferred_frees_capacity;
+
+// Free block bitmap index 'index' once the running transaction commits (alloc_lock held)
+static void defer_block_free_locked(uint32_t index) {
+    // Not shared by new writes meanwhile
+    dedup_forget(&fingerprints, FIRST_DATA_BLOCK + index);
+
+    if (fs_journal.enabled && deferred_frees_count == deferred_frees_capacity) {
+        uint32_t capacity = deferred_frees_capacity ? deferred_frees_capacity * 2 : 256;
+        deferred_free *grown = (deferred_free *)realloc(deferred_frees, capacity * sizeof(deferred_free));
+        if (grown) {
+            deferred_frees = grown;
+            deferred_frees_capacity = capacity;
+        }
+    }
+    if (!fs_journal.enabled || deferred_frees_count == deferred_frees_capacity) {
+        release_blocks_locked(index, 1);
+        return;
+    }
+    deferred_frees[deferred_frees_count].index = index;
+    deferred_frees[deferred_frees_count].sequence = journal_running_sequence(&fs_journal);
+    deferred_frees_count++;
+}
+
+// Release the blocks whose freeing transaction has committed (alloc_lock held)
+static void release_committed_frees_locked() {
+    uint32_t running = journal_running_sequence(&fs_journal);
+    uint32_t n = 0;
+    while (n < deferred_frees_count && deferred_frees[n].sequence < running) {
+        release_blocks_locked(deferred_frees[n].index, 1);
+        n++;
+    }
+    if (n == 0) return;
+    memmove(deferred_frees, deferred_frees + n, (deferred_frees_count - n) * sizeof(deferred_free));
+    deferred_frees_count -= n;
+}
+
+// Release the blocks freed by committed transactions (called after a commit)
+void release_committed_frees() {
+    pthread_mutex_lock(&alloc_lock);
+    release_committed_frees_locked();
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+// [ALLOCATION RESERVATIONS]
+// Every thread claims a window of contiguous free blocks and a small batch of free
+// inodes under alloc_lock, then hands them out to itself without taking the lock.
+// Claimed bits are set in the shared bitmaps (so no other thread picks them) and the
+// free counters drop at claim time. write_metadata logs the still unused part as free,
+// so a crash never leaks a reservation, and release_reservations gives it back.
+# define RESERVATION_BLOCKS 64
+# define RESERVATION_INODES 8
+
+typedef struct alloc_reservation {
+    uint32_t block_start;   // First block bitmap index of the window
+    uint32_t block_end;     // One past the last index of the window
+    uint32_t block_next;    // Next index to hand out (atomic, >= block_end once used up)
+    uint32_t inodes[RESERVATION_INODES]; // Reserved inode numbers
+    uint32_t inode_count;   // Valid entries in 'inodes'
+    uint32_t inode_next;    // Next entry to hand out (atomic, >= inode_count once used up)
+    struct alloc_reservation *next; // Next reservation in the registry
+} alloc_reservation;
+
+// Windows and batches are (re)filled only by their owner, under alloc_lock;
+// other threads read them under alloc_lock and only ever empty them.
+alloc_reservation *reservations; // Registry of all reservations (alloc_lock)
+static __thread alloc_reservation *local_reservation;
+static pthread_key_t reservation_key;
+static pthread_once_t reservation_once = PTHREAD_ONCE_INIT;
+
+// Give the unused part of a reservation back to the shared bitmaps (alloc_lock held)
+static void return_reservation_locked(alloc_reservation *r) {
+    uint32_t n = __atomic_exchange_n(&r->block_next, r->block_end, __ATOMIC_ACQ_REL);
+    if (n < r->block_end) release_blocks_locked(n, r->block_end - n);
+    n = __atomic_exchange_n(&r->inode_next, r->inode_count, __ATOMIC_ACQ_REL);
+    for (uint32_t i = n; i < r->inode_count; i++) {
+        free_bitmap_bit(fs_meta.inode_bitmap, r->inodes[i]);
+        fs_meta.gd.free_inodes_count++;
+    }
+}
+
+// Thread exit: return what is left and drop the reservation from the registry
+static void destroy_reservation(void *arg) {
+    alloc_reservation *r = (alloc_reservation *)arg;
+    pthread_mutex_lock(&alloc_lock);
+    return_reservation_locked(r);
+    for (alloc_reservation **link = &reservations; *link; link = &(*link)->next) {
+        if (*link == r) {
+            *link = r->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    free(r);
+}
+
+static void create_reservation_key() {
+    pthread_key_create(&reservation_key, destroy_reservation);
+}
+
+// The reservation of the calling thread (created on first use), or NULL if out of memory
+static alloc_reservation *get_local_reservation() {
+    if (local_reservation) return local_reservation;
+
+    alloc_reservation *r = (alloc_reservation *)calloc(1, sizeof(alloc_reservation));
+    if (!r) return NULL;
+    pthread_once(&reservation_once, create_reservation_key);
+    pthread_setspecific(reservation_key, r);
+
+    pthread_mutex_lock(&alloc_lock);
+    r->next = reservations;
+    reservations = r;
+    pthread_mutex_unlock(&alloc_lock);
+
+    local_reservation = r;
+    return r;
+}
+
+// Return the unused part of every thread's reservation (called on sync and unmount)
+void release_reservations() {
+    pthread_mutex_lock(&alloc_lock);
+    for (alloc_reservation *r = reservations; r; r = r->next) {
+        return_reservation_locked(r);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+// Claim a new window of up to RESERVATION_BLOCKS contiguous free blocks from the
+// lowest free extent (first fit, so freed blocks are reused early).
+// Returns 0, or -1 if the drive is full.
+static int refill_block_reservation(alloc_reservation *r) {
+    pthread_mutex_lock(&alloc_lock);
+    return_reservation_locked(r);
+    release_committed_frees_locked();
+
+    uint32_t length;
+    int start = extent_index_first(&free_extents, &length);
+    if (start < 0) {
+        pthread_mutex_unlock(&alloc_lock);
+        return -1;
+    }
+
+    uint32_t count = (length < RESERVATION_BLOCKS) ? length : RESERVATION_BLOCKS;
+    claim_blocks_locked((uint32_t)start, count);
+    r->block_start = (uint32_t)start;
+    r->block_end = (uint32_t)start + count;
+    __atomic_store_n(&r->block_next, (uint32_t)start, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&alloc_lock);
+    return 0;
+}
+
+// Claim a new batch of up to RESERVATION_INODES free inodes. Returns 0, or -1 if none are left.
+static int refill_inode_reservation(alloc_reservation *r) {
+    pthread_mutex_lock(&alloc_lock);
+    return_reservation_locked(r);
+
+    uint32_t count = 0;
+    if (__atomic_load_n(&fs_meta.itable.used_inodes, __ATOMIC_RELAXED) < INODES_COUNT) {
+        uint32_t i;
+        for (i = 0; i < INODES_COUNT && count < RESERVATION_INODES && fs_meta.gd.free_inodes_count > 0; i++) {
+            if (is_bit_free(fs_meta.inode_bitmap, i)) {
+                set_bitmap_bit(fs_meta.inode_bitmap, i);
+                fs_meta.gd.free_inodes_count--;
+                r->inodes[count++] = i;
+            }
+        }
+        metrics_add(&metrics.bits_scanned, i);
+    }
+    r->inode_count = count;
+    __atomic_store_n(&r->inode_next, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&alloc_lock);
+    return count > 0 ? 0 : -1;
+}
+
+// Take the next block bitmap index from the window of 'r', or -1 if it is used up
+static int take_reserved_block(alloc_reservation *r) {
+    uint32_t n = __atomic_fetch_add(&r->block_next, 1, __ATOMIC_ACQ_REL);
+    return n < r->block_end ? (int)n : -1;
+}
+
+// Take the next inode number from the batch of 'r', or -1 if it is used up
+static int take_reserved_inode(alloc_reservation *r) {
+    uint32_t n = __atomic_fetch_add(&r->inode_next, 1, __ATOMIC_ACQ_REL);
+    return n < r->inode_count ? (int)r->inodes[n] : -1;
+}
+
+// Build the on-disk view of the counters and bitmaps: the unused part of every
+// reservation and the deferred frees are shown as free (alloc_lock held; the bitmaps may be NULL)
+static void reservation_image_locked(group_descriptor *gd_out, uint8_t *block_out, uint8_t *inode_out) {
+    group_descriptor *gd = &fs_meta.gd;
+    gd_out->block_bitmap = gd->block_bitmap;
+    gd_out->inode_bitmap = gd->inode_bitmap;
+    gd_out->inode_table = gd->inode_table;
+    gd_out->free_blocks_count = gd->free_blocks_count;
+    gd_out->free_inodes_count = gd->free_inodes_count;
+    gd_out->used_dirs_count = __atomic_load_n(&gd->used_dirs_count, __ATOMIC_RELAXED);
+    if (block_out) memcpy(block_out, fs_meta.block_bitmap, BLOCKS_COUNT / 8);
+    if (inode_out) memcpy(inode_out, fs_meta.inode_bitmap, INODES_COUNT / 8);
+
+    for (alloc_reservation *r = reservations; r; r = r->next) {
+        uint32_t n = __atomic_load_n(&r->block_next, __ATOMIC_ACQUIRE);
+        for (uint32_t i = n; i < r->block_end; i++) {
+            if (block_out) free_bitmap_bit(block_out, i);
+            gd_out->free_blocks_count++;
+        }
+        n = __atomic_load_n(&r->inode_next, __ATOMIC_ACQUIRE);
+        for (uint32_t i = n; i < r->inode_count; i++) {
+            if (inode_out) free_bitmap_bit(inode_out, r->inodes[i]);
+            gd_out->free_inodes_count++;
+        }
+    }
+
+    // Blocks freed but not yet reusable are free on disk
+    for (uint32_t i = 0; i < deferred_frees_count; i++) {
+        if (block_out) free_bitmap_bit(block_out, deferred_frees[i].index);
+        gd_out->free_blocks_count++;
+    }
+}
+
+// Inodes freed by the running operation of this thread. Their bitmap bits are cleared
+// by write_metadata only after the zeroed inodes are logged, so another thread cannot
+// take one from a fresh reservation and initialize it while it is being copied.
+static __thread uint32_t *freed_inodes;
+static __thread uint32_t freed_inodes_count;
+static __thread uint32_t freed_inodes_capacity;
+
+// Remember a freed inode; returns false if it could not be recorded (out of memory)
+static bool defer_inode_free(uint32_t inode_number) {
+    if (freed_inodes_count == freed_inodes_capacity) {
+        uint32_t capacity = freed_inodes_capacity ? freed_inodes_capacity * 2 : 64;
+        uint32_t *grown = (uint32_t *)realloc(freed_inodes, capacity * sizeof(uint32_t));
+        if (!grown) return false;
+        freed_inodes = grown;
+        freed_inodes_capacity = capacity;
+    }
+    freed_inodes[freed_inodes_count++] = inode_number;
+    return true;
+}
+
+static bool inode_free_deferred(uint32_t inode_number) {
+    for (uint32_t i = 0; i < freed_inodes_count; i++) {
+        if (freed_inodes[i] == inode_number) return true;
+    }
+    return false;
+}
+
 // [HELPER FUNCTIONS]
 // Allocate a new inode in the inode table
 inode *allocate_inode(inode_table *itable,
@@ -24,19 +467,53 @@ inode *allocate_inode(inode_table *itable,
                       uint32_t file_type,
                       uint32_t permissions) 
 {
-    // 1. Quick check: if all inodes are in use at group level
+    // 1. On the mounted drive, take an inode from this thread's reservation
+    if (inode_bitmap == fs_meta.inode_bitmap) {
+        alloc_reservation *r = get_local_reservation();
+        if (r) {
+            // A sync may empty the batch again right after a refill, so retry until
+            // an inode is taken or none are left
+            int i;
+            while ((i = take_reserved_inode(r)) < 0) {
+                if (refill_inode_reservation(r) != 0) {
+                    fprintf(stderr, "Error: No free inodes available in the group.\n");
+                    return NULL;
+                }
+            }
+
+            if (file_type == 1) {
+                __atomic_add_fetch(&gd->used_dirs_count, 1, __ATOMIC_RELAXED);
+            }
+            __atomic_add_fetch(&itable->used_inodes, 1, __ATOMIC_RELAXED);
+            metrics_add(&metrics.inode_allocations, 1);
+
+            // A lookup holding a stale inode number may still read the old inode
+            inode *new_node = &itable->inodes[i];
+            lock_inode_write(i);
+            initialize_inode(new_node, i, file_type, permissions);
+            unlock_inode(i);
+            mark_inode_dirty(new_node);
+            return new_node;
+        }
+    }
+
+    pthread_mutex_lock(&alloc_lock);
+
+    // 2. Quick check: if all inodes are in use at group level
     if (gd->free_inodes_count == 0) {
+        pthread_mutex_unlock(&alloc_lock);
         fprintf(stderr, "Error: No free inodes available in the group.\n");
         return NULL;
     }
 
-    // 2. Also check local usage in inode_table struct
+    // 3. Also check local usage in inode_table struct
     if (itable->used_inodes >= INODES_COUNT) {
+        pthread_mutex_unlock(&alloc_lock);
         fprintf(stderr, "Error: Inode table is full.\n");
         return NULL;
     }
 
-    // 3. Scan for a free bit in the inode bitmap
+    // 4. Scan for a free bit in the inode bitmap
     for (uint32_t i = 0; i < INODES_COUNT; i++) {
         if (is_bit_free(inode_bitmap, i)) {
             // Mark this bit as used
@@ -47,25 +524,134 @@ inode *allocate_inode(inode_table *itable,
 
             // If it's a directory (by convention file_type=1), increment used_dirs_count
             if (file_type == 1) {
-                gd->used_dirs_count++;
+                __atomic_add_fetch(&gd->used_dirs_count, 1, __ATOMIC_RELAXED);
             }
 
             // Increment the local used_inodes count
-            itable->used_inodes++;
+            __atomic_add_fetch(&itable->used_inodes, 1, __ATOMIC_RELAXED);
+            metrics_add(&metrics.inode_allocations, 1);
+            metrics_add(&metrics.bits_scanned, i + 1);
 
             // Initialize the inode structure
             inode *new_node = &itable->inodes[i];
             initialize_inode(new_node, i, file_type, permissions);
+            pthread_mutex_unlock(&alloc_lock);
 
+            mark_inode_dirty(new_node);
             return new_node;
         }
     }
+    pthread_mutex_unlock(&alloc_lock);
 
-    // 4. If we exit the loop, there was no free inode
+    // 5. If we exit the loop, there was no free inode
     printf("Error: Inode bitmap indicates free inodes, but none found.\n");
     return NULL;
 }
 
+// Check the inode bitmap of the mounted drive
+bool inode_is_allocated(uint32_t inode_number) {
+    pthread_mutex_lock(&alloc_lock);
+    bool allocated = !is_bit_free(fs_meta.inode_bitmap, inode_number);
+    pthread_mutex_unlock(&alloc_lock);
+    return allocated;
+}
+
+// Report and refuse a change to an inode of a snapshot, or to the directory that holds
+// the snapshots (both are read-only; only the snapshot commands change them)
+static bool reject_readonly(uint32_t inode_number) {
+    if (inode_number >= INODES_COUNT || !inode_is_readonly(&fs_meta.itable.inodes[inode_number])) return false;
+    fprintf(stderr, "Error: inode #%u belongs to the snapshots and is read-only.\n", inode_number);
+    return true;
+}
+
+// Directory of the snapshots in the root (see [SNAPSHOTS]). Its name is reserved there
+// and the directory is read-only, so ordinary operations cannot make, change or remove it.
+# define SNAPSHOT_DIR_NAME ".snapshots"
+
+// Report and refuse a new entry of the root that takes the name of the snapshot directory
+static bool reject_reserved_name(uint32_t parent_inode_number, const char *name) {
+    if (parent_inode_number != 0 || strcmp(name, SNAPSHOT_DIR_NAME) != 0) return false;
+    fprintf(stderr, "Error: the name '%s' is reserved for snapshots.\n", name);
+    return true;
+}
+
+// Report and refuse a new entry named "." or "..", or named like an entry the directory
+// already has (its entries read with the directory lock held)
+static bool reject_taken_name(const directory_block_t *dir, const char *name) {
+    bool taken = strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+    for (uint32_t i = 0; !taken && i < dir->entries_count; i++) {
+        taken = strcmp(dir->entries[i].name, name) == 0;
+    }
+    if (taken) fprintf(stderr, "Error: '%s' already exists.\n", name);
+    return taken;
+}
+
+// reject_taken_name and reject_reserved_name for a batch of new entries, which must also
+// differ from each other. The names go through a hash table, so a large batch in a large
+// directory is checked in linear time. Every clash is reported; true refuses the batch.
+static bool reject_taken_names(const directory_block_t *dir, uint32_t parent_inode_number,
+                               char **names, uint32_t count) {
+    uint32_t slots = 64;
+    while (slots < 2 * (dir->entries_count + count)) slots *= 2;
+    const char **table = (const char **)calloc(slots, sizeof(const char *));
+    if (!table) {
+        fprintf(stderr, "Error: could not allocate memory for the name check.\n");
+        return true;
+    }
+
+    // The entries of the directory first, then the new names
+    bool taken = false;
+    for (uint32_t i = 0; i < dir->entries_count + count; i++) {
+        bool is_new = i >= dir->entries_count;
+        const char *name = is_new ? names[i - dir->entries_count] : dir->entries[i].name;
+        if (is_new && reject_reserved_name(parent_inode_number, name)) {
+            taken = true;
+            continue;
+        }
+        uint32_t hash = 2166136261u;
+        for (const char *c = name; *c; c++) hash = (hash ^ (uint8_t)*c) * 16777619u;
+        uint32_t k = hash & (slots - 1);
+        while (table[k] && strcmp(table[k], name) != 0) k = (k + 1) & (slots - 1);
+        if (is_new && (table[k] || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)) {
+            fprintf(stderr, "Error: '%s' already exists.\n", name);
+            taken = true;
+        }
+        table[k] = name;
+    }
+    free(table);
+    return taken;
+}
+
+// Check, with its directory lock held, that a directory resolved before the lock was
+// taken is still there: allocated, a directory and linked into the tree (not on the
+// orphan list)
+static bool directory_still_linked(uint32_t inode_number) {
+    if (inode_number >= INODES_COUNT) {
+        fprintf(stderr, "Error: invalid inode number %u\n", inode_number);
+        return false;
+    }
+
+    // Inodes are set up and cleared under alloc_lock, their fields change under the inode lock
+    lock_inode_read(inode_number);
+    pthread_mutex_lock(&alloc_lock);
+    bool linked = !is_bit_free(fs_meta.inode_bitmap, inode_number)
+               && !orphan_contains(&fs_meta.orphans, inode_number);
+    bool is_directory = fs_meta.itable.inodes[inode_number].file_type == 1;
+    pthread_mutex_unlock(&alloc_lock);
+    unlock_inode(inode_number);
+
+    if (!linked || !is_directory) {
+        fprintf(stderr, "Error: directory inode #%u was removed.\n", inode_number);
+        return false;
+    }
+    return true;
+}
+
+// directory_still_linked, and the directory may be changed (it is not read-only)
+static bool directory_still_usable(uint32_t inode_number) {
+    return directory_still_linked(inode_number) && !reject_readonly(inode_number);
+}
+
 // Deallocate an inode in the inode table
 void deallocate_inode(inode_table *itable,
                       uint8_t *inode_bitmap,
@@ -79,231 +665,781 @@ void deallocate_inode(inode_table *itable,
     }
 
     // 2. Check if the bitmap bit is actually set
-    if (!is_bit_free(inode_bitmap, inode_number)) {
+    pthread_mutex_lock(&alloc_lock);
+    if (!is_bit_free(inode_bitmap, inode_number) && !inode_free_deferred(inode_number)) {
         // For reporting, grab the inode before zeroing it
         inode *old_inode = &itable->inodes[inode_number];
         uint32_t old_file_type = old_inode->file_type;
 
-        // Free the bit in the bitmap
-        free_bitmap_bit(inode_bitmap, inode_number);
+        // Free the bit in the bitmap and count the inode as free (on the mounted drive
+        // once the inode is logged)
+        if (inode_bitmap != fs_meta.inode_bitmap || !defer_inode_free(inode_number)) {
+            free_bitmap_bit(inode_bitmap, inode_number);
+            gd->free_inodes_count++;
+        }
 
         // If this was a directory, decrement used_dirs_count
         if (old_file_type == 1) {
-            gd->used_dirs_count--;
+            __atomic_sub_fetch(&gd->used_dirs_count, 1, __ATOMIC_RELAXED);
         }
 
         // Clear the inode structure
         memset(&itable->inodes[inode_number], 0, sizeof(inode));
 
         // Decrement the local used_inodes count
-        if (itable->used_inodes > 0) {
-            itable->used_inodes--;
+        if (__atomic_load_n(&itable->used_inodes, __ATOMIC_RELAXED) > 0) {
+            __atomic_sub_fetch(&itable->used_inodes, 1, __ATOMIC_RELAXED);
         }
+        pthread_mutex_unlock(&alloc_lock);
+        mark_inode_dirty(&itable->inodes[inode_number]);
     } else {
+        pthread_mutex_unlock(&alloc_lock);
         printf("Error: Inode %u is not allocated.\n", inode_number);
     }
 }
 
 // Find a free block and allocate it
 int find_and_allocate_free_block(uint8_t *block_bitmap, group_descriptor *gd) {
-    int free_index = find_free_block(block_bitmap, BLOCKS_COUNT, 1);
+    // On the mounted drive, take the next block of this thread's window
+    if (block_bitmap == fs_meta.block_bitmap) {
+        alloc_reservation *r = get_local_reservation();
+        if (r) {
+            int free_index;
+            while ((free_index = take_reserved_block(r)) < 0) {
+                if (refill_block_reservation(r) != 0) {
+                    fprintf(stderr, "Error: No free blocks available.\n");
+                    return -1;
+                }
+            }
+            journal_revoke(&fs_journal, FIRST_DATA_BLOCK + free_index);
+            metrics_add(&metrics.block_allocations, 1);
+            return FIRST_DATA_BLOCK + free_index;
+        }
+    }
+
+    pthread_mutex_lock(&alloc_lock);
+    if (block_bitmap == fs_meta.block_bitmap) release_committed_frees_locked();
+    uint32_t length;
+    int free_index = (block_bitmap == fs_meta.block_bitmap) ? extent_index_first(&free_extents, &length)
+                                                            : find_free_block(block_bitmap, BLOCKS_COUNT, 1);
     if (free_index < 0) {
+        pthread_mutex_unlock(&alloc_lock);
         fprintf(stderr, "Error: No free blocks available.\n");
         return -1;
     }
 
-    set_bitmap_bit(block_bitmap, free_index);
-    gd->free_blocks_count--;
+    if (block_bitmap == fs_meta.block_bitmap) {
+        claim_blocks_locked((uint32_t)free_index, 1);
+    } else {
+        set_bitmap_bit(block_bitmap, free_index);
+        gd->free_blocks_count--;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+
+    // The block may still have journaled images from an earlier life as metadata
+    journal_revoke(&fs_journal, FIRST_DATA_BLOCK + free_index);
+    metrics_add(&metrics.block_allocations, 1);
 
     return FIRST_DATA_BLOCK + free_index;
 }
 
-// Read a block reference from the disk
-int read_block_reference(FILE *disk, uint32_t block_index, uint32_t entry_index, uint32_t *out_block_num) {
-    // Seek to: block_index * BLOCK_SIZE + entry_index * 4
-    if (fseek(disk, (long)block_index * BLOCK_SIZE + entry_index * sizeof(uint32_t), SEEK_SET) != 0) {
-        return -1;
+// Read the group descriptor, bitmaps and inode table (any of them may be NULL to skip it).
+// Used at mount to load fs_meta; operations work on fs_meta directly. Returns -1 if a
+// block fails its checksum (every block is still read, so each one is reported).
+int read_metadata(FILE *disk,
+                  group_descriptor *gd,
+                  uint8_t *block_bitmap,
+                  uint8_t *inode_bitmap,
+                  inode_table *itable)
+{
+    int status = journal_read_metadata(&fs_journal, disk, 1, 0, gd, sizeof(group_descriptor));
+    if (block_bitmap) status |= journal_read_metadata(&fs_journal, disk, gd->block_bitmap, 0, block_bitmap, BLOCKS_COUNT / 8);
+    if (inode_bitmap) status |= journal_read_metadata(&fs_journal, disk, gd->inode_bitmap, 0, inode_bitmap, INODES_COUNT / 8);
+    if (itable) status |= journal_read_metadata(&fs_journal, disk, gd->inode_table, 0, itable, sizeof(inode_table));
+    return status ? -1 : 0;
+}
+
+// Write the group descriptor, bitmaps and inode table back through the journal (NULL skips one).
+// Only the blocks that actually changed are logged; of the inode table only the inodes
+// marked dirty by this thread are written, each copied under its lock, so the caller must
+// not hold an inode lock. Always called on fs_meta.
+void write_metadata(FILE *disk,
+                    group_descriptor *gd,
+                    uint8_t *block_bitmap,
+                    uint8_t *inode_bitmap,
+                    inode_table *itable)
+{
+    group_descriptor gd_image;
+    static __thread uint8_t block_image[BLOCKS_COUNT / 8];
+    static __thread uint8_t inode_image[INODES_COUNT / 8];
+    TRACE_BEGIN(trace_start);
+
+    // 1. Log the dirty inodes (all of them after an overflow), each copied under its lock
+    //    since other threads may be changing it
+    if (itable) {
+        uint32_t count = dirty_inodes_overflow ? INODES_COUNT : dirty_inodes_count;
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t n = dirty_inodes_overflow ? i : dirty_inodes[i];
+            lock_inode_read(n);
+            inode node = itable->inodes[n];
+            unlock_inode(n);
+            journal_write(&fs_journal, disk, gd->inode_table, n * sizeof(inode), &node, sizeof(inode));
+        }
+        dirty_inodes_count = 0;
+        dirty_inodes_overflow = false;
     }
-    if (fread(out_block_num, sizeof(uint32_t), 1, disk) != 1) {
-        return -1;
+
+    pthread_mutex_lock(&alloc_lock);
+
+    // 2. Inodes freed by this operation are logged now and may be handed out again
+    if (freed_inodes_count > 0) {
+        for (uint32_t i = 0; i < freed_inodes_count; i++) {
+            free_bitmap_bit(fs_meta.inode_bitmap, freed_inodes[i]);
+            fs_meta.gd.free_inodes_count++;
+        }
+        freed_inodes_count = 0;
+        inode_bitmap = fs_meta.inode_bitmap;
     }
-    return 0;
-}
 
-// Write a block reference to the disk
-int write_block_reference(FILE *disk, uint32_t block_index, uint32_t entry_index, uint32_t block_num) {
-    if (fseek(disk, (long)block_index * BLOCK_SIZE + entry_index * sizeof(uint32_t), SEEK_SET) != 0) {
-        return -1;
+    // 3. Log what the drive should hold: reserved but unused blocks and inodes as free
+    reservation_image_locked(&gd_image, block_bitmap ? block_image : NULL, inode_bitmap ? inode_image : NULL);
+    journal_write(&fs_journal, disk, 1, 0, &gd_image, sizeof(group_descriptor));
+    journal_write(&fs_journal, disk, 1, ORPHAN_TABLE_OFFSET, &fs_meta.orphans, orphan_table_bytes(&fs_meta.orphans));
+    if (block_bitmap) journal_write(&fs_journal, disk, gd->block_bitmap, 0, block_image, BLOCKS_COUNT / 8);
+    if (inode_bitmap) journal_write(&fs_journal, disk, gd->inode_bitmap, 0, inode_image, INODES_COUNT / 8);
+    if (itable) {
+        uint32_t used_inodes = __atomic_load_n(&itable->used_inodes, __ATOMIC_RELAXED);
+        journal_write(&fs_journal, disk, gd->inode_table, offsetof(inode_table, used_inodes),
+                      &used_inodes, sizeof(uint32_t));
     }
-    if (fwrite(&block_num, sizeof(uint32_t), 1, disk) != 1) {
-        return -1;
+
+    // 4. Blocks of the refcount table changed by this operation
+    for (uint32_t k = 0; dirty_refcount_blocks != 0; k++) {
+        if (!(dirty_refcount_blocks & (1u << k))) continue;
+        journal_write(&fs_journal, disk, fs_meta.refcount_start + k, 0,
+                      (uint8_t *)fs_meta.refcounts + (size_t)k * BLOCK_SIZE, BLOCK_SIZE);
+        dirty_refcount_blocks &= ~(1u << k);
     }
+    pthread_mutex_unlock(&alloc_lock);
+    TRACE_END(trace_start, "write_metadata");
+}
+
+// Read a block reference from the disk (-1 if the indirect block fails its checksum)
+int read_block_reference(FILE *disk, uint32_t block_index, uint32_t entry_index, uint32_t *out_block_num) {
+    return journal_read_metadata(&fs_journal, disk, block_index, entry_index * sizeof(uint32_t), out_block_num, sizeof(uint32_t));
+}
+
+// Write a block reference to the disk (indirect blocks are metadata and go through the journal)
+int write_block_reference(FILE *disk, uint32_t block_index, uint32_t entry_index, uint32_t block_num) {
+    journal_write(&fs_journal, disk, block_index, entry_index * sizeof(uint32_t), &block_num, sizeof(uint32_t));
     return 0;
 }
 
 // Zero out a block on the disk
 void zero_block_on_disk(FILE *disk, uint32_t block_index) {
+    static const uint8_t zero_buf[BLOCK_SIZE];
+    disk_write(disk, (uint64_t)block_index * BLOCK_SIZE, zero_buf, BLOCK_SIZE);
+}
+
+// Write a block of a new directory in place (the rest of the block zeroed) and record its
+// checksum. Only for a block just allocated in the running transaction, which links it:
+// a block freed by the running transaction is not handed out again before that commits
+// (deferred frees), so a crash before the commit leaves the old content of the block
+// unreachable, and the allocation revoked older images of it in the log.
+void write_new_directory_block(FILE *disk, uint32_t block_index, const void *data, size_t len) {
+    uint8_t content[BLOCK_SIZE] = {0};
+    memcpy(content, data, len);
+    disk_write(disk, (uint64_t)block_index * BLOCK_SIZE, content, BLOCK_SIZE);
+    journal_set_checksum(&fs_journal, block_index, content);
+}
+
+// Zero out a metadata (indirect) block through the journal
+void zero_metadata_block(FILE *disk, uint32_t block_index) {
     static uint8_t zero_buf[BLOCK_SIZE];
-    memset(zero_buf, 0, BLOCK_SIZE);
-    fseek(disk, (long)block_index * BLOCK_SIZE, SEEK_SET);
-    fwrite(zero_buf, BLOCK_SIZE, 1, disk);
+    journal_write(&fs_journal, disk, block_index, 0, zero_buf, BLOCK_SIZE);
 }
 
-/**
- * Allocate a new data block for the 'n'-th (0-based) block of this inode.
- * 
- * Handling:
- *  - If n < 12, uses direct blocks.
- *  - If 12 <= n < 12 + 1024, uses single_indirect.
- *  - If 12 + 1024 <= n < 12 + 1024 + (1024*1024), uses double_indirect.
- *    (Ignoring triple-indirect for simplicity.)
- * 
- *  Each indirect block is an array of 1024 uint32_t block references.
- * 
- * Returns: the newly allocated block index on success, or -1 on failure.
- */
-int allocate_data_block_for_inode(
-    FILE *disk,
-    inode *node,
-    uint32_t n,
-    uint8_t *block_bitmap,
-    group_descriptor *gd
-) {
-    // Step 1: find a free data block in the bitmap and allocate it
-    int new_data_block = find_and_allocate_free_block(block_bitmap, gd);
-    if (new_data_block == -1) {
-        fprintf(stderr, "Error: No free data blocks available.\n");
-        return -1;
+// Frees(deallocates) the given block in the block bitmap.
+// A block shared with other files only loses one reference.
+static void free_data_block(uint8_t *block_bitmap, group_descriptor *gd, int block_idx) {
+    pthread_mutex_lock(&alloc_lock);
+    if (block_bitmap != fs_meta.block_bitmap) {
+        free_bitmap_bit(block_bitmap, block_idx - FIRST_DATA_BLOCK);
+        gd->free_blocks_count++;
+        pthread_mutex_unlock(&alloc_lock);
+        return;
+    }
+    if (fs_meta.refcounts[block_idx] > 0) {
+        set_block_refs_locked((uint32_t)block_idx, fs_meta.refcounts[block_idx] - 1);
+        pthread_mutex_unlock(&alloc_lock);
+        return;
     }
+    defer_block_free_locked((uint32_t)(block_idx - FIRST_DATA_BLOCK));
+    pthread_mutex_unlock(&alloc_lock);
+}
 
-    zero_block_on_disk(disk, (uint32_t)new_data_block);
+// [SHARED BLOCKS]
+// A data block may be mapped by several files at once (deduplicated content). The
+// refcount table of the drive holds the extra references of every block, so a block
+// with a single owner counts 0. Freeing a shared block only drops one reference
+// (free_data_block), and a shared block is never written in place: the writer maps
+// a copy of its own first (see allocate_data_block_for_inode). Blocks only become
+// shared through the fingerprint index, and an owner takes its block out of the
+// index before writing it in place, both under alloc_lock, so a block never gains
+// a reference while it is being overwritten.
+
+// Extra references of a block of the mounted drive
+uint16_t block_extra_refs(uint32_t block) {
+    return __atomic_load_n(&fs_meta.refcounts[block], __ATOMIC_RELAXED);
+}
 
-    // Step 2: figure out where to store 'new_data_block' in the inode
-    // Step 2a: Direct blocks (0..11)
-    if (n < 12) {
-        node->blocks[n] = new_data_block;
-        return new_data_block;
+/**
+ * Add a reference to 'block', which must still be in the fingerprint index under
+ * 'hash' (so its content is the one that was fingerprinted).
+ *
+ * Returns: 0 on success, or -1 if it cannot be shared (no longer indexed, at the
+ *          reference limit, or the drive has no refcount table).
+ */
+static int share_data_block(uint32_t block, uint64_t hash) {
+    int status = -1;
+    pthread_mutex_lock(&alloc_lock);
+    if (fs_meta.refcount_start != 0 && fs_meta.refcounts[block] < UINT16_MAX &&
+        dedup_holds(&fingerprints, hash, block)) {
+        set_block_refs_locked(block, fs_meta.refcounts[block] + 1);
+        status = 0;
     }
+    pthread_mutex_unlock(&alloc_lock);
+    return status;
+}
 
-    // Step 2b: Single indirect range (12..12+1024-1)
-    uint32_t single_start = 12;
-    uint32_t single_end = single_start + 1024 - 1; // up to 12 + 1024 - 1 = 1035
+// Whether the (only) owner of 'block' may write it in place; the block leaves the
+// fingerprint index so that no other write starts sharing it
+static bool data_block_writable(uint32_t block) {
+    if (!fingerprints.slots) return block_extra_refs(block) == 0;
+    pthread_mutex_lock(&alloc_lock);
+    bool writable = fs_meta.refcounts[block] == 0;
+    if (writable) dedup_forget(&fingerprints, block);
+    pthread_mutex_unlock(&alloc_lock);
+    return writable;
+}
 
-    if (n <= single_end) {
-        uint32_t si_offset = n - single_start;
+// Indirect blocks are shared by cloned files (see clone_file). An extra reference on
+// an indirect block stands for its whole subtree: the blocks below it count the
+// shared indirect block once. Before a file changes anything below a shared
+// indirect block it takes a private copy of it, and the blocks it points to gain
+// the reference of the copy (unshare_indirect_block).
+
+// Drop one reference of a shared block (true), or return false if the caller holds the last one
+static bool drop_shared_reference(uint8_t *block_bitmap, uint32_t block) {
+    if (block_bitmap != fs_meta.block_bitmap) return false;
+    pthread_mutex_lock(&alloc_lock);
+    bool shared = fs_meta.refcounts[block] > 0;
+    if (shared) set_block_refs_locked(block, fs_meta.refcounts[block] - 1);
+    pthread_mutex_unlock(&alloc_lock);
+    return shared;
+}
 
-        // If single_indirect == 0, allocate the single-indirect block itself
-        if (node->single_indirect == 0) {
-            int si_block = find_and_allocate_free_block(block_bitmap, gd);
-            if (si_block == -1) {
-                fprintf(stderr, "Error: No free blocks for single indirect block.\n");
-                // rollback
-                free_bitmap_bit(block_bitmap, new_data_block);
-                gd -> free_blocks_count++;
-                return -1;
-            }
-            node->single_indirect = si_block;
-            zero_block_on_disk(disk, (uint32_t)si_block);
+/**
+ * Free an indirect block ('depth' 1: single, 2: double) and, when this was its
+ * last reference, everything below it. A shared block only loses one reference.
+ */
+void free_indirect_tree(FILE *disk, uint32_t block, int depth, uint8_t *block_bitmap, group_descriptor *gd) {
+    if (drop_shared_reference(block_bitmap, block)) return;
+
+    // A corrupt block is freed alone: what it points to is left for the consistency check
+    uint32_t refs[BLOCK_SIZE / sizeof(uint32_t)];
+    if (journal_read_metadata(&fs_journal, disk, block, 0, refs, BLOCK_SIZE) != 0) memset(refs, 0, sizeof(refs));
+    for (uint32_t i = 0; i < BLOCK_SIZE / sizeof(uint32_t); i++) {
+        if (refs[i] == 0) continue;
+        if (depth > 1) {
+            free_indirect_tree(disk, refs[i], depth - 1, block_bitmap, gd);
+        } else {
+            free_data_block(block_bitmap, gd, (int)refs[i]);
         }
+    }
+    free_data_block(block_bitmap, gd, (int)block);
+}
 
-        // Write 'new_data_block' to the single indirect block
-        if (write_block_reference(disk, node->single_indirect, si_offset, (uint32_t)new_data_block) != 0) {
-            fprintf(stderr, "Error: Could not write single_indirect reference.\n");
-            // roll back
-            free_bitmap_bit(block_bitmap, new_data_block);
-            gd->free_blocks_count++;
-            return -1;
-        }
+/**
+ * Give the caller a private copy of a shared indirect block. The copy holds the
+ * same references, so every block it points to gains one, and the shared block
+ * loses the caller's. The content of a shared block never changes, so it can
+ * be read before alloc_lock is taken.
+ *
+ * Returns: the block to use in place of 'block' ('block' itself when it is not
+ *          shared), or -1 if no block is free or a reference count is full.
+ */
+int unshare_indirect_block(FILE *disk, uint32_t block, uint8_t *block_bitmap, group_descriptor *gd) {
+    if (block_bitmap != fs_meta.block_bitmap || block_extra_refs(block) == 0) return (int)block;
 
-        return new_data_block;
+    // 1. Copy the references
+    int copy = find_and_allocate_free_block(block_bitmap, gd);
+    if (copy < 0) {
+        fprintf(stderr, "Error: No free blocks to copy shared indirect block %u.\n", block);
+        return -1;
     }
-    
-    // Double indirect range: [12+1024, 12+1024+1024*1024 - 1]
-    uint32_t double_start = single_end + 1;
-    uint32_t double_end = 12 + 1024 + (1024 * 1024) - 1;
-
-    if (n > double_end) {
-        fprintf(stderr, "Error: Block index out of range.\n");
-        // roll back
-        free_bitmap_bit(block_bitmap, new_data_block);
-        gd->free_blocks_count++;
+    uint32_t refs[BLOCK_SIZE / sizeof(uint32_t)];
+    if (journal_read_metadata(&fs_journal, disk, block, 0, refs, BLOCK_SIZE) != 0) {
+        free_data_block(block_bitmap, gd, copy);
         return -1;
     }
 
-    // if we reach here, 1036 <= n <= double_end
-    uint32_t di_offset = n - double_start; // offset into double-indirect region
-    // Each single-indirect block can hold 1024 references, so:
-    uint32_t si_index   = di_offset / 1024;   // which single-indirect block inside double_indirect
-    uint32_t si_offset2 = di_offset % 1024;   // index within that single-indirect block
-
-    // If double_indirect == 0, allocate it
-    if (node->double_indirect == 0) {
-        int di_block = find_and_allocate_free_block(block_bitmap, gd);
-        if (di_block < 0) {
-            fprintf(stderr, "Error: No free blocks for double_indirect.\n");
-            free_bitmap_bit(block_bitmap, new_data_block);
-            gd->free_blocks_count++;
+    // 2. Move the caller's reference to the copy (unless the other users left meanwhile)
+    pthread_mutex_lock(&alloc_lock);
+    if (fs_meta.refcounts[block] == 0) {
+        pthread_mutex_unlock(&alloc_lock);
+        free_data_block(block_bitmap, gd, copy);
+        return (int)block;
+    }
+    for (uint32_t i = 0; i < BLOCK_SIZE / sizeof(uint32_t); i++) {
+        if (refs[i] != 0 && fs_meta.refcounts[refs[i]] == UINT16_MAX) {
+            pthread_mutex_unlock(&alloc_lock);
+            free_data_block(block_bitmap, gd, copy);
+            fprintf(stderr, "Error: Block %u has too many references.\n", refs[i]);
             return -1;
         }
-        node->double_indirect = di_block;
-        zero_block_on_disk(disk, (uint32_t)di_block);
     }
-
-    // Now, read the block number of the 'si_index'-th single-indirect block from the double_indirect block.
-    uint32_t si_block_num;
-    if (read_block_reference(disk, node->double_indirect, si_index, &si_block_num) != 0) {
-        fprintf(stderr, "Error: Could not read from double_indirect block.\n");
-        free_bitmap_bit(block_bitmap, new_data_block);
-        gd->free_blocks_count++;
-        return -1;
+    for (uint32_t i = 0; i < BLOCK_SIZE / sizeof(uint32_t); i++) {
+        if (refs[i] != 0) set_block_refs_locked(refs[i], fs_meta.refcounts[refs[i]] + 1);
     }
+    set_block_refs_locked(block, fs_meta.refcounts[block] - 1);
+    pthread_mutex_unlock(&alloc_lock);
 
-    // If si_block_num == 0, allocate a new single-indirect block
-    if (si_block_num == 0) {
+    // 3. Write the copy
+    journal_write(&fs_journal, disk, (uint32_t)copy, 0, refs, BLOCK_SIZE);
+    return copy;
+}
+
+/**
+ * Look up the physical block backing the 'n'-th (0-based) block of this inode
+ * like lookup_data_block_of_inode, first replacing every shared indirect block
+ * on the way with a private copy. The data block found is then shared only if
+ * its own reference count says so, and the inode may change its mapping.
+ *
+ * Returns: 0 on success with *out_block set (0 if the block is not mapped),
+ *          or -1 if the index is out of range or a copy failed.
+ */
+int lookup_private_data_block(FILE *disk, inode *node, uint32_t n, uint32_t *out_block,
+                              uint8_t *block_bitmap, group_descriptor *gd)
+{
+    uint32_t refs_per_block = BLOCK_SIZE / sizeof(uint32_t);
+    *out_block = 0;
+
+    if (n < 12) {
+        *out_block = node->blocks[n];
+        return 0;
+    }
+
+    if (n < 12 + refs_per_block) {
+        if (node->single_indirect == 0) return 0;
+        int single = unshare_indirect_block(disk, node->single_indirect, block_bitmap, gd);
+        if (single < 0) return -1;
+        node->single_indirect = (uint32_t)single;
+        return read_block_reference(disk, node->single_indirect, n - 12, out_block);
+    }
+
+    uint32_t di_offset = n - 12 - refs_per_block;
+    if (di_offset >= refs_per_block * refs_per_block) return -1;
+    if (node->double_indirect == 0) return 0;
+    int dbl = unshare_indirect_block(disk, node->double_indirect, block_bitmap, gd);
+    if (dbl < 0) return -1;
+    node->double_indirect = (uint32_t)dbl;
+
+    uint32_t si_block_num;
+    read_block_reference(disk, node->double_indirect, di_offset / refs_per_block, &si_block_num);
+    if (si_block_num == 0) return 0;
+    int single = unshare_indirect_block(disk, si_block_num, block_bitmap, gd);
+    if (single < 0) return -1;
+    if ((uint32_t)single != si_block_num) {
+        write_block_reference(disk, node->double_indirect, di_offset / refs_per_block, (uint32_t)single);
+    }
+    return read_block_reference(disk, (uint32_t)single, di_offset % refs_per_block, out_block);
+}
+
+/**
+ * Look up the physical block backing the 'n'-th (0-based) block of this inode.
+ *
+ * Returns: 0 on success with *out_block set (0 if the block is not mapped),
+ *          or -1 if the index is out of range or a read failed.
+ */
+int lookup_data_block_of_inode(FILE *disk, inode *node, uint32_t n, uint32_t *out_block) {
+    *out_block = 0;
+
+    if (n < 12) {
+        *out_block = node->blocks[n];
+        return 0;
+    }
+
+    uint32_t single_start = 12;
+    uint32_t single_end = single_start + 1024 - 1;
+    if (n <= single_end) {
+        if (node->single_indirect == 0) return 0;
+        return read_block_reference(disk, node->single_indirect, n - single_start, out_block);
+    }
+
+    uint32_t double_start = single_end + 1;
+    uint32_t double_end = 12 + 1024 + (1024 * 1024) - 1;
+    if (n > double_end) return -1;
+    if (node->double_indirect == 0) return 0;
+
+    uint32_t di_offset = n - double_start;
+    uint32_t si_block_num;
+    if (read_block_reference(disk, node->double_indirect, di_offset / 1024, &si_block_num) != 0) {
+        return -1;
+    }
+    if (si_block_num == 0) return 0;
+    return read_block_reference(disk, si_block_num, di_offset % 1024, out_block);
+}
+
+// One mapped data block of a file
+typedef struct mapped_block {
+    uint32_t logical;   // Index of the block in the file
+    uint32_t physical;  // Block number on the drive
+} mapped_block;
+
+static int append_mapped_block(mapped_block **blocks, uint32_t *count, uint32_t *capacity, uint32_t logical, uint32_t physical) {
+    if (*count == *capacity) {
+        uint32_t grown_capacity = *capacity ? *capacity * 2 : 64;
+        mapped_block *grown = (mapped_block *)realloc(*blocks, grown_capacity * sizeof(mapped_block));
+        if (!grown) return -1;
+        *blocks = grown;
+        *capacity = grown_capacity;
+    }
+    (*blocks)[(*count)++] = (mapped_block){ logical, physical };
+    return 0;
+}
+
+/**
+ * Collect the mapped data blocks of 'node' (direct, single-indirect and
+ * double-indirect) in logical order, skipping holes. Every indirect block is
+ * read once.
+ *
+ * Returns: the number of blocks, with *out_blocks set to a malloc'd array
+ *          (NULL if there are none), or -1 if out of memory.
+ */
+int collect_data_blocks(FILE *disk, inode *node, mapped_block **out_blocks) {
+    uint32_t refs_per_block = BLOCK_SIZE / sizeof(uint32_t);
+    uint32_t refs[BLOCK_SIZE / sizeof(uint32_t)];
+    uint32_t si_refs[BLOCK_SIZE / sizeof(uint32_t)];
+    mapped_block *blocks = NULL;
+    uint32_t count = 0, capacity = 0;
+    *out_blocks = NULL;
+
+    // 1. Direct blocks
+    for (uint32_t i = 0; i < 12; i++) {
+        if (node->blocks[i] != 0 && append_mapped_block(&blocks, &count, &capacity, i, node->blocks[i]) != 0) goto fail;
+    }
+
+    // 2. Single-indirect block (logical blocks 12..1035)
+    if (node->single_indirect != 0) {
+        if (journal_read_metadata(&fs_journal, disk, node->single_indirect, 0, refs, BLOCK_SIZE) != 0) goto fail;
+        for (uint32_t i = 0; i < refs_per_block; i++) {
+            if (refs[i] != 0 && append_mapped_block(&blocks, &count, &capacity, 12 + i, refs[i]) != 0) goto fail;
+        }
+    }
+
+    // 3. Double-indirect block (logical blocks 1036..)
+    if (node->double_indirect != 0) {
+        if (journal_read_metadata(&fs_journal, disk, node->double_indirect, 0, si_refs, BLOCK_SIZE) != 0) goto fail;
+        for (uint32_t i = 0; i < refs_per_block; i++) {
+            if (si_refs[i] == 0) continue;
+            if (journal_read_metadata(&fs_journal, disk, si_refs[i], 0, refs, BLOCK_SIZE) != 0) goto fail;
+            for (uint32_t j = 0; j < refs_per_block; j++) {
+                uint32_t logical = 12 + refs_per_block + i * refs_per_block + j;
+                if (refs[j] != 0 && append_mapped_block(&blocks, &count, &capacity, logical, refs[j]) != 0) goto fail;
+            }
+        }
+    }
+
+    *out_blocks = blocks;
+    return (int)count;
+
+fail:
+    free(blocks);
+    return -1;
+}
+
+// Number of extents (runs of consecutive blocks on the drive) of a block map. Holes
+// do not split an extent, so the clusters of a compressed file stored back to back
+// count as one.
+uint32_t count_extents(const mapped_block *blocks, uint32_t count) {
+    uint32_t extents = (count > 0) ? 1 : 0;
+    for (uint32_t i = 1; i < count; i++) {
+        if (blocks[i].physical != blocks[i - 1].physical + 1) extents++;
+    }
+    return extents;
+}
+
+/**
+ * Store an already allocated data block as the 'n'-th (0-based) block of this inode.
+ *
+ * Handling:
+ *  - If n < 12, uses direct blocks.
+ *  - If 12 <= n < 12 + 1024, uses single_indirect.
+ *  - If 12 + 1024 <= n < 12 + 1024 + (1024*1024), uses double_indirect.
+ *    (Ignoring triple-indirect for simplicity.)
+ *
+ *  Each indirect block is an array of 1024 uint32_t block references.
+ *  Indirect blocks are allocated on demand, and shared ones are copied first (see
+ *  unshare_indirect_block); the data block itself is not freed on failure.
+ *
+ * Returns: 0 on success, or -1 on failure.
+ */
+int map_data_block_to_inode(
+    FILE *disk,
+    inode *node,
+    uint32_t n,
+    uint32_t data_block,
+    uint8_t *block_bitmap,
+    group_descriptor *gd
+) {
+    // Direct blocks (0..11)
+    if (n < 12) {
+        node->blocks[n] = data_block;
+        return 0;
+    }
+
+    // Single indirect range (12..12+1024-1)
+    uint32_t single_start = 12;
+    uint32_t single_end = single_start + 1024 - 1; // up to 12 + 1024 - 1 = 1035
+
+    if (n <= single_end) {
+        uint32_t si_offset = n - single_start;
+
+        // If single_indirect == 0, allocate the single-indirect block itself
+        if (node->single_indirect == 0) {
+            int si_block = find_and_allocate_free_block(block_bitmap, gd);
+            if (si_block == -1) {
+                fprintf(stderr, "Error: No free blocks for single indirect block.\n");
+                return -1;
+            }
+            node->single_indirect = si_block;
+            zero_metadata_block(disk, (uint32_t)si_block);
+        } else {
+            // A single_indirect shared with a clone is copied before it changes
+            int si_block = unshare_indirect_block(disk, node->single_indirect, block_bitmap, gd);
+            if (si_block < 0) return -1;
+            node->single_indirect = (uint32_t)si_block;
+        }
+
+        // Write 'data_block' to the single indirect block
+        if (write_block_reference(disk, node->single_indirect, si_offset, data_block) != 0) {
+            fprintf(stderr, "Error: Could not write single_indirect reference.\n");
+            return -1;
+        }
+
+        return 0;
+    }
+
+    // Double indirect range: [12+1024, 12+1024+1024*1024 - 1]
+    uint32_t double_start = single_end + 1;
+    uint32_t double_end = 12 + 1024 + (1024 * 1024) - 1;
+
+    if (n > double_end) {
+        fprintf(stderr, "Error: Block index out of range.\n");
+        return -1;
+    }
+
+    // if we reach here, 1036 <= n <= double_end
+    uint32_t di_offset = n - double_start; // offset into double-indirect region
+    // Each single-indirect block can hold 1024 references, so:
+    uint32_t si_index   = di_offset / 1024;   // which single-indirect block inside double_indirect
+    uint32_t si_offset2 = di_offset % 1024;   // index within that single-indirect block
+
+    // If double_indirect == 0, allocate it
+    if (node->double_indirect == 0) {
+        int di_block = find_and_allocate_free_block(block_bitmap, gd);
+        if (di_block < 0) {
+            fprintf(stderr, "Error: No free blocks for double_indirect.\n");
+            return -1;
+        }
+        node->double_indirect = di_block;
+        zero_metadata_block(disk, (uint32_t)di_block);
+    } else {
+        int di_block = unshare_indirect_block(disk, node->double_indirect, block_bitmap, gd);
+        if (di_block < 0) return -1;
+        node->double_indirect = (uint32_t)di_block;
+    }
+
+    // Now, read the block number of the 'si_index'-th single-indirect block from the double_indirect block.
+    uint32_t si_block_num;
+    if (read_block_reference(disk, node->double_indirect, si_index, &si_block_num) != 0) {
+        fprintf(stderr, "Error: Could not read from double_indirect block.\n");
+        return -1;
+    }
+
+    // If si_block_num == 0, allocate a new single-indirect block
+    if (si_block_num == 0) {
         int new_si_block = find_and_allocate_free_block(block_bitmap, gd);
         if (new_si_block < 0) {
             fprintf(stderr, "Error: No free blocks for double_indirect's single-indirect.\n");
-            free_bitmap_bit(block_bitmap, new_data_block);
-            gd->free_blocks_count++;
             return -1;
         }
         // store it in the double_indirect block
         if (write_block_reference(disk, node->double_indirect, si_index, (uint32_t)new_si_block) != 0) {
             fprintf(stderr, "Error: Could not write new_si_block reference.\n");
-            free_bitmap_bit(block_bitmap, new_data_block);
-            gd->free_blocks_count++;
-            // also free new_si_block
-            free_bitmap_bit(block_bitmap, new_si_block);
-            gd->free_blocks_count++;
+            free_data_block(block_bitmap, gd, new_si_block);
             return -1;
         }
         si_block_num = (uint32_t)new_si_block;
-        zero_block_on_disk(disk, si_block_num);
+        zero_metadata_block(disk, si_block_num);
+    } else {
+        int si_block = unshare_indirect_block(disk, si_block_num, block_bitmap, gd);
+        if (si_block < 0) return -1;
+        if ((uint32_t)si_block != si_block_num) {
+            write_block_reference(disk, node->double_indirect, si_index, (uint32_t)si_block);
+            si_block_num = (uint32_t)si_block;
+        }
     }
 
-    // Finally, write the 'new_data_block' into the chosen single_indirect block at index si_offset2
-    if (write_block_reference(disk, si_block_num, si_offset2, (uint32_t)new_data_block) != 0) {
+    // Finally, write the 'data_block' into the chosen single_indirect block at index si_offset2
+    if (write_block_reference(disk, si_block_num, si_offset2, data_block) != 0) {
         fprintf(stderr, "Error: Could not write to single_indirect block in double_indirect.\n");
-        free_bitmap_bit(block_bitmap, new_data_block);
-        gd->free_blocks_count++;
         return -1;
     }
 
+    return 0;
+}
+
+/**
+ * Allocate a new data block for the 'n'-th (0-based) block of this inode.
+ *
+ * If the block is already mapped (e.g. preallocated by fallocate, or written
+ * by an earlier append), the existing block is reused instead of leaking it,
+ * unless other files share it: then it is copied to a new block, which replaces
+ * it in this inode (copy on write). Otherwise a free block is taken from the
+ * bitmap, zeroed and stored via map_data_block_to_inode(). The returned block
+ * can be written in place.
+ *
+ * Returns: the block index on success, or -1 on failure.
+ */
+int allocate_data_block_for_inode(
+    FILE *disk,
+    inode *node,
+    uint32_t n,
+    uint8_t *block_bitmap,
+    group_descriptor *gd
+) {
+    // Step 1: reuse the block if this index is already mapped (and not shared)
+    uint32_t existing_block;
+    if (lookup_private_data_block(disk, node, n, &existing_block, block_bitmap, gd) != 0) {
+        existing_block = 0;
+    }
+    if (existing_block != 0 && (block_bitmap != fs_meta.block_bitmap || data_block_writable(existing_block))) {
+        return (int)existing_block;
+    }
+
+    // Step 2: find a free data block in the bitmap and allocate it
+    TRACE_BEGIN(trace_start);
+    int new_data_block = find_and_allocate_free_block(block_bitmap, gd);
+    if (new_data_block == -1) {
+        fprintf(stderr, "Error: No free data blocks available.\n");
+        return -1;
+    }
+
+    if (existing_block != 0) {
+        uint8_t content[BLOCK_SIZE];
+        journal_read(&fs_journal, disk, existing_block, 0, content, BLOCK_SIZE);
+        disk_write(disk, (uint64_t)new_data_block * BLOCK_SIZE, content, BLOCK_SIZE);
+    } else {
+        zero_block_on_disk(disk, (uint32_t)new_data_block);
+    }
+
+    // Step 3: store 'new_data_block' in the inode, rolling back on failure
+    if (map_data_block_to_inode(disk, node, n, (uint32_t)new_data_block, block_bitmap, gd) != 0) {
+        free_data_block(block_bitmap, gd, new_data_block);
+        return -1;
+    }
+
+    // Step 4: a shared block that was copied loses this inode's reference
+    if (existing_block != 0) free_data_block(block_bitmap, gd, (int)existing_block);
+
+    TRACE_END(trace_start, "allocate_block");
     return new_data_block;
 }
 
-// Frees(deallocates) the given block in the block bitmap.
-static void free_data_block(uint8_t *block_bitmap, group_descriptor *gd, int block_idx) {
-    free_bitmap_bit(block_bitmap, block_idx - FIRST_DATA_BLOCK);
-    gd->free_blocks_count++;
+/**
+ * Write one full block of file data as the 'n'-th (0-based) block of this inode.
+ *
+ * With deduplication on, the content is fingerprinted first: if an identical
+ * block is already stored (and the bytes compare equal), that block is mapped
+ * instead and nothing is written. Otherwise the data goes to the block already
+ * mapped at 'n' when this inode is its only owner, or to a new block (a shared
+ * block is replaced, not copied, since all of it is overwritten, and kept when
+ * it already holds the data). New content is added to the fingerprint index.
+ *
+ * Returns: the block index on success, or -1 on failure.
+ */
+int write_data_block(FILE *disk, inode *node, uint32_t n, const uint8_t *data,
+                     uint8_t *block_bitmap, group_descriptor *gd)
+{
+    uint32_t current;
+    if (lookup_private_data_block(disk, node, n, &current, block_bitmap, gd) != 0) return -1;
+    bool dedup = fingerprints.slots != NULL && block_bitmap == fs_meta.block_bitmap;
+    uint64_t hash = 0;
+
+    // 1. Map an identical stored block
+    if (dedup) {
+        metrics_add(&metrics.dedup_lookups, 1);
+        hash = dedup_hash(data, BLOCK_SIZE);
+        uint32_t candidate = dedup_lookup(&fingerprints, hash);
+        if (candidate != 0 && (candidate == current || share_data_block(candidate, hash) == 0)) {
+            uint8_t stored[BLOCK_SIZE];
+            journal_read(&fs_journal, disk, candidate, 0, stored, BLOCK_SIZE);
+            bool same = memcmp(stored, data, BLOCK_SIZE) == 0;
+
+            if (same && candidate == current) {
+                metrics_add(&metrics.dedup_hits, 1);
+                return (int)current;
+            }
+            if (same && map_data_block_to_inode(disk, node, n, candidate, block_bitmap, gd) == 0) {
+                if (current != 0) free_data_block(block_bitmap, gd, (int)current);
+                metrics_add(&metrics.dedup_hits, 1);
+                return (int)candidate;
+            }
+            // A hash collision (or a failed mapping): drop the reference just taken
+            if (candidate != current) free_data_block(block_bitmap, gd, (int)candidate);
+        }
+    }
+
+    // 2. A block this inode may overwrite. A shared block that already holds the
+    //    data stays shared: rewriting a clone only copies the blocks that change.
+    int block = (int)current;
+    bool writable = current == 0 || block_bitmap != fs_meta.block_bitmap || data_block_writable(current);
+    if (!writable) {
+        uint8_t stored[BLOCK_SIZE];
+        journal_read(&fs_journal, disk, current, 0, stored, BLOCK_SIZE);
+        if (memcmp(stored, data, BLOCK_SIZE) == 0) return (int)current;
+    }
+    if (current == 0 || !writable) {
+        TRACE_BEGIN(trace_start);
+        block = find_and_allocate_free_block(block_bitmap, gd);
+        if (block < 0) {
+            fprintf(stderr, "Error: No free data blocks available.\n");
+            return -1;
+        }
+        if (map_data_block_to_inode(disk, node, n, (uint32_t)block, block_bitmap, gd) != 0) {
+            free_data_block(block_bitmap, gd, block);
+            return -1;
+        }
+        if (current != 0) free_data_block(block_bitmap, gd, (int)current);
+        TRACE_END(trace_start, "allocate_block");
+    }
+
+    // 3. Write it and remember its content
+    disk_write(disk, (uint64_t)block * BLOCK_SIZE, data, BLOCK_SIZE);
+    if (dedup) dedup_insert(&fingerprints, hash, (uint32_t)block);
+    return block;
 }
 
 // Free all data blocks (direct, single-indirect, double-indirect) used by 'node'.
+// Indirect blocks shared with a clone only lose one reference (see free_indirect_tree).
 void free_all_data_blocks_of_inode(FILE *disk,
                                    inode *node,
                                    uint8_t *block_bitmap,
                                    group_descriptor *gd)
 {
+    uint64_t metrics_start = metrics_now();
     // 1. Free Direct blocks
     for (int i = 0; i < 12; i++) {
         if (node->blocks[i] != 0) {
@@ -312,126 +1448,517 @@ void free_all_data_blocks_of_inode(FILE *disk,
         }
     }
 
-    // 2. Free Single-Indirect blocks
+    // 2. Free the Single-Indirect block and the blocks it points to
     if (node->single_indirect != 0) {
-        uint32_t block_ref;
-        for (int i = 0; i < BLOCK_SIZE / sizeof(uint32_t); i++) {
-            if (read_block_reference(disk, node->single_indirect, i, &block_ref) != 0) {
-                fprintf(stderr, "Warning: failed to read single-indirect block #%u index %d.\n",
-                        node->single_indirect, i);
-                break;
-            }
-            if (block_ref != 0) {
-                free_data_block(block_bitmap, gd, block_ref);
-            }
-        }
-        // free the signle-indirect block itself
-        free_data_block(block_bitmap, gd, node->single_indirect);
+        free_indirect_tree(disk, node->single_indirect, 1, block_bitmap, gd);
         node->single_indirect = 0;
     }
 
-    // 3. Free Double-Indirect blocks
+    // 3. Free the Double-Indirect block, its single-indirect blocks and their blocks
     if (node->double_indirect != 0) {
-        // The double-indirect block is an array of up to 1024 references,
-        // each pointing to a single-indirect block.
-        uint32_t si_block_num;
-        for (int i = 0; i < BLOCK_SIZE /sizeof(uint32_t); i++) {
-            if (read_block_reference(disk, node->double_indirect, i, &si_block_num) != 0) {
-                fprintf(stderr, "Warning: failed to read double-indirect block #%u index %d.\n",
-                        node->double_indirect, i);
-                break;
-            }
-            if (si_block_num != 0) {
-                uint32_t block_ref;
-                // For each single-indirect block, free up the blocks
-                for (int j = 0; j < BLOCK_SIZE / sizeof(uint32_t); j++) {
-                    if (read_block_reference(disk, si_block_num, j, &block_ref) != 0) {
-                        fprintf(stderr, "Warning: failed to read single-indirect block #%u index %d.\n",
-                                si_block_num, j);
-                        break;
-                    }
-                    if (block_ref != 0) {
-                        free_data_block(block_bitmap, gd, block_ref);
-                    }
-                }
-                // free the single-indirect block itself
-                free_data_block(block_bitmap, gd, si_block_num);
-            }
-        }
-        // now free the double-indirect block itself
-        free_data_block(block_bitmap, gd, node->double_indirect);
+        free_indirect_tree(disk, node->double_indirect, 2, block_bitmap, gd);
         node->double_indirect = 0;
     }
+    metrics_record(METRIC_FREE_DATA_BLOCKS, metrics_start);
 }
 
 /**
- * Reads data from an inode into a buffer.
- *
- * This function reads the data blocks associated with an inode from a disk
- * image file and stores the data in the provided buffer. It handles direct,
- * single-indirect, and double-indirect blocks.
+ * Clear the references of an indirect block from index 'first' on and free what
+ * they point to ('depth' 1: data blocks, 2: single-indirect blocks and their
+ * blocks). 'refs' holds the content of '*block'. A shared block is replaced by
+ * a private copy first (and *block updated); nothing is written when no
+ * reference goes.
  *
- * @param disk A pointer to the FILE object representing the disk image.
- * @param node A pointer to the inode structure containing block information.
- * @param buffer A pointer to the buffer where the read data will be stored.
- * @param size The maximum number of bytes to read into the buffer.
- * @return The number of bytes read into the buffer.
+ * Returns: 0 on success, or -1 if the copy failed.
  */
-int read_inode_data(FILE *disk, inode *node, char *buffer, size_t size) {
-    size_t bytes_read = 0;
-
-    // 1. Read direct blocks
-    for (int i = 0; i < 12; i++) {
-        if (node->blocks[i] == 0) break;
-
-        size_t to_read = (size - bytes_read) > BLOCK_SIZE ? BLOCK_SIZE : (size - bytes_read);
-
-        fseek(disk, node->blocks[i] * BLOCK_SIZE, SEEK_SET);
-        fread(buffer + bytes_read, to_read, 1, disk);
-
-        bytes_read += to_read;
-        if (bytes_read >= size) break;
+static int trim_indirect_block(FILE *disk, uint32_t *block, uint32_t *refs, uint32_t first, int depth,
+                               uint8_t *block_bitmap, group_descriptor *gd)
+{
+    uint32_t refs_per_block = BLOCK_SIZE / sizeof(uint32_t);
+    uint32_t i = first;
+    while (i < refs_per_block && refs[i] == 0) i++;
+    if (i == refs_per_block) return 0;
+
+    int private_block = unshare_indirect_block(disk, *block, block_bitmap, gd);
+    if (private_block < 0) return -1;
+    *block = (uint32_t)private_block;
+
+    for (; i < refs_per_block; i++) {
+        if (refs[i] == 0) continue;
+        if (depth > 1) {
+            free_indirect_tree(disk, refs[i], depth - 1, block_bitmap, gd);
+        } else {
+            free_data_block(block_bitmap, gd, (int)refs[i]);
+        }
+        refs[i] = 0;
     }
+    journal_write(&fs_journal, disk, *block, 0, refs, BLOCK_SIZE);
+    return 0;
+}
 
-    // 2. Read single-indirect blocks
-    if (node->single_indirect != 0 && bytes_read < size) {
-        uint32_t single_indirect_blocks[BLOCK_SIZE / sizeof(uint32_t)];
-        fseek(disk, node->single_indirect * BLOCK_SIZE, SEEK_SET);
-        fread(single_indirect_blocks, BLOCK_SIZE, 1, disk);
+/**
+ * Free the data blocks of 'node' that lie beyond 'new_size' bytes.
+ *
+ * Direct blocks past the new end are released individually. Indirect blocks
+ * are read once, their trailing references cleared and written back in a
+ * single block write; an indirect block that ends up empty is freed as well.
+ * An indirect block shared with a clone is copied before it is cut, or only
+ * loses a reference when all of it goes. The inode's file_size is not changed
+ * here.
+ */
+void truncate_inode_blocks(FILE *disk,
+                           inode *node,
+                           uint32_t new_size,
+                           uint8_t *block_bitmap,
+                           group_descriptor *gd)
+{
+    uint32_t refs_per_block = BLOCK_SIZE / sizeof(uint32_t);
+    uint32_t keep = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE; // number of blocks to keep
 
-        for (int i = 0; i < BLOCK_SIZE / sizeof(uint32_t); i++) {
-            if (single_indirect_blocks[i] == 0) break;
+    // 1. Direct blocks
+    for (uint32_t i = keep; i < 12; i++) {
+        if (node->blocks[i] != 0) {
+            free_data_block(block_bitmap, gd, node->blocks[i]);
+            node->blocks[i] = 0;
+        }
+    }
 
-            size_t to_read = (size - bytes_read) > BLOCK_SIZE ? BLOCK_SIZE : (size - bytes_read);
+    // 2. Single-indirect block (logical blocks 12..1035)
+    if (node->single_indirect != 0) {
+        uint32_t first = keep > 12 ? keep - 12 : 0;
+        if (first == 0) {
+            free_indirect_tree(disk, node->single_indirect, 1, block_bitmap, gd);
+            node->single_indirect = 0;
+        } else if (first < refs_per_block) {
+            uint32_t refs[BLOCK_SIZE / sizeof(uint32_t)];
+            if (journal_read_metadata(&fs_journal, disk, node->single_indirect, 0, refs, BLOCK_SIZE) != 0) return;
+            if (trim_indirect_block(disk, &node->single_indirect, refs, first, 1, block_bitmap, gd) != 0) return;
+        }
+    }
 
-            fseek(disk, single_indirect_blocks[i] * BLOCK_SIZE, SEEK_SET);
-            fread(buffer + bytes_read, to_read, 1, disk);
+    // 3. Double-indirect block (logical blocks 1036..)
+    if (node->double_indirect != 0) {
+        uint32_t double_start = 12 + refs_per_block;
+        uint32_t first = keep > double_start ? keep - double_start : 0;
 
-            bytes_read += to_read;
-            if (bytes_read >= size) break;
+        if (first == 0) {
+            free_indirect_tree(disk, node->double_indirect, 2, block_bitmap, gd);
+            node->double_indirect = 0;
+            return;
+        }
+        uint32_t si_refs[BLOCK_SIZE / sizeof(uint32_t)];
+        uint32_t refs[BLOCK_SIZE / sizeof(uint32_t)];
+        if (journal_read_metadata(&fs_journal, disk, node->double_indirect, 0, si_refs, BLOCK_SIZE) != 0) return;
+
+        // Nothing to do if no block lies past the new end
+        uint32_t i = first / refs_per_block;
+        uint32_t first_in_si = first % refs_per_block;
+        bool cut = false;
+        for (uint32_t k = (first_in_si != 0) ? i + 1 : i; k < refs_per_block && !cut; k++) cut = si_refs[k] != 0;
+        if (first_in_si != 0 && si_refs[i] != 0) {
+            if (journal_read_metadata(&fs_journal, disk, si_refs[i], 0, refs, BLOCK_SIZE) != 0) return;
+            for (uint32_t j = first_in_si; j < refs_per_block && !cut; j++) cut = refs[j] != 0;
+        }
+        if (!cut) return;
+
+        // A shared double-indirect block is copied before anything below it changes
+        int dbl = unshare_indirect_block(disk, node->double_indirect, block_bitmap, gd);
+        if (dbl < 0) return;
+        node->double_indirect = (uint32_t)dbl;
+
+        // The single-indirect block holding the new end keeps its head
+        if (first_in_si != 0) {
+            if (si_refs[i] != 0) {
+                uint32_t single = si_refs[i];
+                if (trim_indirect_block(disk, &single, refs, first_in_si, 1, block_bitmap, gd) != 0) return;
+                if (single != si_refs[i]) {
+                    si_refs[i] = single;
+                    write_block_reference(disk, node->double_indirect, i, single);
+                }
+            }
+            i++;
         }
+
+        // The single-indirect blocks after it go as a whole
+        if (i < refs_per_block) trim_indirect_block(disk, &node->double_indirect, si_refs, i, 2, block_bitmap, gd);
     }
+}
 
-    // 6. Read double-indirect blocks
+/**
+ * Preallocate the blocks covering bytes [offset, offset + len) of 'node'.
+ *
+ * Blocks that are already mapped are left alone. The missing ones are taken
+ * from the smallest free extent that holds all of them (best fit, through the
+ * free extent index of the mounted drive), falling back to block-by-block
+ * allocation when no extent is large enough. Preallocated blocks are not zeroed
+ * ("unwritten"): reads never go past file_size and every write path fills
+ * whole blocks, so stale content is never exposed. The inode's file_size is
+ * not changed.
+ *
+ * Returns: the number of newly allocated data blocks, or -1 on failure.
+ */
+int fallocate_inode_blocks(FILE *disk,
+                           inode *node,
+                           uint32_t offset,
+                           uint32_t len,
+                           uint8_t *block_bitmap,
+                           group_descriptor *gd)
+{
+    if (len == 0) return 0;
+
+    uint32_t first = offset / BLOCK_SIZE;
+    uint32_t last = (uint32_t)(((uint64_t)offset + len - 1) / BLOCK_SIZE);
+
+    // 1. Count the holes in the requested range
+    int missing = 0;
+    for (uint32_t n = first; n <= last; n++) {
+        uint32_t block;
+        if (lookup_data_block_of_inode(disk, node, n, &block) != 0) {
+            fprintf(stderr, "Error: Block index %u out of range.\n", n);
+            return -1;
+        }
+        if (block == 0) missing++;
+    }
+    if (missing == 0) return 0;
+
+    pthread_mutex_lock(&alloc_lock);
+    if (gd == &fs_meta.gd) release_committed_frees_locked();
+    if ((uint32_t)missing > gd->free_blocks_count) {
+        pthread_mutex_unlock(&alloc_lock);
+        fprintf(stderr, "Error: Not enough free blocks to preallocate %d blocks.\n", missing);
+        return -1;
+    }
+
+    // 2. Prefer one contiguous run for all missing blocks. The whole run is
+    //    claimed up front so that indirect blocks are not carved out of it.
+    int run_start = extent_index_best_fit(&free_extents, (uint32_t)missing);
+    if (run_start >= 0) {
+        claim_blocks_locked((uint32_t)run_start, (uint32_t)missing);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+
+    if (run_start >= 0) {
+        for (int i = 0; i < missing; i++) {
+            journal_revoke(&fs_journal, FIRST_DATA_BLOCK + run_start + i);
+        }
+        metrics_add(&metrics.block_allocations, (uint64_t)missing);
+    }
+
+    // 3. Map each hole
+    int allocated = 0;
+    for (uint32_t n = first; n <= last; n++) {
+        uint32_t block;
+        lookup_data_block_of_inode(disk, node, n, &block);
+        if (block != 0) continue;
+
+        int new_block;
+        if (run_start >= 0) {
+            new_block = FIRST_DATA_BLOCK + run_start + allocated;
+        } else {
+            new_block = find_and_allocate_free_block(block_bitmap, gd);
+            if (new_block < 0) return -1;
+        }
+
+        if (map_data_block_to_inode(disk, node, n, (uint32_t)new_block, block_bitmap, gd) != 0) {
+            // Release this block and, for a claimed run, the part not yet mapped
+            int unused = (run_start >= 0) ? missing - allocated : 1;
+            for (int i = 0; i < unused; i++) {
+                free_data_block(block_bitmap, gd, new_block + i);
+            }
+            return -1;
+        }
+        allocated++;
+    }
+
+    return allocated;
+}
+
+// [COMPRESSION]
+// A compressed file is cut into clusters of COMPRESS_CLUSTER_BLOCKS logical blocks,
+// each compressed on its own (see compress.h). A cluster that shrinks by at least
+// one block is stored in the first blocks of its logical range and the rest of the
+// range stays a hole; otherwise it is stored raw in the whole range. The number of
+// mapped blocks of a cluster thus tells both its stored size and its form.
+typedef struct compressed_image {
+    uint8_t *data;              // Stored clusters back to back, each padded to whole blocks
+    uint32_t blocks;            // Blocks in 'data'
+    uint32_t clusters;
+    uint8_t *cluster_blocks;    // Blocks stored for each cluster (all of its blocks: raw)
+} compressed_image;
+
+void free_compressed_image(compressed_image *image) {
+    free(image->data);
+    free(image->cluster_blocks);
+    memset(image, 0, sizeof(compressed_image));
+}
+
+/**
+ * Compress the content of a file cluster by cluster.
+ *
+ * Returns: 0 on success, or -1 if out of memory.
+ */
+int compress_file_image(const void *content, size_t size, compressed_image *image) {
+    const size_t cluster_bytes = (size_t)COMPRESS_CLUSTER_BLOCKS * BLOCK_SIZE;
+    const uint8_t *src = (const uint8_t *)content;
+    size_t raw_blocks_total = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    memset(image, 0, sizeof(compressed_image));
+    image->clusters = (uint32_t)((size + cluster_bytes - 1) / cluster_bytes);
+    image->data = (uint8_t *)calloc(raw_blocks_total ? raw_blocks_total : 1, BLOCK_SIZE);
+    image->cluster_blocks = (uint8_t *)malloc(image->clusters ? image->clusters : 1);
+    if (!image->data || !image->cluster_blocks) {
+        free_compressed_image(image);
+        return -1;
+    }
+
+    TRACE_BEGIN(trace_start);
+    for (uint32_t c = 0; c < image->clusters; c++) {
+        size_t offset = (size_t)c * cluster_bytes;
+        size_t raw_len = (size - offset < cluster_bytes) ? size - offset : cluster_bytes;
+        uint32_t raw_blocks = (uint32_t)((raw_len + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        uint8_t *out = image->data + (size_t)image->blocks * BLOCK_SIZE;
+
+        // Keep the compressed form only if it saves at least one block
+        size_t stored_len = (raw_blocks > 1) ? lz_compress(src + offset, raw_len, out, (size_t)(raw_blocks - 1) * BLOCK_SIZE) : 0;
+        uint32_t stored_blocks;
+        if (stored_len > 0) {
+            stored_blocks = (uint32_t)((stored_len + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        } else {
+            memcpy(out, src + offset, raw_len);
+            stored_blocks = raw_blocks;
+        }
+        image->cluster_blocks[c] = (uint8_t)stored_blocks;
+        image->blocks += stored_blocks;
+    }
+    TRACE_END(trace_start, "compress");
+
+    metrics_add(&metrics.compress_input_bytes, size);
+    metrics_add(&metrics.compress_stored_bytes, (uint64_t)image->blocks * BLOCK_SIZE);
+    return 0;
+}
+
+/**
+ * Replace the data blocks of 'node' with a compressed image.
+ *
+ * The old blocks are freed and the image is written with one drive write into
+ * the smallest free run that holds it (best fit), or block by block when no run
+ * is large enough. The inode's file_size is not changed.
+ *
+ * Returns: 0 on success, or -1 on failure (the inode then maps no blocks).
+ */
+int write_compressed_image(FILE *disk, inode *node, const compressed_image *image, uint8_t *block_bitmap, group_descriptor *gd) {
+    // 1. Drop the old block map
+    truncate_inode_blocks(disk, node, 0, block_bitmap, gd);
+    if (image->blocks == 0) return 0;
+
+    // 2. Prefer one contiguous run for the whole image
+    pthread_mutex_lock(&alloc_lock);
+    if (block_bitmap == fs_meta.block_bitmap) release_committed_frees_locked();
+    int run_start = (block_bitmap == fs_meta.block_bitmap) ? extent_index_best_fit(&free_extents, image->blocks) : -1;
+    if (run_start >= 0) {
+        claim_blocks_locked((uint32_t)run_start, image->blocks);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+
+    if (run_start >= 0) {
+        for (uint32_t i = 0; i < image->blocks; i++) {
+            journal_revoke(&fs_journal, FIRST_DATA_BLOCK + run_start + i);
+        }
+        metrics_add(&metrics.block_allocations, image->blocks);
+        disk_write(disk, (uint64_t)(FIRST_DATA_BLOCK + run_start) * BLOCK_SIZE, image->data, (size_t)image->blocks * BLOCK_SIZE);
+    }
+
+    // 3. Map the stored blocks at the start of every cluster
+    uint32_t stored = 0;
+    for (uint32_t c = 0; c < image->clusters; c++) {
+        for (uint32_t k = 0; k < image->cluster_blocks[c]; k++) {
+            int block;
+            if (run_start >= 0) {
+                block = FIRST_DATA_BLOCK + run_start + (int)stored;
+            } else {
+                block = find_and_allocate_free_block(block_bitmap, gd);
+                if (block < 0) {
+                    truncate_inode_blocks(disk, node, 0, block_bitmap, gd);
+                    return -1;
+                }
+                disk_write(disk, (uint64_t)block * BLOCK_SIZE, image->data + (size_t)stored * BLOCK_SIZE, BLOCK_SIZE);
+            }
+
+            if (map_data_block_to_inode(disk, node, c * COMPRESS_CLUSTER_BLOCKS + k, (uint32_t)block, block_bitmap, gd) != 0) {
+                // Release this block and, for a claimed run, the part not yet mapped
+                uint32_t unused = (run_start >= 0) ? image->blocks - stored : 1;
+                for (uint32_t i = 0; i < unused; i++) {
+                    free_data_block(block_bitmap, gd, block + (int)i);
+                }
+                truncate_inode_blocks(disk, node, 0, block_bitmap, gd);
+                return -1;
+            }
+            stored++;
+        }
+    }
+    return 0;
+}
+
+// Compress 'size' bytes of content and store them as the data of 'node' (0, or -1 on failure)
+int write_compressed_inode_data(FILE *disk, inode *node, const void *content, size_t size, uint8_t *block_bitmap, group_descriptor *gd) {
+    compressed_image image;
+    if (compress_file_image(content, size, &image) != 0) {
+        fprintf(stderr, "Error: could not allocate memory to compress inode #%u.\n", node->inode_number);
+        return -1;
+    }
+    int status = write_compressed_image(disk, node, &image, block_bitmap, gd);
+    free_compressed_image(&image);
+    return status;
+}
+
+/**
+ * Read the first 'size' bytes of a compressed file.
+ *
+ * Only the clusters covering them are read and decompressed; physically
+ * consecutive blocks of a cluster are read together.
+ *
+ * Returns: 0 on success, or -1 if out of memory or a cluster is corrupt.
+ */
+int read_compressed_inode_data(FILE *disk, inode *node, char *buffer, size_t size) {
+    const size_t cluster_bytes = (size_t)COMPRESS_CLUSTER_BLOCKS * BLOCK_SIZE;
+    if (size > node->file_size) size = node->file_size;
+
+    mapped_block *blocks;
+    int count = collect_data_blocks(disk, node, &blocks);
+    uint8_t *stored = (uint8_t *)malloc(cluster_bytes);
+    if (count < 0 || !stored) {
+        fprintf(stderr, "Error: could not allocate memory to read inode #%u.\n", node->inode_number);
+        if (count > 0) free(blocks);
+        free(stored);
+        return -1;
+    }
+
+    TRACE_BEGIN(trace_start);
+    int status = 0;
+    uint32_t next = 0; // Next entry of 'blocks'
+    for (uint32_t c = 0; (size_t)c * cluster_bytes < size; c++) {
+        size_t offset = (size_t)c * cluster_bytes;
+        size_t raw_len = (node->file_size - offset < cluster_bytes) ? node->file_size - offset : cluster_bytes;
+        size_t to_copy = (size - offset < raw_len) ? size - offset : raw_len;
+        uint32_t raw_blocks = (uint32_t)((raw_len + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        uint32_t first = c * COMPRESS_CLUSTER_BLOCKS;
+
+        // 1. The stored blocks of the cluster, which are the first of its range
+        uint32_t first_entry = next, stored_blocks = 0;
+        while (next < (uint32_t)count && blocks[next].logical < first + COMPRESS_CLUSTER_BLOCKS) {
+            if (blocks[next].logical != first + stored_blocks) break;
+            stored_blocks++;
+            next++;
+        }
+        if (next < (uint32_t)count && blocks[next].logical < first + COMPRESS_CLUSTER_BLOCKS) {
+            fprintf(stderr, "Error: cluster %u of inode #%u is corrupt.\n", c, node->inode_number);
+            status = -1;
+            break;
+        }
+        for (uint32_t i = 0; i < stored_blocks; ) {
+            uint32_t run = 1;
+            while (i + run < stored_blocks && blocks[first_entry + i + run].physical == blocks[first_entry + i].physical + run) run++;
+            journal_read(&fs_journal, disk, blocks[first_entry + i].physical, 0, stored + (size_t)i * BLOCK_SIZE, (size_t)run * BLOCK_SIZE);
+            i += run;
+        }
+
+        // 2. Decode it: a hole, raw or compressed
+        if (stored_blocks == 0) {
+            memset(buffer + offset, 0, to_copy);
+        } else if (stored_blocks >= raw_blocks) {
+            memcpy(buffer + offset, stored, to_copy);
+        } else if (to_copy == raw_len) {
+            status = lz_decompress(stored, (size_t)stored_blocks * BLOCK_SIZE, (uint8_t *)buffer + offset, raw_len);
+        } else {
+            uint8_t *plain = (uint8_t *)malloc(raw_len);
+            status = plain ? lz_decompress(stored, (size_t)stored_blocks * BLOCK_SIZE, plain, raw_len) : -1;
+            if (status == 0) memcpy(buffer + offset, plain, to_copy);
+            free(plain);
+        }
+        if (status != 0) {
+            fprintf(stderr, "Error: cluster %u of inode #%u could not be decompressed.\n", c, node->inode_number);
+            break;
+        }
+    }
+    TRACE_END(trace_start, "read_compressed");
+
+    free(blocks);
+    free(stored);
+    return status;
+}
+
+// Read 'len' bytes of one content block of 'node'. Directory blocks are metadata and
+// checked against their checksums, file data is not. Returns 0, or -1 on a mismatch.
+static int read_content_block(FILE *disk, inode *node, uint32_t block, void *buf, size_t len) {
+    if (node->file_type == 1) return journal_read_metadata(&fs_journal, disk, block, 0, buf, len);
+    journal_read(&fs_journal, disk, block, 0, buf, len);
+    return 0;
+}
+
+/**
+ * Reads data from an inode into a buffer.
+ *
+ * This function reads the data blocks associated with an inode from a disk
+ * image file and stores the data in the provided buffer. It handles direct,
+ * single-indirect, and double-indirect blocks.
+ *
+ * @param disk A pointer to the FILE object representing the disk image.
+ * @param node A pointer to the inode structure containing block information.
+ * @param buffer A pointer to the buffer where the read data will be stored.
+ * @param size The maximum number of bytes to read into the buffer.
+ * @return 0, or -1 if an indirect or directory block fails its checksum.
+ */
+int read_inode_data(FILE *disk, inode *node, char *buffer, size_t size) {
+    if (inode_is_compressed(node)) return read_compressed_inode_data(disk, node, buffer, size);
+    size_t bytes_read = 0;
+    TRACE_BEGIN(trace_start);
+
+    // 1. Read direct blocks
+    for (int i = 0; i < 12; i++) {
+        if (node->blocks[i] == 0) break;
+
+        size_t to_read = (size - bytes_read) > BLOCK_SIZE ? BLOCK_SIZE : (size - bytes_read);
+
+        if (read_content_block(disk, node, node->blocks[i], buffer + bytes_read, to_read) != 0) goto fail;
+
+        bytes_read += to_read;
+        if (bytes_read >= size) break;
+    }
+
+    // 2. Read single-indirect blocks
+    if (node->single_indirect != 0 && bytes_read < size) {
+        uint32_t single_indirect_blocks[BLOCK_SIZE / sizeof(uint32_t)];
+        if (journal_read_metadata(&fs_journal, disk, node->single_indirect, 0, single_indirect_blocks, BLOCK_SIZE) != 0) goto fail;
+
+        for (int i = 0; i < BLOCK_SIZE / sizeof(uint32_t); i++) {
+            if (single_indirect_blocks[i] == 0) break;
+
+            size_t to_read = (size - bytes_read) > BLOCK_SIZE ? BLOCK_SIZE : (size - bytes_read);
+
+            if (read_content_block(disk, node, single_indirect_blocks[i], buffer + bytes_read, to_read) != 0) goto fail;
+
+            bytes_read += to_read;
+            if (bytes_read >= size) break;
+        }
+    }
+
+    // 6. Read double-indirect blocks
     if (node->double_indirect != 0 && bytes_read < size) {
         uint32_t double_indirect_blocks[BLOCK_SIZE / sizeof(uint32_t)];
-        fseek(disk, node->double_indirect * BLOCK_SIZE, SEEK_SET);
-        fread(double_indirect_blocks, BLOCK_SIZE, 1, disk);
+        if (journal_read_metadata(&fs_journal, disk, node->double_indirect, 0, double_indirect_blocks, BLOCK_SIZE) != 0) goto fail;
 
         for (int i = 0; i < BLOCK_SIZE / sizeof(uint32_t); i++) {
             if (double_indirect_blocks[i] == 0) break;
 
             uint32_t single_indirect_blocks[BLOCK_SIZE / sizeof(uint32_t)];
-            fseek(disk, double_indirect_blocks[i] * BLOCK_SIZE, SEEK_SET);
-            fread(single_indirect_blocks, BLOCK_SIZE, 1, disk);
+            if (journal_read_metadata(&fs_journal, disk, double_indirect_blocks[i], 0, single_indirect_blocks, BLOCK_SIZE) != 0) goto fail;
 
             for (int j = 0; j < BLOCK_SIZE / sizeof(uint32_t); j++) {
                 if (single_indirect_blocks[j] == 0) break;
 
                 size_t to_read = (size - bytes_read) > BLOCK_SIZE ? BLOCK_SIZE : (size - bytes_read);
 
-                fseek(disk, single_indirect_blocks[j] * BLOCK_SIZE, SEEK_SET);
-                fread(buffer + bytes_read, to_read, 1, disk);
+                if (read_content_block(disk, node, single_indirect_blocks[j], buffer + bytes_read, to_read) != 0) goto fail;
 
                 bytes_read += to_read;
                 if (bytes_read >= size) break;
@@ -440,6 +1967,154 @@ int read_inode_data(FILE *disk, inode *node, char *buffer, size_t size) {
             if (bytes_read >= size) break;
         }
     }
+
+    TRACE_END(trace_start, "read_data");
+    return 0;
+
+fail:
+    fprintf(stderr, "Error: inode #%u has a corrupt block.\n", node->inode_number);
+    TRACE_END(trace_start, "read_data");
+    return -1;
+}
+
+/**
+ * Write the pending (delayed) content of one file to disk.
+ *
+ * Blocks past the new end are released, the missing ones are mapped from one
+ * contiguous free run where possible (see fallocate_inode_blocks), and the
+ * data is then written with one write per physically contiguous run. Mapped
+ * blocks shared with other files are replaced first, unless they already hold
+ * their part of the content. With deduplication on the
+ * content is written block by block instead (see write_data_block).
+ *
+ * Returns: 0 on success, or -1 on failure.
+ */
+int write_delayed_inode(FILE *disk,
+                        inode *node,
+                        delalloc_buffer *buf,
+                        uint8_t *block_bitmap,
+                        group_descriptor *gd)
+{
+    uint32_t needed_blocks = (uint32_t)((buf->size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    if (inode_is_compressed(node)) {
+        return write_compressed_inode_data(disk, node, buf->data, buf->size, block_bitmap, gd);
+    }
+
+    // 1. Resize the block map to exactly fit the buffered content
+    truncate_inode_blocks(disk, node, (uint32_t)buf->size, block_bitmap, gd);
+    if (fingerprints.slots) {
+        for (uint32_t i = 0; i < needed_blocks; i++) {
+            uint8_t block_data[BLOCK_SIZE] = {0};
+            size_t offset = (size_t)i * BLOCK_SIZE;
+            memcpy(block_data, buf->data + offset, (buf->size - offset > BLOCK_SIZE) ? BLOCK_SIZE : buf->size - offset);
+            if (write_data_block(disk, node, i, block_data, block_bitmap, gd) < 0) return -1;
+        }
+        return 0;
+    }
+    for (uint32_t i = 0; i < needed_blocks; i++) {
+        uint32_t block;
+        if (lookup_private_data_block(disk, node, i, &block, block_bitmap, gd) == 0 && block != 0 && !data_block_writable(block)) {
+            // A shared block that already holds the data stays (and is not written below)
+            uint8_t stored[BLOCK_SIZE];
+            uint8_t block_data[BLOCK_SIZE] = {0};
+            size_t offset = (size_t)i * BLOCK_SIZE;
+            memcpy(block_data, buf->data + offset, (buf->size - offset > BLOCK_SIZE) ? BLOCK_SIZE : buf->size - offset);
+            journal_read(&fs_journal, disk, block, 0, stored, BLOCK_SIZE);
+            if (memcmp(stored, block_data, BLOCK_SIZE) == 0) continue;
+
+            map_data_block_to_inode(disk, node, i, 0, block_bitmap, gd);
+            free_data_block(block_bitmap, gd, (int)block);
+        }
+    }
+    if (fallocate_inode_blocks(disk, node, 0, (uint32_t)buf->size, block_bitmap, gd) < 0) {
+        return -1;
+    }
+
+    // 2. Write the content run by run
+    uint32_t i = 0;
+    while (i < needed_blocks) {
+        uint32_t run_start_block;
+        if (lookup_data_block_of_inode(disk, node, i, &run_start_block) != 0 || run_start_block == 0) {
+            return -1;
+        }
+        if (block_extra_refs(run_start_block) > 0) {
+            i++;
+            continue;
+        }
+
+        // Extend the run while the next logical block is the next physical block
+        uint32_t run_len = 1;
+        while (i + run_len < needed_blocks) {
+            uint32_t next_block;
+            if (lookup_data_block_of_inode(disk, node, i + run_len, &next_block) != 0 ||
+                next_block != run_start_block + run_len || block_extra_refs(next_block) > 0) {
+                break;
+            }
+            run_len++;
+        }
+
+        size_t offset = (size_t)i * BLOCK_SIZE;
+        size_t bytes_left = buf->size - offset;
+        size_t to_write = (bytes_left > (size_t)run_len * BLOCK_SIZE) ? (size_t)run_len * BLOCK_SIZE : bytes_left;
+
+        uint64_t disk_offset = (uint64_t)run_start_block * BLOCK_SIZE;
+        disk_write(disk, disk_offset, buf->data + offset, to_write);
+
+        // Zero the tail of a partial last block (it may hold stale preallocated data)
+        if (to_write % BLOCK_SIZE != 0) {
+            static const uint8_t zero_buf[BLOCK_SIZE];
+            disk_write(disk, disk_offset + to_write, zero_buf, BLOCK_SIZE - to_write % BLOCK_SIZE);
+        }
+
+        i += run_len;
+    }
+
+    return 0;
+}
+
+/**
+ * Assign blocks to all pending (delayed) writes and flush them to disk.
+ *
+ * Metadata is loaded and written back once for the whole batch, and inodes are
+ * processed in inode-number order so that files created together end up next
+ * to each other on disk.
+ */
+void flush_delayed_allocations(FILE *disk) {
+    if (delalloc_pending_count(&pending_writes) == 0) return;
+    uint64_t metrics_start = metrics_now();
+    journal_start(&fs_journal);
+
+    // 1. Use the in-memory metadata of the mounted drive
+    group_descriptor *gd = &fs_meta.gd;
+    uint8_t *block_bitmap = fs_meta.block_bitmap;
+    inode_table *itable = &fs_meta.itable;
+
+    // 2. Allocate and write every pending file
+    uint32_t flushed = 0;
+    for (uint32_t i = 0; i < INODES_COUNT && delalloc_pending_count(&pending_writes) > 0; i++) {
+        if (!delalloc_lookup(&pending_writes, i)) continue;
+
+        // The buffer may have been flushed or dropped before the lock was taken
+        lock_inode_write(i);
+        delalloc_buffer *buf = delalloc_lookup(&pending_writes, i);
+        if (buf) {
+            if (write_delayed_inode(disk, &itable->inodes[i], buf, block_bitmap, gd) != 0) {
+                fprintf(stderr, "Error: could not flush delayed data of inode #%u.\n", i);
+            } else {
+                flushed++;
+            }
+            mark_inode_dirty(&itable->inodes[i]);
+            delalloc_drop(&pending_writes, i);
+        }
+        unlock_inode(i);
+    }
+
+    // 3. Write updated metadata back to disk
+    write_metadata(disk, gd, block_bitmap, NULL, itable);
+    journal_stop(&fs_journal, disk);
+
+    if (VERBOSE) printf("Flushed delayed data of %u files.\n", flushed);
+    metrics_record(METRIC_FLUSH_DELALLOC, metrics_start);
 }
 
 // [END OF HELPER FUNCTIONS]
@@ -525,7 +2200,13 @@ void initialize_drive(FILE *disk) {
         FIRST_DATA_BLOCK,
         "1234567890abcdef",
         "MyDrive",
-        0xEF53
+        0xEF53,
+        JOURNAL_START,
+        JOURNAL_BLOCKS,
+        REFCOUNT_START,
+        REFCOUNT_BLOCKS,
+        CHECKSUM_START,
+        CHECKSUM_BLOCKS
     );
 
     // 1b. Group Descriptor
@@ -535,7 +2216,7 @@ void initialize_drive(FILE *disk) {
         2, // block_bitmap
         3, // inode_bitmap
         4, // inode_table
-        BLOCKS_COUNT - FIRST_DATA_BLOCK + 1,
+        BLOCKS_COUNT - FIRST_DATA_BLOCK + 1 - JOURNAL_BLOCKS - REFCOUNT_BLOCKS - CHECKSUM_BLOCKS,
         INODES_COUNT,
         0  // used_dirs_count
     );
@@ -543,6 +2224,12 @@ void initialize_drive(FILE *disk) {
     // 1c. Data block bitmap
     uint8_t *data_block_bitmap = (uint8_t *) malloc(BLOCKS_COUNT / 8 + 1);
     initialize_bitmap(data_block_bitmap, BLOCKS_COUNT);
+
+    // Reserve the checksum table, the refcount table and the journal area so
+    // that they are never handed out as data blocks
+    for (uint32_t i = 0; i < CHECKSUM_BLOCKS + REFCOUNT_BLOCKS + JOURNAL_BLOCKS; i++) {
+        set_bitmap_bit(data_block_bitmap, CHECKSUM_START - FIRST_DATA_BLOCK + i);
+    }
     
     // 1d. Inode bitmap
     uint8_t *inode_bitmap = (uint8_t * ) malloc(INODES_COUNT / 8);
@@ -586,167 +2273,405 @@ void initialize_drive(FILE *disk) {
     size_t root_dir_size = sizeof(directory_block_t)
                          + root_dir_block->entries_count * sizeof(dir_entry_t);
     root_inode->file_size = root_dir_size;
-    fseek(disk, root_block * BLOCK_SIZE, SEEK_SET);
-    fwrite(root_dir_block, root_dir_size, 1, disk);
+    disk_write(disk, (uint64_t)root_block * BLOCK_SIZE, root_dir_block, root_dir_size);
 
     // 3b. Super block
-    fseek(disk, 0, SEEK_SET);
-    fwrite(&sb, sizeof(superblock), 1, disk);
+    disk_write(disk, 0, &sb, sizeof(superblock));
 
     // 3c. Group Descriptor
-    fseek(disk, BLOCK_SIZE, SEEK_SET);
-    fwrite(&gd, sizeof(group_descriptor), 1, disk);
+    disk_write(disk, BLOCK_SIZE, &gd, sizeof(group_descriptor));
 
     // 3d. Block Bitmap
-    fseek(disk, gd.block_bitmap * BLOCK_SIZE, SEEK_SET);
-    fwrite(data_block_bitmap, BLOCKS_COUNT / 8, 1, disk);
+    disk_write(disk, (uint64_t)gd.block_bitmap * BLOCK_SIZE, data_block_bitmap, BLOCKS_COUNT / 8);
 
     // 3e. Inode Bitmap
-    fseek(disk, gd.inode_bitmap * BLOCK_SIZE, SEEK_SET);
-    fwrite(inode_bitmap, INODES_COUNT / 8, 1, disk);
+    disk_write(disk, (uint64_t)gd.inode_bitmap * BLOCK_SIZE, inode_bitmap, INODES_COUNT / 8);
 
     // 3f. Inode Table
-    fseek(disk, gd.inode_table * BLOCK_SIZE, SEEK_SET);
-    fwrite(&itable, sizeof(itable), 1, disk);
+    disk_write(disk, (uint64_t)gd.inode_table * BLOCK_SIZE, &itable, sizeof(itable));
+
+    // 3g. Reference count table (no block is shared yet)
+    for (uint32_t i = 0; i < REFCOUNT_BLOCKS; i++) {
+        zero_block_on_disk(disk, REFCOUNT_START + i);
+    }
+
+    // 3h. Empty journal
+    journal_free_checksums(&fs_journal);
+    initialize_journal(&fs_journal, BLOCK_SIZE, JOURNAL_START, JOURNAL_BLOCKS);
+    if (journal_format(&fs_journal, disk) != 0) {
+        fprintf(stderr, "Error: Could not write the journal.\n");
+        free(root_dir_block);
+        free(data_block_bitmap);
+        free(inode_bitmap);
+        exit(EXIT_FAILURE);
+    }
 
+    // 3i. Checksum table: every metadata block written above, logged and written home
+    if (fs_journal.enabled && journal_create_checksums(&fs_journal, CHECKSUM_START, CHECKSUM_BLOCKS) == 0) {
+        uint8_t *content = (uint8_t *) malloc(BLOCK_SIZE);
+        for (uint32_t block = 0; block < FIRST_DATA_BLOCK; block++) {
+            disk_read(disk, (uint64_t)block * BLOCK_SIZE, content, BLOCK_SIZE);
+            journal_set_checksum(&fs_journal, block, content);
+        }
+        disk_read(disk, (uint64_t)root_block * BLOCK_SIZE, content, BLOCK_SIZE);
+        journal_set_checksum(&fs_journal, root_block, content);
+        memset(content, 0, BLOCK_SIZE);
+        for (uint32_t i = 0; i < REFCOUNT_BLOCKS; i++) {
+            journal_set_checksum(&fs_journal, REFCOUNT_START + i, content);
+        }
+        free(content);
+        if (journal_commit(&fs_journal, disk) != 0 || journal_checkpoint(&fs_journal, disk) != 0) {
+            fprintf(stderr, "Error: Could not write the checksum table.\n");
+            free(root_dir_block);
+            free(data_block_bitmap);
+            free(inode_bitmap);
+            exit(EXIT_FAILURE);
+        }
+        journal_free_checksums(&fs_journal);
+    }
 
     // 4. Clean up in-memory structures
     free(root_dir_block);
     free(data_block_bitmap);
     free(inode_bitmap);
-    fseek(disk, 0, SEEK_SET);
 
-    printf("Drive initialized successfully with root directory at inode #%u (block %d).\n",
-           root_inode->inode_number, root_block);
+    if (VERBOSE) printf("Drive initialized successfully with root directory at inode #%u (block %d).\n",
+                         root_inode->inode_number, root_block);
 }
 
 
 /**
- * @brief Reads a file from the disk using its inode number.
+ * @brief Mounts the drive: sets up the journal, replays it after an unclean shutdown,
+ * loads the metadata into memory and builds the free extent index.
  *
- * This function reads the file data from the disk by locating the inode
- * using the provided inode number. It first reads the group descriptor
- * and inode table, validates the inode number, checks if the inode is
- * allocated and is a file, and then reads the file data into a newly
- * allocated memory buffer.
+ * Drives formatted without a journal (journal_blocks == 0 in the superblock)
+ * are mounted with journaling disabled and written in place. Drives formatted
+ * without a refcount table never share blocks, so deduplication stays off.
+ * On drives with a checksum table, metadata blocks are checked as they are read;
+ * a mismatch is reported and the operation reading the block fails. For the
+ * metadata loaded here (superblock, group descriptor, bitmaps, inode table,
+ * orphan list and reference counts) that operation is the mount itself: working
+ * on a damaged bitmap would hand out blocks that are in use.
  *
- * @param disk Pointer to the disk file.
- * @param inode_number The inode number of the file to be read.
- * @return Pointer to the file data structure (file_t) on success, or NULL on failure.
+ * @param disk A pointer to the FILE object representing the disk.
+ * @return 0 on success, -1 if the journal cannot be replayed or the metadata fails
+ *         its checksums (run check_drive --repair).
  */
-file_t* read_file(FILE* disk, uint32_t inode_number) {
-
-    // 1. Read the group descriptor
-    group_descriptor gd;
-    fseek(disk, BLOCK_SIZE, SEEK_SET);
-    fread(&gd, sizeof(group_descriptor), 1, disk);
-
-    // 2. Read the inode table
-    inode_table itable;
-    fseek(disk, gd.inode_table * BLOCK_SIZE, SEEK_SET);
-    fread(&itable, sizeof(inode_table), 1, disk);
-
-    // 3. Validate inode number
-    if (inode_number == 0 || inode_number > INODES_COUNT) {
-        fprintf(stderr, "Error: invalid inode number %u\n", inode_number);
-        return NULL;
+int mount_drive(FILE *disk) {
+    superblock sb;
+    disk_read(disk, 0, &sb, sizeof(superblock));
+
+    // Deferred frees belong to the journal of the previous mount (fs_meta is loaded again below)
+    pthread_mutex_lock(&alloc_lock);
+    deferred_frees_count = 0;
+    pthread_mutex_unlock(&alloc_lock);
+
+    journal_free_checksums(&fs_journal);
+    initialize_journal(&fs_journal, BLOCK_SIZE, sb.journal_start, sb.journal_blocks);
+    int replayed = journal_recover(&fs_journal, disk);
+    if (replayed < 0) {
+        fprintf(stderr, "Error: could not replay the journal, the drive is not mounted.\n");
+        return -1;
     }
-
-    inode *file_inode = &itable.inodes[inode_number];
-
-    // Check if the inode is allocated
-    if (file_inode->file_size == 0) {
-        fprintf(stderr, "Error: inode #%u is not allocated or is empty.\n", inode_number);
-        return NULL;
+    if (replayed > 0) {
+        printf("Journal recovery: replayed %d transactions.\n", replayed);
     }
 
-    // Check if the inode is a file
-    if (file_inode->file_type != 0) {
-        fprintf(stderr, "Error: inode #%u is not a file.\n", inode_number);
-        return NULL;
+    // Metadata checksums (drives formatted without a table, or without a journal, have none)
+    int damaged = 0;
+    if (fs_journal.enabled && sb.checksum_blocks == CHECKSUM_BLOCKS) {
+        if (journal_load_checksums(&fs_journal, disk, sb.checksum_start, sb.checksum_blocks) < 0) {
+            fprintf(stderr, "Error: could not allocate the checksum table, metadata is not checked.\n");
+        }
+        damaged |= journal_read_metadata(&fs_journal, disk, 0, 0, &sb, sizeof(superblock));
     }
 
-    // 4. Allocate memory to reconstruct the file_t structure and return
-    size_t file_size = file_inode->file_size;
-    file_t *file_data = (file_t *)malloc(file_size);
-    if (!file_data) {
-        fprintf(stderr, "Error: could not allocate memory to read file.\n");
-        return NULL;
+    // Load the metadata every operation works on
+    TRACE_BEGIN(trace_start);
+    damaged |= read_metadata(disk, &fs_meta.gd, fs_meta.block_bitmap, fs_meta.inode_bitmap, &fs_meta.itable);
+    TRACE_END(trace_start, "load_metadata");
+    destroy_extent_index(&free_extents);
+    if (initialize_extent_index(&free_extents, fs_meta.block_bitmap, 1, DATA_INDEX_LIMIT) != 0) {
+        fprintf(stderr, "Error: could not allocate the free extent index.\n");
+        exit(EXIT_FAILURE);
     }
-
-    if (read_inode_data(disk, file_inode, (char*) file_data, file_size) != 0) {
-        fprintf(stderr, "Error: could not read file data.\n");
-        free(file_data);
-        return NULL;
+    damaged |= journal_read_metadata(&fs_journal, disk, 1, ORPHAN_TABLE_OFFSET, &fs_meta.orphans, sizeof(orphan_table));
+    if (fs_meta.orphans.count > ORPHAN_TABLE_MAX) {
+        fprintf(stderr, "Error: corrupt orphan list (%u entries), ignoring it.\n", fs_meta.orphans.count);
+        initialize_orphan_table(&fs_meta.orphans);
     }
 
-    return file_data;
+    // Block reference counts, and an empty fingerprint index
+    memset(fs_meta.refcounts, 0, sizeof(fs_meta.refcounts));
+    fs_meta.refcount_start = (sb.refcount_blocks == REFCOUNT_BLOCKS) ? sb.refcount_start : 0;
+    if (fs_meta.refcount_start != 0) {
+        damaged |= journal_read_metadata(&fs_journal, disk, fs_meta.refcount_start, 0, fs_meta.refcounts, sizeof(fs_meta.refcounts));
+    }
+    if (damaged) {
+        fprintf(stderr, "Error: the metadata of the drive fails its checksums, it is not mounted. "
+                        "Run check_drive --repair.\n");
+        return -1;
+    }
+    destroy_dedup_index(&fingerprints);
+    if (DEDUP && fs_meta.refcount_start == 0) {
+        fprintf(stderr, "Warning: the drive has no reference count table, deduplication is off.\n");
+    } else if (DEDUP && initialize_dedup_index(&fingerprints, BLOCKS_COUNT) != 0) {
+        fprintf(stderr, "Error: could not allocate the fingerprint index, deduplication is off.\n");
+    }
+    return 0;
 }
 
-
 /**
- * Reads the directory block associated with a given inode number from the disk.
+ * @brief Makes all pending changes durable and writes journaled metadata home.
  *
  * @param disk A pointer to the FILE object representing the disk.
- * @param inode_number The inode number of the directory to read.
- * @return A pointer to the directory_block_t structure containing the directory data,
- *         or NULL if an error occurs (e.g., invalid inode number, inode not allocated,
- *         inode is not a directory, memory allocation failure, or read error).
- *
- * The function performs the following steps:
- * 1. Reads the group descriptor from the disk.
- * 2. Reads the inode table from the disk.
- * 3. Validates the inode number.
- * 4. Checks if the inode is allocated and is a directory.
- * 5. Allocates memory for the directory data and reads it from the disk.
+ * @return 0 on success, -1 if the changes could not be made durable.
  */
-directory_block_t* read_directory(FILE* disk, uint32_t inode_number) {
-    // 1. Read the group descriptor
-    group_descriptor gd;
-    fseek(disk, BLOCK_SIZE, SEEK_SET);
-    fread(&gd, sizeof(group_descriptor), 1, disk);
-
-
-    // 2. Read the inode table
+int unmount_drive(FILE *disk) {
+    flush_delayed_allocations(disk);
+    release_reservations();
+    if (journal_commit(&fs_journal, disk) != 0) return -1;
+    release_committed_frees();
+    return journal_checkpoint(&fs_journal, disk);
+}
 
-    inode_table itable;
-    fseek(disk, gd.inode_table * BLOCK_SIZE, SEEK_SET);
-    fread(&itable, sizeof(inode_table), 1, disk);
+/**
+ * @brief Writes delayed allocations, returns unused allocation reservations
+ * and commits the running transaction.
+ *
+ * @param disk A pointer to the FILE object representing the disk.
+ * @return 0 on success, -1 if the transaction could not be committed.
+ */
+int sync_filesystem(FILE *disk) {
+    flush_delayed_allocations(disk);
+    release_reservations();
+    if (journal_commit(&fs_journal, disk) != 0) return -1;
+    release_committed_frees();
+    return 0;
+}
+
+// [BACKGROUND FLUSHER]
+// State of the periodic flusher thread
+typedef struct flusher_state {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    FILE *disk;
+    bool running;
+    bool stop;
+} flusher_state;
+
+flusher_state flusher = { .lock = PTHREAD_MUTEX_INITIALIZER, .wakeup = PTHREAD_COND_INITIALIZER };
+
+/**
+ * @brief Body of the flusher thread.
+ *
+ * Every FLUSH_INTERVAL_MS it writes delayed allocations, commits the running
+ * transaction and writes the committed metadata home in block order, so
+ * foreground operations only touch memory and the journal.
+ */
+static void *flusher_main(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&flusher.lock);
+    while (!flusher.stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += FLUSH_INTERVAL_MS / 1000;
+        deadline.tv_nsec += (long)(FLUSH_INTERVAL_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&flusher.wakeup, &flusher.lock, &deadline);
+        if (flusher.stop) break;
+
+        // Foreground operations keep running while the flusher writes back
+        pthread_mutex_unlock(&flusher.lock);
+        sync_filesystem(flusher.disk);
+        journal_checkpoint(&fs_journal, flusher.disk);
+        pthread_mutex_lock(&flusher.lock);
+    }
+    pthread_mutex_unlock(&flusher.lock);
+    return NULL;
+}
+
+/**
+ * @brief Applies the durability policy to the mounted drive and starts the
+ * flusher thread in periodic mode.
+ *
+ * @param disk A pointer to the FILE object representing the disk.
+ */
+void start_flusher(FILE *disk) {
+    switch (DURABILITY) {
+        case DURABILITY_NOSYNC:
+            fs_journal.use_fsync = false;
+            break;
+        case DURABILITY_SYNC:
+            fs_journal.group_ops = 1;
+            break;
+        case DURABILITY_PERIODIC:
+            // Commits are driven by the timer (or by a full transaction)
+            fs_journal.group_ops = UINT32_MAX;
+            break;
+        default:
+            break;
+    }
+    if (DURABILITY != DURABILITY_PERIODIC) return;
+
+    flusher.disk = disk;
+    flusher.stop = false;
+    if (pthread_create(&flusher.thread, NULL, flusher_main, NULL) != 0) {
+        fprintf(stderr, "Error: could not start the flusher thread, committing every operation.\n");
+        fs_journal.group_ops = 1;
+        return;
+    }
+    flusher.running = true;
+}
+
+/**
+ * @brief Stops the flusher thread (if running) and waits for it to exit.
+ *
+ * @param disk A pointer to the FILE object representing the disk.
+ */
+void stop_flusher(FILE *disk) {
+    (void)disk;
+    if (!flusher.running) return;
+
+    pthread_mutex_lock(&flusher.lock);
+    flusher.stop = true;
+    pthread_cond_signal(&flusher.wakeup);
+    pthread_mutex_unlock(&flusher.lock);
+
+    pthread_join(flusher.thread, NULL);
+    flusher.running = false;
+}
+
+
+/**
+ * @brief Reads a file from the disk using its inode number.
+ *
+ * This function reads the file data from the disk by locating the inode
+ * using the provided inode number. It first reads the group descriptor
+ * and inode table, validates the inode number, checks if the inode is
+ * allocated and is a file, and then reads the file data into a newly
+ * allocated memory buffer.
+ *
+ * @param disk Pointer to the disk file.
+ * @param inode_number The inode number of the file to be read.
+ * @return Pointer to the file data structure (file_t) on success, or NULL on failure.
+ */
+file_t* read_file(FILE* disk, uint32_t inode_number) {
+    uint64_t metrics_start = metrics_now();
 
-    // 3. Validate inode number
-    if (inode_number > INODES_COUNT) {
+    // 1. Validate inode number
+    if (inode_number == 0 || inode_number >= INODES_COUNT) {
         fprintf(stderr, "Error: invalid inode number %u\n", inode_number);
         return NULL;
     }
 
-    inode *dir_inode = &itable.inodes[inode_number];
+    // 2. Readers of the same file run in parallel; writers are excluded
+    lock_inode_read(inode_number);
+    inode *file_inode = &fs_meta.itable.inodes[inode_number];
+    file_t *file_data = NULL;
 
     // Check if the inode is allocated
-    if (dir_inode->file_size == 0) {
+    if (file_inode->file_size == 0) {
         fprintf(stderr, "Error: inode #%u is not allocated or is empty.\n", inode_number);
+        goto cleanup;
+    }
+
+    // Check if the inode is a file
+    if (file_inode->file_type != 0) {
+        fprintf(stderr, "Error: inode #%u is not a file.\n", inode_number);
+        goto cleanup;
+    }
+
+    // 3. Allocate memory to reconstruct the file_t structure and return
+    size_t file_size = file_inode->file_size;
+    file_data = (file_t *)malloc(file_size);
+    if (!file_data) {
+        fprintf(stderr, "Error: could not allocate memory to read file.\n");
+        goto cleanup;
+    }
+
+    // Data that is still waiting for delayed allocation is served from memory
+    delalloc_buffer *pending = delalloc_lookup(&pending_writes, inode_number);
+    if (pending) {
+        memcpy(file_data, pending->data, file_size);
+        goto cleanup;
+    }
+
+    if (read_inode_data(disk, file_inode, (char*) file_data, file_size) != 0) {
+        fprintf(stderr, "Error: could not read file data.\n");
+        free(file_data);
+        file_data = NULL;
+    }
+
+cleanup:
+    unlock_inode(inode_number);
+    metrics_record(METRIC_READ_FILE, metrics_start);
+    return file_data;
+}
+
+
+/**
+ * Reads the directory block associated with a given inode number from the disk.
+ *
+ * @param disk A pointer to the FILE object representing the disk.
+ * @param inode_number The inode number of the directory to read.
+ * @return A pointer to the directory_block_t structure containing the directory data,
+ *         or NULL if an error occurs (e.g., invalid inode number, inode not allocated,
+ *         inode is not a directory, memory allocation failure, or read error).
+ *
+ * The function performs the following steps:
+ * 1. Validates the inode number.
+ * 2. Takes the directory inode lock for reading.
+ * 3. Checks if the inode is allocated and is a directory.
+ * 4. Allocates memory for the directory data and reads it from the disk.
+ */
+directory_block_t* read_directory(FILE* disk, uint32_t inode_number) {
+    uint64_t metrics_start = metrics_now();
+    // 1. Validate inode number
+    if (inode_number >= INODES_COUNT) {
+        fprintf(stderr, "Error: invalid inode number %u\n", inode_number);
         return NULL;
     }
 
+    // 2. Lock the directory inode against concurrent rewrites
+    lock_inode_read(inode_number);
+    inode *dir_inode = &fs_meta.itable.inodes[inode_number];
+    directory_block_t *dir_data = NULL;
+
+    // Check if the inode is allocated
+    if (dir_inode->file_size == 0) {
+        fprintf(stderr, "Error: inode #%u is not allocated or is empty.\n", inode_number);
+        goto cleanup;
+    }
+
     // Check if the inode is a directory
     if (dir_inode->file_type != 1) {
         fprintf(stderr, "Error: inode #%u is not a directory.\n", inode_number);
-        return NULL;
+        goto cleanup;
     }
 
-    // 4. Allocate memory to reconstruct the directory_block_t structure and return
+    // 3. Allocate memory to reconstruct the directory_block_t structure and return
     size_t dir_size = dir_inode->file_size;
-    directory_block_t *dir_data = (directory_block_t *)malloc(dir_size);
+    dir_data = (directory_block_t *)malloc(dir_size);
     if (!dir_data) {
         fprintf(stderr, "Error: could not allocate memory to read directory.\n");
-        return NULL;
+        goto cleanup;
     }
 
     if (read_inode_data(disk, dir_inode, (char*) dir_data, dir_size) != 0) {
         fprintf(stderr, "Error: could not read directory data.\n");
         free(dir_data);
-        return NULL;
+        dir_data = NULL;
     }
 
+cleanup:
+    unlock_inode(inode_number);
+    metrics_record(METRIC_READ_DIRECTORY, metrics_start);
     return dir_data;
 }
 
@@ -754,8 +2679,10 @@ directory_block_t* read_directory(FILE* disk, uint32_t inode_number) {
  * @brief Updates a directory's data blocks on disk.
  *
  * The `update_directory` function is responsible for updating the on-disk representation
- * of a directory by freeing its existing data blocks and allocating new blocks to store
- * the updated directory data. This is typically used after modifications to the directory
+ * of a directory: its blocks are rewritten in place through the journal, blocks past the
+ * new end are freed and missing ones allocated. (Blocks freed by an operation cannot be
+ * reused before it commits, so freeing all of them and allocating new ones would log the
+ * whole directory every time.) This is typically used after modifications to the directory
  * contents, such as adding or removing entries.
  *
  * @param disk           Pointer to the FILE object representing the disk image.
@@ -764,6 +2691,8 @@ directory_block_t* read_directory(FILE* disk, uint32_t inode_number) {
  * @param gd             Pointer to the group descriptor structure containing filesystem metadata.
  * @param inode_number   The inode number of the directory being updated.
  * @param dir_block      Pointer to the `directory_block_t` structure containing the updated directory entries.
+ *
+ * The caller holds the directory lock; the directory inode is locked for writing here.
  */
 void update_directory(FILE* disk,
                       inode_table *itable,
@@ -771,11 +2700,14 @@ void update_directory(FILE* disk,
                       uint8_t *block_bitmap,
                       group_descriptor *gd,
                       directory_block_t *dir_block) {
+    uint64_t metrics_start = metrics_now();
 
+    lock_inode_write(inode_number);
     inode *inode = &itable->inodes[inode_number];
-    free_all_data_blocks_of_inode(disk, inode, block_bitmap, gd);
+    mark_inode_dirty(inode);
 
     inode->file_size = sizeof(directory_block_t) + dir_block->entries_count * sizeof(dir_entry_t);
+    truncate_inode_blocks(disk, inode, inode->file_size, block_bitmap, gd);
     uint32_t needed_blocks = (inode->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
     
     for (size_t i = 0; i < needed_blocks; i++) {
@@ -783,25 +2715,150 @@ void update_directory(FILE* disk,
         if (allocated_block < 0) {
             fprintf(stderr, "Error: could not allocate data block for parent directory.\n");
             free(dir_block);
-            return;
+            break;
         }
 
         size_t offset = i * BLOCK_SIZE;
         size_t bytes_left = inode->file_size - offset;
         size_t to_write = (bytes_left > BLOCK_SIZE) ? BLOCK_SIZE : bytes_left;
 
-        fseek(disk, + allocated_block * BLOCK_SIZE, SEEK_SET);
-        fwrite((uint8_t *)dir_block + offset, to_write, 1, disk);
+        journal_write(&fs_journal, disk, allocated_block, 0, (uint8_t *)dir_block + offset, to_write);
+    }
+    unlock_inode(inode_number);
+    metrics_record(METRIC_UPDATE_DIRECTORY, metrics_start);
+}
+
+
+// [PARALLEL TREE REMOVAL]
+// Every subdirectory, and every file large enough to have indirect blocks, becomes a
+// task of a work-stealing pool (see work_pool.h). The workers run inside the journal
+// handle of the calling operation, so the whole tree goes away in one transaction;
+// each worker logs its bitmap and inode table changes once, when it runs out of work.
+# define DELETE_TASK_DIRECTORY 0
+# define DELETE_TASK_FILE      1
+# define DELETE_WORKERS_MAX    8
+
+typedef struct delete_context {
+    FILE *disk;
+    group_descriptor *gd;
+    inode_table *itable;
+    uint8_t *inode_bitmap;
+    uint8_t *block_bitmap;
+    uint32_t root;          // Directory the removal started at (locked by the caller)
+
+    // Directories removed by each worker; their dentries are dropped in one pass
+    uint32_t *removed[WORK_POOL_MAX_WORKERS];
+    uint32_t removed_count[WORK_POOL_MAX_WORKERS];
+    uint32_t removed_capacity[WORK_POOL_MAX_WORKERS];
+} delete_context;
+
+static int compare_inode_numbers(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Drop the dentries of the directories this worker removed. Must run before the
+// worker's write_metadata, which makes their inodes available again.
+static void delete_forget_removed(delete_context *ctx, uint32_t self) {
+    if (ctx->removed_count[self] == 0) return;
+    qsort(ctx->removed[self], ctx->removed_count[self], sizeof(uint32_t), compare_inode_numbers);
+    dcache_invalidate_dirs(&dentry_cache, ctx->removed[self], ctx->removed_count[self]);
+    ctx->removed_count[self] = 0;
+}
+
+static void delete_note_removed(delete_context *ctx, uint32_t dir_inode_number) {
+    uint32_t self = work_pool_self;
+    if (ctx->removed_count[self] == ctx->removed_capacity[self]) {
+        uint32_t capacity = ctx->removed_capacity[self] ? ctx->removed_capacity[self] * 2 : 64;
+        uint32_t *grown = (uint32_t *)realloc(ctx->removed[self], capacity * sizeof(uint32_t));
+        if (!grown) {
+            dcache_invalidate_dir(&dentry_cache, dir_inode_number);
+            return;
+        }
+        ctx->removed[self] = grown;
+        ctx->removed_capacity[self] = capacity;
+    }
+    ctx->removed[self][ctx->removed_count[self]++] = dir_inode_number;
+}
+
+// Free the data blocks and the inode of one file
+static void delete_tree_file(delete_context *ctx, uint32_t inode_number) {
+    lock_inode_write(inode_number);
+    delalloc_drop(&pending_writes, inode_number);
+    free_all_data_blocks_of_inode(ctx->disk, &ctx->itable->inodes[inode_number], ctx->block_bitmap, ctx->gd);
+    deallocate_inode(ctx->itable, ctx->inode_bitmap, ctx->gd, inode_number);
+    unlock_inode(inode_number);
+}
+
+// Remove one directory: queue its subdirectories and large files, free the rest
+static void delete_tree_task(work_pool *pool, work_task task, void *arg) {
+    delete_context *ctx = (delete_context *)arg;
+    if (task.kind == DELETE_TASK_FILE) {
+        delete_tree_file(ctx, task.arg0);
+        return;
+    }
+
+    uint32_t dir_inode_number = task.arg0;
+    uint32_t par_inode_number = task.arg1;
+    if (dir_inode_number != ctx->root) lock_directory(dir_inode_number);
+
+    directory_block_t *dir_block = read_directory(ctx->disk, dir_inode_number);
+    if (!dir_block) {
+        fprintf(stderr, "Error: could not read directory block.\n");
+        goto unlock;
+    }
+
+    for (size_t i = 0; i < dir_block->entries_count; i++) {
+        dir_entry_t *entry = &dir_block->entries[i];
+        if (entry->inode == dir_inode_number || entry->inode == par_inode_number) {
+            continue; // Skip '.' and '..' entries
+        }
+
+        if (entry->file_type == 1) {
+            work_task sub = { DELETE_TASK_DIRECTORY, entry->inode, dir_inode_number };
+            work_pool_push(pool, sub);
+        } else if (entry->file_type == 0) {
+            // Files with indirect blocks take long enough to be worth handing out
+            lock_inode_read(entry->inode);
+            bool large = ctx->itable->inodes[entry->inode].single_indirect != 0;
+            unlock_inode(entry->inode);
+
+            if (large) {
+                work_task file = { DELETE_TASK_FILE, entry->inode, dir_inode_number };
+                work_pool_push(pool, file);
+            } else {
+                delete_tree_file(ctx, entry->inode);
+            }
+        }
     }
+
+    // Free all blocks used by this directory (directory, single-indirect, double-indirect)
+    lock_inode_write(dir_inode_number);
+    free_all_data_blocks_of_inode(ctx->disk, &ctx->itable->inodes[dir_inode_number], ctx->block_bitmap, ctx->gd);
+    deallocate_inode(ctx->itable, ctx->inode_bitmap, ctx->gd, dir_inode_number);
+    unlock_inode(dir_inode_number);
+    delete_note_removed(ctx, dir_inode_number);
+
+    free(dir_block);
+unlock:
+    if (dir_inode_number != ctx->root) unlock_directory(dir_inode_number);
 }
 
+// Last step of every helper thread: log what it changed into the running transaction
+static void delete_tree_finish(void *arg) {
+    delete_context *ctx = (delete_context *)arg;
+    delete_forget_removed(ctx, work_pool_self);
+    write_metadata(ctx->disk, ctx->gd, ctx->block_bitmap, ctx->inode_bitmap, ctx->itable);
+}
 
 /**
  * @brief Recursively deletes a directory and its contents from the file system.
  *
  * This function deletes a directory and all its contents, including subdirectories
  * and files, from the file system. It deallocates the inodes and data blocks used
- * by the directory and its contents.
+ * by the directory and its contents. Subtrees are removed in parallel by up to
+ * DELETE_WORKERS_MAX threads; helper threads are only started once there is
+ * queued work for them.
  *
  * @param disk Pointer to the file representing the disk.
  * @param dir_inode_number The inode number of the directory to be deleted.
@@ -809,6 +2866,10 @@ void update_directory(FILE* disk,
  * @param itable Pointer to the inode table structure.
  * @param inode_bitmap Pointer to the inode bitmap.
  * @param block_bitmap Pointer to the block bitmap.
+ *
+ * The caller holds a journal handle and the directory lock of dir_inode_number;
+ * subdirectories are locked by the worker removing them. The caller's own changes
+ * are logged by its next write_metadata.
  */
 void delete_directory_recur(FILE *disk, 
                             uint32_t dir_inode_number,
@@ -818,721 +2879,2304 @@ void delete_directory_recur(FILE *disk,
                             uint8_t *inode_bitmap,
                             uint8_t *block_bitmap)
 {
-    directory_block_t *dir_block = read_directory(disk, dir_inode_number);
-    if (!dir_block) {
-        fprintf(stderr, "Error: could not read directory block.\n");
-        return;
+    delete_context ctx;
+    memset(&ctx, 0, sizeof(delete_context));
+    ctx.disk = disk;
+    ctx.gd = gd;
+    ctx.itable = itable;
+    ctx.inode_bitmap = inode_bitmap;
+    ctx.block_bitmap = block_bitmap;
+    ctx.root = dir_inode_number;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t workers = (cpus < 1) ? 1 : (cpus > DELETE_WORKERS_MAX ? DELETE_WORKERS_MAX : (uint32_t)cpus);
+
+    work_task first = { DELETE_TASK_DIRECTORY, dir_inode_number, par_inode_number };
+    work_pool_run(first, delete_tree_task, delete_tree_finish, &ctx, workers);
+
+    // The calling thread was worker 0
+    delete_forget_removed(&ctx, 0);
+
+    for (uint32_t i = 0; i < WORK_POOL_MAX_WORKERS; i++) {
+        free(ctx.removed[i]);
     }
+}
 
-    for (size_t i = 0; i < dir_block->entries_count; i++) {
-        dir_entry_t *entry = &dir_block->entries[i];
-        if (entry->inode == dir_inode_number || entry->inode == par_inode_number) {
-            continue; // Skip '.' and '..' entries
+
+// [ORPHAN RECLAIMER]
+// State of the background thread that frees the blocks of unlinked inodes
+typedef struct reclaimer_state {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    FILE *disk;
+    bool running;
+    bool stop;
+    bool kicked;    // New orphans were queued since the thread last looked
+} reclaimer_state;
+
+reclaimer_state reclaimer = { .lock = PTHREAD_MUTEX_INITIALIZER, .wakeup = PTHREAD_COND_INITIALIZER };
+
+// Put an unlinked inode on the orphan list (inside the caller's journal handle).
+// Returns 0, or -1 if the list is full and the inode must be freed right away.
+int add_orphan(uint32_t inode_number, uint32_t parent_inode_number) {
+    pthread_mutex_lock(&alloc_lock);
+    int result = orphan_add(&fs_meta.orphans, inode_number, parent_inode_number);
+    pthread_mutex_unlock(&alloc_lock);
+    return result;
+}
+
+// Tell the reclaimer thread that there is work
+void wake_reclaimer() {
+    pthread_mutex_lock(&reclaimer.lock);
+    reclaimer.kicked = true;
+    pthread_cond_signal(&reclaimer.wakeup);
+    pthread_mutex_unlock(&reclaimer.lock);
+}
+
+/**
+ * @brief Frees the blocks and inodes of up to 'max' orphans in one transaction.
+ *
+ * A file orphan loses its data blocks and its inode; a directory orphan is
+ * removed with everything below it by delete_directory_recur. Nobody else can
+ * reach an orphan any more, so only the locks the removal code expects are taken.
+ *
+ * @param disk A pointer to the FILE object representing the disk.
+ * @param max Maximum number of orphans to reclaim.
+ * @return The number of orphans taken off the list.
+ */
+uint32_t reclaim_orphans(FILE *disk, uint32_t max) {
+    journal_start(&fs_journal);
+    group_descriptor *gd = &fs_meta.gd;
+    uint8_t *block_bitmap = fs_meta.block_bitmap;
+    uint8_t *inode_bitmap = fs_meta.inode_bitmap;
+    inode_table *itable = &fs_meta.itable;
+
+    uint32_t reclaimed = 0;
+    while (reclaimed < max) {
+        orphan_entry orphan;
+        pthread_mutex_lock(&alloc_lock);
+        int taken = orphan_take(&fs_meta.orphans, &orphan);
+        pthread_mutex_unlock(&alloc_lock);
+        if (taken != 0) break;
+        reclaimed++;
+
+        if (orphan.inode == 0 || orphan.inode >= INODES_COUNT || !inode_is_allocated(orphan.inode)) {
+            fprintf(stderr, "Error: orphan list holds invalid inode %u, dropping it.\n", orphan.inode);
+            continue;
         }
 
-        // If the entry is a directory, recursively delete it
-        if (entry->file_type == 1) {
-            delete_directory_recur(disk, entry->inode, dir_inode_number, gd, itable, inode_bitmap, block_bitmap);
+        if (itable->inodes[orphan.inode].file_type == 1) {
+            lock_directory(orphan.inode);
+            delete_directory_recur(disk, orphan.inode, orphan.parent, gd, itable, inode_bitmap, block_bitmap);
+            unlock_directory(orphan.inode);
+        } else {
+            lock_inode_write(orphan.inode);
+            free_all_data_blocks_of_inode(disk, &itable->inodes[orphan.inode], block_bitmap, gd);
+            deallocate_inode(itable, inode_bitmap, gd, orphan.inode);
+            unlock_inode(orphan.inode);
         }
-        // If the entry is a file, deallocate its inode and data blocks
-        else if (entry->file_type == 0) {
-            inode *file_inode = &itable->inodes[entry->inode];
-            free_all_data_blocks_of_inode(disk, file_inode, block_bitmap, gd);
-            deallocate_inode(itable, inode_bitmap, gd, entry->inode);
+    }
+
+    if (reclaimed > 0) write_metadata(disk, gd, block_bitmap, inode_bitmap, itable);
+    journal_stop(&fs_journal, disk);
+    return reclaimed;
+}
+
+// Body of the reclaimer thread: drain the orphan list in batches, then sleep until kicked
+static void *reclaimer_main(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&reclaimer.lock);
+    while (!reclaimer.stop) {
+        reclaimer.kicked = false;
+        pthread_mutex_unlock(&reclaimer.lock);
+        while (reclaim_orphans(reclaimer.disk, ORPHAN_BATCH) > 0) {
+            pthread_mutex_lock(&reclaimer.lock);
+            bool stop = reclaimer.stop;
+            pthread_mutex_unlock(&reclaimer.lock);
+            if (stop) break;
+        }
+        pthread_mutex_lock(&reclaimer.lock);
+
+        while (!reclaimer.stop && !reclaimer.kicked) {
+            pthread_cond_wait(&reclaimer.wakeup, &reclaimer.lock);
+        }
+    }
+    pthread_mutex_unlock(&reclaimer.lock);
+    return NULL;
+}
+
+/**
+ * @brief Deals with orphans found at mount and starts the reclaimer thread
+ * when asynchronous unlink is enabled.
+ *
+ * Without asynchronous unlink, orphans left behind by a crash are reclaimed
+ * right here; otherwise the thread picks them up first.
+ *
+ * @param disk A pointer to the FILE object representing the disk.
+ */
+void start_reclaimer(FILE *disk) {
+    if (!ASYNC_UNLINK) {
+        uint32_t recovered = 0, batch;
+        while ((batch = reclaim_orphans(disk, ORPHAN_BATCH)) > 0) {
+            recovered += batch;
+        }
+        if (recovered > 0) printf("Orphan recovery: reclaimed %u inodes.\n", recovered);
+        return;
+    }
+
+    reclaimer.disk = disk;
+    reclaimer.stop = false;
+    reclaimer.kicked = true;
+    if (pthread_create(&reclaimer.thread, NULL, reclaimer_main, NULL) != 0) {
+        fprintf(stderr, "Error: could not start the reclaimer thread, unlinking synchronously.\n");
+        ASYNC_UNLINK = false;
+        start_reclaimer(disk);
+        return;
+    }
+    reclaimer.running = true;
+}
+
+/**
+ * @brief Stops the reclaimer thread (if running) and reclaims what is left,
+ * so a clean unmount leaves no orphans behind.
+ *
+ * @param disk A pointer to the FILE object representing the disk.
+ */
+void stop_reclaimer(FILE *disk) {
+    if (reclaimer.running) {
+        pthread_mutex_lock(&reclaimer.lock);
+        reclaimer.stop = true;
+        pthread_cond_signal(&reclaimer.wakeup);
+        pthread_mutex_unlock(&reclaimer.lock);
+
+        pthread_join(reclaimer.thread, NULL);
+        reclaimer.running = false;
+    }
+    while (reclaim_orphans(disk, ORPHAN_BATCH) > 0);
+}
+
+
+/**
+ * remove_directory - Deletes a directory and its contents from the filesystem.
+ * 
+ * @disk: The file pointer to the disk image.
+ * @dir_inode_number: The inode number of the directory to be deleted.
+ * @parent_inode_number: The inode number of the parent directory.
+ * @snapshot: True only for delete_snapshot, which removes a read-only snapshot from
+ *            the read-only snapshot directory; ordinary deletes refuse both.
+ * 
+ * Returns 0 on success, -1 on error. delete_directory is the ordinary entry point.
+ *
+ * This function performs the following steps:
+ * 1. Locks the parent and the directory, and uses the in-memory group descriptor,
+ *    block bitmap, inode bitmap, and inode table.
+ * 2. Validates the directory inode number to ensure it is within a valid range
+ *    and is allocated.
+ * 3. Recursively deletes the directory and its contents, or with asynchronous
+ *    unlink puts the directory on the orphan list for the reclaimer thread.
+ * 4. Updates the parent directory block to remove the entry for the deleted directory.
+ * 5. Writes the updated structures back to the disk, including the group descriptor,
+ *    block bitmap, inode bitmap, and inode table.
+ * 
+ * If any errors occur during the process, appropriate error messages are printed
+ * to stderr, and the function performs cleanup before returning.
+ * 
+ * Note: This function assumes that the directory inode number and parent inode number
+ * are valid and that the disk image is properly formatted.
+ */
+static int remove_directory(FILE *disk, uint32_t dir_inode_number, uint32_t parent_inode_number, bool snapshot) {
+    uint64_t metrics_start = metrics_now();
+
+    // 1. Lock the parent, then the directory, and use the in-memory metadata
+    journal_start(&fs_journal);
+    group_descriptor *gd = &fs_meta.gd;
+    uint8_t *block_bitmap = fs_meta.block_bitmap;
+    uint8_t *inode_bitmap = fs_meta.inode_bitmap;
+    inode_table *itable = &fs_meta.itable;
+    bool orphaned = false;
+    int status = -1;
+    lock_directory(parent_inode_number);
+
+    // 2. Validate dir_inode_number: the path was resolved before the parent was locked,
+    //    so both may have been removed (and their inodes reused) in the meantime
+    directory_block_t *parent_dir_block = NULL;
+    if (dir_inode_number == 0 || dir_inode_number >= INODES_COUNT || dir_inode_number == parent_inode_number) {
+        fprintf(stderr, "Error: invalid inode number %u\n", dir_inode_number);
+        goto unlock_parent;
+    }
+    if (snapshot ? !directory_still_linked(parent_inode_number) : !directory_still_usable(parent_inode_number)) {
+        goto unlock_parent;
+    }
+
+    parent_dir_block = read_directory(disk, parent_inode_number);
+    if (!parent_dir_block) {
+        fprintf(stderr, "Error: could not read parent directory block.\n");
+        goto unlock_parent;
+    }
+    size_t entry_index = parent_dir_block->entries_count;
+    for (size_t i = 2; i < parent_dir_block->entries_count; i++) {
+        if (parent_dir_block->entries[i].inode == dir_inode_number) {
+            entry_index = i;
+            break;
         }
     }
+    if (entry_index == parent_dir_block->entries_count) {
+        fprintf(stderr, "Error: inode #%u is no longer an entry of directory #%u.\n",
+                dir_inode_number, parent_inode_number);
+        goto unlock_parent;
+    }
+    lock_directory(dir_inode_number);
+
+    inode *dir_inode = &itable->inodes[dir_inode_number];
+
+    // Check if this inode is actually allocated
+    if (!inode_is_allocated(dir_inode_number)) {
+        fprintf(stderr, "Error: inode #%u is not allocated.\n", dir_inode_number);
+        goto cleanup;
+    }
+
+    // Check if this inode is a directory
+    if (dir_inode->file_type != 1) {
+        fprintf(stderr, "Error: Inode #%u is not a directory (file_type=%u).\n",
+                dir_inode_number, dir_inode->file_type);
+        goto cleanup;
+    }
+
+    // A snapshot is a read-only directory in the read-only snapshot directory, and only
+    // delete_snapshot removes it; nothing else that is read-only can be removed
+    if (snapshot && (!inode_is_readonly(dir_inode) || !inode_is_readonly(&itable->inodes[parent_inode_number]))) {
+        fprintf(stderr, "Error: inode #%u is not a snapshot.\n", dir_inode_number);
+        goto cleanup;
+    }
+    if (!snapshot && reject_readonly(dir_inode_number)) goto cleanup;
+
+    // 3. Recursively delete the directory and its contents (with asynchronous unlink
+    //    the reclaimer does that once the name is gone)
+    orphaned = ASYNC_UNLINK && add_orphan(dir_inode_number, parent_inode_number) == 0;
+    if (!orphaned) {
+        delete_directory_recur(disk, dir_inode_number, parent_inode_number, gd, itable, inode_bitmap, block_bitmap);
+    }
+
+    // 4. Update the parent directory block (read under the parent lock) to remove the entry,
+    //    and drop the name from the dentry cache
+    dcache_remove(&dentry_cache, parent_inode_number, parent_dir_block->entries[entry_index].name);
+    directory_block_t *new_parent_dir_block = remove_entry_from_directory_block(parent_dir_block, dir_inode_number);
+    update_directory(disk, itable, parent_inode_number, block_bitmap, gd, new_parent_dir_block);
+    free(new_parent_dir_block);
+
+    // 5. Write everything back
+    write_metadata(disk, gd, block_bitmap, inode_bitmap, itable);
+
+    if (VERBOSE) printf("Directory inode #%u deleted successfully.\n", dir_inode_number);
+    status = 0;
+
+cleanup:
+    unlock_directory(dir_inode_number);
+unlock_parent:
+    free(parent_dir_block);
+    unlock_directory(parent_inode_number);
+    journal_stop(&fs_journal, disk);
+    metrics_record(METRIC_DELETE_DIRECTORY, metrics_start);
+    if (orphaned) wake_reclaimer();
+    return status;
+}
+
+void delete_directory(FILE *disk, uint32_t dir_inode_number, uint32_t parent_inode_number) {
+    remove_directory(disk, dir_inode_number, parent_inode_number, false);
+}
+
+
+/**
+ * @brief Creates a new directory in the file system.
+ *
+ * This function creates a new directory with the specified name, permissions, 
+ * and parent inode number in the file system represented by the given disk file.
+ *
+ * @param disk The file pointer to the disk image.
+ * @param dir_name The name of the new directory to be created.
+ * @param permissions The permissions for the new directory.
+ * @param parent_inode_number The inode number of the parent directory.
+ *
+ * The function performs the following steps:
+ * 1. Locks the parent directory and uses the in-memory group descriptor, 
+ *    block bitmap, inode bitmap, and inode table.
+ * 2. Allocates necessary structures for the new directory in memory, including 
+ *    an inode and a minimal directory block.
+ * 3. Allocates the required number of blocks for the directory and writes the 
+ *    directory block to the disk.
+ * 4. Updates the parent directory block to include the new directory entry.
+ * 5. Overwrites the updated metadata structures, including the group descriptor, 
+ *    block bitmap, inode bitmap, and inode table.
+ *
+ * If any error occurs during the process, the function rolls back the changes 
+ * and frees allocated memory.
+ *
+ * @note The function assumes that the disk image is properly formatted and 
+ *       that the necessary structures are correctly initialized.
+ */
+void create_directory(FILE *disk, 
+                      const char *dir_name, 
+                      uint32_t permissions,
+                      uint32_t parent_inode_number) {
+    uint64_t metrics_start = metrics_now();
+
+    // 1. Lock the parent directory and use the in-memory metadata
+    journal_start(&fs_journal);
+    group_descriptor *gd = &fs_meta.gd;
+    uint8_t *block_bitmap = fs_meta.block_bitmap;
+    uint8_t *inode_bitmap = fs_meta.inode_bitmap;
+    inode_table *itable = &fs_meta.itable;
+    lock_directory(parent_inode_number);
+    uint32_t locked_inode = INODES_COUNT; // New directory, locked until its entries are in place
+    directory_block_t *parent_dir_block = NULL;
+    if (!directory_still_usable(parent_inode_number)) goto cleanup;
+    // Only the snapshot code makes the (read-only) snapshot directory
+    if (!(permissions & INODE_READONLY) && reject_reserved_name(parent_inode_number, dir_name)) goto cleanup;
+
+    // The entries of the parent, read under its lock: the name must still be free
+    parent_dir_block = read_directory(disk, parent_inode_number);
+    if (!parent_dir_block) {
+        fprintf(stderr, "Error: could not read parent directory block.\n");
+        goto cleanup;
+    }
+    if (reject_taken_name(parent_dir_block, dir_name)) goto cleanup;
+
+    // 2. Allocate necessary structures for the new directory in memory
+    // 2a. Inode for the new directory
+    inode *dir_inode = allocate_inode(itable, inode_bitmap, gd, 1, permissions);
+    if (!dir_inode) {
+        fprintf(stderr, "Error: cannot allocate inode for directory\n");
+        goto cleanup;
+    }
+    locked_inode = dir_inode->inode_number;
+    lock_inode_write(locked_inode);
+    dir_inode->file_type = 1; // Set the file type to directory
+    dir_inode->permissions = permissions;
+
+    // 2b. Create a minimal directory block in memory
+    directory_block_t *dirblk = create_minimal_directory_block(dir_inode->inode_number, parent_inode_number);
+    if (!dirblk) {
+        fprintf(stderr, "Error: could not create minimal directory block in memory.\n");
+        // Roll back the inode
+        deallocate_inode(itable, inode_bitmap, gd, dir_inode->inode_number);
+        goto cleanup;
+    }
+
+    // 2c. Calculate the number of blocks needed for the directory
+    size_t dirblk_size = sizeof(directory_block_t) + dirblk->entries_count * sizeof(dir_entry_t);
+    size_t needed_blocks = (dirblk_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    dir_inode->file_size = (uint32_t)dirblk_size;
+
+    // 3. Allocate each needed block
+    uint8_t *src_ptr = (uint8_t *)dirblk;
+    for (size_t i = 0; i < needed_blocks; i++) {
+        // Use the extended allocate_data_block_for_inode
+        int allocated_block = allocate_data_block_for_inode(disk, dir_inode, i, block_bitmap, gd);
+        if (allocated_block < 0) {
+            fprintf(stderr, "Error: could not allocate data block for directory.\n");
+            // Roll back the inode
+            deallocate_inode(itable, inode_bitmap, gd, dir_inode->inode_number);
+            // Roll back the directory block
+            free(dirblk);
+            goto cleanup;
+        }
+
+        // Write the slice of the dirblk that fits in this block
+        size_t offset = i * BLOCK_SIZE;
+        size_t bytes_left = dirblk_size - offset;
+        size_t to_write = (bytes_left > BLOCK_SIZE) ? BLOCK_SIZE : bytes_left;
+
+        journal_write(&fs_journal, disk, allocated_block, 0, src_ptr + offset, to_write);
+
+        dir_inode->file_size += to_write;
+    }
+
+    free(dirblk);
+
+    // 4. Rewrite the parent directory block (read in step 1) to include the new entry
+    directory_block_t *new_parent_dir_block = add_entry_to_directory_block(parent_dir_block, dir_inode->inode_number, dir_name, 1);
+    
+    // Write the updated parent directory block back to disk
+    update_directory(disk, itable, parent_inode_number, block_bitmap, gd, new_parent_dir_block);
+    dcache_insert(&dentry_cache, parent_inode_number, dir_name, dir_inode->inode_number, 1);
+
+    free(new_parent_dir_block);
+
+    if (VERBOSE) printf("Directory '%s' created (inode #%u). Size=%u bytes.\n", dir_name, dir_inode->inode_number, dir_inode->file_size);
+
+cleanup:
+    free(parent_dir_block);
+    unlock_inode(locked_inode);
+    // 5. Overwrite updated metadata structures (with the new inode unlocked)
+    write_metadata(disk, gd, block_bitmap, inode_bitmap, itable);
+    unlock_directory(parent_inode_number);
+    journal_stop(&fs_journal, disk);
+    metrics_record(METRIC_CREATE_DIRECTORY, metrics_start);
+}
+
+
+/**
+ * @brief Creates a file in the specified parent directory inode.
+ *
+ * This function creates a file with the given name, extension, permissions, and data
+ * in the specified parent directory inode. It performs the following steps:
+ * 1. Locks the parent directory and uses the in-memory metadata (group descriptor, bitmaps, inode table).
+ * 2. Creates the file metadata structure and allocates an inode for the file.
+ * 3. Adds the file entry to the parent directory's directory block.
+ * 4. Allocates the necessary blocks for the file and writes the file metadata and data to the disk.
+ * 5. Updates the metadata structures on the disk.
+ *
+ * @param disk The file pointer to the disk image.
+ * @param file_name The name of the file to be created.
+ * @param extension The extension of the file to be created.
+ * @param permissions The permissions for the new file.
+ * @param data The data to be written to the new file.
+ * @param parent_inode_number The inode number of the parent directory where the file will be created.
+ */
+void create_file(FILE *disk, 
+                 const char *file_name, 
+                 const char *extension, 
+                 uint32_t permissions,
+                 const char *data,
+                 uint32_t parent_inode_number) {
+    uint64_t metrics_start = metrics_now();
+
+    // 1. Lock the parent directory and use the in-memory metadata
+    journal_start(&fs_journal);
+    group_descriptor *gd = &fs_meta.gd;
+    uint8_t *block_bitmap = fs_meta.block_bitmap;
+    uint8_t *inode_bitmap = fs_meta.inode_bitmap;
+    inode_table *itable = &fs_meta.itable;
+    lock_directory(parent_inode_number);
+    uint32_t locked_inode = INODES_COUNT; // New file, locked until its data is in place
+    directory_block_t *parent_dir_block = NULL;
+    if (!directory_still_usable(parent_inode_number)) goto cleanup;
+    char full_name[256];
+    snprintf(full_name, sizeof(full_name), "%s.%s", file_name, extension);
+    if (reject_reserved_name(parent_inode_number, full_name)) goto cleanup;
+
+    // The entries of the parent, read under its lock: the name must still be free
+    parent_dir_block = read_directory(disk, parent_inode_number);
+    if (!parent_dir_block) {
+        fprintf(stderr, "Error: could not read parent directory block.\n");
+        goto cleanup;
+    }
+    if (reject_taken_name(parent_dir_block, full_name)) goto cleanup;
+
+    // 2. Create the file_t structure
+    // 2a. Initialize the file_t structure
+    size_t file_size = sizeof(file_t) + strlen(data);
+    file_t *file_data = (file_t *)calloc(1, file_size); // Zeroed: the content is terminated
+    if (!file_data) {
+        fprintf(stderr, "Error: could not allocate memory for file metadata\n");
+        goto cleanup;
+    }
+
+    // Initialize the file_t structure
+    strncpy(file_data->name, file_name, sizeof(file_data->name) - 1);
+    strncpy(file_data->extension, extension, sizeof(file_data->extension) - 1);
+    file_data->size = file_size;
+    memcpy(file_data->data, data, strlen(data));
+
+    // Allocate a new file inode
+    inode *file_inode = allocate_inode(itable, inode_bitmap, gd, 0, permissions);
+    if (!file_inode) {
+        fprintf(stderr, "Error: cannot allocate inode for file\n");
+        free(file_data);
+        goto cleanup;
+    }
+    file_data->inode = file_inode->inode_number;
+    locked_inode = file_inode->inode_number;
+    lock_inode_write(locked_inode);
+
+    // 2b. Set the inode
+    file_inode->file_size = (uint32_t)file_size;
+    file_inode->file_type = 0; // Regular file
+    file_inode->permissions = permissions | (COMPRESS ? INODE_COMPRESSED : 0);
+
+    // 2c. Calculate the number of blocks needed for the file
+    size_t needed_blocks = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    // 3. Add file to the parent directory's directory block (read in step 1)
+    // 3a. Add the new file entry to the parent directory block
+    directory_block_t *new_parent_dir_block = add_entry_to_directory_block(parent_dir_block, file_inode->inode_number, full_name, 0);
+    
+    // 3b. Write the updated parent directory block back to disk
+    update_directory(disk, itable, parent_inode_number, block_bitmap, gd, new_parent_dir_block);
+    dcache_insert(&dentry_cache, parent_inode_number, full_name, file_inode->inode_number, 0);
+
+    // 3c. Clean up the new parent directory block
+    free(new_parent_dir_block);
+
+    // 4. Allocate each needed block and write the file metadata/data
+    //    (with delayed allocation the data stays in memory until the next flush)
+    if (DELALLOC) {
+        if (delalloc_store(&pending_writes, file_inode->inode_number, file_data, file_size) != 0) {
+            fprintf(stderr, "Error: could not buffer file data.\n");
+            deallocate_inode(itable, inode_bitmap, gd, file_inode->inode_number);
+            free(file_data);
+            goto cleanup;
+        }
+        needed_blocks = 0;
+    } else if (inode_is_compressed(file_inode)) {
+        if (write_compressed_inode_data(disk, file_inode, file_data, file_size, block_bitmap, gd) != 0) {
+            fprintf(stderr, "Error: could not write compressed file data.\n");
+            deallocate_inode(itable, inode_bitmap, gd, file_inode->inode_number);
+            free(file_data);
+            goto cleanup;
+        }
+        needed_blocks = 0;
+    }
+
+    uint8_t *src_ptr = (uint8_t *)file_data;
+    size_t bytes_written = 0;
+    TRACE_BEGIN(trace_start);
+    for (size_t i = 0; i < needed_blocks; i++) {
+        // Write the slice of the file_metadata that fits in this block (zero-padded)
+        size_t offset = i * BLOCK_SIZE;
+        size_t bytes_left = file_size - offset;
+        size_t to_write = (bytes_left > BLOCK_SIZE) ? BLOCK_SIZE : bytes_left;
+        uint8_t block_data[BLOCK_SIZE] = {0};
+        memcpy(block_data, src_ptr + offset, to_write);
+
+        if (write_data_block(disk, file_inode, i, block_data, block_bitmap, gd) < 0) {
+            fprintf(stderr, "Error: could not allocate data block for file.\n");
+            // Roll back the inode
+            free_all_data_blocks_of_inode(disk, file_inode, block_bitmap, gd);
+            deallocate_inode(itable, inode_bitmap, gd, file_inode->inode_number);
+            free(file_data);
+            goto cleanup;
+        }
+
+        bytes_written += to_write;
+    }
+    TRACE_END(trace_start, "write_data");
+
+    free(file_data);
+
+    if (VERBOSE) printf("File '%s.%s' created (inode #%u). Size=%lu bytes.\n", file_name, extension, file_inode->inode_number, file_size);
+
+cleanup:
+    free(parent_dir_block);
+    unlock_inode(locked_inode);
+    // 5. Overwrite updated metadata structures (with the new inode unlocked)
+    write_metadata(disk, gd, block_bitmap, inode_bitmap, itable);
+    unlock_directory(parent_inode_number);
+    journal_stop(&fs_journal, disk);
+    metrics_record(METRIC_CREATE_FILE, metrics_start);
+
+    if (DELALLOC && delalloc_dirty_bytes(&pending_writes) > DELALLOC_MAX_DIRTY) {
+        flush_delayed_allocations(disk);
+    }
+}
+
+
+/**
+ * @brief Creates many directories in one parent directory at once.
+ *
+ * Unlike calling create_directory 'count' times, the parent directory is read
+ * once, all the new entries are appended to it together and it is rewritten a
+ * single time, and the metadata is logged once, all in one journal handle. The
+ * blocks of the new directories are written in place, like file data: nothing
+ * refers to them until the transaction with the parent entries commits. If a
+ * name is taken in the parent (or given twice) nothing is created.
+ *
+ * @param disk The file pointer to the disk image.
+ * @param dir_names The names of the new directories.
+ * @param count The number of directories to create.
+ * @param permissions The permissions for the new directories.
+ * @param parent_inode_number The inode number of the parent directory.
+ * @return The number of directories created (less than 'count' if the inodes
+ *         or blocks ran out, 0 if a name is taken).
+ */
+uint32_t create_directories(FILE *disk,
+                            char **dir_names,
+                            uint32_t count,
+                            uint32_t permissions,
+                            uint32_t parent_inode_number) {
+    uint64_t metrics_start = metrics_now();
+    uint32_t created = 0;
+
+    // 1. Lock the parent directory and use the in-memory metadata
+    journal_start(&fs_journal);
+    group_descriptor *gd = &fs_meta.gd;
+    uint8_t *block_bitmap = fs_meta.block_bitmap;
+    uint8_t *inode_bitmap = fs_meta.inode_bitmap;
+    inode_table *itable = &fs_meta.itable;
+    lock_directory(parent_inode_number);
+
+    uint32_t *inode_numbers = NULL;
+    directory_block_t *parent_dir_block = NULL;
+    if (!directory_still_usable(parent_inode_number)) goto cleanup;
+    inode_numbers = (uint32_t *)malloc((count ? count : 1) * sizeof(uint32_t));
+    parent_dir_block = read_directory(disk, parent_inode_number);
+    if (!inode_numbers || !parent_dir_block) {
+        fprintf(stderr, "Error: could not read parent directory block.\n");
+        goto cleanup;
+    }
+    if (reject_taken_names(parent_dir_block, parent_inode_number, dir_names, count)) goto cleanup;
+
+    // 2. Allocate and write every new directory
+    for (; created < count; created++) {
+        inode *dir_inode = allocate_inode(itable, inode_bitmap, gd, 1, permissions);
+        if (!dir_inode) {
+            fprintf(stderr, "Error: cannot allocate inode for directory\n");
+            break;
+        }
+        dir_inode->file_type = 1;
+        dir_inode->permissions = permissions;
+
+        directory_block_t *dirblk = create_minimal_directory_block(dir_inode->inode_number, parent_inode_number);
+        if (!dirblk) {
+            fprintf(stderr, "Error: could not create minimal directory block in memory.\n");
+            deallocate_inode(itable, inode_bitmap, gd, dir_inode->inode_number);
+            break;
+        }
+        size_t dirblk_size = sizeof(directory_block_t) + dirblk->entries_count * sizeof(dir_entry_t);
+        dir_inode->file_size = (uint32_t)dirblk_size;
+
+        bool allocated = true;
+        for (size_t offset = 0; offset < dirblk_size; offset += BLOCK_SIZE) {
+            int allocated_block = allocate_data_block_for_inode(disk, dir_inode, offset / BLOCK_SIZE, block_bitmap, gd);
+            if (allocated_block < 0) {
+                fprintf(stderr, "Error: could not allocate data block for directory.\n");
+                allocated = false;
+                break;
+            }
+            size_t to_write = (dirblk_size - offset > BLOCK_SIZE) ? BLOCK_SIZE : dirblk_size - offset;
+            write_new_directory_block(disk, (uint32_t)allocated_block, (uint8_t *)dirblk + offset, to_write);
+        }
+        free(dirblk);
+        if (!allocated) {
+            free_all_data_blocks_of_inode(disk, dir_inode, block_bitmap, gd);
+            deallocate_inode(itable, inode_bitmap, gd, dir_inode->inode_number);
+            break;
+        }
+
+        inode_numbers[created] = dir_inode->inode_number;
+        if (VERBOSE) printf("Directory '%s' created (inode #%u). Size=%u bytes.\n", dir_names[created], dir_inode->inode_number, dir_inode->file_size);
+    }
+
+    // 3. Append all the entries to the parent and rewrite it once
+    if (created > 0) {
+        directory_block_t *new_parent_dir_block = add_entries_to_directory_block(parent_dir_block, created, inode_numbers, dir_names, 1);
+        if (!new_parent_dir_block) {
+            fprintf(stderr, "Error: could not allocate memory for the parent directory.\n");
+            for (uint32_t i = 0; i < created; i++) {
+                free_all_data_blocks_of_inode(disk, &itable->inodes[inode_numbers[i]], block_bitmap, gd);
+                deallocate_inode(itable, inode_bitmap, gd, inode_numbers[i]);
+            }
+            created = 0;
+        } else {
+            update_directory(disk, itable, parent_inode_number, block_bitmap, gd, new_parent_dir_block);
+            for (uint32_t i = 0; i < created; i++) {
+                dcache_insert(&dentry_cache, parent_inode_number, dir_names[i], inode_numbers[i], 1);
+            }
+            free(new_parent_dir_block);
+        }
+    }
+
+    // 4. Log the metadata once for all of them
+    write_metadata(disk, gd, block_bitmap, inode_bitmap, itable);
+
+cleanup:
+    free(parent_dir_block);
+    free(inode_numbers);
+    unlock_directory(parent_inode_number);
+    journal_stop(&fs_journal, disk);
+    metrics_record(METRIC_CREATE_MANY, metrics_start);
+    return created;
+}
+
+// Split "name.ext" at its last dot into name and extension (empty without a dot)
+void split_file_name(const char *filename, char *name, char *extension) {
+    const char *dot = strrchr(filename, '.');
+    if (dot) {
+        strncpy(name, filename, dot - filename);
+        name[dot - filename] = '\0';
+        strncpy(extension, dot + 1, 255);
+        extension[255] = '\0';
+    } else {
+        strncpy(name, filename, 255);
+        name[255] = '\0';
+        extension[0] = '\0';
+    }
+}
+
+/**
+ * @brief Creates many files with the same content in one parent directory at once.
+ *
+ * Like create_directories: the parent directory is rewritten once and the
+ * metadata logged once, in one journal handle, and a name that is taken
+ * refuses the whole batch.
+ *
+ * @param disk The file pointer to the disk image.
+ * @param file_names The names of the new files ("name.ext").
+ * @param count The number of files to create.
+ * @param permissions The permissions for the new files.
+ * @param data The content of every new file.
+ * @param parent_inode_number The inode number of the parent directory.
+ * @return The number of files created (less than 'count' if the inodes or
+ *         blocks ran out, 0 if a name is taken).
+ */
+uint32_t create_files(FILE *disk,
+                      char **file_names,
+                      uint32_t count,
+                      uint32_t permissions,
+                      const char *data,
+                      uint32_t parent_inode_number) {
+    uint64_t metrics_start = metrics_now();
+    uint32_t created = 0;
+
+    // 1. Lock the parent directory and use the in-memory metadata
+    journal_start(&fs_journal);
+    group_descriptor *gd = &fs_meta.gd;
+    uint8_t *block_bitmap = fs_meta.block_bitmap;
+    uint8_t *inode_bitmap = fs_meta.inode_bitmap;
+    inode_table *itable = &fs_meta.itable;
+    lock_directory(parent_inode_number);
+
+    size_t data_size = strlen(data);
+    size_t file_size = sizeof(file_t) + data_size;
+    size_t needed_blocks = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t *inode_numbers = NULL;
+    file_t *file_data = NULL;
+    directory_block_t *parent_dir_block = NULL;
+    if (!directory_still_usable(parent_inode_number)) goto cleanup;
+    inode_numbers = (uint32_t *)malloc((count ? count : 1) * sizeof(uint32_t));
+    file_data = (file_t *)calloc(1, file_size);
+    parent_dir_block = read_directory(disk, parent_inode_number);
+    if (!inode_numbers || !file_data || !parent_dir_block) {
+        fprintf(stderr, "Error: could not allocate memory for file metadata\n");
+        goto cleanup;
+    }
+    if (reject_taken_names(parent_dir_block, parent_inode_number, file_names, count)) goto cleanup;
+    file_data->size = file_size;
+    memcpy(file_data->data, data, data_size);
+
+    // 2. Allocate and write every new file
+    for (; created < count; created++) {
+        char name[256], extension[256];
+        split_file_name(file_names[created], name, extension);
+        memset(file_data->name, 0, sizeof(file_data->name));
+        memset(file_data->extension, 0, sizeof(file_data->extension));
+        strncpy(file_data->name, name, sizeof(file_data->name) - 1);
+        strncpy(file_data->extension, extension, sizeof(file_data->extension) - 1);
+
+        inode *file_inode = allocate_inode(itable, inode_bitmap, gd, 0, permissions);
+        if (!file_inode) {
+            fprintf(stderr, "Error: cannot allocate inode for file\n");
+            break;
+        }
+        file_data->inode = file_inode->inode_number;
+        file_inode->file_size = (uint32_t)file_size;
+        file_inode->file_type = 0;
+        file_inode->permissions = permissions | (COMPRESS ? INODE_COMPRESSED : 0);
+
+        if (DELALLOC) {
+            if (delalloc_store(&pending_writes, file_inode->inode_number, file_data, file_size) != 0) {
+                fprintf(stderr, "Error: could not buffer file data.\n");
+                deallocate_inode(itable, inode_bitmap, gd, file_inode->inode_number);
+                break;
+            }
+        } else if (COMPRESS) {
+            if (write_compressed_inode_data(disk, file_inode, file_data, file_size, block_bitmap, gd) != 0) {
+                fprintf(stderr, "Error: could not write compressed file data.\n");
+                deallocate_inode(itable, inode_bitmap, gd, file_inode->inode_number);
+                break;
+            }
+        } else {
+            bool allocated = true;
+            for (size_t i = 0; i < needed_blocks; i++) {
+                size_t offset = i * BLOCK_SIZE;
+                size_t to_write = (file_size - offset > BLOCK_SIZE) ? BLOCK_SIZE : file_size - offset;
+                uint8_t block_data[BLOCK_SIZE] = {0};
+                memcpy(block_data, (uint8_t *)file_data + offset, to_write);
+                if (write_data_block(disk, file_inode, i, block_data, block_bitmap, gd) < 0) {
+                    fprintf(stderr, "Error: could not allocate data block for file.\n");
+                    allocated = false;
+                    break;
+                }
+            }
+            if (!allocated) {
+                free_all_data_blocks_of_inode(disk, file_inode, block_bitmap, gd);
+                deallocate_inode(itable, inode_bitmap, gd, file_inode->inode_number);
+                break;
+            }
+        }
+
+        inode_numbers[created] = file_inode->inode_number;
+        if (VERBOSE) printf("File '%s' created (inode #%u). Size=%lu bytes.\n", file_names[created], file_inode->inode_number, file_size);
+    }
+
+    // 3. Append all the entries ("name.ext") to the parent and rewrite it once
+    if (created > 0) {
+        directory_block_t *new_parent_dir_block = add_entries_to_directory_block(parent_dir_block, created, inode_numbers, file_names, 0);
+        if (!new_parent_dir_block) {
+            fprintf(stderr, "Error: could not allocate memory for the parent directory.\n");
+            for (uint32_t i = 0; i < created; i++) {
+                delalloc_drop(&pending_writes, inode_numbers[i]);
+                free_all_data_blocks_of_inode(disk, &itable->inodes[inode_numbers[i]], block_bitmap, gd);
+                deallocate_inode(itable, inode_bitmap, gd, inode_numbers[i]);
+            }
+            created = 0;
+        } else {
+            update_directory(disk, itable, parent_inode_number, block_bitmap, gd, new_parent_dir_block);
+            for (uint32_t i = 0; i < created; i++) {
+                dcache_insert(&dentry_cache, parent_inode_number, file_names[i], inode_numbers[i], 0);
+            }
+            free(new_parent_dir_block);
+        }
+    }
+
+    // 4. Log the metadata once for all of them
+    write_metadata(disk, gd, block_bitmap, inode_bitmap, itable);
+
+cleanup:
+    free(parent_dir_block);
+    free(file_data);
+    free(inode_numbers);
+    unlock_directory(parent_inode_number);
+    journal_stop(&fs_journal, disk);
+    metrics_record(METRIC_CREATE_MANY, metrics_start);
+
+    if (DELALLOC && delalloc_dirty_bytes(&pending_writes) > DELALLOC_MAX_DIRTY) {
+        flush_delayed_allocations(disk);
+    }
+    return created;
+}
+
+
+/**
+ * @brief Deletes a file from the file system.
+ *
+ * This function deletes a file by its inode number and updates the parent directory.
+ * It performs the following steps:
+ * 1. Locks the parent directory and the file, and uses the in-memory group descriptor, bitmaps and inode table.
+ * 2. Validates the inode number to ensure it is within a valid range and allocated.
+ * 3. Frees all data blocks used by the file and deallocates the inode.
+ * 4. Removes the file entry from the parent directory and updates the parent directory block on the disk.
+ * 5. Writes the updated metadata back to the disk, including the group descriptor, block bitmap, inode bitmap, and inode table.
+ *
+ * @param disk A pointer to the file representing the disk.
+ * @param inode_number The inode number of the file to be deleted.
+ * @param parent_inode_number The inode number of the parent directory.
+ */
+void delete_file(FILE *disk, uint32_t inode_number, uint32_t parent_inode_number) {
+    uint64_t metrics_start = metrics_now();
+    // 1. Lock the parent directory and use the in-memory metadata
+    journal_start(&fs_journal);
+    group_descriptor *gd = &fs_meta.gd;
+    uint8_t *block_bitmap = fs_meta.block_bitmap;
+    uint8_t *inode_bitmap = fs_meta.inode_bitmap;
+    inode_table *itable = &fs_meta.itable;
+    bool orphaned = false;
+    lock_directory(parent_inode_number);
+
+    // 2. Validate inode number, and that the parent (resolved before it was locked)
+    //    still exists and still holds the file
+    if (inode_number == 0 || inode_number >= INODES_COUNT) {
+        fprintf(stderr, "Error: invalid inode number %u\n", inode_number);
+        unlock_directory(parent_inode_number);
+        journal_stop(&fs_journal, disk);
+        return;
+    }
+    lock_inode_write(inode_number);
+
+    inode *file_inode = &itable->inodes[inode_number];
+    directory_block_t *parent_dir_block = NULL;
+    if (!directory_still_usable(parent_inode_number)) goto cleanup;
+
+    // Check if the inode is allocated
+    if (!inode_is_allocated(inode_number)) {
+        fprintf(stderr, "Error: inode #%u is not allocated.\n", inode_number);
+        goto cleanup;
+    }
+
+    parent_dir_block = read_directory(disk, parent_inode_number);
+    if (!parent_dir_block) {
+        fprintf(stderr, "Error: could not read parent directory block.\n");
+        goto cleanup;
+    }
+    size_t entry_index = parent_dir_block->entries_count;
+    for (size_t i = 2; i < parent_dir_block->entries_count; i++) {
+        if (parent_dir_block->entries[i].inode == inode_number) {
+            entry_index = i;
+            break;
+        }
+    }
+    if (entry_index == parent_dir_block->entries_count) {
+        fprintf(stderr, "Error: inode #%u is no longer an entry of directory #%u.\n",
+                inode_number, parent_inode_number);
+        goto cleanup;
+    }
+
+    // 3. Free all data blocks used by the file and deallocate the inode. With asynchronous
+    //    unlink a file that has indirect blocks is left to the reclaimer instead.
+    delalloc_drop(&pending_writes, inode_number);
+    orphaned = ASYNC_UNLINK && (file_inode->single_indirect != 0 || file_inode->double_indirect != 0) &&
+               add_orphan(inode_number, parent_inode_number) == 0;
+    if (!orphaned) {
+        free_all_data_blocks_of_inode(disk, file_inode, block_bitmap, gd);
+        deallocate_inode(itable, inode_bitmap, gd, inode_number);
+    }
+
+    // 4. Remove the file entry from the parent directory block (read under the parent
+    //    lock) and drop the name from the dentry cache
+    dcache_remove(&dentry_cache, parent_inode_number, parent_dir_block->entries[entry_index].name);
+    directory_block_t *new_parent_dir_block = remove_entry_from_directory_block(parent_dir_block, inode_number);
+    update_directory(disk, itable, parent_inode_number, block_bitmap, gd, new_parent_dir_block);
+    free(new_parent_dir_block);
+
+    if (VERBOSE) printf("File with inode #%u deleted successfully.\n", inode_number);
+
+cleanup:
+    free(parent_dir_block);
+    unlock_inode(inode_number);
+    // 5. Write updated metadata back to disk (with the inode unlocked)
+    write_metadata(disk, gd, block_bitmap, inode_bitmap, itable);
+    unlock_directory(parent_inode_number);
+    journal_stop(&fs_journal, disk);
+    metrics_record(METRIC_DELETE_FILE, metrics_start);
+    if (orphaned) wake_reclaimer();
+}
+
+
+/**
+ * @brief Modifies the content of an existing file in the file system.
+ *
+ * This function finds the file by its inode number and either appends new data
+ * or overwrites the file's content based on the specified mode (-o or -a).
+ * The function updates the file's metadata and ensures changes are reflected
+ * on the disk.
+ *
+ * @param disk Pointer to the file representing the disk.
+ * @param inode_number The inode number of the file to be modified.
+ * @param new_data The new content to write into the file.
+ * @param mode The mode of operation: "-o" for overwrite, "-a" for append.
+ */
+void write_file(FILE *disk, uint32_t inode_number, const char *new_data, const char *mode) {
+    uint64_t metrics_start = metrics_now();
+    // 1. Validate inode number
+    if (inode_number == 0 || inode_number >= INODES_COUNT) {
+        fprintf(stderr, "Error: invalid inode number %u\n", inode_number);
+        return;
+    }
+
+    // 2. Lock the file and use the in-memory metadata
+    journal_start(&fs_journal);
+    group_descriptor *gd = &fs_meta.gd;
+    uint8_t *block_bitmap = fs_meta.block_bitmap;
+    uint8_t *inode_bitmap = fs_meta.inode_bitmap;
+    inode_table *itable = &fs_meta.itable;
+    lock_inode_write(inode_number);
+
+    inode *file_inode = &itable->inodes[inode_number];
+
+    // Check if the inode is allocated
+    if (!inode_is_allocated(inode_number)) {
+        fprintf(stderr, "Error: inode #%u is not allocated.\n", inode_number);
+        goto cleanup;
+    }
+
+    // Check if the inode is a file
+    if (file_inode->file_type != 0) {
+        fprintf(stderr, "Error: inode #%u is not a file.\n", inode_number);
+        goto cleanup;
+    }
+    if (reject_readonly(inode_number)) goto cleanup;
+
+    // 3. Read the existing file metadata
+    file_t *old_file = (file_t *)malloc(sizeof(file_t) + file_inode->file_size);
+    if (!old_file) {
+        fprintf(stderr, "Error: could not allocate memory for existing file metadata.\n");
+        goto cleanup;
+    }
+
+    delalloc_buffer *pending = delalloc_lookup(&pending_writes, inode_number);
+    if (pending) {
+        memcpy(old_file, pending->data, file_inode->file_size);
+    } else if (read_inode_data(disk, file_inode, (char *)old_file, file_inode->file_size) != 0) {
+        fprintf(stderr, "Error: could not read existing file metadata.\n");
+        free(old_file);
+        goto cleanup;
+    }
+
+    // 4. Determine the new content size and behavior based on mode
+    size_t old_data_size = file_inode->file_size - sizeof(file_t);
+    size_t new_data_size = strlen(new_data);
+    size_t total_data_size;
+
+    if (strcmp(mode, "-o") == 0) {
+        // Overwrite mode: replace old data with new data
+        // (with delayed allocation the existing blocks are resized at flush time)
+        if (!DELALLOC) {
+            free_all_data_blocks_of_inode(disk, file_inode, block_bitmap, gd);
+        }
+        total_data_size = new_data_size;
+    } else if (strcmp(mode, "-a") == 0) {
+        // Append mode: add new data to the existing data
+        total_data_size = old_data_size + new_data_size;
+    } else {
+        fprintf(stderr, "Error: invalid mode '%s'. Use -o for overwrite or -a for append.\n", mode);
+        free(old_file);
+        goto cleanup;
+    }
+
+    size_t new_file_size = sizeof(file_t) + total_data_size;
+    file_t *new_file = (file_t *)calloc(1, new_file_size); // Zeroed: the content is terminated
+    if (!new_file) {
+        fprintf(stderr, "Error: could not allocate memory for new file content.\n");
+        free(old_file);
+        goto cleanup;
+    }
+
+    // Copy metadata from the old file
+    strncpy(new_file->name, old_file->name, sizeof(new_file->name) - 1);
+    strncpy(new_file->extension, old_file->extension, sizeof(new_file->extension) - 1);
+    new_file->name[sizeof(new_file->name) - 1] = '\0';
+    new_file->extension[sizeof(new_file->extension) - 1] = '\0';
+    new_file->inode = old_file->inode;
+    new_file->size = new_file_size;
+
+    // Copy existing data and append new data
+    if (strcmp(mode, "-a") == 0) {
+        memcpy(new_file->data, old_file->data, old_data_size);
+        memcpy(new_file->data + old_data_size, new_data, new_data_size);
+    } else {
+        memset(new_file->data, 0, total_data_size); // Clear data in overwrite mode
+        memcpy(new_file->data, new_data, new_data_size);
+    }
+
+    // 5. Write the new file data to blocks
+    //    (with delayed allocation the data stays in memory until the next flush)
+    file_inode->file_size = (uint32_t)new_file_size;
+    size_t needed_blocks = (new_file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (DELALLOC) {
+        if (delalloc_store(&pending_writes, inode_number, new_file, new_file_size) != 0) {
+            fprintf(stderr, "Error: could not buffer file data.\n");
+            free(old_file);
+            free(new_file);
+            goto cleanup;
+        }
+        needed_blocks = 0;
+    } else if (inode_is_compressed(file_inode)) {
+        // A compressed file is stored again as a whole
+        if (write_compressed_inode_data(disk, file_inode, new_file, new_file_size, block_bitmap, gd) != 0) {
+            fprintf(stderr, "Error: could not write compressed file data.\n");
+            free(old_file);
+            free(new_file);
+            goto cleanup;
+        }
+        needed_blocks = 0;
+    }
+    uint8_t *src_ptr = (uint8_t *)new_file;
+    size_t bytes_written = 0;
+    TRACE_BEGIN(trace_start);
+
+    for (size_t i = 0; i < needed_blocks; i++) {
+        size_t offset = i * BLOCK_SIZE;
+        size_t bytes_left = new_file_size - offset;
+        size_t to_write = (bytes_left > BLOCK_SIZE) ? BLOCK_SIZE : bytes_left;
+
+        // Zero out the entire block before writing (to clear residual data)
+        uint8_t temp_block[BLOCK_SIZE] = {0};
+        memcpy(temp_block, src_ptr + offset, to_write);
+        if (write_data_block(disk, file_inode, i, temp_block, block_bitmap, gd) < 0) {
+            fprintf(stderr, "Error: could not allocate data block for file.\n");
+            free(old_file);
+            free(new_file);
+            goto cleanup;
+        }
+
+        bytes_written += to_write;
+    }
+    TRACE_END(trace_start, "write_data");
+
+    free(old_file);
+    free(new_file);
 
-    // Free all blocks used by this directory (directory, single-indirect, double-indirect)
-    free_all_data_blocks_of_inode(disk, &itable->inodes[dir_inode_number], block_bitmap, gd);
+    mark_inode_dirty(file_inode);
 
-    // Deallocate the inode
-    deallocate_inode(itable, inode_bitmap, gd, dir_inode_number);
+    if (VERBOSE) printf("File with inode #%u updated successfully. New size: %lu bytes.\n", inode_number, new_file_size);
 
-    free(dir_block);
+cleanup:
+    unlock_inode(inode_number);
+    // 6. Write updated metadata back to disk (with the inode unlocked)
+    write_metadata(disk, gd, block_bitmap, inode_bitmap, itable);
+    journal_stop(&fs_journal, disk);
+    metrics_record(METRIC_WRITE_FILE, metrics_start);
+
+    if (DELALLOC && delalloc_dirty_bytes(&pending_writes) > DELALLOC_MAX_DIRTY) {
+        flush_delayed_allocations(disk);
+    }
 }
 
 
 /**
- * delete_directory - Deletes a directory and its contents from the filesystem.
- * 
- * @disk: The file pointer to the disk image.
- * @dir_inode_number: The inode number of the directory to be deleted.
- * @parent_inode_number: The inode number of the parent directory.
- * 
- * This function performs the following steps:
- * 1. Reads necessary structures from the disk, including the group descriptor,
- *    block bitmap, inode bitmap, and inode table.
- * 2. Validates the directory inode number to ensure it is within a valid range
- *    and is allocated.
- * 3. Recursively deletes the directory and its contents.
- * 4. Updates the parent directory block to remove the entry for the deleted directory.
- * 5. Writes the updated structures back to the disk, including the group descriptor,
- *    block bitmap, inode bitmap, and inode table.
- * 
- * If any errors occur during the process, appropriate error messages are printed
- * to stderr, and the function performs cleanup before returning.
- * 
- * Note: This function assumes that the directory inode number and parent inode number
- * are valid and that the disk image is properly formatted.
+ * Resize a compressed file: its content is decompressed, cut or zero-extended
+ * to 'new_size' bytes (header included, its size field updated) and stored
+ * again. The inode's file_size is not changed.
+ *
+ * Returns: 0 on success, or -1 on failure.
  */
-void delete_directory(FILE *disk, uint32_t dir_inode_number, uint32_t parent_inode_number) {
+int resize_compressed_file(FILE *disk, inode *node, uint32_t new_size, uint8_t *block_bitmap, group_descriptor *gd) {
+    uint32_t old_size = node->file_size;
+    char *content = (char *)calloc(1, (old_size > new_size) ? old_size : new_size);
+    if (!content) {
+        fprintf(stderr, "Error: could not allocate memory for file content.\n");
+        return -1;
+    }
+    if (read_inode_data(disk, node, content, old_size) != 0) {
+        free(content);
+        return -1;
+    }
+    ((file_t *)content)->size = new_size;
 
-    // 1. Read necessary structures from disk
-    // 1a. Read the group descriptor
-    group_descriptor gd;
-    fseek(disk, BLOCK_SIZE, SEEK_SET);
-    fread(&gd, sizeof(group_descriptor), 1, disk);
+    // A shorter file ends (and is terminated) at offsetof(file_t, data) plus its new length
+    uint32_t new_end = new_size - (uint32_t)sizeof(file_t) + (uint32_t)offsetof(file_t, data);
+    if (new_size < old_size) memset(content + new_end, 0, new_size - new_end);
 
-    // 1b. Read the block bitmap
-    uint8_t *block_bitmap = (uint8_t *)malloc(BLOCKS_COUNT / 8);
-    fseek(disk, gd.block_bitmap * BLOCK_SIZE, SEEK_SET);
-    fread(block_bitmap, BLOCKS_COUNT / 8, 1, disk);
+    int status = write_compressed_inode_data(disk, node, content, new_size, block_bitmap, gd);
+    free(content);
+    return status;
+}
 
-    // 1c. Read the inode bitmap
-    uint8_t *inode_bitmap = (uint8_t *)malloc(INODES_COUNT / 8);
-    fseek(disk, gd.inode_bitmap * BLOCK_SIZE, SEEK_SET);
-    fread(inode_bitmap, INODES_COUNT / 8, 1, disk);
 
-    // 1d. Read the inode table
-    inode_table itable;
-    fseek(disk, gd.inode_table * BLOCK_SIZE, SEEK_SET);
-    fread(&itable, sizeof(inode_table), 1, disk);
+/**
+ * @brief Changes the size of an existing file.
+ *
+ * Shrinking releases only the blocks that lie beyond the new end, including
+ * indirect blocks that become empty, instead of rewriting the whole file.
+ * Growing maps the missing blocks (reusing preallocated ones) and zero-fills
+ * the new range.
+ *
+ * @param disk Pointer to the file representing the disk.
+ * @param inode_number The inode number of the file to be resized.
+ * @param new_data_size The new size of the file content in bytes (excluding file metadata).
+ */
+void truncate_file(FILE *disk, uint32_t inode_number, uint32_t new_data_size) {
+    uint64_t metrics_start = metrics_now();
+    // 0. Delayed data must have its blocks before the block map is changed
+    flush_delayed_allocations(disk);
 
-    // 2. Validate dir_inode_number
-    if (dir_inode_number == 0 || dir_inode_number > INODES_COUNT) {
-        fprintf(stderr, "Error: invalid inode number %u\n", dir_inode_number);
-        goto cleanup;
+    // 1. Validate inode number and size
+    if (inode_number == 0 || inode_number >= INODES_COUNT) {
+        fprintf(stderr, "Error: invalid inode number %u\n", inode_number);
+        return;
+    }
+    if (new_data_size > MAX_FILE_DATA_SIZE) {
+        fprintf(stderr, "Error: size %u is beyond the largest file (%llu bytes).\n",
+                new_data_size, (unsigned long long)MAX_FILE_DATA_SIZE);
+        return;
     }
 
-    inode *dir_inode = &itable.inodes[dir_inode_number];
+    // 2. Lock the file and use the in-memory metadata
+    journal_start(&fs_journal);
+    group_descriptor *gd = &fs_meta.gd;
+    uint8_t *block_bitmap = fs_meta.block_bitmap;
+    inode_table *itable = &fs_meta.itable;
+    lock_inode_write(inode_number);
 
-    // Check if this inode is actually allocated
-    if (is_bit_free(inode_bitmap, dir_inode_number)) {
-        fprintf(stderr, "Error: inode #%u is not allocated.\n", dir_inode_number);
-        goto cleanup;
-    }
+    inode *file_inode = &itable->inodes[inode_number];
 
-    // Check if this inode is a directory
-    if (dir_inode->file_type != 1) {
-        fprintf(stderr, "Error: Inode #%u is not a directory (file_type=%u).\n",
-                dir_inode_number, dir_inode->file_type);
+    if (!inode_is_allocated(inode_number)) {
+        fprintf(stderr, "Error: inode #%u is not allocated.\n", inode_number);
         goto cleanup;
     }
 
-    // 3. Recursively delete the directory and its contents
-    delete_directory_recur(disk, dir_inode_number, parent_inode_number, &gd, &itable, inode_bitmap, block_bitmap);
-
-    // 4. Update the parent directory block to remove the entry
-    directory_block_t *parent_dir_block = read_directory(disk, parent_inode_number);
-    if (!parent_dir_block) {
-        fprintf(stderr, "Error: could not read parent directory block.\n");
+    if (file_inode->file_type != 0) {
+        fprintf(stderr, "Error: inode #%u is not a file.\n", inode_number);
         goto cleanup;
     }
+    if (reject_readonly(inode_number)) goto cleanup;
+
+    uint32_t old_size = file_inode->file_size;
+    uint32_t new_size = (uint32_t)sizeof(file_t) + new_data_size;
+
+    // 3. Shrink or grow the block map (a compressed file is stored again as a whole)
+    if (inode_is_compressed(file_inode)) {
+        if (resize_compressed_file(disk, file_inode, new_size, block_bitmap, gd) != 0) goto cleanup;
+    } else if (new_size < old_size) {
+        truncate_inode_blocks(disk, file_inode, new_size, block_bitmap, gd);
+
+        // Zero the rest of the kept blocks from the new end of the content on, so the
+        // content is terminated there and none of the cut part can be read back
+        uint32_t new_end = (uint32_t)offsetof(file_t, data) + new_data_size;
+        uint32_t kept_end = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        uint32_t zero_to = (old_size < kept_end) ? old_size : kept_end;
+        uint8_t zero_buf[BLOCK_SIZE] = {0};
+
+        for (uint32_t pos = new_end; pos < zero_to; ) {
+            uint32_t in_block = pos % BLOCK_SIZE;
+            uint32_t len = (zero_to - pos < BLOCK_SIZE - in_block) ? zero_to - pos : BLOCK_SIZE - in_block;
+            // The block may be shared: take a private copy before changing it
+            int block = allocate_data_block_for_inode(disk, file_inode, pos / BLOCK_SIZE, block_bitmap, gd);
+            if (block < 0) {
+                fprintf(stderr, "Error: could not clear the end of inode #%u.\n", inode_number);
+                break;
+            }
+            disk_write(disk, (uint64_t)block * BLOCK_SIZE + in_block, zero_buf, len);
+            pos += len;
+        }
+    } else if (new_size > old_size) {
+        // Content starts at offsetof(file_t, data), which is below sizeof(file_t)
+        uint32_t old_end = old_size - (uint32_t)sizeof(file_t) + (uint32_t)offsetof(file_t, data);
+        uint32_t first = old_end / BLOCK_SIZE;
+        uint32_t needed_blocks = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        uint8_t zero_buf[BLOCK_SIZE] = {0};
+
+        for (uint32_t i = first; i < needed_blocks; i++) {
+            int block = allocate_data_block_for_inode(disk, file_inode, i, block_bitmap, gd);
+            if (block < 0) {
+                fprintf(stderr, "Error: could not allocate data block for file.\n");
+                truncate_inode_blocks(disk, file_inode, old_size, block_bitmap, gd);
+                goto cleanup;
+            }
 
-    // Write the updated parent directory block back to disk
-    directory_block_t *new_parent_dir_block = remove_entry_from_directory_block(parent_dir_block, dir_inode_number);
-    update_directory(disk, &itable, parent_inode_number, block_bitmap, &gd, new_parent_dir_block);
-
-    free(parent_dir_block);
-    free(new_parent_dir_block);
-
-    // 5. Write everything back
-    // 5a. Group Descriptor
-    fseek(disk, BLOCK_SIZE, SEEK_SET);
-    fwrite(&gd, sizeof(gd), 1, disk);
+            // Zero from the old end of file (or block start) to the end of the block,
+            // since the block may have been preallocated and never written
+            uint32_t block_start = i * BLOCK_SIZE;
+            uint32_t zero_from = (old_end > block_start) ? old_end - block_start : 0;
+            disk_write(disk, (uint64_t)block * BLOCK_SIZE + zero_from, zero_buf, BLOCK_SIZE - zero_from);
+        }
+    }
 
-    // 5b. Block Bitmap
-    fseek(disk, gd.block_bitmap * BLOCK_SIZE, SEEK_SET);
-    fwrite(block_bitmap, BLOCKS_COUNT / 8, 1, disk);
+    // 4. Update the sizes in the inode and in the file header
+    file_inode->file_size = new_size;
 
-    // 5c. Inode Bitmap
-    fseek(disk, gd.inode_bitmap * BLOCK_SIZE, SEEK_SET);
-    fwrite(inode_bitmap, INODES_COUNT / 8, 1, disk);
+    if (!inode_is_compressed(file_inode)) {
+        // The first block may be shared: take a private copy before changing it
+        int header_block = allocate_data_block_for_inode(disk, file_inode, 0, block_bitmap, gd);
+        if (header_block < 0) {
+            fprintf(stderr, "Error: could not rewrite the header of inode #%u.\n", inode_number);
+        } else {
+            file_t header;
+            uint64_t header_offset = (uint64_t)header_block * BLOCK_SIZE;
+            disk_read(disk, header_offset, &header, sizeof(file_t));
+            header.size = new_size;
+            disk_write(disk, header_offset, &header, sizeof(file_t));
+        }
+    }
 
-    // 5d. Inode Table
-    fseek(disk, gd.inode_table * BLOCK_SIZE, SEEK_SET);
-    fwrite(&itable, sizeof(itable), 1, disk);
+    mark_inode_dirty(file_inode);
 
-    if (VERBOSE) printf("Directory inode #%u deleted successfully.\n", dir_inode_number);
+    if (VERBOSE) printf("File with inode #%u truncated to %u bytes.\n", inode_number, new_data_size);
 
 cleanup:
-    free(block_bitmap);
-    free(inode_bitmap);
-    fseek(disk, 0, SEEK_SET);
+    unlock_inode(inode_number);
+    // 5. Write updated metadata back to disk (with the inode unlocked)
+    write_metadata(disk, gd, block_bitmap, NULL, itable);
+    journal_stop(&fs_journal, disk);
+    metrics_record(METRIC_TRUNCATE_FILE, metrics_start);
 }
 
 
 /**
- * @brief Creates a new directory in the file system.
- *
- * This function creates a new directory with the specified name, permissions, 
- * and parent inode number in the file system represented by the given disk file.
- *
- * @param disk The file pointer to the disk image.
- * @param dir_name The name of the new directory to be created.
- * @param permissions The permissions for the new directory.
- * @param parent_inode_number The inode number of the parent directory.
- *
- * The function performs the following steps:
- * 1. Reads necessary structures from the disk, including the group descriptor, 
- *    block bitmap, inode bitmap, and inode table.
- * 2. Allocates necessary structures for the new directory in memory, including 
- *    an inode and a minimal directory block.
- * 3. Allocates the required number of blocks for the directory and writes the 
- *    directory block to the disk.
- * 4. Updates the parent directory block to include the new directory entry.
- * 5. Overwrites the updated metadata structures, including the group descriptor, 
- *    block bitmap, inode bitmap, and inode table.
+ * @brief Reserves disk space for a range of an existing file.
  *
- * If any error occurs during the process, the function rolls back the changes 
- * and frees allocated memory.
+ * Preallocates contiguous blocks for the content range [offset, offset + len)
+ * without changing the file size, so later appends reuse them instead of
+ * allocating block by block.
  *
- * @note The function assumes that the disk image is properly formatted and 
- *       that the necessary structures are correctly initialized.
+ * @param disk Pointer to the file representing the disk.
+ * @param inode_number The inode number of the file.
+ * @param offset Start of the range in bytes, relative to the file content.
+ * @param len Length of the range in bytes.
  */
-void create_directory(FILE *disk, 
-                      const char *dir_name, 
-                      uint32_t permissions,
-                      uint32_t parent_inode_number) {
-
-    // 1. Read necessary structures from disk
-    // 1a. Read the group descriptor
-    group_descriptor gd;
-    fseek(disk, BLOCK_SIZE, SEEK_SET);
-    fread(&gd, sizeof(group_descriptor), 1, disk);
+void fallocate_file(FILE *disk, uint32_t inode_number, uint32_t offset, uint32_t len) {
+    uint64_t metrics_start = metrics_now();
+    // 0. Delayed data must have its blocks before the block map is changed
+    flush_delayed_allocations(disk);
 
-    // 1b. Read the block bitmap
-    uint8_t *block_bitmap = (uint8_t *)malloc(BLOCKS_COUNT / 8);
-    fseek(disk, gd.block_bitmap * BLOCK_SIZE, SEEK_SET);
-    fread(block_bitmap, BLOCKS_COUNT / 8, 1, disk);
+    // 1. Validate inode number and range
+    if (inode_number == 0 || inode_number >= INODES_COUNT) {
+        fprintf(stderr, "Error: invalid inode number %u\n", inode_number);
+        return;
+    }
+    if ((uint64_t)offset + len > MAX_FILE_DATA_SIZE) {
+        fprintf(stderr, "Error: range %u+%u is beyond the largest file (%llu bytes).\n",
+                offset, len, (unsigned long long)MAX_FILE_DATA_SIZE);
+        return;
+    }
 
-    // 1c. Read the inode bitmap
-    uint8_t *inode_bitmap = (uint8_t *)malloc(INODES_COUNT / 8);
-    fseek(disk, gd.inode_bitmap * BLOCK_SIZE, SEEK_SET);
-    fread(inode_bitmap, INODES_COUNT / 8, 1, disk);
+    // 2. Lock the file and use the in-memory metadata
+    journal_start(&fs_journal);
+    group_descriptor *gd = &fs_meta.gd;
+    uint8_t *block_bitmap = fs_meta.block_bitmap;
+    inode_table *itable = &fs_meta.itable;
+    lock_inode_write(inode_number);
 
-    // 1d. Read the inode table
-    inode_table itable;
-    fseek(disk, gd.inode_table * BLOCK_SIZE, SEEK_SET);
-    fread(&itable, sizeof(inode_table), 1, disk);
-    
+    inode *file_inode = &itable->inodes[inode_number];
 
-    // 2. Allocate necessary structures for the new directory in memory
-    // 2a. Inode for the new directory
-    inode *dir_inode = allocate_inode(&itable, inode_bitmap, &gd, 1, permissions);
-    if (!dir_inode) {
-        fprintf(stderr, "Error: cannot allocate inode for directory\n");
+    if (!inode_is_allocated(inode_number)) {
+        fprintf(stderr, "Error: inode #%u is not allocated.\n", inode_number);
         goto cleanup;
     }
-    dir_inode->file_type = 1; // Set the file type to directory
-    dir_inode->permissions = permissions;
 
-    // 2b. Create a minimal directory block in memory
-    directory_block_t *dirblk = create_minimal_directory_block(dir_inode->inode_number, parent_inode_number);
-    if (!dirblk) {
-        fprintf(stderr, "Error: could not create minimal directory block in memory.\n");
-        // Roll back the inode
-        deallocate_inode(&itable, inode_bitmap, &gd, dir_inode->inode_number);
+    if (file_inode->file_type != 0) {
+        fprintf(stderr, "Error: inode #%u is not a file.\n", inode_number);
         goto cleanup;
     }
+    if (reject_readonly(inode_number)) goto cleanup;
 
-    // 2c. Calculate the number of blocks needed for the directory
-    size_t dirblk_size = sizeof(directory_block_t) + dirblk->entries_count * sizeof(dir_entry_t);
-    size_t needed_blocks = (dirblk_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    dir_inode->file_size = (uint32_t)dirblk_size;
-
-    // 3. Allocate each needed block
-    uint8_t *src_ptr = (uint8_t *)dirblk;
-    for (size_t i = 0; i < needed_blocks; i++) {
-        // Use the extended allocate_data_block_for_inode
-        int allocated_block = allocate_data_block_for_inode(disk, dir_inode, i, block_bitmap, &gd);
-        if (allocated_block < 0) {
-            fprintf(stderr, "Error: could not allocate data block for directory.\n");
-            // Roll back the inode
-            deallocate_inode(&itable, inode_bitmap, &gd, dir_inode->inode_number);
-            // Roll back the directory block
-            free(dirblk);
-            goto cleanup;
-        }
-
-        // Write the slice of the dirblk that fits in this block
-        size_t offset = i * BLOCK_SIZE;
-        size_t bytes_left = dirblk_size - offset;
-        size_t to_write = (bytes_left > BLOCK_SIZE) ? BLOCK_SIZE : bytes_left;
-
-        fseek(disk, allocated_block * BLOCK_SIZE, SEEK_SET);
-        fwrite(src_ptr + offset, to_write, 1, disk);
-
-        dir_inode->file_size += to_write;
+    // Compressed clusters are rewritten as a whole, preallocated blocks would only be freed
+    if (inode_is_compressed(file_inode)) {
+        fprintf(stderr, "Error: inode #%u is compressed and cannot be preallocated.\n", inode_number);
+        goto cleanup;
     }
 
-    free(dirblk);
-
-    // 4. Rewrite the parent directory block to include the new entry
-    directory_block_t *parent_dir_block = read_directory(disk, parent_inode_number);
-    if (!parent_dir_block) {
-        fprintf(stderr, "Error: could not read parent directory block.\n");
-        // Roll back the inode
-        deallocate_inode(&itable, inode_bitmap, &gd, dir_inode->inode_number);
+    // 3. Preallocate the blocks (offsets are relative to the content, after the file header)
+    int allocated = fallocate_inode_blocks(disk, file_inode, (uint32_t)offsetof(file_t, data) + offset, len, block_bitmap, gd);
+    if (allocated < 0) {
+        fprintf(stderr, "Error: could not preallocate blocks for file.\n");
         goto cleanup;
     }
 
-    // Add the new directory entry to the parent directory block
-    directory_block_t *new_parent_dir_block = add_entry_to_directory_block(parent_dir_block, dir_inode->inode_number, dir_name, 1);
-    
-    // Write the updated parent directory block back to disk
-    update_directory(disk, &itable, parent_inode_number, block_bitmap, &gd, new_parent_dir_block);
+    mark_inode_dirty(file_inode);
 
-    free(parent_dir_block);
-    free(new_parent_dir_block);
+    if (VERBOSE) printf("Preallocated %d blocks for file with inode #%u.\n", allocated, inode_number);
 
-    // 5. Overwrite updated metadata structures
-    // 5a. Group Descriptor
-    fseek(disk, BLOCK_SIZE, SEEK_SET);
-    fwrite(&gd, sizeof(gd), 1, disk);
+cleanup:
+    unlock_inode(inode_number);
+    // 4. Write updated metadata back to disk (with the inode unlocked)
+    write_metadata(disk, gd, block_bitmap, NULL, itable);
+    journal_stop(&fs_journal, disk);
+    metrics_record(METRIC_FALLOCATE_FILE, metrics_start);
+}
 
-    // 5b. Block Bitmap
-    fseek(disk, gd.block_bitmap * BLOCK_SIZE, SEEK_SET);
-    fwrite(block_bitmap, BLOCKS_COUNT / 8, 1, disk);
+// [CLONES]
+/**
+ * Add one reference to every block the map of 'node' points to: its direct
+ * blocks and its indirect blocks (the blocks below an indirect block are shared
+ * through it). Nothing changes if one of them is at the reference limit.
+ *
+ * Returns: 0 on success, or -1 if a reference count is full.
+ */
+static int share_block_map(const inode *node) {
+    uint32_t roots[14];
+    uint32_t roots_count = 0;
+    for (int i = 0; i < 12; i++) {
+        if (node->blocks[i] != 0) roots[roots_count++] = node->blocks[i];
+    }
+    if (node->single_indirect != 0) roots[roots_count++] = node->single_indirect;
+    if (node->double_indirect != 0) roots[roots_count++] = node->double_indirect;
 
-    // 5c. Inode Bitmap
-    fseek(disk, gd.inode_bitmap * BLOCK_SIZE, SEEK_SET);
-    fwrite(inode_bitmap, INODES_COUNT / 8, 1, disk);
+    pthread_mutex_lock(&alloc_lock);
+    for (uint32_t i = 0; i < roots_count; i++) {
+        if (fs_meta.refcounts[roots[i]] == UINT16_MAX) {
+            pthread_mutex_unlock(&alloc_lock);
+            return -1;
+        }
+    }
+    for (uint32_t i = 0; i < roots_count; i++) {
+        set_block_refs_locked(roots[i], fs_meta.refcounts[roots[i]] + 1);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return 0;
+}
 
-    // 5d. Inode Table
-    fseek(disk, gd.inode_table * BLOCK_SIZE, SEEK_SET);
-    fwrite(&itable, sizeof(itable), 1, disk);
+// Store the file header of a clone (its name, extension and inode number)
+static void set_clone_header(file_t *header, const char *file_name, const char *extension, uint32_t inode_number) {
+    memset(header->name, 0, sizeof(header->name));
+    memset(header->extension, 0, sizeof(header->extension));
+    strncpy(header->name, file_name, sizeof(header->name) - 1);
+    strncpy(header->extension, extension, sizeof(header->extension) - 1);
+    header->inode = inode_number;
+}
 
-    if (VERBOSE) printf("Directory '%s' created (inode #%u). Size=%u bytes.\n", dir_name, dir_inode->inode_number, dir_inode->file_size);
+/**
+ * Give a clone its own file header. The first block is still shared with the
+ * source, so it is copied first (see allocate_data_block_for_inode); a
+ * compressed file has its first cluster decompressed, patched and stored again.
+ *
+ * Returns: 0 on success, or -1 on failure.
+ */
+int write_clone_header(FILE *disk, inode *node, const char *file_name, const char *extension,
+                       uint8_t *block_bitmap, group_descriptor *gd)
+{
+    if (!inode_is_compressed(node)) {
+        int header_block = allocate_data_block_for_inode(disk, node, 0, block_bitmap, gd);
+        if (header_block < 0) return -1;
+        file_t header;
+        uint64_t header_offset = (uint64_t)header_block * BLOCK_SIZE;
+        disk_read(disk, header_offset, &header, sizeof(file_t));
+        set_clone_header(&header, file_name, extension, node->inode_number);
+        disk_write(disk, header_offset, &header, sizeof(file_t));
+        return 0;
+    }
 
-cleanup:
-    free(block_bitmap);
-    free(inode_bitmap);
-    fseek(disk, 0, SEEK_SET);
+    // 1. Content of the first cluster, with the new header
+    size_t cluster_bytes = (size_t)COMPRESS_CLUSTER_BLOCKS * BLOCK_SIZE;
+    size_t length = (node->file_size < cluster_bytes) ? node->file_size : cluster_bytes;
+    uint8_t *content = (uint8_t *)malloc(length);
+    compressed_image image;
+    if (!content || read_compressed_inode_data(disk, node, (char *)content, length) != 0) {
+        free(content);
+        return -1;
+    }
+    set_clone_header((file_t *)content, file_name, extension, node->inode_number);
+    int status = compress_file_image(content, length, &image);
+    free(content);
+    if (status != 0) return -1;
+
+    // 2. Replace the stored blocks of the cluster
+    for (uint32_t n = 0; n < COMPRESS_CLUSTER_BLOCKS; n++) {
+        uint32_t block;
+        if (lookup_data_block_of_inode(disk, node, n, &block) != 0 || block == 0) continue;
+        if (map_data_block_to_inode(disk, node, n, 0, block_bitmap, gd) != 0) status = -1;
+        else free_data_block(block_bitmap, gd, (int)block);
+    }
+    for (uint32_t k = 0; k < image.cluster_blocks[0] && status == 0; k++) {
+        int block = find_and_allocate_free_block(block_bitmap, gd);
+        if (block < 0) {
+            status = -1;
+            break;
+        }
+        disk_write(disk, (uint64_t)block * BLOCK_SIZE, image.data + (size_t)k * BLOCK_SIZE, BLOCK_SIZE);
+        if (map_data_block_to_inode(disk, node, k, (uint32_t)block, block_bitmap, gd) != 0) {
+            free_data_block(block_bitmap, gd, block);
+            status = -1;
+        }
+    }
+    free_compressed_image(&image);
+    return status;
 }
 
-
 /**
- * @brief Creates a file in the specified parent directory inode.
+ * @brief Creates a file as a clone of another one (a reflink copy).
  *
- * This function creates a file with the given name, extension, permissions, and data
- * in the specified parent directory inode. It performs the following steps:
- * 1. Reads necessary structures from the disk (group descriptor, block bitmap, inode bitmap, inode table).
- * 2. Creates the file metadata structure and allocates an inode for the file.
- * 3. Adds the file entry to the parent directory's directory block.
- * 4. Allocates the necessary blocks for the file and writes the file metadata and data to the disk.
- * 5. Updates the metadata structures on the disk.
+ * The clone gets a new inode holding the block map of the source: the direct
+ * blocks and the single- and double-indirect blocks gain one reference each,
+ * so the whole content is shared in constant time, whatever the file size.
+ * Blocks are copied only when one of the two files changes them (copy on
+ * write, see unshare_indirect_block). Only the file header is stored again,
+ * since it holds the name and inode number of the clone. The drive must have
+ * a refcount table.
  *
- * @param disk The file pointer to the disk image.
- * @param file_name The name of the file to be created.
- * @param extension The extension of the file to be created.
- * @param permissions The permissions for the new file.
- * @param data The data to be written to the new file.
- * @param parent_inode_number The inode number of the parent directory where the file will be created.
+ * @param disk Pointer to the file representing the disk.
+ * @param src_inode_number The inode number of the file to clone.
+ * @param file_name The name of the new file.
+ * @param extension The extension of the new file.
+ * @param parent_inode_number The inode number of the directory to create it in.
+ * @return The inode number of the clone, or 0 on failure.
  */
-void create_file(FILE *disk, 
-                 const char *file_name, 
-                 const char *extension, 
-                 uint32_t permissions,
-                 const char *data,
-                 uint32_t parent_inode_number) {
-
-    // 1. Read necessary structures from disk
-    // 1a. Read the group descriptor
-    group_descriptor gd;
-    fseek(disk, BLOCK_SIZE, SEEK_SET);
-    fread(&gd, sizeof(group_descriptor), 1, disk);
-
-    // 1b. Read the block bitmap
-    uint8_t *block_bitmap = (uint8_t *)malloc(BLOCKS_COUNT / 8);
-    fseek(disk, gd.block_bitmap * BLOCK_SIZE, SEEK_SET);
-    fread(block_bitmap, BLOCKS_COUNT / 8, 1, disk);
-
-    // 1c. Read the inode bitmap
-    uint8_t *inode_bitmap = (uint8_t *)malloc(INODES_COUNT / 8);
-    fseek(disk, gd.inode_bitmap * BLOCK_SIZE, SEEK_SET);
-    fread(inode_bitmap, INODES_COUNT / 8, 1, disk);
-
-    // 1d. Read the inode table
-    inode_table itable;
-    fseek(disk, gd.inode_table * BLOCK_SIZE, SEEK_SET);
-    fread(&itable, sizeof(inode_table), 1, disk);
+uint32_t clone_file(FILE *disk,
+                    uint32_t src_inode_number,
+                    const char *file_name,
+                    const char *extension,
+                    uint32_t parent_inode_number) {
+    uint64_t metrics_start = metrics_now();
+    // 0. Delayed data of the source must have its blocks
+    if (delalloc_lookup(&pending_writes, src_inode_number)) flush_delayed_allocations(disk);
+
+    // 1. Validate inode number
+    if (src_inode_number == 0 || src_inode_number >= INODES_COUNT) {
+        fprintf(stderr, "Error: invalid inode number %u\n", src_inode_number);
+        return 0;
+    }
 
-    // 2. Create the file_t structure
-    // 2a. Initialize the file_t structure
-    size_t file_size = sizeof(file_t) + strlen(data);
-    file_t *file_data = (file_t *)malloc(file_size);
-    if (!file_data) {
-        fprintf(stderr, "Error: could not allocate memory for file metadata\n");
+    // 2. Lock the parent directory and the source, and use the in-memory metadata
+    journal_start(&fs_journal);
+    group_descriptor *gd = &fs_meta.gd;
+    uint8_t *block_bitmap = fs_meta.block_bitmap;
+    uint8_t *inode_bitmap = fs_meta.inode_bitmap;
+    inode_table *itable = &fs_meta.itable;
+    lock_directory(parent_inode_number);
+    lock_inode_read(src_inode_number);
+    uint32_t locked_inode = INODES_COUNT; // The clone, locked until its header is in place
+    uint32_t clone_number = 0;
+    directory_block_t *parent_dir_block = NULL;
+    if (!directory_still_usable(parent_inode_number)) goto cleanup;
+    char full_name[256];
+    snprintf(full_name, sizeof(full_name), "%s.%s", file_name, extension);
+    if (reject_reserved_name(parent_inode_number, full_name)) goto cleanup;
+    parent_dir_block = read_directory(disk, parent_inode_number);
+    if (!parent_dir_block) {
+        fprintf(stderr, "Error: could not read parent directory block.\n");
         goto cleanup;
     }
+    if (reject_taken_name(parent_dir_block, full_name)) goto cleanup;
 
-    // Initialize the file_t structure
-    strncpy(file_data->name, file_name, sizeof(file_data->name) - 1);
-    strncpy(file_data->extension, extension, sizeof(file_data->extension) - 1);
-    file_data->size = file_size;
-    memcpy(file_data->data, data, strlen(data));
-
-    // Allocate a new file inode
-    inode *file_inode = allocate_inode(&itable, inode_bitmap, &gd, 0, permissions);
-    if (!file_inode) {
-        fprintf(stderr, "Error: cannot allocate inode for file\n");
-        free(file_data);
+    inode *src_inode = &itable->inodes[src_inode_number];
+    if (!inode_is_allocated(src_inode_number) || src_inode->file_size == 0) {
+        fprintf(stderr, "Error: inode #%u is not allocated.\n", src_inode_number);
         goto cleanup;
     }
-    file_data->inode = file_inode->inode_number;
-
-    // 2b. Set the inode
-    file_inode->file_size = (uint32_t)file_size;
-    file_inode->file_type = 0; // Regular file
-    file_inode->permissions = permissions;
-
-    // 2c. Calculate the number of blocks needed for the file
-    size_t needed_blocks = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-
-    // 3. Add file to the parent directory's directory block
-    // 3a. Read the parent directory block
-    directory_block_t *parent_dir_block = read_directory(disk, parent_inode_number);
-    if (!parent_dir_block) {
-        fprintf(stderr, "Error: could not read parent directory block.\n");
-        // Roll back the inode
-        deallocate_inode(&itable, inode_bitmap, &gd, file_inode->inode_number);
-        free(file_data);
+    if (src_inode->file_type != 0) {
+        fprintf(stderr, "Error: inode #%u is not a file.\n", src_inode_number);
+        goto cleanup;
+    }
+    if (fs_meta.refcount_start == 0) {
+        fprintf(stderr, "Error: the drive has no block reference counts, files cannot be cloned.\n");
+        goto cleanup;
+    }
+    if (delalloc_lookup(&pending_writes, src_inode_number)) {
+        fprintf(stderr, "Error: inode #%u has delayed data that is not written yet.\n", src_inode_number);
         goto cleanup;
     }
 
-    // 3b. Add the new file entry to the parent directory block
-    char full_name[256];
-    snprintf(full_name, sizeof(full_name), "%s.%s", file_name, extension);
-    directory_block_t *new_parent_dir_block = add_entry_to_directory_block(parent_dir_block, file_inode->inode_number, full_name, 0);
-    
-    // 3c. Write the updated parent directory block back to disk
-    update_directory(disk, &itable, parent_inode_number, block_bitmap, &gd, new_parent_dir_block);
+    // 3. Allocate the clone with the block map of the source
+    inode *clone_inode = allocate_inode(itable, inode_bitmap, gd, 0, src_inode->permissions & ~INODE_READONLY);
+    if (!clone_inode) {
+        fprintf(stderr, "Error: cannot allocate inode for file\n");
+        goto cleanup;
+    }
+    locked_inode = clone_inode->inode_number;
+    lock_inode_write(locked_inode);
+    clone_inode->file_size = src_inode->file_size;
+    memcpy(clone_inode->blocks, src_inode->blocks, sizeof(clone_inode->blocks));
+    clone_inode->single_indirect = src_inode->single_indirect;
+    clone_inode->double_indirect = src_inode->double_indirect;
+    clone_inode->permissions = src_inode->permissions & ~INODE_READONLY;
+
+    // 4. One more reference on every block of the map
+    if (share_block_map(clone_inode) != 0) {
+        fprintf(stderr, "Error: inode #%u has blocks with too many references.\n", src_inode_number);
+        memset(clone_inode->blocks, 0, sizeof(clone_inode->blocks));
+        clone_inode->single_indirect = 0;
+        clone_inode->double_indirect = 0;
+        deallocate_inode(itable, inode_bitmap, gd, locked_inode);
+        goto cleanup;
+    }
 
-    // 3d. Clean up the parent directory block
-    free(parent_dir_block);
+    // 5. Its own file header
+    if (write_clone_header(disk, clone_inode, file_name, extension, block_bitmap, gd) != 0) {
+        fprintf(stderr, "Error: could not write the header of the clone.\n");
+        free_all_data_blocks_of_inode(disk, clone_inode, block_bitmap, gd);
+        deallocate_inode(itable, inode_bitmap, gd, locked_inode);
+        goto cleanup;
+    }
+
+    // 6. Add the clone to the parent directory (read in step 2)
+    directory_block_t *new_parent_dir_block = add_entry_to_directory_block(parent_dir_block, locked_inode, full_name, 0);
+    update_directory(disk, itable, parent_inode_number, block_bitmap, gd, new_parent_dir_block);
+    dcache_insert(&dentry_cache, parent_inode_number, full_name, locked_inode, 0);
     free(new_parent_dir_block);
 
-    // 4. Allocate each needed block and write the file metadata/data
-    uint8_t *src_ptr = (uint8_t *)file_data;
-    size_t bytes_written = 0;
-    for (size_t i = 0; i < needed_blocks; i++) {
-        // Use the extended allocate_data_block_for_inode
-        int allocated_block = allocate_data_block_for_inode(disk, file_inode, i, block_bitmap, &gd);
-        if (allocated_block < 0) {
-            fprintf(stderr, "Error: could not allocate data block for file.\n");
-            // Roll back the inode
-            deallocate_inode(&itable, inode_bitmap, &gd, file_inode->inode_number);
-            free(file_data);
-            goto cleanup;
-        }
+    mark_inode_dirty(clone_inode);
+    clone_number = locked_inode;
 
-        // Write the slice of the file_metadata that fits in this block
-        size_t offset = i * BLOCK_SIZE;
-        size_t bytes_left = file_size - offset;
-        size_t to_write = (bytes_left > BLOCK_SIZE) ? BLOCK_SIZE : bytes_left;
+    if (VERBOSE) printf("File '%s' cloned from inode #%u (inode #%u).\n", full_name, src_inode_number, clone_number);
 
-        fseek(disk, allocated_block * BLOCK_SIZE, SEEK_SET);
-        fwrite(src_ptr + offset, to_write, 1, disk);
+cleanup:
+    free(parent_dir_block);
+    unlock_inode(locked_inode);
+    unlock_inode(src_inode_number);
+    // 7. Write updated metadata back to disk (with both inodes unlocked)
+    write_metadata(disk, gd, block_bitmap, inode_bitmap, itable);
+    unlock_directory(parent_inode_number);
+    journal_stop(&fs_journal, disk);
+    metrics_record(METRIC_CLONE_FILE, metrics_start);
+    return clone_number;
+}
 
-        bytes_written += to_write;
+// [SNAPSHOTS]
+// A snapshot is a read-only copy of the whole tree, kept as /.snapshots/<name>.
+// Taking one copies the directories (their entries must name the inodes of the
+// snapshot) and gives every file a new inode sharing the block map of the live
+// file, as a clone does, so no file data is copied and the cost grows with the
+// number of inodes only. Updates are held back meanwhile (journal_lock_updates),
+// so the snapshot is a single point in time. Its inodes are flagged
+// INODE_READONLY; a file copied out of it with cp is writable again. A file of a
+// snapshot keeps the header of the live file it was taken from. The snapshot
+// directory is read-only as well, so a snapshot is a read-only directory entry
+// of a read-only /.snapshots, and only create_snapshot and delete_snapshot
+// change that directory.
+
+typedef struct snapshot_context {
+    FILE *disk;
+    uint32_t snapshots_dir;     // Directory of the snapshots, not copied into them
+    uint32_t *created;          // Inodes of the snapshot so far (released on failure)
+    uint32_t created_count;
+} snapshot_context;
+
+// Inode of 'name' in a directory, or 0 if it has no such entry
+static uint32_t find_directory_entry(FILE *disk, uint32_t dir_inode_number, const char *name) {
+    directory_block_t *dir = read_directory(disk, dir_inode_number);
+    uint32_t found = 0;
+    for (uint32_t i = 0; dir && i < dir->entries_count; i++) {
+        if (strcmp(dir->entries[i].name, name) == 0) found = dir->entries[i].inode;
     }
+    free(dir);
+    return found;
+}
 
-    free(file_data);
-
-    // 5. Overwrite updated metadata structures
-    // 5a. Group Descriptor
-    fseek(disk, BLOCK_SIZE, SEEK_SET);
-    fwrite(&gd, sizeof(gd), 1, disk);
-
-    // 5b. Block Bitmap
-    fseek(disk, gd.block_bitmap * BLOCK_SIZE, SEEK_SET);
-    fwrite(block_bitmap, BLOCKS_COUNT / 8, 1, disk);
+// Whether an inode is a read-only directory: a snapshot, or the directory holding them
+static bool is_readonly_directory(uint32_t inode_number) {
+    if (inode_number == 0 || inode_number >= INODES_COUNT) return false;
+    lock_inode_read(inode_number);
+    inode *node = &fs_meta.itable.inodes[inode_number];
+    bool readonly_directory = inode_is_allocated(inode_number) && node->file_type == 1 && inode_is_readonly(node);
+    unlock_inode(inode_number);
+    return readonly_directory;
+}
 
-    // 5c. Inode Bitmap
-    fseek(disk, gd.inode_bitmap * BLOCK_SIZE, SEEK_SET);
-    fwrite(inode_bitmap, INODES_COUNT / 8, 1, disk);
+// The snapshot directory, or 0 if the root has none (or '/.snapshots' is something else)
+static uint32_t find_snapshot_directory(FILE *disk) {
+    uint32_t snapshots_dir = find_directory_entry(disk, 0, SNAPSHOT_DIR_NAME);
+    if (snapshots_dir == 0) return 0;
+    if (!is_readonly_directory(snapshots_dir)) {
+        fprintf(stderr, "Error: '/%s' is not a snapshot directory.\n", SNAPSHOT_DIR_NAME);
+        return 0;
+    }
+    return snapshots_dir;
+}
 
-    // 5d. Inode Table
-    fseek(disk, gd.inode_table * BLOCK_SIZE, SEEK_SET);
-    fwrite(&itable, sizeof(itable), 1, disk);
+// Snapshot inode of a file: a read-only inode sharing its block map (0 on failure)
+static uint32_t snapshot_file(snapshot_context *ctx, uint32_t inode_number) {
+    inode_table *itable = &fs_meta.itable;
+    lock_inode_read(inode_number);
+    inode *src_inode = &itable->inodes[inode_number];
+    inode *copy = allocate_inode(itable, fs_meta.inode_bitmap, &fs_meta.gd, 0, src_inode->permissions | INODE_READONLY);
+    if (!copy) {
+        unlock_inode(inode_number);
+        return 0;
+    }
+    ctx->created[ctx->created_count++] = copy->inode_number;
+    copy->file_size = src_inode->file_size;
+    memcpy(copy->blocks, src_inode->blocks, sizeof(copy->blocks));
+    copy->single_indirect = src_inode->single_indirect;
+    copy->double_indirect = src_inode->double_indirect;
+    int status = share_block_map(copy);
+    unlock_inode(inode_number);
+
+    if (status != 0) {
+        fprintf(stderr, "Error: inode #%u has blocks with too many references.\n", inode_number);
+        memset(copy->blocks, 0, sizeof(copy->blocks));
+        copy->single_indirect = 0;
+        copy->double_indirect = 0;
+        return 0;
+    }
+    mark_inode_dirty(copy);
+    return copy->inode_number;
+}
 
-    if (VERBOSE) printf("File '%s.%s' created (inode #%u). Size=%lu bytes.\n", file_name, extension, file_inode->inode_number, file_size);
+/**
+ * Copy a directory and everything below it into a snapshot whose copy of the
+ * parent is 'snapshot_parent'.
+ *
+ * Returns: 0 on success with *out_inode set to the copy, or -1 on failure.
+ */
+static int snapshot_directory(snapshot_context *ctx, uint32_t dir_inode_number, uint32_t snapshot_parent,
+                              uint32_t *out_inode)
+{
+    FILE *disk = ctx->disk;
+    directory_block_t *dir = read_directory(disk, dir_inode_number);
+    directory_block_t *copy = dir ? allocate_directory_block(dir->entries_count) : NULL;
+    int status = -1;
+    if (!copy) goto done;
+
+    // 1. The copy of the directory
+    inode *snapshot_inode = allocate_inode(&fs_meta.itable, fs_meta.inode_bitmap, &fs_meta.gd, 1,
+                                           fs_meta.itable.inodes[dir_inode_number].permissions | INODE_READONLY);
+    if (!snapshot_inode) goto done;
+    uint32_t self = snapshot_inode->inode_number;
+    ctx->created[ctx->created_count++] = self;
+    snapshot_inode->file_type = 1;
+
+    // 2. Its entries, pointing to the copies of the files and subdirectories
+    copy->entries_count = 0;
+    for (uint32_t i = 0; i < dir->entries_count; i++) {
+        dir_entry_t entry = dir->entries[i];
+        if (strcmp(entry.name, ".") == 0) {
+            entry.inode = self;
+        } else if (strcmp(entry.name, "..") == 0) {
+            entry.inode = snapshot_parent;
+        } else if (entry.inode == ctx->snapshots_dir) {
+            continue;
+        } else if (entry.file_type == 1) {
+            if (snapshot_directory(ctx, entry.inode, self, &entry.inode) != 0) goto done;
+        } else {
+            entry.inode = snapshot_file(ctx, entry.inode);
+            if (entry.inode == 0) goto done;
+        }
+        copy->entries[copy->entries_count++] = entry;
+    }
 
-cleanup:
-    free(block_bitmap);
-    free(inode_bitmap);
-    fseek(disk, 0, SEEK_SET);
+    // 3. Write the entries into new blocks
+    size_t copy_size = sizeof(directory_block_t) + copy->entries_count * sizeof(dir_entry_t);
+    inode *node = &fs_meta.itable.inodes[self];
+    node->file_size = (uint32_t)copy_size;
+    for (size_t offset = 0; offset < copy_size; offset += BLOCK_SIZE) {
+        int block = allocate_data_block_for_inode(disk, node, offset / BLOCK_SIZE, fs_meta.block_bitmap, &fs_meta.gd);
+        if (block < 0) goto done;
+        size_t to_write = (copy_size - offset > BLOCK_SIZE) ? BLOCK_SIZE : copy_size - offset;
+        write_new_directory_block(disk, (uint32_t)block, (uint8_t *)copy + offset, to_write);
+    }
+    mark_inode_dirty(node);
+    *out_inode = self;
+    status = 0;
+
+done:
+    free(dir);
+    free(copy);
+    return status;
 }
 
-
 /**
- * @brief Deletes a file from the file system.
+ * @brief Takes a read-only snapshot of the whole volume as /.snapshots/<name>.
  *
- * This function deletes a file by its inode number and updates the parent directory.
- * It performs the following steps:
- * 1. Reads necessary structures from the disk, including the group descriptor, block bitmap, inode bitmap, and inode table.
- * 2. Validates the inode number to ensure it is within a valid range and allocated.
- * 3. Frees all data blocks used by the file and deallocates the inode.
- * 4. Removes the file entry from the parent directory and updates the parent directory block on the disk.
- * 5. Writes the updated metadata back to the disk, including the group descriptor, block bitmap, inode bitmap, and inode table.
+ * Every other operation waits until the snapshot is taken. The snapshot
+ * directory is made on first use. On failure (out of inodes or blocks) the
+ * part of the snapshot already made is released again.
  *
- * @param disk A pointer to the file representing the disk.
- * @param inode_number The inode number of the file to be deleted.
- * @param parent_inode_number The inode number of the parent directory.
+ * @param disk Pointer to the file representing the disk.
+ * @param name The name of the snapshot.
+ * @return The inode number of the snapshot root, or 0 on failure.
  */
-void delete_file(FILE *disk, uint32_t inode_number, uint32_t parent_inode_number) {
-    // 1. Read necessary structures from disk
-    // 1a. Read the group descriptor
-    group_descriptor gd;
-    fseek(disk, BLOCK_SIZE, SEEK_SET);
-    fread(&gd, sizeof(group_descriptor), 1, disk);
-
-    // 1b. Read the block bitmap
-    uint8_t *block_bitmap = (uint8_t *)malloc(BLOCKS_COUNT / 8);
-    fseek(disk, gd.block_bitmap * BLOCK_SIZE, SEEK_SET);
-    fread(block_bitmap, BLOCKS_COUNT / 8, 1, disk);
-
-    // 1c. Read the inode bitmap
-    uint8_t *inode_bitmap = (uint8_t *)malloc(INODES_COUNT / 8);
-    fseek(disk, gd.inode_bitmap * BLOCK_SIZE, SEEK_SET);
-    fread(inode_bitmap, INODES_COUNT / 8, 1, disk);
-
-    // 1d. Read the inode table
-    inode_table itable;
-    fseek(disk, gd.inode_table * BLOCK_SIZE, SEEK_SET);
-    fread(&itable, sizeof(inode_table), 1, disk);
-
-
-    // 2. Validate inode number
-    if (inode_number == 0 || inode_number > INODES_COUNT) {
-        fprintf(stderr, "Error: invalid inode number %u\n", inode_number);
+uint32_t create_snapshot(FILE *disk, const char *name) {
+    uint64_t metrics_start = metrics_now();
+
+    // 1. Hold back every other operation, then give delayed data its blocks
+    journal_lock_updates(&fs_journal);
+    flush_delayed_allocations(disk);
+    group_descriptor *gd = &fs_meta.gd;
+    uint8_t *block_bitmap = fs_meta.block_bitmap;
+    uint8_t *inode_bitmap = fs_meta.inode_bitmap;
+    inode_table *itable = &fs_meta.itable;
+    snapshot_context ctx = { disk, 0, NULL, 0 };
+    uint32_t snapshot_root = 0;
+
+    if (fs_meta.refcount_start == 0) {
+        fprintf(stderr, "Error: the drive has no block reference counts, snapshots cannot be taken.\n");
         goto cleanup;
     }
 
-    inode *file_inode = &itable.inodes[inode_number];
-
-    // Check if the inode is allocated
-    if (is_bit_free(inode_bitmap, inode_number)) {
-        fprintf(stderr, "Error: inode #%u is not allocated.\n", inode_number);
+    // 2. The (read-only) directory of the snapshots, and no snapshot of that name yet
+    if (find_directory_entry(disk, 0, SNAPSHOT_DIR_NAME) == 0) {
+        create_directory(disk, SNAPSHOT_DIR_NAME, 0644 | INODE_READONLY, 0);
+    }
+    ctx.snapshots_dir = find_snapshot_directory(disk);
+    if (ctx.snapshots_dir == 0) goto cleanup;
+    if (find_directory_entry(disk, ctx.snapshots_dir, name) != 0) {
+        fprintf(stderr, "Error: snapshot '%s' already exists.\n", name);
         goto cleanup;
     }
 
-    // 3. Free all data blocks used by the file and deallocate the inode
-    free_all_data_blocks_of_inode(disk, file_inode, block_bitmap, &gd);
-    deallocate_inode(&itable, inode_bitmap, &gd, inode_number);
-
-    // 4. Remove the file entry from the parent directory
-    // 4a. Read the parent directory block
-    directory_block_t *parent_dir_block = read_directory(disk, parent_inode_number);
-    if (!parent_dir_block) {
-        fprintf(stderr, "Error: could not read parent directory block.\n");
+    // 3. Copy the tree
+    ctx.created = (uint32_t *)malloc(INODES_COUNT * sizeof(uint32_t));
+    if (!ctx.created) {
+        fprintf(stderr, "Error: could not allocate memory for the snapshot.\n");
+        goto cleanup;
+    }
+    if (snapshot_directory(&ctx, 0, ctx.snapshots_dir, &snapshot_root) != 0) {
+        fprintf(stderr, "Error: could not take snapshot '%s'.\n", name);
+        for (uint32_t i = 0; i < ctx.created_count; i++) {
+            free_all_data_blocks_of_inode(disk, &itable->inodes[ctx.created[i]], block_bitmap, gd);
+            deallocate_inode(itable, inode_bitmap, gd, ctx.created[i]);
+        }
+        snapshot_root = 0;
+        write_metadata(disk, gd, block_bitmap, inode_bitmap, itable);
         goto cleanup;
     }
 
-    // 4b. Write the updated parent directory block back to disk
-    directory_block_t *new_parent_dir_block = remove_entry_from_directory_block(parent_dir_block, inode_number);
-    update_directory(disk, &itable, parent_inode_number, block_bitmap, &gd, new_parent_dir_block);
-
-    // 4c. Clean up the parent directory block
-    free(parent_dir_block);
-    free(new_parent_dir_block);
-
-    // 5. Write updated metadata back to disk
-    // 5a. Group Descriptor
-    fseek(disk, BLOCK_SIZE, SEEK_SET);
-    fwrite(&gd, sizeof(gd), 1, disk);
-
-    // 5b. Block Bitmap
-    fseek(disk, gd.block_bitmap * BLOCK_SIZE, SEEK_SET);
-    fwrite(block_bitmap, BLOCKS_COUNT / 8, 1, disk);
+    // 4. Add it to the snapshot directory
+    lock_directory(ctx.snapshots_dir);
+    directory_block_t *snapshots = read_directory(disk, ctx.snapshots_dir);
+    directory_block_t *new_snapshots = snapshots ? add_entry_to_directory_block(snapshots, snapshot_root, name, 1) : NULL;
+    if (new_snapshots) {
+        update_directory(disk, itable, ctx.snapshots_dir, block_bitmap, gd, new_snapshots);
+        dcache_insert(&dentry_cache, ctx.snapshots_dir, name, snapshot_root, 1);
+    }
+    free(snapshots);
+    free(new_snapshots);
+    unlock_directory(ctx.snapshots_dir);
 
-    // 5c. Inode Bitmap
-    fseek(disk, gd.inode_bitmap * BLOCK_SIZE, SEEK_SET);
-    fwrite(inode_bitmap, INODES_COUNT / 8, 1, disk);
+    // 5. Log the metadata once for the whole snapshot
+    write_metadata(disk, gd, block_bitmap, inode_bitmap, itable);
+    if (VERBOSE) printf("Snapshot '%s' taken (%u inodes).\n", name, ctx.created_count);
 
-    // 5d. Inode Table
-    fseek(disk, gd.inode_table * BLOCK_SIZE, SEEK_SET);
-    fwrite(&itable, sizeof(itable), 1, disk);
+cleanup:
+    free(ctx.created);
+    journal_unlock_updates(&fs_journal, disk);
+    metrics_record(METRIC_SNAPSHOT, metrics_start);
+    return snapshot_root;
+}
 
-    if (VERBOSE) printf("File with inode #%u deleted successfully.\n", inode_number);
+/**
+ * @brief Deletes the snapshot /.snapshots/<name> and releases what only it uses.
+ *
+ * Only a read-only directory of the read-only snapshot directory is deleted
+ * (remove_directory checks both again under the directory locks).
+ *
+ * @param disk Pointer to the file representing the disk.
+ * @param name The name of the snapshot.
+ * @return 0 on success, -1 if there is no such snapshot.
+ */
+int delete_snapshot(FILE *disk, const char *name) {
+    uint32_t snapshots_dir = find_snapshot_directory(disk);
+    uint32_t snapshot_root = snapshots_dir ? find_directory_entry(disk, snapshots_dir, name) : 0;
+    if (snapshot_root == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        fprintf(stderr, "Error: snapshot '%s' not found.\n", name);
+        return -1;
+    }
+    return remove_directory(disk, snapshot_root, snapshots_dir, true);
+}
 
-cleanup:
-    free(block_bitmap);
-    free(inode_bitmap);
+// [FRAGMENTATION]
+# define FRAG_WORST_FILES 10     // Most fragmented files listed by the report
+# define FRAG_RUN_BUCKETS 16     // Free runs of 1, 2-3, 4-7, ... blocks; the last one everything longer
+# define DEFRAG_CHUNK_BLOCKS 256 // Blocks copied per drive write when a file is moved
+# define DEFRAG_SKIPPED -2       // defragment_file: the file shares blocks or has delayed data
+
+typedef struct free_run_stats {
+    uint32_t runs;
+    uint32_t blocks;
+    uint32_t largest;
+    uint32_t buckets[FRAG_RUN_BUCKETS];
+} free_run_stats;
+
+static void count_free_run(uint32_t start, uint32_t length, void *arg) {
+    free_run_stats *stats = (free_run_stats *)arg;
+    (void)start;
+    uint32_t bucket = 0;
+    while (bucket + 1 < FRAG_RUN_BUCKETS && (length >> (bucket + 1)) != 0) bucket++;
+    stats->buckets[bucket]++;
+    stats->runs++;
+    stats->blocks += length;
+    if (length > stats->largest) stats->largest = length;
 }
 
+typedef struct fragmented_file {
+    uint32_t inode_number;
+    uint32_t file_type;
+    uint32_t blocks;
+    uint32_t extents;
+} fragmented_file;
 
 /**
- * @brief Modifies the content of an existing file in the file system.
+ * @brief Prints how scattered the files and the free space of the drive are.
  *
- * This function finds the file by its inode number and either appends new data
- * or overwrites the file's content based on the specified mode (-o or -a).
- * The function updates the file's metadata and ensures changes are reflected
- * on the disk.
+ * Walks the block map of every inode and counts its extents, builds a
+ * histogram of the free run lengths from the free extent index and lists the
+ * most fragmented files. Delayed data is flushed and the allocation windows of
+ * all threads are returned first, so that both are counted where they really are.
  *
  * @param disk Pointer to the file representing the disk.
- * @param inode_number The inode number of the file to be modified.
- * @param new_data The new content to write into the file.
- * @param mode The mode of operation: "-o" for overwrite, "-a" for append.
  */
-void write_file(FILE *disk, uint32_t inode_number, const char *new_data, const char *mode) {
-    // 1. Read necessary structures from disk
-    // 1a. Read the group descriptor
-    group_descriptor gd;
-    fseek(disk, BLOCK_SIZE, SEEK_SET);
-    fread(&gd, sizeof(group_descriptor), 1, disk);
+void print_fragmentation(FILE *disk) {
+    flush_delayed_allocations(disk);
+    release_reservations();
 
-    // 1b. Read the block bitmap
-    uint8_t *block_bitmap = (uint8_t *)malloc(BLOCKS_COUNT / 8);
-    fseek(disk, gd.block_bitmap * BLOCK_SIZE, SEEK_SET);
-    fread(block_bitmap, BLOCKS_COUNT / 8, 1, disk);
+    // 1. Extents of every file and directory
+    uint32_t files = 0, fragmented = 0;
+    uint64_t data_blocks = 0, extents = 0;
+    fragmented_file worst[FRAG_WORST_FILES];
+    uint32_t worst_count = 0;
 
-    // 1c. Read the inode bitmap
-    uint8_t *inode_bitmap = (uint8_t *)malloc(INODES_COUNT / 8);
-    fseek(disk, gd.inode_bitmap * BLOCK_SIZE, SEEK_SET);
-    fread(inode_bitmap, INODES_COUNT / 8, 1, disk);
+    for (uint32_t i = 0; i < INODES_COUNT; i++) {
+        if (!inode_is_allocated(i)) continue;
+
+        lock_inode_read(i);
+        mapped_block *blocks;
+        int count = collect_data_blocks(disk, &fs_meta.itable.inodes[i], &blocks);
+        uint32_t file_type = fs_meta.itable.inodes[i].file_type;
+        unlock_inode(i);
+        if (count < 0) {
+            fprintf(stderr, "Error: could not allocate memory for the block map of inode #%u.\n", i);
+            continue;
+        }
+        if (count == 0) continue;
+
+        uint32_t e = count_extents(blocks, (uint32_t)count);
+        free(blocks);
+
+        files++;
+        data_blocks += (uint32_t)count;
+        extents += e;
+        if (e < 2) continue;
+        fragmented++;
+
+        // Keep the most fragmented files, most extents first
+        if (worst_count < FRAG_WORST_FILES || e > worst[worst_count - 1].extents) {
+            uint32_t k = (worst_count < FRAG_WORST_FILES) ? worst_count++ : worst_count - 1;
+            while (k > 0 && worst[k - 1].extents < e) {
+                worst[k] = worst[k - 1];
+                k--;
+            }
+            worst[k] = (fragmented_file){ i, file_type, (uint32_t)count, e };
+        }
+    }
 
-    // 1d. Read the inode table
-    inode_table itable;
-    fseek(disk, gd.inode_table * BLOCK_SIZE, SEEK_SET);
-    fread(&itable, sizeof(inode_table), 1, disk);
+    // 2. Free runs
+    free_run_stats runs;
+    memset(&runs, 0, sizeof(runs));
+    pthread_mutex_lock(&alloc_lock);
+    extent_index_for_each(&free_extents, count_free_run, &runs);
+    pthread_mutex_unlock(&alloc_lock);
+
+    // 3. Report
+    printf("Files with data        : %u (%u fragmented)\n", files, fragmented);
+    printf("Data blocks            : %lu in %lu extents (%.2f extents per file)\n", (unsigned long)data_blocks,
+           (unsigned long)extents, files ? (double)extents / files : 0.0);
+    printf("Free blocks            : %u in %u runs (largest %u blocks)\n", runs.blocks, runs.runs, runs.largest);
+    printf("Free run lengths       :\n");
+    for (uint32_t b = 0; b < FRAG_RUN_BUCKETS; b++) {
+        if (runs.buckets[b] == 0) continue;
+        char range[32];
+        if (b + 1 == FRAG_RUN_BUCKETS) snprintf(range, sizeof(range), "%u+", 1u << b);
+        else if (b == 0) snprintf(range, sizeof(range), "1");
+        else snprintf(range, sizeof(range), "%u-%u", 1u << b, (2u << b) - 1);
+        printf("  %-20s : %u\n", range, runs.buckets[b]);
+    }
+    if (worst_count == 0) return;
+
+    printf("Most fragmented        :\n");
+    printf("  %-8s %-5s %8s %8s  %s\n", "inode", "type", "blocks", "extents", "name");
+    for (uint32_t i = 0; i < worst_count; i++) {
+        char name[MAX_FILENAME_LEN + 20] = "";
+        inode *node = &fs_meta.itable.inodes[worst[i].inode_number];
+        file_t header;
+        lock_inode_read(worst[i].inode_number);
+        if (worst[i].file_type == 0 && node->file_size >= sizeof(file_t) &&
+            read_inode_data(disk, node, (char *)&header, offsetof(file_t, size)) == 0) {
+            header.name[sizeof(header.name) - 1] = '\0';
+            header.extension[sizeof(header.extension) - 1] = '\0';
+            snprintf(name, sizeof(name), "%s%s%s", header.name, header.extension[0] ? "." : "", header.extension);
+        }
+        unlock_inode(worst[i].inode_number);
+        printf("  %-8u %-5s %8u %8u  %s\n", worst[i].inode_number, worst[i].file_type == 0 ? "file" : "dir",
+               worst[i].blocks, worst[i].extents, name);
+    }
+}
 
-    // 2. Validate inode number
-    if (inode_number == 0 || inode_number > INODES_COUNT) {
+/**
+ * @brief Moves the data blocks of one file into a single contiguous free run.
+ *
+ * The smallest free extent that holds all mapped blocks of the file is claimed
+ * (best fit), the data is copied there DEFRAG_CHUNK_BLOCKS blocks per write,
+ * the block map is pointed at the new blocks through the journal and the old
+ * blocks are freed, all in one transaction: after a crash the file maps either
+ * the old or the new copy. Indirect blocks stay where they are and holes stay
+ * holes. A file that is already contiguous, or for which no free run is large
+ * enough, is left alone, as is a file that shares blocks with another one or
+ * still has delayed data.
+ *
+ * @param disk Pointer to the file representing the disk.
+ * @param inode_number The inode number of the file.
+ * @return The number of blocks moved, 0 if the file is contiguous or no free run
+ *         is large enough, DEFRAG_SKIPPED if it shares blocks or has delayed
+ *         data, or -1 on failure.
+ */
+int defragment_file(FILE *disk, uint32_t inode_number) {
+    uint64_t metrics_start = metrics_now();
+    // 1. Validate inode number
+    if (inode_number == 0 || inode_number >= INODES_COUNT) {
         fprintf(stderr, "Error: invalid inode number %u\n", inode_number);
-        goto cleanup;
+        return -1;
     }
 
-    inode *file_inode = &itable.inodes[inode_number];
-
-    // Check if the inode is allocated
-    if (is_bit_free(inode_bitmap, inode_number)) {
+    // 2. Lock the file and use the in-memory metadata
+    journal_start(&fs_journal);
+    group_descriptor *gd = &fs_meta.gd;
+    uint8_t *block_bitmap = fs_meta.block_bitmap;
+    inode_table *itable = &fs_meta.itable;
+    lock_inode_write(inode_number);
+
+    int moved = -1;
+    int count = 0;
+    int run_start = -1;
+    mapped_block *blocks = NULL;
+    uint8_t *buffer = NULL;
+    inode *file_inode = &itable->inodes[inode_number];
+
+    if (!inode_is_allocated(inode_number)) {
         fprintf(stderr, "Error: inode #%u is not allocated.\n", inode_number);
         goto cleanup;
     }
 
-    // Check if the inode is a file
     if (file_inode->file_type != 0) {
         fprintf(stderr, "Error: inode #%u is not a file.\n", inode_number);
         goto cleanup;
     }
 
-    // 3. Read the existing file metadata
-    file_t *old_file = (file_t *)malloc(sizeof(file_t) + file_inode->file_size);
-    if (!old_file) {
-        fprintf(stderr, "Error: could not allocate memory for existing file metadata.\n");
+    // Delayed data has no blocks yet (and gets one contiguous run when flushed)
+    if (delalloc_lookup(&pending_writes, inode_number)) {
+        moved = DEFRAG_SKIPPED;
         goto cleanup;
     }
 
-    if (read_inode_data(disk, file_inode, (char *)old_file, file_inode->file_size) != 0) {
-        fprintf(stderr, "Error: could not read existing file metadata.\n");
-        free(old_file);
+    // 3. Read the block map; nothing to do for a contiguous file
+    count = collect_data_blocks(disk, file_inode, &blocks);
+    if (count < 0) {
+        fprintf(stderr, "Error: could not allocate memory for the block map of inode #%u.\n", inode_number);
+        goto cleanup;
+    }
+    if (count_extents(blocks, (uint32_t)count) < 2) {
+        moved = 0;
         goto cleanup;
     }
 
-    // 4. Determine the new content size and behavior based on mode
-    size_t old_data_size = file_inode->file_size - sizeof(file_t);
-    size_t new_data_size = strlen(new_data);
-    size_t total_data_size;
+    // Blocks shared with other files (directly or through an indirect block of a
+    // clone) would be stored twice once moved
+    if ((file_inode->single_indirect != 0 && block_extra_refs(file_inode->single_indirect) > 0) ||
+        (file_inode->double_indirect != 0 && block_extra_refs(file_inode->double_indirect) > 0)) {
+        moved = DEFRAG_SKIPPED;
+        goto cleanup;
+    }
+    for (int i = 0; i < count; i++) {
+        if (block_extra_refs(blocks[i].physical) > 0) {
+            moved = DEFRAG_SKIPPED;
+            goto cleanup;
+        }
+    }
 
-    if (strcmp(mode, "-o") == 0) {
-        // Overwrite mode: replace old data with new data
-        free_all_data_blocks_of_inode(disk, file_inode, block_bitmap, &gd);
-        total_data_size = new_data_size;
-    } else if (strcmp(mode, "-a") == 0) {
-        // Append mode: add new data to the existing data
-        total_data_size = old_data_size + new_data_size;
-    } else {
-        fprintf(stderr, "Error: invalid mode '%s'. Use -o for overwrite or -a for append.\n", mode);
-        free(old_file);
+    buffer = (uint8_t *)malloc((size_t)DEFRAG_CHUNK_BLOCKS * BLOCK_SIZE);
+    if (!buffer) {
+        fprintf(stderr, "Error: could not allocate memory to move inode #%u.\n", inode_number);
         goto cleanup;
     }
 
-    size_t new_file_size = sizeof(file_t) + total_data_size;
-    file_t *new_file = (file_t *)malloc(new_file_size);
-    if (!new_file) {
-        fprintf(stderr, "Error: could not allocate memory for new file content.\n");
-        free(old_file);
+    // 4. Claim the smallest free run that holds the whole file
+    pthread_mutex_lock(&alloc_lock);
+    release_committed_frees_locked();
+    run_start = extent_index_best_fit(&free_extents, (uint32_t)count);
+    if (run_start >= 0) {
+        claim_blocks_locked((uint32_t)run_start, (uint32_t)count);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    if (run_start < 0) {
+        moved = 0;
         goto cleanup;
     }
 
-    // Copy metadata from the old file
-    strncpy(new_file->name, old_file->name, sizeof(new_file->name) - 1);
-    strncpy(new_file->extension, old_file->extension, sizeof(new_file->extension) - 1);
-    new_file->name[sizeof(new_file->name) - 1] = '\0';
-    new_file->extension[sizeof(new_file->extension) - 1] = '\0';
-    new_file->inode = old_file->inode;
-    new_file->size = new_file_size;
+    uint32_t new_start = FIRST_DATA_BLOCK + (uint32_t)run_start;
+    for (int i = 0; i < count; i++) {
+        journal_revoke(&fs_journal, new_start + i);
+    }
+    metrics_add(&metrics.block_allocations, (uint64_t)count);
 
-    // Copy existing data and append new data
-    if (strcmp(mode, "-a") == 0) {
-        memcpy(new_file->data, old_file->data, old_data_size);
-        memcpy(new_file->data + old_data_size, new_data, new_data_size);
-    } else {
-        memset(new_file->data, 0, total_data_size); // Clear data in overwrite mode
-        memcpy(new_file->data, new_data, new_data_size);
+    // 5. Copy the data into the run
+    for (int i = 0; i < count; i += DEFRAG_CHUNK_BLOCKS) {
+        int chunk = (count - i < DEFRAG_CHUNK_BLOCKS) ? count - i : DEFRAG_CHUNK_BLOCKS;
+        for (int k = 0; k < chunk; k++) {
+            journal_read(&fs_journal, disk, blocks[i + k].physical, 0, buffer + (size_t)k * BLOCK_SIZE, BLOCK_SIZE);
+        }
+        disk_write(disk, (uint64_t)(new_start + i) * BLOCK_SIZE, buffer, (size_t)chunk * BLOCK_SIZE);
     }
 
-    // 5. Write the new file data to blocks
-    file_inode->file_size = (uint32_t)new_file_size;
-    size_t needed_blocks = (new_file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    uint8_t *src_ptr = (uint8_t *)new_file;
-    size_t bytes_written = 0;
+    // 6. Point the block map at the run (every indirect block already exists)
+    //    and free the old blocks
+    for (int i = 0; i < count; i++) {
+        map_data_block_to_inode(disk, file_inode, blocks[i].logical, new_start + i, block_bitmap, gd);
+    }
+    for (int i = 0; i < count; i++) {
+        free_data_block(block_bitmap, gd, (int)blocks[i].physical);
+    }
 
-    for (size_t i = 0; i < needed_blocks; i++) {
-        int allocated_block = allocate_data_block_for_inode(disk, file_inode, i, block_bitmap, &gd);
-        if (allocated_block < 0) {
-            fprintf(stderr, "Error: could not allocate data block for file.\n");
-            free(old_file);
-            free(new_file);
-            goto cleanup;
-        }
+    mark_inode_dirty(file_inode);
+    moved = count;
 
-        size_t offset = i * BLOCK_SIZE;
-        size_t bytes_left = new_file_size - offset;
-        size_t to_write = (bytes_left > BLOCK_SIZE) ? BLOCK_SIZE : bytes_left;
+    if (VERBOSE) printf("File with inode #%u moved to blocks %u-%u.\n", inode_number, new_start, new_start + count - 1);
 
-        // Zero out the entire block before writing (to clear residual data)
-        uint8_t temp_block[BLOCK_SIZE] = {0};
-        memcpy(temp_block, src_ptr + offset, to_write);
-        fseek(disk, allocated_block * BLOCK_SIZE, SEEK_SET);
-        fwrite(temp_block, BLOCK_SIZE, 1, disk);
+cleanup:
+    unlock_inode(inode_number);
+    // 7. Write updated metadata back to disk (with the inode unlocked)
+    write_metadata(disk, gd, block_bitmap, NULL, itable);
+    journal_stop(&fs_journal, disk);
+    free(blocks);
+    free(buffer);
+    metrics_record(METRIC_DEFRAGMENT_FILE, metrics_start);
+    return moved;
+}
 
-        bytes_written += to_write;
+/**
+ * @brief Defragments every fragmented file of the drive, in inode order.
+ *
+ * Each file is moved in its own transaction (see defragment_file), so the
+ * drive stays usable by other threads while this runs.
+ *
+ * @param disk Pointer to the file representing the disk.
+ * @return 0 on success, or -1 if a file could not be moved.
+ */
+int defragment_drive(FILE *disk) {
+    flush_delayed_allocations(disk);
+    release_reservations();
+
+    uint32_t fragmented = 0, defragmented = 0, no_room = 0, skipped = 0;
+    uint64_t moved_blocks = 0;
+    int status = 0;
+    for (uint32_t i = 1; i < INODES_COUNT; i++) {
+        if (!inode_is_allocated(i)) continue;
+
+        // Only fragmented files are moved (the check is repeated under the write lock)
+        lock_inode_read(i);
+        mapped_block *blocks;
+        uint32_t extents = 0;
+        bool is_file = fs_meta.itable.inodes[i].file_type == 0;
+        int count = is_file ? collect_data_blocks(disk, &fs_meta.itable.inodes[i], &blocks) : 0;
+        if (count > 0) {
+            extents = count_extents(blocks, (uint32_t)count);
+            free(blocks);
+        }
+        unlock_inode(i);
+        if (extents < 2) continue;
+        fragmented++;
+
+        int moved = defragment_file(disk, i);
+        if (moved > 0) {
+            defragmented++;
+            moved_blocks += (uint32_t)moved;
+        } else if (moved == 0) {
+            no_room++;
+        } else if (moved == DEFRAG_SKIPPED) {
+            skipped++;
+        } else {
+            status = -1;
+        }
     }
 
-    free(old_file);
-    free(new_file);
+    if (VERBOSE) {
+        printf("Defragmented %u of %u fragmented files (%lu blocks moved).\n", defragmented, fragmented,
+               (unsigned long)moved_blocks);
+        if (no_room > 0) printf("%u files were left in place: no free run is large enough.\n", no_room);
+        if (skipped > 0) printf("%u files were left in place: they share blocks or have delayed data.\n", skipped);
+    }
+    return status;
+}
 
-    // 6. Write updated metadata back to disk
-    // 6a. Group Descriptor
-    fseek(disk, BLOCK_SIZE, SEEK_SET);
-    fwrite(&gd, sizeof(gd), 1, disk);
+// [PATH FUNCTIONS]
+# define ROOT_INODE_NUMBER 0
+
+/**
+ * @brief Looks up a single name inside a directory.
+ *
+ * The dentry cache is consulted first. On a miss the directory is read once,
+ * all of its entries are added to the cache and, if the name is absent, a
+ * negative entry is recorded so that repeated misses do not touch the disk.
+ *
+ * @param disk Pointer to the disk file.
+ * @param dir_inode_number The inode number of the directory to search.
+ * @param name The entry name to look up.
+ * @param out_inode Receives the inode number of the entry.
+ * @param out_file_type Receives the file type of the entry (0 = file, 1 = directory).
+ * @return 0 if the name was found, -1 otherwise.
+ */
+int lookup_name(FILE *disk, uint32_t dir_inode_number, const char *name, uint32_t *out_inode, uint8_t *out_file_type) {
+    metrics_add(&metrics.lookups, 1);
+    int cached = dcache_lookup(&dentry_cache, dir_inode_number, name, out_inode, out_file_type);
+    metrics_add(cached == DCACHE_MISS ? &metrics.dcache_misses : &metrics.dcache_hits, 1);
+    if (cached == DCACHE_HIT) return 0;
+    if (cached == DCACHE_NEGATIVE) return -1;
+
+    // Entries are cached under the directory lock so that a concurrent create or
+    // delete in this directory cannot be overwritten with stale entries
+    lock_directory(dir_inode_number);
+    directory_block_t *dir_block = read_directory(disk, dir_inode_number);
+    if (!dir_block) {
+        unlock_directory(dir_inode_number);
+        return -1;
+    }
 
-    // 6b. Block Bitmap
-    fseek(disk, gd.block_bitmap * BLOCK_SIZE, SEEK_SET);
-    fwrite(block_bitmap, BLOCKS_COUNT / 8, 1, disk);
+    int found = -1;
+    uint64_t compared = 0;
+    for (size_t i = 0; i < dir_block->entries_count; i++) {
+        dir_entry_t *entry = &dir_block->entries[i];
+        dcache_insert(&dentry_cache, dir_inode_number, entry->name, entry->inode, entry->file_type);
+        if (found == 0) continue;
+
+        compared++;
+        if (strcmp(entry->name, name) == 0) {
+            *out_inode = entry->inode;
+            *out_file_type = entry->file_type;
+            found = 0;
+        }
+    }
+    metrics_add(&metrics.entries_compared, compared);
+    free(dir_block);
 
-    // 6c. Inode Bitmap
-    fseek(disk, gd.inode_bitmap * BLOCK_SIZE, SEEK_SET);
-    fwrite(inode_bitmap, INODES_COUNT / 8, 1, disk);
+    if (found != 0) {
+        dcache_insert_negative(&dentry_cache, dir_inode_number, name);
+    }
+    unlock_directory(dir_inode_number);
+    return found;
+}
 
-    // 6d. Inode Table
-    fseek(disk, gd.inode_table * BLOCK_SIZE, SEEK_SET);
-    fwrite(&itable, sizeof(inode_table), 1, disk);
+/**
+ * @brief Resolves a path to an inode, component by component.
+ *
+ * Absolute paths ("/a/b") start at the root directory, relative paths
+ * ("a/b", "../c") at 'cwd_inode_number'. Every intermediate component must be
+ * a directory. An empty path or "/" resolves to the start directory itself.
+ *
+ * @return 0 on success, or -1 if a component does not exist or is not a directory.
+ */
+int resolve_path(FILE *disk, uint32_t cwd_inode_number, const char *path, uint32_t *out_inode, uint8_t *out_file_type) {
+    uint32_t current = (path[0] == '/') ? ROOT_INODE_NUMBER : cwd_inode_number;
+    uint8_t current_type = 1;
+
+    const char *p = path;
+    while (*p) {
+        // Skip separators
+        while (*p == '/') p++;
+        if (*p == '\0') break;
+
+        // Extract the next component
+        const char *end = strchr(p, '/');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        if (len > MAX_FILENAME_LEN) return -1;
+
+        char component[MAX_FILENAME_LEN + 1];
+        memcpy(component, p, len);
+        component[len] = '\0';
+        p += len;
+
+        if (current_type != 1) return -1; // Cannot descend into a file
+        if (strcmp(component, ".") == 0) continue;
+
+        if (lookup_name(disk, current, component, &current, &current_type) != 0) {
+            return -1;
+        }
+    }
 
-    if (VERBOSE) printf("File with inode #%u updated successfully. New size: %lu bytes.\n", inode_number, new_file_size);
+    *out_inode = current;
+    *out_file_type = current_type;
+    return 0;
+}
 
-cleanup:
-    free(block_bitmap);
-    free(inode_bitmap);
-    fseek(disk, 0, SEEK_SET);
+/**
+ * @brief Resolves the directory that contains the last component of a path.
+ *
+ * "a/b/c" resolves "a/b" and returns "c" in 'leaf'; "x" returns the current
+ * directory. Trailing slashes are ignored.
+ *
+ * @param leaf Buffer of at least MAX_FILENAME_LEN + 1 bytes receiving the last component.
+ * @return 0 on success, or -1 if the parent does not exist or the path has no last component.
+ */
+int resolve_parent(FILE *disk, uint32_t cwd_inode_number, const char *path, uint32_t *out_parent, char *leaf) {
+    size_t len = strlen(path);
+    while (len > 0 && path[len - 1] == '/') len--;
+    if (len == 0) return -1;
+
+    size_t leaf_start = len;
+    while (leaf_start > 0 && path[leaf_start - 1] != '/') leaf_start--;
+    if (len - leaf_start > MAX_FILENAME_LEN) return -1;
+
+    memcpy(leaf, path + leaf_start, len - leaf_start);
+    leaf[len - leaf_start] = '\0';
+
+    char parent_path[MAX_INPUT_SIZE];
+    if (leaf_start >= sizeof(parent_path)) return -1;
+    memcpy(parent_path, path, leaf_start);
+    parent_path[leaf_start] = '\0';
+    if (leaf_start == 0 && path[0] == '/') strcpy(parent_path, "/");
+
+    uint8_t parent_type;
+    if (resolve_path(disk, cwd_inode_number, parent_path, out_parent, &parent_type) != 0 || parent_type != 1) {
+        return -1;
+    }
+    return 0;
 }
 
+// [END PATH FUNCTIONS]
+
 
 // [CLI FUNCTIONS]
-# define MAX_INPUT_SIZE 1024
+// Command handlers return 0, or -1 if the command was rejected (target not found,
+// bad arguments); failures inside the filesystem operation itself are only printed.
 # define RED     "\033[1;31m"
 # define GREEN   "\033[1;32m"
 # define YELLOW  "\033[1;33m"
@@ -1540,11 +5184,18 @@ cleanup:
 # define RESET   "\033[0m"
 
 // Function to list directory contents
-void list_directory_cli(FILE *disk, uint32_t inode_number) {
-    directory_block_t *dir_block = read_directory(disk, inode_number);
+int list_directory_cli(FILE *disk, uint32_t inode_number, const char *path) {
+    uint32_t dir_inode_number;
+    uint8_t file_type;
+    if (resolve_path(disk, inode_number, path, &dir_inode_number, &file_type) != 0 || file_type != 1) {
+        fprintf(stderr, "Error: directory '%s' not found.\n", path);
+        return -1;
+    }
+
+    directory_block_t *dir_block = read_directory(disk, dir_inode_number);
     if (!dir_block) {
         fprintf(stderr, "Error: could not read directory block.\n");
-        return;
+        return -1;
     }
 
     for (size_t i = 0; i < dir_block->entries_count; i++) {
@@ -1552,40 +5203,39 @@ void list_directory_cli(FILE *disk, uint32_t inode_number) {
 
         char *file_type = (entry->file_type == 0) ? "file" : "dir";
         
+        if (!VERBOSE) continue;
         if (entry->file_type == 1) {
             printf(BLUE "%s (%s, inode=%u)\n" RESET, entry->name, file_type, entry->inode);
         } else {
             printf("%s (%s, inode=%u)\n", entry->name, file_type, entry->inode);
         }
     }
+    free(dir_block);
+    return 0;
 }
 
-void read_file_cli(FILE *disk, uint32_t inode_number, char *filename) {
-    directory_block_t *dir_block = read_directory(disk, inode_number);
-    if (!dir_block) {
-        fprintf(stderr, "Error: could not read directory block.\n");
-        return;
+// Resolve a path that must name a regular file, printing an error otherwise
+int resolve_file_cli(FILE *disk, uint32_t inode_number, const char *path, uint32_t *out_inode) {
+    uint8_t file_type;
+    if (resolve_path(disk, inode_number, path, out_inode, &file_type) != 0 || file_type != 0) {
+        fprintf(stderr, "Error: file '%s' not found.\n", path);
+        return -1;
     }
+    return 0;
+}
 
+int read_file_cli(FILE *disk, uint32_t inode_number, char *filename) {
     // Find the inode number of the file
-    uint32_t file_inode_number = -1;
-    for (size_t i = 0; i < dir_block->entries_count; i++) {
-        dir_entry_t *entry = &dir_block->entries[i];
-        if (strcmp(entry->name, filename) == 0) {
-            file_inode_number = entry->inode;
-            break;
-        }
-    }
-    if (file_inode_number == -1) {
-        fprintf(stderr, "Error: file '%s' not found.\n", filename);
-        return;
+    uint32_t file_inode_number;
+    if (resolve_file_cli(disk, inode_number, filename, &file_inode_number) != 0) {
+        return -1;
     }
 
     // Read the file data
     file_t *file_data = read_file(disk, file_inode_number);
     if (!file_data) {
         fprintf(stderr, "Error: could not read file data.\n");
-        return;
+        return -1;
     }
 
     if (VERBOSE) {
@@ -1595,200 +5245,577 @@ void read_file_cli(FILE *disk, uint32_t inode_number, char *filename) {
         printf("File Data:\n%s\n", file_data->data);
     }
     free(file_data);
+    return 0;
 }
 
-void write_file_cli(FILE *disk, uint32_t inode_number, const char *filename, const char *mode, const char *new_content) {
-    // Locate the file in the current directory
-    directory_block_t *dir_block = read_directory(disk, inode_number);
-    if (!dir_block) {
-        fprintf(stderr, "Error: could not read directory block.\n");
-        return;
+int write_file_cli(FILE *disk, uint32_t inode_number, const char *filename, const char *mode, const char *new_content) {
+    // Locate the file
+    uint32_t file_inode_number;
+    if (resolve_file_cli(disk, inode_number, filename, &file_inode_number) != 0) {
+        return -1;
     }
 
-    uint32_t file_inode_number = -1;
-    for (size_t i = 0; i < dir_block->entries_count; i++) {
-        dir_entry_t *entry = &dir_block->entries[i];
-        if (strcmp(entry->name, filename) == 0) {
-            file_inode_number = entry->inode;
-            break;
-        }
+    // Update the file's content based on the mode
+    write_file(disk, file_inode_number, new_content, mode);
+    return 0;
+}
+
+// Parse a size or offset argument: decimal digits only (no sign) that fit 32 bits
+int parse_size_cli(const char *text, uint32_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long long value = isdigit((unsigned char)text[0]) ? strtoull(text, &end, 10) : 0;
+    if (!isdigit((unsigned char)text[0]) || errno != 0 || *end != '\0' || value > UINT32_MAX) {
+        fprintf(stderr, "Error: invalid size '%s'.\n", text);
+        return -1;
     }
+    *out = (uint32_t)value;
+    return 0;
+}
 
-    if (file_inode_number == -1) {
-        fprintf(stderr, "Error: file '%s' not found.\n", filename);
-        free(dir_block);
-        return;
+int truncate_file_cli(FILE *disk, uint32_t inode_number, const char *filename, uint32_t size) {
+    uint32_t file_inode_number;
+    if (resolve_file_cli(disk, inode_number, filename, &file_inode_number) != 0) {
+        return -1;
     }
 
-    // Update the file's content based on the mode
-    write_file(disk, file_inode_number, new_content, mode);
+    truncate_file(disk, file_inode_number, size);
+    return 0;
+}
 
-    free(dir_block);
+int fallocate_file_cli(FILE *disk, uint32_t inode_number, const char *filename, uint32_t offset, uint32_t len) {
+    uint32_t file_inode_number;
+    if (resolve_file_cli(disk, inode_number, filename, &file_inode_number) != 0) {
+        return -1;
+    }
+
+    fallocate_file(disk, file_inode_number, offset, len);
+    return 0;
 }
 
-// Function to change directory
-int change_directory(FILE *disk, char *current_dirname, uint32_t inode_number, const char *dirname) {
-    directory_block_t *dir_block = read_directory(disk, inode_number);
-    if (!dir_block) {
-        fprintf(stderr, "Error: could not read directory block.\n");
+int defragment_cli(FILE *disk, uint32_t inode_number, const char *filename) {
+    if (!filename) return defragment_drive(disk);
+
+    uint32_t file_inode_number;
+    if (resolve_file_cli(disk, inode_number, filename, &file_inode_number) != 0) {
         return -1;
     }
 
-    // Find the inode number of the directory to change to
-    uint32_t new_inode_number = -1;
-    for (size_t i = 0; i < dir_block->entries_count; i++) {
-        dir_entry_t *entry = &dir_block->entries[i];
-        if (strcmp(entry->name, dirname) == 0 && entry->file_type == 1) {
-            new_inode_number = entry->inode;
-            break;
+    flush_delayed_allocations(disk);
+    int moved = defragment_file(disk, file_inode_number);
+    if (moved == DEFRAG_SKIPPED && VERBOSE) printf("File '%s' was left in place: it shares blocks or has delayed data.\n", filename);
+    else if (moved == 0 && VERBOSE) printf("File '%s' was left in place.\n", filename);
+    return moved == -1 ? -1 : 0;
+}
+
+/**
+ * @brief Copies a file. The copy is a clone sharing the blocks of the source
+ * when the drive has a refcount table (always with "--reflink", which fails
+ * otherwise); without one the content is read and written again. A destination
+ * that is a directory receives a file with the name of the source.
+ */
+int copy_file_cli(FILE *disk, uint32_t inode_number, const char *src, const char *dst, bool reflink) {
+    uint32_t src_parent_inode_number;
+    uint32_t src_inode_number;
+    char src_leaf[MAX_FILENAME_LEN + 1];
+    if (resolve_file_cli(disk, inode_number, src, &src_inode_number) != 0 ||
+        resolve_parent(disk, inode_number, src, &src_parent_inode_number, src_leaf) != 0) {
+        return -1;
+    }
+
+    // Target directory and name
+    uint32_t parent_inode_number;
+    char leaf[MAX_FILENAME_LEN + 1];
+    uint32_t existing_inode;
+    uint8_t file_type;
+    if (resolve_path(disk, inode_number, dst, &parent_inode_number, &file_type) == 0 && file_type == 1) {
+        strcpy(leaf, src_leaf);
+    } else if (resolve_parent(disk, inode_number, dst, &parent_inode_number, leaf) != 0) {
+        fprintf(stderr, "Error: parent directory of '%s' not found.\n", dst);
+        return -1;
+    }
+    if (lookup_name(disk, parent_inode_number, leaf, &existing_inode, &file_type) == 0) {
+        fprintf(stderr, "Error: '%s' already exists.\n", dst);
+        return -1;
+    }
+
+    char name[256];
+    char extension[256];
+    split_file_name(leaf, name, extension);
+
+    if (reflink || fs_meta.refcount_start != 0) {
+        return (clone_file(disk, src_inode_number, name, extension, parent_inode_number) != 0) ? 0 : -1;
+    }
+
+    // No shared blocks on this drive: write a copy of the content
+    file_t *file_data = read_file(disk, src_inode_number);
+    if (!file_data) {
+        fprintf(stderr, "Error: could not read file data.\n");
+        return -1;
+    }
+    size_t content_size = file_data->size - sizeof(file_t);
+    char *content = (char *)malloc(content_size + 1);
+    if (!content) {
+        fprintf(stderr, "Error: could not allocate memory to copy file.\n");
+        free(file_data);
+        return -1;
+    }
+    memcpy(content, file_data->data, content_size);
+    content[content_size] = '\0';
+    create_file(disk, name, extension, 0644, content, parent_inode_number);
+    free(content);
+    free(file_data);
+    return 0;
+}
+
+// Function to create, delete or list snapshots (kept in /.snapshots)
+int snapshot_cli(FILE *disk, const char *action, const char *name) {
+    if (strcmp(action, "list") == 0) {
+        uint32_t snapshots_dir = find_snapshot_directory(disk);
+        directory_block_t *dir = snapshots_dir ? read_directory(disk, snapshots_dir) : NULL;
+        for (uint32_t i = 2; dir && i < dir->entries_count; i++) {
+            dir_entry_t *entry = &dir->entries[i];
+            if (VERBOSE && is_readonly_directory(entry->inode)) {
+                printf(BLUE "%s (snapshot, inode=%u)\n" RESET, entry->name, entry->inode);
+            }
         }
+        free(dir);
+        return 0;
     }
-    
-    if (new_inode_number == -1) {
+    if (!name || name[0] == '\0' || strchr(name, '/') || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+        strlen(name) > MAX_FILENAME_LEN) {
+        fprintf(stderr, "Error: invalid snapshot name.\n");
+        return -1;
+    }
+
+    if (strcmp(action, "create") == 0) {
+        return (create_snapshot(disk, name) != 0) ? 0 : -1;
+    }
+    if (strcmp(action, "delete") == 0) {
+        return delete_snapshot(disk, name);
+    }
+    fprintf(stderr, "Error: invalid action '%s'. Use create, delete or list.\n", action);
+    return -1;
+}
+
+// Function to create a file (the last path component is split into name and extension)
+void free_name_range(char **names, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) free(names[i]);
+    free(names);
+}
+
+/**
+ * @brief Expands a name holding a numeric range, "dir_{1..3000}" or
+ * "file_{01..10}.txt" (as in the shell, a leading zero pads all numbers to the
+ * same width).
+ *
+ * @param pattern The name to expand.
+ * @param out_names Set to the expanded names (free with free_name_range).
+ * @param out_count Set to the number of names.
+ * @return 0 if the range was expanded, 1 if 'pattern' holds no range, -1 if the
+ *         range is invalid.
+ */
+int expand_name_range(const char *pattern, char ***out_names, uint32_t *out_count) {
+    const char *open = strchr(pattern, '{');
+    const char *dots = open ? strstr(open, "..") : NULL;
+    const char *close = dots ? strchr(dots, '}') : NULL;
+    if (!close) return 1;
+
+    char *end;
+    unsigned long first = strtoul(open + 1, &end, 10);
+    if (end != dots || !isdigit((unsigned char)open[1])) return 1;
+    unsigned long last = strtoul(dots + 2, &end, 10);
+    if (end != close || !isdigit((unsigned char)dots[2])) return 1;
+
+    if (last < first || last - first >= INODES_COUNT) {
+        fprintf(stderr, "Error: invalid range in '%s' (at most %u names).\n", pattern, INODES_COUNT);
+        return -1;
+    }
+    int first_len = (int)(dots - open - 1), last_len = (int)(close - dots - 2);
+    bool padded = (open[1] == '0' && first_len > 1) || (dots[2] == '0' && last_len > 1);
+    int width = padded ? ((first_len > last_len) ? first_len : last_len) : 0;
+    int prefix_len = (int)(open - pattern);
+    uint32_t count = (uint32_t)(last - first + 1);
+
+    char **names = (char **)calloc(count, sizeof(char *));
+    if (!names) {
+        fprintf(stderr, "Error: could not allocate memory for the names.\n");
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        char name[MAX_INPUT_SIZE];
+        int len = snprintf(name, sizeof(name), "%.*s%0*lu%s", prefix_len, pattern, width, first + i, close + 1);
+        if (len > MAX_FILENAME_LEN || (names[i] = strdup(name)) == NULL) {
+            fprintf(stderr, "Error: name '%s' is too long.\n", name);
+            free_name_range(names, count);
+            return -1;
+        }
+    }
+    *out_names = names;
+    *out_count = count;
+    return 0;
+}
+
+int create_file_cli(FILE *disk, uint32_t inode_number, const char *path, const char *data) {
+    uint32_t parent_inode_number;
+    char filename[MAX_FILENAME_LEN + 1];
+    if (resolve_parent(disk, inode_number, path, &parent_inode_number, filename) != 0) {
+        fprintf(stderr, "Error: parent directory of '%s' not found.\n", path);
+        return -1;
+    }
+
+    // "file_{1..100}.txt" creates all the files at once
+    char **names;
+    uint32_t count;
+    int range = expand_name_range(filename, &names, &count);
+    if (range < 0) return -1;
+    if (range == 0) {
+        uint32_t created = create_files(disk, names, count, 0644, data, parent_inode_number);
+        free_name_range(names, count);
+        return (created == count) ? 0 : -1;
+    }
+
+    char name[256];
+    char extension[256];
+    split_file_name(filename, name, extension);
+
+    create_file(disk, name, extension, 0644, data, parent_inode_number);
+    return 0;
+}
+
+// Function to change directory
+int change_directory(FILE *disk, char *current_dirname, uint32_t inode_number, const char *dirname) {
+    uint32_t new_inode_number;
+    uint8_t file_type;
+    if (resolve_path(disk, inode_number, dirname, &new_inode_number, &file_type) != 0 || file_type != 1) {
         fprintf(stderr, "Error: directory '%s' not found.\n", dirname);
         return -1;
     }
 
-    // Update the current directory name
-    if (strcmp(dirname, "..") == 0) {
-        if (strcmp(current_dirname, "root") != 0) {
-            // Handle going up one directory
-            char *last_slash = strrchr(current_dirname, '/');
-            if (last_slash != NULL) {
-                *last_slash = '\0';
-            } else {
-                strcpy(current_dirname, "root");
+    // Update the current directory name component by component
+    if (dirname[0] == '/') {
+        strcpy(current_dirname, "root");
+    }
+
+    char path[MAX_INPUT_SIZE];
+    strncpy(path, dirname, sizeof(path) - 1);
+    path[sizeof(path) - 1] = '\0';
+
+    for (char *component = strtok(path, "/"); component != NULL; component = strtok(NULL, "/")) {
+        if (strcmp(component, "..") == 0) {
+            if (strcmp(current_dirname, "root") != 0) {
+                // Handle going up one directory
+                char *last_slash = strrchr(current_dirname, '/');
+                if (last_slash != NULL) {
+                    *last_slash = '\0';
+                } else {
+                    strcpy(current_dirname, "root");
+                }
             }
+        } else if (strcmp(component, ".") != 0) {
+            strcat(current_dirname, "/");
+            strcat(current_dirname, component);
         }
-    } else if (strcmp(dirname, ".") != 0) {
-        strcat(current_dirname, "/");
-        strcat(current_dirname, dirname);
     }
 
     return new_inode_number;
 }
 
 // Function to create a new directory
-void make_directories_cli(FILE *disk, uint32_t inode_number, const char *dirname) {
-    
-}
-
-// Function to remove a file or directory
-void remove_entry_cli(FILE *disk, uint32_t inode_number, const char *flag, const char *path) {
-    directory_block_t *dir_block = read_directory(disk, inode_number);
-    if (!dir_block) {
-        fprintf(stderr, "Error: could not read directory block.\n");
-        return;
+int make_directories_cli(FILE *disk, uint32_t inode_number, const char *dirname) {
+    uint32_t parent_inode_number;
+    char leaf[MAX_FILENAME_LEN + 1];
+    if (resolve_parent(disk, inode_number, dirname, &parent_inode_number, leaf) != 0) {
+        fprintf(stderr, "Error: parent directory of '%s' not found.\n", dirname);
+        return -1;
     }
 
-    // Find the inode number of the entry to remove
-    uint32_t entry_inode_number = -1;
-    for (size_t i = 0; i < dir_block->entries_count; i++) {
-        dir_entry_t *entry = &dir_block->entries[i];
-        if (strcmp(entry->name, path) == 0) {
-            entry_inode_number = entry->inode;
-            break;
-        }
+    // "dir_{1..3000}" creates all the directories at once
+    char **names;
+    uint32_t count;
+    int range = expand_name_range(leaf, &names, &count);
+    if (range < 0) return -1;
+    if (range == 0) {
+        uint32_t created = create_directories(disk, names, count, 0644, parent_inode_number);
+        free_name_range(names, count);
+        return (created == count) ? 0 : -1;
     }
 
-    if (entry_inode_number == -1) {
+    create_directory(disk, leaf, 0644, parent_inode_number);
+    return 0;
+}
+
+// Function to remove a file or directory
+int remove_entry_cli(FILE *disk, uint32_t inode_number, const char *flag, const char *path) {
+    // Find the parent directory and the inode number of the entry to remove
+    uint32_t parent_inode_number;
+    char leaf[MAX_FILENAME_LEN + 1];
+    uint32_t entry_inode_number;
+    uint8_t file_type;
+    if (resolve_parent(disk, inode_number, path, &parent_inode_number, leaf) != 0 ||
+        lookup_name(disk, parent_inode_number, leaf, &entry_inode_number, &file_type) != 0) {
         fprintf(stderr, "Error: entry '%s' not found.\n", path);
-        return;
+        return -1;
     }
 
     if (strcmp(flag, "-f") == 0) {
-        delete_file(disk, entry_inode_number, inode_number);
+        delete_file(disk, entry_inode_number, parent_inode_number);
     } else if (strcmp(flag, "-d") == 0) {
-        delete_directory(disk, entry_inode_number, inode_number);
+        delete_directory(disk, entry_inode_number, parent_inode_number);
     } else {
         fprintf(stderr, "Error: invalid flag '%s'. Use -f for file, -d for directory.\n", flag);
+        return -1;
     }
+    return 0;
 }
 
 // [END CLI FUNCTIONS]
 
-# include <time.h>
+# define COMMAND_EXIT 1 // execute_command: the CLI should exit
 
+/**
+ * @brief Executes one parsed CLI command.
+ *
+ * @param disk A pointer to the FILE object representing the disk.
+ * @param command The command name.
+ * @param args The command arguments.
+ * @param args_count The number of arguments.
+ * @param cwd The current directory path (updated by cd).
+ * @param inode_number The current directory inode (updated by cd).
+ * @return COMMAND_EXIT if the CLI should exit, -1 if the command failed, 0 otherwise.
+ */
+int execute_command(FILE *disk, char *command, char **args, int args_count, char *cwd, uint32_t *inode_number) {
+    int status = 0;
 
-void test(FILE *disk) {
-    uint32_t root_inode_number = 0;
-    clock_t t; 
-    VERBOSE = 0; // Assuming VERBOSE is an integer flag
-
-    // TEST 1: Test create_directory function execution time by creating 3000 directories
-    printf("TEST 1: Creating 3000 directories...\n");
-    t = clock(); 
-    for (int i = 0; i < 3000; i++) {
-        char dirname[256];
-        snprintf(dirname, sizeof(dirname), "dir_%d", i);
-        create_directory(disk, dirname, 0755, root_inode_number);
+    if (strcmp(command, "ls") == 0) {
+        status = list_directory_cli(disk, *inode_number, (args_count > 0) ? args[0] : ".");
     }
-    t = clock() - t;
-
-    double time_taken = ((double)t) / CLOCKS_PER_SEC;
-    printf("Time taken to create 3000 directories: %f seconds\n\n", time_taken);
-
-    // TEST 2: Test delete_directory function execution time by deleting 3000 directories
-    printf("TEST 2: Deleting 3000 directories...\n");
-    t = clock();
-    for (int i = 0; i < 3000; i++) {
-        char dirname[256];
-        snprintf(dirname, sizeof(dirname), "dir_%d", i);
-        remove_entry_cli(disk, root_inode_number, "-d", dirname);
+    else if (strcmp(command, "pwd") == 0) {
+        printf("%s\n", cwd);
     }
-    t = clock() - t;
+    else if (strcmp(command, "cf") == 0) {
+        if (args_count < 2) {
+            fprintf(stderr, "Usage: cf <filename> <data>\n");
+            return -1;
+        }
 
-    time_taken = ((double)t) / CLOCKS_PER_SEC;
-    printf("Time taken to delete 3000 directories: %f seconds\n\n", time_taken);
+        char *filename = args[0];
+        char data[MAX_INPUT_SIZE - 2] = "";
+        for (int i = 1; i < args_count; i++) {
+            strcat(data, args[i]);
+            if (i < args_count - 1) {
+                strcat(data, " ");
+            }
+        }
 
-    // TEST 3: Test create_file function execution time by creating 100 files with 1MB data
-    printf("TEST 3: Creating 100 files with 1MB data...\n");
-    char data[1024 * 1024];
-    for (int i = 0; i < 1024 * 1024; i++) {
-        data[i] = (rand() % 26) + 'a';
+        status = create_file_cli(disk, *inode_number, filename, data);
     }
-    t = clock();
-    for (int i = 0; i < 100; i++) {
-        char filename[256];
-        snprintf(filename, sizeof(filename), "file_%d", i);
-        create_file(disk, filename, "txt", 0644, data, root_inode_number);
+    else if (strcmp(command, "rf") == 0) {
+        if (args_count < 1) {
+            fprintf(stderr, "Usage: rf <filename>\n");
+            return -1;
+        }
+        status = read_file_cli(disk, *inode_number, args[0]);   
     }
-    t = clock() - t;
+    else if (strcmp(command, "wf") == 0) {
+        if (args_count < 3) {
+            fprintf(stderr, "Usage: wf <-a/-o> <filename> <new_content>\n");
+            return -1;
+        }
 
-    time_taken = ((double)t) / CLOCKS_PER_SEC;
-    printf("Time taken to create 100 files with 1MB data: %f seconds\n\n", time_taken);
+        char *mode = args[0];
+        char *filename = args[1];
+        char new_content[MAX_INPUT_SIZE - 2] = "";
+        for (int i = 2; i < args_count; i++) {
+            strcat(new_content, args[i]);
+            if (i < args_count - 1) {
+                strcat(new_content, " ");
+            }
+        }
 
-    // TEST 4: Test read_file function execution time by reading 100 files
-    printf("TEST 4: Reading 100 files...\n");
-    t = clock();
-    for (int i = 0; i < 100; i++) {
-        char filename[256];
-        snprintf(filename, sizeof(filename), "file_%d.txt", i);
-        read_file_cli(disk, root_inode_number, filename);
+        status = write_file_cli(disk, *inode_number, filename, mode, new_content);
+    }
+    else if (strcmp(command, "truncate") == 0) {
+        if (args_count < 2) {
+            fprintf(stderr, "Usage: truncate <filename> <size>\n");
+            return -1;
+        }
+        uint32_t size;
+        if (parse_size_cli(args[1], &size) != 0) return -1;
+        status = truncate_file_cli(disk, *inode_number, args[0], size);
+    }
+    else if (strcmp(command, "fallocate") == 0) {
+        if (args_count < 3) {
+            fprintf(stderr, "Usage: fallocate <filename> <offset> <length>\n");
+            return -1;
+        }
+        uint32_t offset, len;
+        if (parse_size_cli(args[1], &offset) != 0 || parse_size_cli(args[2], &len) != 0) return -1;
+        status = fallocate_file_cli(disk, *inode_number, args[0], offset, len);
     }
-    t = clock() - t;
+    else if (strcmp(command, "cd") == 0) {
+        if (args_count < 1) {
+            fprintf(stderr, "Usage: cd <dirname>\n");
+            return -1;
+        }
 
-    time_taken = ((double)t) / CLOCKS_PER_SEC;
-    printf("Time taken to read 100 files with 1MB data: %f seconds\n\n", time_taken);
+        char dirname[MAX_INPUT_SIZE] = "";
+        for (int i = 0; i < args_count; i++) {
+            strcat(dirname, args[i]);
+            if (i < args_count - 1) {
+                strcat(dirname, " ");
+            }
+        }
 
-    // TEST 5: Test delete_file function execution time by deleting 100 files
-    printf("TEST 5: Deleting 100 files...\n");
-    t = clock();
-    for (int i = 0; i < 100; i++) {
-        char filename[256];
-        snprintf(filename, sizeof(filename), "file_%d.txt", i);
-        remove_entry_cli(disk, root_inode_number, "-f", filename);
+        int new_inode_number = change_directory(disk, cwd, *inode_number, dirname);
+        if (new_inode_number == -1) return -1;
+        *inode_number = new_inode_number;
     }
-    t = clock() - t;
-
-    time_taken = ((double)t) / CLOCKS_PER_SEC;
-    printf("Time taken to delete 100 files with 1MB data: %f seconds\n\n", time_taken);
+    else if (strcmp(command, "mkdir") == 0) {
+        if (args_count < 1) {
+            fprintf(stderr, "Usage: mkdir <dirname>\n");
+            return -1;
+        }
+        
+        char dirname[MAX_INPUT_SIZE] = "";
+        for (int i = 0; i < args_count; i++) {
+            strcat(dirname, args[i]);
+            if (i < args_count - 1) {
+                strcat(dirname, " ");
+            }
+        }
 
+        status = make_directories_cli(disk, *inode_number, dirname);
+    }
+    else if (strcmp(command, "rm") == 0) {
+        if (args_count < 2) {
+            fprintf(stderr, "Usage: rm <-f/-d> <filename>\n");
+            return -1;
+        }
+        status = remove_entry_cli(disk, *inode_number, args[0], args[1]);
+    }
+    else if (strcmp(command, "sync") == 0) {
+        status = sync_filesystem(disk);
+    }
+    else if (strcmp(command, "frag") == 0) {
+        print_fragmentation(disk);
+    }
+    else if (strcmp(command, "defrag") == 0) {
+        status = defragment_cli(disk, *inode_number, (args_count > 0) ? args[0] : NULL);
+    }
+    else if (strcmp(command, "cp") == 0) {
+        bool reflink = args_count > 0 && strcmp(args[0], "--reflink") == 0;
+        if (args_count < (reflink ? 3 : 2)) {
+            fprintf(stderr, "Usage: cp [--reflink] <source> <destination>\n");
+            return -1;
+        }
+        int first = reflink ? 1 : 0;
+        status = copy_file_cli(disk, *inode_number, args[first], args[first + 1], reflink);
+    }
+    else if (strcmp(command, "snapshot") == 0) {
+        if (args_count < 1) {
+            fprintf(stderr, "Usage: snapshot <create|delete|list> [name]\n");
+            return -1;
+        }
+        status = snapshot_cli(disk, args[0], (args_count > 1) ? args[1] : NULL);
+    }
+    else if (strcmp(command, "trace") == 0) {
+#ifdef FS_TRACE
+        if (args_count >= 1 && strcmp(args[0], "start") == 0) {
+            trace_enable(true);
+        } else if (args_count >= 1 && strcmp(args[0], "stop") == 0) {
+            trace_enable(false);
+        } else if (args_count >= 2 && strcmp(args[0], "dump") == 0) {
+            int spans = trace_dump(args[1]);
+            if (spans < 0) fprintf(stderr, "Error: Unable to create file %s\n", args[1]);
+            else printf("Wrote %d spans to %s.\n", spans, args[1]);
+        } else {
+            fprintf(stderr, "Usage: trace <start|stop|dump <file>>\n");
+        }
+#else
+        fprintf(stderr, "Error: tracing is not compiled in (build with -DFS_TRACE).\n");
+#endif
+    }
+    else if (strcmp(command, "stats") == 0) {
+        if (args_count > 0 && strcmp(args[0], "reset") == 0) {
+            metrics_reset();
+        } else {
+            print_metrics(stdout);
+        }
+    }
+    else if (strcmp(command, "exit") == 0) {
+        return COMMAND_EXIT;
+    }
+    else {
+        
+    }
 
-    VERBOSE = 1; // Restore VERBOSE flag
+    return status;
 }
 
-int main() {
+// The benchmark tools include this file for the filesystem and provide their own main()
+#ifndef NO_CLI_MAIN
+int main(int argc, char *argv[]) {
+    FILE *script = stdin;
+    const char *script_name = NULL;
+
+    // Parse options
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            script_name = argv[++i];
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            BATCH = true;
+        } else if (strncmp(argv[i], "--checkpoint=", 13) == 0 && atoi(argv[i] + 13) >= 0) {
+            BATCH_CHECKPOINT = (uint32_t)atoi(argv[i] + 13);
+        } else if (strcmp(argv[i], "--delalloc") == 0) {
+            DELALLOC = true;
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            COMPRESS = true;
+        } else if (strcmp(argv[i], "--dedup") == 0) {
+            DEDUP = true;
+        } else if (strcmp(argv[i], "--durability=group") == 0) {
+            DURABILITY = DURABILITY_GROUP;
+        } else if (strcmp(argv[i], "--durability=none") == 0) {
+            DURABILITY = DURABILITY_NOSYNC;
+        } else if (strcmp(argv[i], "--durability=sync") == 0) {
+            DURABILITY = DURABILITY_SYNC;
+        } else if (strcmp(argv[i], "--durability=periodic") == 0) {
+            DURABILITY = DURABILITY_PERIODIC;
+        } else if (strncmp(argv[i], "--flush-interval=", 17) == 0 && atoi(argv[i] + 17) > 0) {
+            FLUSH_INTERVAL_MS = (uint32_t)atoi(argv[i] + 17);
+        } else if (strcmp(argv[i], "--async-unlink") == 0) {
+            ASYNC_UNLINK = true;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            DUMP_STATS = true;
+        } else if (strncmp(argv[i], "--trace=", 8) == 0 && argv[i][8] != '\0') {
+#ifdef FS_TRACE
+            TRACE_FILE = argv[i] + 8;
+            trace_enable(true);
+#else
+            fprintf(stderr, "Error: tracing is not compiled in (build with -DFS_TRACE).\n");
+            return 1;
+#endif
+        } else if (strncmp(argv[i], "--record=", 9) == 0 && argv[i][9] != '\0') {
+            RECORD_FILE = argv[i] + 9;
+        } else {
+            fprintf(stderr, "Usage: %s [--delalloc] [--compress] [--dedup] [--durability=group|none|sync|periodic] [--flush-interval=<ms>] [--async-unlink] [--stats] [--trace=<file>] [--record=<file>] [-f <script>] [--batch] [--checkpoint=<commands>]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (script_name) {
+        script = fopen(script_name, "r");
+        if (script == NULL) {
+            fprintf(stderr, "Error: Unable to open file %s\n", script_name);
+            return 1;
+        }
+    }
+    if (script != stdin || !isatty(STDIN_FILENO)) {
+        BATCH = true;
+    }
+    initialize_delalloc_table(&pending_writes);
+    initialize_dcache(&dentry_cache);
+    initialize_locks();
+
     // Check if the drive file exists, if not, create it
     FILE *disk = fopen(DRIVE_NAME, "rb+");
     if (disk == NULL) {
@@ -1798,6 +5825,21 @@ int main() {
         // Initialize the drive
         initialize_drive(disk);
     }
+    if (mount_drive(disk) != 0) {
+        fclose(disk);
+        return 1;
+    }
+    if (BATCH && (DURABILITY == DURABILITY_GROUP || DURABILITY == DURABILITY_NOSYNC)) {
+        // Commits are driven by the checkpoints (or by a full transaction); set before
+        // the background threads start, since they open handles too
+        fs_journal.group_ops = UINT32_MAX;
+    }
+    start_flusher(disk);
+    start_reclaimer(disk);
+    if (RECORD_FILE && workload_open(&recorder, RECORD_FILE, metrics_now()) != 0) {
+        fprintf(stderr, "Error: Unable to create file %s\n", RECORD_FILE);
+        RECORD_FILE = NULL;
+    }
 
     char input[MAX_INPUT_SIZE];
     uint32_t inode_number = 0;
@@ -1809,22 +5851,26 @@ int main() {
     }
     strcpy(cwd, "root");
 
+    uint32_t commands_since_checkpoint = 0;
+
     while(1) {
         //Display the prompt
-        printf(GREEN "cli_fi %s>" RESET, cwd);
-        fflush(stdout);
+        if (!BATCH) {
+            printf(GREEN "cli_fi %s>" RESET, cwd);
+            fflush(stdout);
+        }
 
         // Read input
-        if (fgets(input, MAX_INPUT_SIZE, stdin) == NULL) {
-            printf("\n");
+        if (fgets(input, MAX_INPUT_SIZE, script) == NULL) {
+            if (!BATCH) printf("\n");
             break;
         }
 
         // Remove trailing newline
         input[strcspn(input, "\n")] = 0;
 
-        // Skip empty input
-        if (strlen(input) == 0) {
+        // Skip empty input (and comment lines of scripts)
+        if (strlen(input) == 0 || (BATCH && input[0] == '#')) {
             continue;
         }
 
@@ -1846,127 +5892,43 @@ int main() {
             continue;
         }
 
-        // Execute command
-        if (strcmp(command, "ls") == 0) {
-            list_directory_cli(disk, inode_number);
-        }
-        else if (strcmp(command, "pwd") == 0) {
-            printf("%s\n", cwd);
-        }
-        else if (strcmp(command, "cf") == 0) {
-            if (args_count < 2) {
-                fprintf(stderr, "Usage: cf <filename> <data>\n");
-                continue;
-            }
-
-            char *filename = args[0];
-            char data[MAX_INPUT_SIZE - 2] = "";
-            for (int i = 1; i < args_count; i++) {
-                strcat(data, args[i]);
-                if (i < args_count - 1) {
-                    strcat(data, " ");
-                }
-            }
-
-            char *dot = strrchr(filename, '.');
-            char name[256];
-            char extension[256];
-
-            if (dot) {
-                strncpy(name, filename, dot - filename);
-                name[dot - filename] = '\0';
-                strncpy(extension, dot + 1, sizeof(extension) - 1);
-                extension[sizeof(extension) - 1] = '\0';
-            } else {
-                strncpy(name, filename, sizeof(name) - 1);
-                name[sizeof(name) - 1] = '\0';
-                extension[0] = '\0';
-            }
-
-            create_file(disk, name, extension, 0644, data, inode_number);
-        }
-        else if (strcmp(command, "rf") == 0) {
-            if (args_count < 1) {
-                fprintf(stderr, "Usage: rf <filename>\n");
-                continue;
-            }
-            read_file_cli(disk, inode_number, args[0]);   
-        }
-        else if (strcmp(command, "wf") == 0) {
-            if (args_count < 3) {
-                fprintf(stderr, "Usage: wf <-a/-o> <filename> <new_content>\n");
-                continue;
-            }
-
-            char *mode = args[0];
-            char *filename = args[1];
-            char new_content[MAX_INPUT_SIZE - 2] = "";
-            for (int i = 2; i < args_count; i++) {
-                strcat(new_content, args[i]);
-                if (i < args_count - 1) {
-                    strcat(new_content, " ");
-                }
-            }
-
-            write_file_cli(disk, inode_number, filename, mode, new_content);
-        }
-        else if (strcmp(command, "cd") == 0) {
-            if (args_count < 1) {
-                fprintf(stderr, "Usage: cd <dirname>\n");
-                continue;
-            }
-
-            char dirname[MAX_INPUT_SIZE] = "";
-            for (int i = 0; i < args_count; i++) {
-                strcat(dirname, args[i]);
-                if (i < args_count - 1) {
-                    strcat(dirname, " ");
-                }
-            }
-
-            int new_inode_number = change_directory(disk, cwd, inode_number, dirname);
-            if (new_inode_number != -1) {
-                inode_number = new_inode_number;
-            }
-        }
-        else if (strcmp(command, "mkdir") == 0) {
-            if (args_count < 1) {
-                fprintf(stderr, "Usage: mkdir <dirname>\n");
-                continue;
-            }
-            
-            char dirname[MAX_INPUT_SIZE] = "";
-            for (int i = 0; i < args_count; i++) {
-                strcat(dirname, args[i]);
-                if (i < args_count - 1) {
-                    strcat(dirname, " ");
-                }
-            }
-
-            create_directory(disk, dirname, 0644, inode_number);
-        }
-        else if (strcmp(command, "rm") == 0) {
-            if (args_count < 2) {
-                fprintf(stderr, "Usage: rm <-f/-d> <filename>\n");
-                continue;
-            }
-            remove_entry_cli(disk, inode_number, args[0], args[1]);
-        }
-        else if (strcmp(command, "exit") == 0) {
-            break;
+        // Execute command (and append it to the workload trace)
+        int op = RECORD_FILE ? workload_op(command) : -1;
+        uint64_t command_start = (op >= 0) ? metrics_now() : 0;
+        int done = execute_command(disk, command, args, args_count, cwd, &inode_number);
+        if (op >= 0 && workload_append(&recorder, op, args, args_count, cwd, done, command_start, metrics_now()) != 0) {
+            fprintf(stderr, "Error: Unable to write to %s, recording stopped.\n", RECORD_FILE);
+            workload_close(&recorder);
+            RECORD_FILE = NULL;
         }
-        else if (strcmp(command, "test") == 0) {
-            test(disk);
+        if (DURABILITY == DURABILITY_SYNC && delalloc_pending_count(&pending_writes) > 0) {
+            sync_filesystem(disk);
         }
-        else {
-            
+        if (done == COMMAND_EXIT) break;
+        if (BATCH && BATCH_CHECKPOINT > 0 && ++commands_since_checkpoint >= BATCH_CHECKPOINT) {
+            sync_filesystem(disk);
+            commands_since_checkpoint = 0;
         }
     }
-
-    printf("Exiting CLI.\n");
-    return 0;
-
+    if (script != stdin) fclose(script);
+
+    stop_reclaimer(disk);
+    stop_flusher(disk);
+    int status = 0;
+    if (unmount_drive(disk) != 0) {
+        fprintf(stderr, "Error: not every change could be written to the drive.\n");
+        status = 1;
+    }
     fclose(disk);
+    if (RECORD_FILE) workload_close(&recorder);
+    if (DUMP_STATS) print_metrics(stdout);
+#ifdef FS_TRACE
+    if (TRACE_FILE && trace_dump(TRACE_FILE) < 0) {
+        fprintf(stderr, "Error: Unable to create file %s\n", TRACE_FILE);
+    }
+#endif
 
-    return 0;
-}
\ No newline at end of file
+    if (!BATCH) printf("Exiting CLI.\n");
+    return status;
+}
+#endif // NO_CLI_MAIN
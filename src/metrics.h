@@ -0,0 +1,178 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "trace.h"
+
+// Instrumentation counters of the filesystem.
+//
+// Every counter is a plain 64-bit integer updated with relaxed atomic adds, so
+// any thread can count without a lock and a reader sees each value (not a
+// consistent snapshot of all of them). Operations also record their latency
+// in a log2 histogram.
+
+// Timed operations
+# define METRIC_CREATE_FILE         0
+# define METRIC_CREATE_DIRECTORY    1
+# define METRIC_READ_FILE           2
+# define METRIC_READ_DIRECTORY      3
+# define METRIC_WRITE_FILE          4
+# define METRIC_TRUNCATE_FILE       5
+# define METRIC_FALLOCATE_FILE      6
+# define METRIC_DELETE_FILE         7
+# define METRIC_DELETE_DIRECTORY    8
+# define METRIC_UPDATE_DIRECTORY    9
+# define METRIC_FREE_DATA_BLOCKS    10  // free_all_data_blocks_of_inode
+# define METRIC_FLUSH_DELALLOC      11
+# define METRIC_JOURNAL_COMMIT      12
+# define METRIC_CREATE_MANY         13  // create_directories, create_files
+# define METRIC_DEFRAGMENT_FILE     14
+# define METRIC_CLONE_FILE          15
+# define METRIC_SNAPSHOT            16
+# define METRIC_OPS_COUNT           17
+
+static const char *metric_op_names[METRIC_OPS_COUNT] = {
+    "create_file", "create_directory", "read_file", "read_directory", "write_file",
+    "truncate_file", "fallocate_file", "delete_file", "delete_directory",
+    "update_directory", "free_all_data_blocks", "flush_delalloc", "journal_commit",
+    "create_many", "defragment_file", "clone_file", "snapshot"
+};
+
+// Bucket b counts latencies in [2^b, 2^(b+1)) ns; the last one everything longer
+# define METRIC_HISTOGRAM_BUCKETS 40
+
+typedef struct op_metrics {
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t histogram[METRIC_HISTOGRAM_BUCKETS];
+} op_metrics;
+
+typedef struct fs_metrics {
+    op_metrics ops[METRIC_OPS_COUNT];
+    uint64_t read_calls;        // pread calls on the drive
+    uint64_t write_calls;       // pwrite/pwritev calls on the drive
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t fsyncs;
+    uint64_t block_allocations; // Data blocks handed out
+    uint64_t inode_allocations;
+    uint64_t bits_scanned;      // Bitmap bits tested while searching for free ones
+    uint64_t lookups;           // Name lookups in a directory
+    uint64_t entries_compared;  // Directory entries compared by lookups that missed the cache
+    uint64_t dcache_hits;       // Including negative hits
+    uint64_t dcache_misses;
+    uint64_t compress_input_bytes;  // File content given to the compressor
+    uint64_t compress_stored_bytes; // Blocks it was stored in, in bytes
+    uint64_t dedup_lookups;     // Blocks written with deduplication on
+    uint64_t dedup_hits;        // Of those, blocks mapped to an identical stored block
+    uint64_t checksums_verified; // Metadata blocks read from disk that matched their checksum
+    uint64_t checksum_errors;   // Metadata blocks read from disk that did not
+} fs_metrics;
+
+fs_metrics metrics;
+
+// Add 'n' to a counter
+static inline void metrics_add(uint64_t *counter, uint64_t n) {
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+// Monotonic time in nanoseconds, the start of a timed operation
+static inline uint64_t metrics_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Record one call of 'op' that started at 'start_ns' (and trace it as a span)
+void metrics_record(int op, uint64_t start_ns) {
+    TRACE_SPAN(metric_op_names[op], start_ns);
+    uint64_t ns = metrics_now() - start_ns;
+    op_metrics *m = &metrics.ops[op];
+
+    uint32_t bucket = 0;
+    while (bucket + 1 < METRIC_HISTOGRAM_BUCKETS && (ns >> (bucket + 1)) != 0) bucket++;
+
+    metrics_add(&m->calls, 1);
+    metrics_add(&m->total_ns, ns);
+    metrics_add(&m->histogram[bucket], 1);
+
+    uint64_t max = __atomic_load_n(&m->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&m->max_ns, &max, ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Zero all counters (counts from other threads racing with the reset may survive)
+void metrics_reset() {
+    uint64_t *counters = (uint64_t *)&metrics;
+    for (size_t i = 0; i < sizeof(fs_metrics) / sizeof(uint64_t); i++) {
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+// Upper bound of the bucket holding the p-th percentile of one operation (at
+// most the maximum seen), in ns
+static uint64_t metrics_percentile_ns(const op_metrics *m, uint32_t p) {
+    uint64_t calls = __atomic_load_n(&m->calls, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&m->max_ns, __ATOMIC_RELAXED);
+    if (calls == 0) return 0;
+    uint64_t rank = (calls * p + 99) / 100;
+    uint64_t seen = 0;
+    for (uint32_t b = 0; b < METRIC_HISTOGRAM_BUCKETS; b++) {
+        seen += __atomic_load_n(&m->histogram[b], __ATOMIC_RELAXED);
+        if (seen >= rank) return ((2ull << b) - 1 < max) ? (2ull << b) - 1 : max;
+    }
+    return max;
+}
+
+// Print every counter and the latency summary of each operation that ran
+void print_metrics(FILE *out) {
+    fprintf(out, "%-22s %10s %12s %12s %12s %12s\n", "operation", "calls", "mean(us)", "p50(us)", "p99(us)", "max(us)");
+    for (int op = 0; op < METRIC_OPS_COUNT; op++) {
+        const op_metrics *m = &metrics.ops[op];
+        uint64_t calls = __atomic_load_n(&m->calls, __ATOMIC_RELAXED);
+        if (calls == 0) continue;
+        fprintf(out, "%-22s %10lu %12.2f %12.2f %12.2f %12.2f\n", metric_op_names[op], (unsigned long)calls,
+                __atomic_load_n(&m->total_ns, __ATOMIC_RELAXED) / 1000.0 / calls,
+                metrics_percentile_ns(m, 50) / 1000.0, metrics_percentile_ns(m, 99) / 1000.0,
+                __atomic_load_n(&m->max_ns, __ATOMIC_RELAXED) / 1000.0);
+    }
+
+    uint64_t lookups = __atomic_load_n(&metrics.lookups, __ATOMIC_RELAXED);
+    uint64_t allocations = __atomic_load_n(&metrics.block_allocations, __ATOMIC_RELAXED) +
+                           __atomic_load_n(&metrics.inode_allocations, __ATOMIC_RELAXED);
+    fprintf(out, "\n");
+    fprintf(out, "Drive reads            : %lu calls, %lu bytes\n",
+            (unsigned long)__atomic_load_n(&metrics.read_calls, __ATOMIC_RELAXED),
+            (unsigned long)__atomic_load_n(&metrics.bytes_read, __ATOMIC_RELAXED));
+    fprintf(out, "Drive writes           : %lu calls, %lu bytes\n",
+            (unsigned long)__atomic_load_n(&metrics.write_calls, __ATOMIC_RELAXED),
+            (unsigned long)__atomic_load_n(&metrics.bytes_written, __ATOMIC_RELAXED));
+    fprintf(out, "Fsyncs                 : %lu\n", (unsigned long)__atomic_load_n(&metrics.fsyncs, __ATOMIC_RELAXED));
+    fprintf(out, "Allocations            : %lu blocks, %lu inodes\n",
+            (unsigned long)__atomic_load_n(&metrics.block_allocations, __ATOMIC_RELAXED),
+            (unsigned long)__atomic_load_n(&metrics.inode_allocations, __ATOMIC_RELAXED));
+    fprintf(out, "Bitmap bits scanned    : %lu (%.1f per allocation)\n",
+            (unsigned long)__atomic_load_n(&metrics.bits_scanned, __ATOMIC_RELAXED),
+            allocations ? (double)__atomic_load_n(&metrics.bits_scanned, __ATOMIC_RELAXED) / allocations : 0.0);
+    fprintf(out, "Lookups                : %lu (%.1f entries compared per lookup)\n", (unsigned long)lookups,
+            lookups ? (double)__atomic_load_n(&metrics.entries_compared, __ATOMIC_RELAXED) / lookups : 0.0);
+    fprintf(out, "Dentry cache           : %lu hits, %lu misses\n",
+            (unsigned long)__atomic_load_n(&metrics.dcache_hits, __ATOMIC_RELAXED),
+            (unsigned long)__atomic_load_n(&metrics.dcache_misses, __ATOMIC_RELAXED));
+    uint64_t compress_input = __atomic_load_n(&metrics.compress_input_bytes, __ATOMIC_RELAXED);
+    uint64_t compress_stored = __atomic_load_n(&metrics.compress_stored_bytes, __ATOMIC_RELAXED);
+    fprintf(out, "Compression            : %lu bytes stored in %lu (%.2fx)\n", (unsigned long)compress_input,
+            (unsigned long)compress_stored, compress_stored ? (double)compress_input / compress_stored : 0.0);
+    fprintf(out, "Deduplication          : %lu of %lu blocks written mapped to a stored copy\n",
+            (unsigned long)__atomic_load_n(&metrics.dedup_hits, __ATOMIC_RELAXED),
+            (unsigned long)__atomic_load_n(&metrics.dedup_lookups, __ATOMIC_RELAXED));
+    fprintf(out, "Metadata checksums     : %lu blocks verified, %lu mismatches\n",
+            (unsigned long)__atomic_load_n(&metrics.checksums_verified, __ATOMIC_RELAXED),
+            (unsigned long)__atomic_load_n(&metrics.checksum_errors, __ATOMIC_RELAXED));
+}
+
+#endif // METRICS_H
@@ -0,0 +1,358 @@
+// Microbenchmarks of the hot filesystem primitives.
+//
+// Each primitive runs in isolation on synthetic state: private bitmaps filled to
+// a given fullness, directory blocks of a given size, and files of a given size
+// on a scratch drive. Reports the time per call and the heap allocations per call.
+//
+//     gcc -O2 -pthread src/microbench.c -o obj/microbench.o && obj/microbench.o
+# define NO_CLI_MAIN
+# include "main.c"
+
+# define MICRO_DRIVE_NAME "microbench.bin"
+
+// Heap allocations made by the whole process: malloc, calloc and realloc are
+// wrapped around the glibc allocator so the primitives are measured unchanged.
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+static uint64_t micro_allocations;
+
+void *malloc(size_t size) {
+    __atomic_add_fetch(&micro_allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    __atomic_add_fetch(&micro_allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    __atomic_add_fetch(&micro_allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+// Time and allocations accumulated over the measured regions of one case
+typedef struct micro_timer {
+    uint64_t ns;
+    uint64_t allocations;
+    uint64_t ops;
+    uint64_t start_ns;
+    uint64_t start_allocations;
+} micro_timer;
+
+bool MICRO_JSON = false;
+uint32_t MICRO_SCALE = 1;   // Multiplies the number of operations of every case
+static bool micro_first_result = true;
+
+static uint64_t micro_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void micro_begin(micro_timer *t) {
+    t->start_allocations = __atomic_load_n(&micro_allocations, __ATOMIC_RELAXED);
+    t->start_ns = micro_now_ns();
+}
+
+static void micro_end(micro_timer *t, uint64_t ops) {
+    t->ns += micro_now_ns() - t->start_ns;
+    t->allocations += __atomic_load_n(&micro_allocations, __ATOMIC_RELAXED) - t->start_allocations;
+    t->ops += ops;
+}
+
+static void micro_report(const char *primitive, const char *variant, micro_timer *t) {
+    double ns_per_op = t->ops ? (double)t->ns / t->ops : 0.0;
+    double allocs_per_op = t->ops ? (double)t->allocations / t->ops : 0.0;
+
+    if (MICRO_JSON) {
+        printf("%s  {\"primitive\": \"%s\", \"case\": \"%s\", \"ops\": %lu, \"ns_per_op\": %.1f, \"allocs_per_op\": %.2f}",
+               micro_first_result ? "" : ",\n", primitive, variant, (unsigned long)t->ops, ns_per_op, allocs_per_op);
+    } else {
+        printf("%-36s %-14s %10lu %12.1f %10.2f\n", primitive, variant, (unsigned long)t->ops, ns_per_op, allocs_per_op);
+    }
+    micro_first_result = false;
+}
+
+// Mark about 'percent'% of the first 'bits' bits as used, at random positions
+static void micro_fill_bitmap(uint8_t *bitmap, uint32_t bits, uint32_t percent) {
+    memset(bitmap, 0, bits / 8);
+    for (uint32_t i = 0; i < bits; i++) {
+        if ((uint32_t)(rand() % 100) < percent) set_bitmap_bit(bitmap, i);
+    }
+}
+
+static const uint32_t micro_fullness[] = { 0, 50, 90, 99 };
+# define MICRO_FULLNESS_COUNT (sizeof(micro_fullness) / sizeof(micro_fullness[0]))
+
+// find_free_block: scan of the block bitmap from the first data block
+static void micro_find_free_block() {
+    uint8_t *bitmap = (uint8_t *)malloc(BLOCKS_COUNT / 8);
+    for (uint32_t f = 0; f < MICRO_FULLNESS_COUNT; f++) {
+        micro_fill_bitmap(bitmap, BLOCKS_COUNT, micro_fullness[f]);
+        uint64_t ops = 20000ull * MICRO_SCALE;
+        volatile int sink = 0;
+
+        micro_timer t = { 0 };
+        micro_begin(&t);
+        for (uint64_t i = 0; i < ops; i++) {
+            sink += find_free_block(bitmap, BLOCKS_COUNT, 1);
+        }
+        micro_end(&t, ops);
+        (void)sink;
+
+        char variant[32];
+        snprintf(variant, sizeof(variant), "%u%% full", micro_fullness[f]);
+        micro_report("find_free_block", variant, &t);
+    }
+    free(bitmap);
+}
+
+// Best fit and claim/release of one block in the free extent index
+static void micro_extent_index() {
+    uint8_t *bitmap = (uint8_t *)malloc(BLOCKS_COUNT / 8);
+    for (uint32_t f = 0; f < MICRO_FULLNESS_COUNT; f++) {
+        micro_fill_bitmap(bitmap, BLOCKS_COUNT, micro_fullness[f]);
+        extent_index idx;
+        if (initialize_extent_index(&idx, bitmap, 1, BLOCKS_COUNT) != 0) break;
+        uint64_t ops = 200000ull * MICRO_SCALE;
+
+        micro_timer t = { 0 };
+        micro_begin(&t);
+        for (uint64_t i = 0; i < ops; i++) {
+            int start = extent_index_best_fit(&idx, 1);
+            if (start < 0) break;
+            extent_index_claim(&idx, (uint32_t)start, 1);
+            extent_index_release(&idx, (uint32_t)start, 1);
+        }
+        micro_end(&t, ops);
+        destroy_extent_index(&idx);
+
+        char variant[32];
+        snprintf(variant, sizeof(variant), "%u%% full", micro_fullness[f]);
+        micro_report("extent_index best fit+claim+release", variant, &t);
+    }
+    free(bitmap);
+}
+
+# define MICRO_INODE_BATCH 64
+
+// allocate_inode on a private inode table (the locked bitmap scan); freed outside the timer
+static void micro_allocate_inode() {
+    inode_table *itable = (inode_table *)calloc(1, sizeof(inode_table));
+    uint8_t inode_bitmap[INODES_COUNT / 8];
+    group_descriptor gd;
+    uint32_t batch[MICRO_INODE_BATCH];
+
+    for (uint32_t f = 0; f < MICRO_FULLNESS_COUNT; f++) {
+        if (micro_fullness[f] == 99) continue; // Too few free inodes for a batch
+        micro_fill_bitmap(inode_bitmap, INODES_COUNT, micro_fullness[f]);
+        memset(&gd, 0, sizeof(gd));
+        gd.free_inodes_count = INODES_COUNT;
+        itable->used_inodes = 0;
+        uint64_t rounds = 200ull * MICRO_SCALE;
+
+        micro_timer t = { 0 };
+        for (uint64_t r = 0; r < rounds; r++) {
+            uint32_t count = 0;
+            micro_begin(&t);
+            for (uint32_t i = 0; i < MICRO_INODE_BATCH; i++) {
+                inode *node = allocate_inode(itable, inode_bitmap, &gd, 0, 0644);
+                if (!node) break;
+                batch[count++] = node->inode_number;
+            }
+            micro_end(&t, count);
+
+            for (uint32_t i = 0; i < count; i++) {
+                free_bitmap_bit(inode_bitmap, batch[i]);
+                gd.free_inodes_count++;
+                itable->used_inodes--;
+            }
+        }
+
+        char variant[32];
+        snprintf(variant, sizeof(variant), "%u%% full", micro_fullness[f]);
+        micro_report("allocate_inode", variant, &t);
+    }
+    free(itable);
+}
+
+// add_entry_to_directory_block / remove_entry_from_directory_block at several directory sizes
+static void micro_directory_entries() {
+    static const uint32_t sizes[] = { 2, 64, 1024, 4096 };
+    for (uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        directory_block_t *dir = allocate_directory_block(sizes[s]);
+        for (uint32_t i = 0; i < sizes[s]; i++) {
+            dir->entries[i].inode = i + 1;
+            dir->entries[i].rec_len = sizeof(dir_entry_t);
+            snprintf(dir->entries[i].name, sizeof(dir->entries[i].name), "entry_%u", i);
+            dir->entries[i].name_len = (uint8_t)strlen(dir->entries[i].name);
+        }
+        uint64_t ops = (sizes[s] >= 1024 ? 500ull : 20000ull) * MICRO_SCALE;
+
+        micro_timer add = { 0 };
+        micro_begin(&add);
+        for (uint64_t i = 0; i < ops; i++) {
+            free(add_entry_to_directory_block(dir, INODES_COUNT, "new_entry.txt", 0));
+        }
+        micro_end(&add, ops);
+
+        // Remove the middle entry
+        micro_timer remove = { 0 };
+        micro_begin(&remove);
+        for (uint64_t i = 0; i < ops; i++) {
+            free(remove_entry_from_directory_block(dir, sizes[s] / 2 + 1));
+        }
+        micro_end(&remove, ops);
+
+        char variant[32];
+        snprintf(variant, sizeof(variant), "%u entries", sizes[s]);
+        micro_report("add_entry_to_directory_block", variant, &add);
+        micro_report("remove_entry_from_directory_block", variant, &remove);
+        free(dir);
+    }
+}
+
+// Create a file of 'size' content bytes in the root directory; returns its inode or -1
+static int micro_create_file(FILE *disk, const char *name, uint32_t size) {
+    char *data = (char *)malloc((size_t)size + 1);
+    if (!data) return -1;
+    memset(data, 'x', size);
+    data[size] = '\0';
+    create_file(disk, name, "dat", 0644, data, ROOT_INODE_NUMBER);
+    free(data);
+
+    char full_name[64];
+    uint32_t inode_number;
+    uint8_t file_type;
+    snprintf(full_name, sizeof(full_name), "%s.dat", name);
+    if (lookup_name(disk, ROOT_INODE_NUMBER, full_name, &inode_number, &file_type) != 0) return -1;
+    return (int)inode_number;
+}
+
+static const uint32_t micro_file_sizes[] = { 4 * 1024, 48 * 1024, 1024 * 1024, 8 * 1024 * 1024 };
+# define MICRO_FILE_SIZES_COUNT (sizeof(micro_file_sizes) / sizeof(micro_file_sizes[0]))
+
+static void micro_size_variant(char *variant, size_t len, uint32_t size) {
+    if (size >= 1024 * 1024) snprintf(variant, len, "%u MB file", size / (1024 * 1024));
+    else snprintf(variant, len, "%u KB file", size / 1024);
+}
+
+// Block map translation of random block indices, and read_inode_data of whole files
+static void micro_file_primitives(FILE *disk) {
+    for (uint32_t s = 0; s < MICRO_FILE_SIZES_COUNT; s++) {
+        char name[32];
+        snprintf(name, sizeof(name), "micro_%u", s);
+        int inode_number = micro_create_file(disk, name, micro_file_sizes[s]);
+        if (inode_number < 0) {
+            fprintf(stderr, "Error: could not create the %u byte test file.\n", micro_file_sizes[s]);
+            return;
+        }
+        inode *node = &fs_meta.itable.inodes[inode_number];
+        uint32_t blocks = (node->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        char variant[32];
+        micro_size_variant(variant, sizeof(variant), micro_file_sizes[s]);
+
+        uint64_t ops = 100000ull * MICRO_SCALE;
+        volatile uint32_t sink = 0;
+        micro_timer map = { 0 };
+        micro_begin(&map);
+        for (uint64_t i = 0; i < ops; i++) {
+            uint32_t block;
+            lookup_data_block_of_inode(disk, node, (uint32_t)(i * 2654435761u % blocks), &block);
+            sink += block;
+        }
+        micro_end(&map, ops);
+        (void)sink;
+        micro_report("lookup_data_block_of_inode", variant, &map);
+
+        char *buffer = (char *)malloc(node->file_size);
+        uint64_t reads = (micro_file_sizes[s] >= 1024 * 1024 ? 20ull : 2000ull) * MICRO_SCALE;
+        micro_timer read = { 0 };
+        micro_begin(&read);
+        for (uint64_t i = 0; i < reads; i++) {
+            read_inode_data(disk, node, buffer, node->file_size);
+        }
+        micro_end(&read, reads);
+        free(buffer);
+        micro_report("read_inode_data", variant, &read);
+    }
+}
+
+// allocate_data_block_for_inode: map every block of a new file of each size, then free it
+static void micro_allocate_data_blocks(FILE *disk) {
+    for (uint32_t s = 0; s < MICRO_FILE_SIZES_COUNT; s++) {
+        uint32_t blocks = micro_file_sizes[s] / BLOCK_SIZE;
+        uint64_t files = (micro_file_sizes[s] >= 1024 * 1024 ? 3ull : 50ull) * MICRO_SCALE;
+        micro_timer t = { 0 };
+
+        for (uint64_t f = 0; f < files; f++) {
+            inode node;
+            initialize_inode(&node, 0, 0, 0644);
+
+            journal_start(&fs_journal);
+            micro_begin(&t);
+            for (uint32_t n = 0; n < blocks; n++) {
+                if (allocate_data_block_for_inode(disk, &node, n, fs_meta.block_bitmap, &fs_meta.gd) < 0) break;
+            }
+            micro_end(&t, blocks);
+            free_all_data_blocks_of_inode(disk, &node, fs_meta.block_bitmap, &fs_meta.gd);
+            write_metadata(disk, &fs_meta.gd, fs_meta.block_bitmap, fs_meta.inode_bitmap, &fs_meta.itable);
+            journal_stop(&fs_journal, disk);
+        }
+
+        char variant[32];
+        micro_size_variant(variant, sizeof(variant), micro_file_sizes[s]);
+        micro_report("allocate_data_block_for_inode", variant, &t);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            MICRO_JSON = true;
+        } else if (strncmp(argv[i], "--scale=", 8) == 0 && atoi(argv[i] + 8) > 0) {
+            MICRO_SCALE = (uint32_t)atoi(argv[i] + 8);
+        } else {
+            fprintf(stderr, "Usage: %s [--json] [--scale=<n>]\n", argv[0]);
+            return 1;
+        }
+    }
+    VERBOSE = false;
+    srand(1);
+
+    // 1. Scratch drive for the primitives that work on file blocks
+    initialize_delalloc_table(&pending_writes);
+    initialize_dcache(&dentry_cache);
+    initialize_locks();
+    create_drive_file(MICRO_DRIVE_NAME, (uint64_t)BLOCK_SIZE * BLOCKS_COUNT);
+    FILE *disk = fopen(MICRO_DRIVE_NAME, "rb+");
+    if (!disk) {
+        fprintf(stderr, "Error: Unable to open file %s\n", MICRO_DRIVE_NAME);
+        return 1;
+    }
+    initialize_drive(disk);
+    if (mount_drive(disk) != 0) {
+        fclose(disk);
+        return 1;
+    }
+
+    // 2. Run the cases
+    if (MICRO_JSON) printf("[\n");
+    else printf("%-36s %-14s %10s %12s %10s\n", "primitive", "case", "ops", "ns/op", "allocs/op");
+
+    micro_find_free_block();
+    micro_extent_index();
+    micro_allocate_inode();
+    micro_directory_entries();
+    micro_allocate_data_blocks(disk);
+    micro_file_primitives(disk);
+
+    if (MICRO_JSON) printf("\n]\n");
+
+    unmount_drive(disk);
+    fclose(disk);
+    remove(MICRO_DRIVE_NAME);
+    return 0;
+}
@@ -0,0 +1,63 @@
+#ifndef ORPHAN_H
+#define ORPHAN_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+// Orphan list: inodes whose name is already gone but whose blocks have not been
+// reclaimed yet (asynchronous unlink). The table lives in the unused tail of the
+// group descriptor block and is logged with it, so orphans left behind by a crash
+// are found and reclaimed at the next mount.
+
+# define ORPHAN_TABLE_OFFSET 512 // Byte offset of the table inside the group descriptor block
+# define ORPHAN_TABLE_MAX 440    // Entries that fit in the rest of the block
+
+typedef struct orphan_entry {
+    uint32_t inode;     // Unlinked inode (file or directory tree)
+    uint32_t parent;    // Directory it was removed from (the '..' of a directory orphan)
+} orphan_entry;
+
+typedef struct orphan_table {
+    uint32_t count;
+    uint32_t reserved;
+    orphan_entry entries[ORPHAN_TABLE_MAX];
+} orphan_table;
+
+// Initialize an empty table
+void initialize_orphan_table(orphan_table *table) {
+    memset(table, 0, sizeof(orphan_table));
+}
+
+// Bytes of the table that are in use (header and live entries), i.e. what has to be logged
+size_t orphan_table_bytes(const orphan_table *table) {
+    return offsetof(orphan_table, entries) + table->count * sizeof(orphan_entry);
+}
+
+// Append an orphan; returns 0, or -1 if the table is full
+int orphan_add(orphan_table *table, uint32_t inode, uint32_t parent) {
+    if (table->count >= ORPHAN_TABLE_MAX) return -1;
+    table->entries[table->count].inode = inode;
+    table->entries[table->count].parent = parent;
+    table->count++;
+    return 0;
+}
+
+// Remove the most recent orphan into 'out'; returns 0, or -1 if the table is empty
+int orphan_take(orphan_table *table, orphan_entry *out) {
+    if (table->count == 0) return -1;
+    *out = table->entries[--table->count];
+    return 0;
+}
+
+// Whether an inode is on the list (unlinked, waiting to be reclaimed)
+bool orphan_contains(const orphan_table *table, uint32_t inode) {
+    for (uint32_t i = 0; i < table->count; i++) {
+        if (table->entries[i].inode == inode) return true;
+    }
+    return false;
+}
+
+#endif // ORPHAN_H
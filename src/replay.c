@@ -0,0 +1,266 @@
+// Replay of a workload trace recorded by the CLI (main.c --record=<file>).
+//
+// Formats a fresh drive and runs the recorded commands against it, either as
+// fast as possible or at the pace they were recorded (--paced). With
+// --streams=N the commands are split into N streams run by parallel threads:
+// commands under the same top-level entry of the root always go to the same
+// stream and keep their recorded order; commands of different streams may
+// interleave in any order. A command with paths in several streams (a "cp"
+// between two top-level entries) is run once all of them have reached it.
+//
+//     gcc -O2 -pthread src/replay.c -o obj/replay.o && obj/replay.o trace.bin --streams=4
+# define NO_CLI_MAIN
+# include "main.c"
+# include <fcntl.h>
+
+# define REPLAY_DRIVE_NAME "replay.bin"
+# define REPLAY_MAX_STREAMS 64
+
+// Rendezvous of the streams at the commands that span several of them
+typedef struct replay_joins {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    uint8_t *needed;        // Per record: number of streams it spans
+    uint8_t *arrived;       // Per record: streams that reached it (needed + 1 once run)
+} replay_joins;
+
+typedef struct replay_stream {
+    FILE *disk;
+    workload_record *records;
+    replay_joins *joins;
+    uint32_t *indexes;      // Records of this stream, in recorded order
+    uint32_t count;
+    uint64_t origin_ns;     // Start of the replay (paced mode)
+    bool paced;
+    uint32_t mismatches;    // Commands whose result differs from the recorded one
+    uint32_t failures;      // Commands that failed (recorded failures included)
+    pthread_t thread;
+} replay_stream;
+
+// Streams of a record (bit s for stream s): hash of the first component of
+// each of its path arguments, stream 0 if it has none
+static uint64_t replay_streams_of(const workload_record *r, uint32_t streams) {
+    uint64_t mask = 0;
+    for (int a = 0; a < r->h.argc; a++) {
+        if (!workload_is_path(r->h.op, r->args, r->h.argc, a)) continue;
+        const char *p = r->args[a];
+        while (*p == '/') p++;
+        uint32_t hash = 2166136261u;
+        for (; *p != '\0' && *p != '/'; p++) {
+            hash = (hash ^ (uint8_t)*p) * 16777619u;
+        }
+        mask |= 1ull << (hash % streams);
+    }
+    return mask ? mask : 1;
+}
+
+// Wait until every stream of record 'index' reached it; true for the last
+// one to arrive, which runs the command while the others wait for it
+static bool replay_join(replay_joins *joins, uint32_t index) {
+    pthread_mutex_lock(&joins->lock);
+    bool last = ++joins->arrived[index] == joins->needed[index];
+    while (!last && joins->arrived[index] <= joins->needed[index]) {
+        pthread_cond_wait(&joins->done, &joins->lock);
+    }
+    pthread_mutex_unlock(&joins->lock);
+    return last;
+}
+
+static void replay_join_done(replay_joins *joins, uint32_t index) {
+    pthread_mutex_lock(&joins->lock);
+    joins->arrived[index]++;
+    pthread_cond_broadcast(&joins->done);
+    pthread_mutex_unlock(&joins->lock);
+}
+
+static void *replay_stream_run(void *arg) {
+    replay_stream *s = (replay_stream *)arg;
+    char cwd[MAX_INPUT_SIZE];
+    char *args[WORKLOAD_MAX_ARGS];
+
+    for (uint32_t i = 0; i < s->count; i++) {
+        workload_record *r = &s->records[s->indexes[i]];
+        bool joined = s->joins->needed[s->indexes[i]] > 1;
+        if (joined && !replay_join(s->joins, s->indexes[i])) continue;
+
+        // 1. Wait for the recorded start time of the command
+        if (s->paced) {
+            uint64_t due = s->origin_ns + r->h.start_us * 1000;
+            uint64_t now = metrics_now();
+            if (due > now) {
+                struct timespec delay = { (time_t)((due - now) / 1000000000ull), (long)((due - now) % 1000000000ull) };
+                nanosleep(&delay, NULL);
+            }
+        }
+
+        // 2. Run it from the root (execute_command may modify its arguments)
+        strcpy(cwd, "root");
+        uint32_t inode_number = ROOT_INODE_NUMBER;
+        for (uint32_t a = 0; a < r->h.argc; a++) args[a] = r->args[a];
+        int result = execute_command(s->disk, (char *)workload_op_names[r->h.op], args, r->h.argc, cwd, &inode_number);
+
+        if (result != 0) s->failures++;
+        if (result != r->h.result) s->mismatches++;
+        if (joined) replay_join_done(s->joins, s->indexes[i]);
+    }
+    return NULL;
+}
+
+static void replay_usage(const char *program) {
+    fprintf(stderr, "Usage: %s <trace> [--streams=<n>] [--paced] [--verbose] [--drive=<file>] [--delalloc] [--compress] [--dedup] [--durability=group|none|sync|periodic]\n", program);
+}
+
+int main(int argc, char *argv[]) {
+    const char *trace_path = NULL;
+    const char *drive_name = REPLAY_DRIVE_NAME;
+    uint32_t streams_count = 1;
+    bool paced = false;
+    VERBOSE = false;
+
+    // 1. Parse options
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--streams=", 10) == 0 && atoi(argv[i] + 10) > 0 && atoi(argv[i] + 10) <= REPLAY_MAX_STREAMS) {
+            streams_count = (uint32_t)atoi(argv[i] + 10);
+        } else if (strcmp(argv[i], "--paced") == 0) {
+            paced = true;
+        } else if (strcmp(argv[i], "--verbose") == 0) {
+            VERBOSE = true;
+        } else if (strncmp(argv[i], "--drive=", 8) == 0 && argv[i][8] != '\0') {
+            drive_name = argv[i] + 8;
+        } else if (strcmp(argv[i], "--delalloc") == 0) {
+            DELALLOC = true;
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            COMPRESS = true;
+        } else if (strcmp(argv[i], "--dedup") == 0) {
+            DEDUP = true;
+        } else if (strcmp(argv[i], "--durability=group") == 0) {
+            DURABILITY = DURABILITY_GROUP;
+        } else if (strcmp(argv[i], "--durability=none") == 0) {
+            DURABILITY = DURABILITY_NOSYNC;
+        } else if (strcmp(argv[i], "--durability=sync") == 0) {
+            DURABILITY = DURABILITY_SYNC;
+        } else if (strcmp(argv[i], "--durability=periodic") == 0) {
+            DURABILITY = DURABILITY_PERIODIC;
+        } else if (argv[i][0] != '-' && trace_path == NULL) {
+            trace_path = argv[i];
+        } else {
+            replay_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!trace_path) {
+        replay_usage(argv[0]);
+        return 1;
+    }
+
+    // 2. Load the trace and split it into streams
+    workload_record *records = NULL;
+    uint32_t records_count = 0;
+    if (workload_load(trace_path, &records, &records_count) != 0) return 1;
+
+    int status = 1;
+    FILE *disk = NULL;
+    replay_stream streams[REPLAY_MAX_STREAMS];
+    memset(streams, 0, sizeof(streams));
+    replay_joins joins = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL };
+    joins.needed = (uint8_t *)calloc(records_count ? records_count : 1, 1);
+    joins.arrived = (uint8_t *)calloc(records_count ? records_count : 1, 1);
+    if (!joins.needed || !joins.arrived) {
+        fprintf(stderr, "Error: could not allocate memory for the replay.\n");
+        goto cleanup;
+    }
+    for (uint32_t s = 0; s < streams_count; s++) {
+        streams[s].indexes = (uint32_t *)malloc((records_count ? records_count : 1) * sizeof(uint32_t));
+        if (!streams[s].indexes) {
+            fprintf(stderr, "Error: could not allocate memory for the replay.\n");
+            goto cleanup;
+        }
+    }
+    for (uint32_t i = 0; i < records_count; i++) {
+        uint64_t mask = replay_streams_of(&records[i], streams_count);
+        for (uint32_t s = 0; s < streams_count; s++) {
+            if (!(mask & (1ull << s))) continue;
+            streams[s].indexes[streams[s].count++] = i;
+            joins.needed[i]++;
+        }
+    }
+
+    // 3. Format and mount a fresh drive
+    initialize_delalloc_table(&pending_writes);
+    initialize_dcache(&dentry_cache);
+    initialize_locks();
+    create_drive_file(drive_name, (uint64_t)BLOCK_SIZE * BLOCKS_COUNT);
+    disk = fopen(drive_name, "rb+");
+    if (!disk) {
+        fprintf(stderr, "Error: Unable to open file %s\n", drive_name);
+        goto cleanup;
+    }
+    initialize_drive(disk);
+    if (mount_drive(disk) != 0) {
+        fclose(disk);
+        disk = NULL;
+        goto cleanup;
+    }
+    start_flusher(disk);
+    start_reclaimer(disk);
+
+    // 4. Run the streams; the output of the commands is discarded unless --verbose
+    fflush(stdout);
+    fflush(stderr);
+    int saved_stdout = dup(STDOUT_FILENO), saved_stderr = dup(STDERR_FILENO);
+    if (!VERBOSE) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(null_fd);
+    }
+
+    uint64_t start = metrics_now();
+    for (uint32_t s = 0; s < streams_count; s++) {
+        streams[s].disk = disk;
+        streams[s].records = records;
+        streams[s].joins = &joins;
+        streams[s].origin_ns = start;
+        streams[s].paced = paced;
+        pthread_create(&streams[s].thread, NULL, replay_stream_run, &streams[s]);
+    }
+    for (uint32_t s = 0; s < streams_count; s++) {
+        pthread_join(streams[s].thread, NULL);
+    }
+    sync_filesystem(disk);
+    uint64_t elapsed = metrics_now() - start;
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_stdout, STDOUT_FILENO);
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stdout);
+    close(saved_stderr);
+
+    // 5. Report
+    uint32_t mismatches = 0, failures = 0;
+    for (uint32_t s = 0; s < streams_count; s++) {
+        mismatches += streams[s].mismatches;
+        failures += streams[s].failures;
+    }
+    uint64_t recorded_us = records_count ? records[records_count - 1].h.start_us + records[records_count - 1].h.duration_us : 0;
+    printf("Commands          : %u in %u stream(s)%s\n", records_count, streams_count, paced ? ", paced" : "");
+    printf("Elapsed           : %.3f ms (recorded %.3f ms)\n", elapsed / 1e6, recorded_us / 1e3);
+    printf("Throughput        : %.1f ops/s\n", elapsed ? records_count / (elapsed / 1e9) : 0.0);
+    printf("Failed commands   : %u\n", failures);
+    printf("Result mismatches : %u\n", mismatches);
+    status = 0;
+
+cleanup:
+    if (disk) {
+        stop_reclaimer(disk);
+        stop_flusher(disk);
+        if (unmount_drive(disk) != 0) status = 1;
+        fclose(disk);
+    }
+    for (uint32_t s = 0; s < streams_count; s++) free(streams[s].indexes);
+    free(joins.needed);
+    free(joins.arrived);
+    workload_free(records, records_count);
+    return status;
+}
@@ -35,6 +35,24 @@ typedef struct superblock {
 
     uint32_t magic_number;      // A constant value to identify the file system type.
                                 // For example, 0xEF53 is commonly used for Ext4.
+
+    uint32_t journal_start;     // First block of the metadata journal area.
+                                // The journal blocks are marked as used in the block bitmap.
+
+    uint32_t journal_blocks;    // Size of the journal area in blocks.
+                                // 0 means the file system was formatted without a journal.
+
+    uint32_t refcount_start;    // First block of the block reference count table.
+                                // Like the journal, the table blocks are marked as used in the block bitmap.
+
+    uint32_t refcount_blocks;   // Size of the reference count table in blocks.
+                                // 0 means the file system was formatted without one (no block is shared).
+
+    uint32_t checksum_start;    // First block of the metadata checksum table (CRC32C of every metadata block).
+                                // Like the refcount table, the table blocks are marked as used in the block bitmap.
+
+    uint32_t checksum_blocks;   // Size of the checksum table in blocks.
+                                // 0 means the file system was formatted without one (metadata is not checked).
 } superblock;
 
 void initialize_superblock(
@@ -48,7 +66,13 @@ void initialize_superblock(
         uint32_t first_data_block,
         const char *fs_uuid,
         const char *volume_name,
-        uint32_t magic_number
+        uint32_t magic_number,
+        uint32_t journal_start,
+        uint32_t journal_blocks,
+        uint32_t refcount_start,
+        uint32_t refcount_blocks,
+        uint32_t checksum_start,
+        uint32_t checksum_blocks
     ) 
 {
     sb->total_blocks = total_blocks;
@@ -61,6 +85,12 @@ void initialize_superblock(
     strncpy(sb->fs_uuid, fs_uuid, sizeof(sb->fs_uuid) - 1);
     strncpy(sb->volume_name, volume_name, sizeof(sb->volume_name) - 1);
     sb->magic_number = magic_number;
+    sb->journal_start = journal_start;
+    sb->journal_blocks = journal_blocks;
+    sb->refcount_start = refcount_start;
+    sb->refcount_blocks = refcount_blocks;
+    sb->checksum_start = checksum_start;
+    sb->checksum_blocks = checksum_blocks;
 }
 
 void print_superblock(const struct superblock *sb) {
@@ -75,6 +105,12 @@ void print_superblock(const struct superblock *sb) {
     printf("File System UUID   : %s\n", sb->fs_uuid);
     printf("Volume Name        : %s\n", sb->volume_name);
     printf("Magic Number       : 0x%X\n", sb->magic_number);
+    printf("Journal Start      : %u\n", sb->journal_start);
+    printf("Journal Blocks     : %u\n", sb->journal_blocks);
+    printf("Refcount Start     : %u\n", sb->refcount_start);
+    printf("Refcount Blocks    : %u\n", sb->refcount_blocks);
+    printf("Checksum Start     : %u\n", sb->checksum_start);
+    printf("Checksum Blocks    : %u\n", sb->checksum_blocks);
 }
 
 
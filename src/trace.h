@@ -0,0 +1,110 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+// Operation tracer.
+//
+// Spans (an operation or one of its phases, with start and duration) are kept in
+// a fixed ring buffer; when it is full the oldest spans are overwritten. The ring
+// is dumped in the Chrome trace event format, which chrome://tracing and Perfetto
+// open directly.
+//
+// Tracing is compiled in only with -DFS_TRACE. Without it the TRACE_* macros
+// expand to nothing, so the spans cost nothing at all.
+
+#ifdef FS_TRACE
+
+# define TRACE_RING_EVENTS 65536 // Power of two
+
+typedef struct trace_event {
+    const char *name;       // Static string
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint32_t tid;
+    uint64_t seq;           // Index of the span + 1 once it is completely written, 0 before
+} trace_event;
+
+typedef struct trace_ring {
+    trace_event events[TRACE_RING_EVENTS];
+    uint64_t next;          // Index of the next span to write
+    bool enabled;
+} trace_ring;
+
+trace_ring tracer;
+static uint32_t trace_threads;
+static __thread uint32_t trace_tid;
+
+static inline uint64_t trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Record a span that started at 'start_ns' and ends now
+void trace_record(const char *name, uint64_t start_ns) {
+    if (!__atomic_load_n(&tracer.enabled, __ATOMIC_RELAXED)) return;
+    if (trace_tid == 0) trace_tid = __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+
+    uint64_t index = __atomic_fetch_add(&tracer.next, 1, __ATOMIC_RELAXED);
+    trace_event *e = &tracer.events[index & (TRACE_RING_EVENTS - 1)];
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    e->name = name;
+    e->start_ns = start_ns;
+    e->duration_ns = trace_now() - start_ns;
+    e->tid = trace_tid;
+    __atomic_store_n(&e->seq, index + 1, __ATOMIC_RELEASE);
+}
+
+// Start or stop recording (the ring keeps its spans)
+void trace_enable(bool enabled) {
+    __atomic_store_n(&tracer.enabled, enabled, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Write the spans in the ring, oldest first, as a Chrome trace JSON file.
+ *
+ * Spans still being written by other threads are skipped.
+ *
+ * @return The number of spans written, or -1 if the file cannot be created.
+ */
+int trace_dump(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (!out) return -1;
+
+    uint64_t end = __atomic_load_n(&tracer.next, __ATOMIC_ACQUIRE);
+    uint64_t begin = (end > TRACE_RING_EVENTS) ? end - TRACE_RING_EVENTS : 0;
+    int written = 0;
+
+    fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    for (uint64_t i = begin; i < end; i++) {
+        trace_event *e = &tracer.events[i & (TRACE_RING_EVENTS - 1)];
+        if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != i + 1) continue;
+        fprintf(out, "%s{\"name\": \"%s\", \"cat\": \"fs\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %u}",
+                written ? ",\n" : "", e->name, e->start_ns / 1000.0, e->duration_ns / 1000.0, e->tid);
+        written++;
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+    return written;
+}
+
+// Declare 'var' holding the start of a span (0 while tracing is off)
+# define TRACE_BEGIN(var) uint64_t var = __atomic_load_n(&tracer.enabled, __ATOMIC_RELAXED) ? trace_now() : 0
+// Close the span opened by TRACE_BEGIN(var)
+# define TRACE_END(var, name) do { if (var) trace_record(name, var); } while (0)
+// Record a span from a start time taken for another purpose
+# define TRACE_SPAN(name, start_ns) trace_record(name, start_ns)
+
+#else
+
+# define TRACE_BEGIN(var)
+# define TRACE_END(var, name) do { } while (0)
+# define TRACE_SPAN(name, start_ns) do { } while (0)
+
+#endif // FS_TRACE
+
+#endif // TRACE_H
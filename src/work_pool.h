@@ -0,0 +1,236 @@
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// Work-stealing task pool for tree-shaped jobs.
+//
+// Every worker owns a deque: it pushes the tasks it discovers at the bottom and pops
+// them back from the bottom (depth first, good locality), while idle workers steal
+// from the top of other deques (the oldest, usually largest, subtrees).
+// The calling thread is worker 0; more workers are started on demand, only when
+// queued work piles up, so small jobs never pay for thread creation.
+
+# define WORK_POOL_MAX_WORKERS 16
+
+// One unit of work; the meaning of the fields is up to the task function
+typedef struct work_task {
+    uint32_t kind;
+    uint32_t arg0;
+    uint32_t arg1;
+} work_task;
+
+struct work_pool;
+typedef void (*work_task_fn)(struct work_pool *pool, work_task task, void *ctx);
+typedef void (*work_finish_fn)(void *ctx); // Run on every helper thread before it exits
+
+typedef struct work_deque {
+    pthread_mutex_t lock;
+    work_task *tasks;
+    uint32_t top;           // Index of the oldest task (stolen from here)
+    uint32_t bottom;        // One past the newest task (pushed and popped here)
+    uint32_t capacity;
+} work_deque;
+
+// Start argument of a helper thread
+typedef struct work_worker {
+    struct work_pool *pool;
+    uint32_t id;
+} work_worker;
+
+typedef struct work_pool {
+    work_deque deques[WORK_POOL_MAX_WORKERS];
+    pthread_t threads[WORK_POOL_MAX_WORKERS];
+    work_worker workers[WORK_POOL_MAX_WORKERS];
+    uint32_t max_workers;
+    uint32_t started;       // Workers running (including the caller)
+
+    pthread_mutex_t lock;   // Protects 'started', 'queued' and 'pending'
+    pthread_cond_t wakeup;  // Signalled when a task is queued or the job is done
+    uint32_t queued;        // Tasks waiting in some deque
+    uint32_t pending;       // Tasks queued or running
+
+    work_task_fn run;
+    work_finish_fn finish;
+    void *ctx;
+} work_pool;
+
+// Index of the worker running on this thread
+static __thread uint32_t work_pool_self;
+
+static bool work_deque_push(work_deque *dq, work_task task) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom == dq->capacity) {
+        // Slide the live part down before growing
+        if (dq->top > 0) {
+            memmove(dq->tasks, dq->tasks + dq->top, (dq->bottom - dq->top) * sizeof(work_task));
+            dq->bottom -= dq->top;
+            dq->top = 0;
+        }
+        if (dq->bottom == dq->capacity) {
+            uint32_t capacity = dq->capacity ? dq->capacity * 2 : 256;
+            work_task *grown = (work_task *)realloc(dq->tasks, capacity * sizeof(work_task));
+            if (!grown) {
+                pthread_mutex_unlock(&dq->lock);
+                return false;
+            }
+            dq->tasks = grown;
+            dq->capacity = capacity;
+        }
+    }
+    dq->tasks[dq->bottom++] = task;
+    pthread_mutex_unlock(&dq->lock);
+    return true;
+}
+
+static bool work_deque_pop(work_deque *dq, work_task *out) {
+    pthread_mutex_lock(&dq->lock);
+    bool found = dq->bottom > dq->top;
+    if (found) *out = dq->tasks[--dq->bottom];
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static bool work_deque_steal(work_deque *dq, work_task *out) {
+    pthread_mutex_lock(&dq->lock);
+    bool found = dq->bottom > dq->top;
+    if (found) *out = dq->tasks[dq->top++];
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static void *work_pool_worker_main(void *arg);
+
+// Run a task immediately on this worker, without queueing it
+static void work_pool_run_task(work_pool *pool, work_task task) {
+    pool->run(pool, task, pool->ctx);
+}
+
+/**
+ * @brief Queue a task on the calling worker's deque.
+ *
+ * If it cannot be queued (out of memory) it runs right away instead.
+ */
+void work_pool_push(work_pool *pool, work_task task) {
+    if (!work_deque_push(&pool->deques[work_pool_self], task)) {
+        work_pool_run_task(pool, task);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pool->pending++;
+
+    // More queued work than workers to take it: start one more
+    if (pool->queued > 1 && pool->started < pool->max_workers) {
+        uint32_t id = pool->started;
+        pool->workers[id].pool = pool;
+        pool->workers[id].id = id;
+        if (pthread_create(&pool->threads[id], NULL, work_pool_worker_main, &pool->workers[id]) == 0) {
+            pool->started++;
+        }
+    }
+    pthread_cond_signal(&pool->wakeup);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Take a task: own deque first, then steal from the others
+static bool work_pool_take(work_pool *pool, work_task *out) {
+    uint32_t self = work_pool_self;
+    bool found = work_deque_pop(&pool->deques[self], out);
+
+    pthread_mutex_lock(&pool->lock);
+    uint32_t workers = pool->started;
+    pthread_mutex_unlock(&pool->lock);
+
+    for (uint32_t i = 1; !found && i < workers; i++) {
+        found = work_deque_steal(&pool->deques[(self + i) % workers], out);
+    }
+    if (found) {
+        pthread_mutex_lock(&pool->lock);
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return found;
+}
+
+// Worker loop: run tasks until every queued and running task is done
+static void work_pool_loop(work_pool *pool) {
+    for (;;) {
+        work_task task;
+        if (work_pool_take(pool, &task)) {
+            work_pool_run_task(pool, task);
+
+            pthread_mutex_lock(&pool->lock);
+            if (--pool->pending == 0) pthread_cond_broadcast(&pool->wakeup);
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool->pending > 0 && pool->queued == 0) {
+            pthread_cond_wait(&pool->wakeup, &pool->lock);
+        }
+        bool done = pool->pending == 0;
+        pthread_mutex_unlock(&pool->lock);
+        if (done) break;
+    }
+}
+
+static void *work_pool_worker_main(void *arg) {
+    work_worker *worker = (work_worker *)arg;
+    work_pool_self = worker->id;
+    work_pool_loop(worker->pool);
+    if (worker->pool->finish) worker->pool->finish(worker->pool->ctx);
+    return NULL;
+}
+
+/**
+ * @brief Run 'first' and every task it spawns, on up to 'max_workers' threads.
+ *
+ * The calling thread takes part as worker 0 and returns once all tasks are done
+ * and every helper has run 'finish' and exited ('finish' is not run on the caller).
+ */
+void work_pool_run(work_task first, work_task_fn run, work_finish_fn finish, void *ctx, uint32_t max_workers) {
+    work_pool pool;
+    memset(&pool, 0, sizeof(work_pool));
+    pool.max_workers = (max_workers == 0) ? 1 : (max_workers > WORK_POOL_MAX_WORKERS ? WORK_POOL_MAX_WORKERS : max_workers);
+    pool.started = 1;
+    pool.pending = 1; // 'first', run below by this thread
+    pool.run = run;
+    pool.finish = finish;
+    pool.ctx = ctx;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.wakeup, NULL);
+    for (uint32_t i = 0; i < WORK_POOL_MAX_WORKERS; i++) {
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+    }
+
+    uint32_t self = work_pool_self;
+    work_pool_self = 0;
+    work_pool_run_task(&pool, first);
+    pthread_mutex_lock(&pool.lock);
+    if (--pool.pending == 0) pthread_cond_broadcast(&pool.wakeup);
+    pthread_mutex_unlock(&pool.lock);
+    work_pool_loop(&pool);
+    work_pool_self = self;
+
+    // Every task is done; wait for the helpers to run 'finish' and exit
+    for (uint32_t i = 1; i < pool.started; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+
+    for (uint32_t i = 0; i < WORK_POOL_MAX_WORKERS; i++) {
+        pthread_mutex_destroy(&pool.deques[i].lock);
+        free(pool.deques[i].tasks);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.wakeup);
+}
+
+#endif // WORK_POOL_H
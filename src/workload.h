@@ -0,0 +1,230 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+// Workload trace of the CLI.
+//
+// Every filesystem command run by the CLI can be appended to a binary file with
+// its arguments, result, start time and duration, so that the exact same
+// sequence of operations can be replayed later against a fresh drive (see
+// replay.c). Path arguments are stored absolute, which makes a record
+// independent of the directory the CLI was in.
+//
+// File layout (host byte order):
+//   header : magic "FSWL", u32 version
+//   record : u8 op, u8 argc, i32 result, u64 start (us since the file was
+//            opened), u32 duration (us), then argc times: u32 length, bytes
+
+# define WORKLOAD_MAGIC "FSWL"
+# define WORKLOAD_VERSION 1
+# define WORKLOAD_MAX_ARGS 255
+
+// Recorded commands, the index is the op stored in a record
+# define WORKLOAD_OPS_COUNT 12
+static const char *workload_op_names[WORKLOAD_OPS_COUNT] = {
+    "ls", "cf", "rf", "wf", "truncate", "fallocate", "mkdir", "rm", "sync", "cp", "snapshot", "defrag"
+};
+
+// Path arguments of each op, bit i for argument i counted after the leading
+// "--" options (so "cp --reflink a b" has its paths at 1 and 2)
+static const uint32_t workload_path_args[WORKLOAD_OPS_COUNT] = {
+    1u << 0, 1u << 0, 1u << 0, 1u << 1, 1u << 0, 1u << 0, 1u << 0, 1u << 1, 0, (1u << 0) | (1u << 1), 0, 1u << 0
+};
+
+typedef struct __attribute__((packed)) workload_record_header {
+    uint8_t op;
+    uint8_t argc;
+    int32_t result;
+    uint64_t start_us;
+    uint32_t duration_us;
+} workload_record_header;
+
+typedef struct workload_record {
+    workload_record_header h;
+    char **args;            // argc NUL-terminated strings
+} workload_record;
+
+typedef struct workload_writer {
+    FILE *file;
+    uint64_t origin_ns;     // Time the file was opened, start of the trace
+} workload_writer;
+
+// Op of a CLI command, or -1 if the command is not recorded
+int workload_op(const char *command) {
+    for (int op = 0; op < WORKLOAD_OPS_COUNT; op++) {
+        if (strcmp(command, workload_op_names[op]) == 0) return op;
+    }
+    return -1;
+}
+
+// Whether argument 'index' of a command is one of the path arguments of its op
+bool workload_is_path(int op, char **args, int args_count, int index) {
+    int options = 0;
+    while (options < args_count && strncmp(args[options], "--", 2) == 0) options++;
+    int bit = index - options;
+    return bit >= 0 && bit < 32 && (workload_path_args[op] & (1u << bit));
+}
+
+/**
+ * @brief Create the trace file and write its header.
+ *
+ * @return 0 on success, -1 if the file cannot be created.
+ */
+int workload_open(workload_writer *w, const char *path, uint64_t now_ns) {
+    w->file = fopen(path, "wb");
+    if (!w->file) return -1;
+    w->origin_ns = now_ns;
+
+    uint32_t version = WORKLOAD_VERSION;
+    if (fwrite(WORKLOAD_MAGIC, 4, 1, w->file) != 1 || fwrite(&version, sizeof(version), 1, w->file) != 1) {
+        fclose(w->file);
+        w->file = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Append one command to the trace.
+ *
+ * The path arguments of the op are made absolute using 'cwd' (the CLI form
+ * "root/a/b"); "ls" without an argument records the current directory.
+ *
+ * @return 0 on success, -1 if the record could not be written.
+ */
+int workload_append(workload_writer *w, int op, char **args, int args_count, const char *cwd,
+                    int result, uint64_t start_ns, uint64_t end_ns) {
+    // 1. Absolute form of the path arguments
+    const char *prefix = (strncmp(cwd, "root", 4) == 0) ? cwd + 4 : "";
+    char cwd_path[4096];
+    char *ls_args[1] = { cwd_path };
+    if (op == 0 && args_count == 0) {
+        snprintf(cwd_path, sizeof(cwd_path), "%s", (*prefix == '\0') ? "/" : prefix);
+        args = ls_args;
+        args_count = 1;
+    }
+    if (args_count > WORKLOAD_MAX_ARGS) args_count = WORKLOAD_MAX_ARGS;
+
+    // 2. Header
+    workload_record_header h;
+    h.op = (uint8_t)op;
+    h.argc = (uint8_t)args_count;
+    h.result = result;
+    h.start_us = (start_ns - w->origin_ns) / 1000;
+    h.duration_us = (uint32_t)((end_ns - start_ns) / 1000);
+    if (fwrite(&h, sizeof(h), 1, w->file) != 1) return -1;
+
+    // 3. Arguments
+    char path[4096];
+    for (int i = 0; i < args_count; i++) {
+        const char *arg = args[i];
+        if (args[i][0] != '/' && workload_is_path(op, args, args_count, i)) {
+            snprintf(path, sizeof(path), "%s/%s", prefix, args[i]);
+            arg = path;
+        }
+        uint32_t length = (uint32_t)strlen(arg);
+        if (fwrite(&length, sizeof(length), 1, w->file) != 1) return -1;
+        if (length > 0 && fwrite(arg, length, 1, w->file) != 1) return -1;
+    }
+    return 0;
+}
+
+void workload_close(workload_writer *w) {
+    if (w->file) fclose(w->file);
+    w->file = NULL;
+}
+
+void workload_free(workload_record *records, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        for (uint32_t a = 0; a < records[i].h.argc; a++) free(records[i].args[a]);
+        free(records[i].args);
+    }
+    free(records);
+}
+
+/**
+ * @brief Load a whole trace file.
+ *
+ * @param out_records Set to a malloc'd array of the records (free with workload_free).
+ * @param out_count Set to the number of records.
+ * @return 0 on success, -1 if the file cannot be read or is not a valid trace.
+ */
+int workload_load(const char *path, workload_record **out_records, uint32_t *out_count) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Error: Unable to open file %s\n", path);
+        return -1;
+    }
+
+    int status = -1;
+    workload_record *records = NULL;
+    uint32_t count = 0, capacity = 0;
+
+    // 1. Header
+    char magic[4];
+    uint32_t version;
+    if (fread(magic, 4, 1, file) != 1 || memcmp(magic, WORKLOAD_MAGIC, 4) != 0 ||
+        fread(&version, sizeof(version), 1, file) != 1 || version != WORKLOAD_VERSION) {
+        fprintf(stderr, "Error: %s is not a workload trace.\n", path);
+        goto cleanup;
+    }
+
+    // 2. Records until the end of the file
+    workload_record_header h;
+    while (fread(&h, sizeof(h), 1, file) == 1) {
+        if (h.op >= WORKLOAD_OPS_COUNT) {
+            fprintf(stderr, "Error: invalid op %u in record %u of %s.\n", h.op, count, path);
+            goto cleanup;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            workload_record *grown = realloc(records, capacity * sizeof(workload_record));
+            if (!grown) {
+                fprintf(stderr, "Error: could not allocate memory for the workload.\n");
+                goto cleanup;
+            }
+            records = grown;
+        }
+
+        workload_record *r = &records[count];
+        r->h = h;
+        r->h.argc = 0;
+        r->args = calloc(h.argc ? h.argc : 1, sizeof(char *));
+        if (!r->args) goto cleanup;
+        count++;
+
+        for (uint32_t a = 0; a < h.argc; a++) {
+            uint32_t length;
+            if (fread(&length, sizeof(length), 1, file) != 1 || length > (1u << 30)) {
+                fprintf(stderr, "Error: truncated record %u in %s.\n", count - 1, path);
+                goto cleanup;
+            }
+            char *arg = malloc(length + 1);
+            if (!arg) goto cleanup;
+            if (length > 0 && fread(arg, length, 1, file) != 1) {
+                free(arg);
+                fprintf(stderr, "Error: truncated record %u in %s.\n", count - 1, path);
+                goto cleanup;
+            }
+            arg[length] = '\0';
+            r->args[r->h.argc++] = arg;
+        }
+    }
+
+    *out_records = records;
+    *out_count = count;
+    records = NULL;
+    status = 0;
+
+cleanup:
+    if (records) workload_free(records, count);
+    fclose(file);
+    return status;
+}
+
+#endif // WORKLOAD_H